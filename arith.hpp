@@ -0,0 +1,411 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+#include <cpixmap.hpp>
+#include <convert.hpp>
+#include <pixelop.hpp>
+
+// Pixel arithmetic between pixmaps, or a pixmap and a constant.  Integer
+// results saturate to the range of T, floating results follow IEEE.  dst
+// is resized to match the sources when needed and may be one of them, so
+// every operation also works in place.
+
+enum ARITH_KIND {
+  ARITH_FLOAT = 0,
+  ARITH_UNSIGNED = 1,
+  ARITH_SIGNED = 2
+};
+
+template <typename T>
+struct arith_kind
+  : std::integral_constant<int, !std::numeric_limits<T>::is_integer ? ARITH_FLOAT :
+			   std::numeric_limits<T>::is_signed ? ARITH_SIGNED : ARITH_UNSIGNED> {};
+
+// Scaled operations run in float up to 16-bit pixels and in double above
+// (64-bit integers lose precision beyond 2^53).
+template <typename T> struct arith_traits { typedef double work_type; };
+template <> struct arith_traits<int8_t> { typedef float work_type; };
+template <> struct arith_traits<uint8_t> { typedef float work_type; };
+template <> struct arith_traits<int16_t> { typedef float work_type; };
+template <> struct arith_traits<uint16_t> { typedef float work_type; };
+template <> struct arith_traits<float> { typedef float work_type; };
+
+// Lane-wise helpers on V, a GCC vector of T or T itself.  The signed forms
+// compute in the unsigned type so that wrap-around is defined and detect
+// overflow from the signs of the operands and the result.
+
+template <typename T, typename V>
+SIMD_INLINE void arith_add(V& a, const V& b, std::integral_constant<int, ARITH_FLOAT>) { a = a + b; }
+
+template <typename T, typename V>
+SIMD_INLINE void arith_add(V& a, const V& b, std::integral_constant<int, ARITH_UNSIGNED>)
+{
+  V s = (V)(a + b);
+  V hi = V() + std::numeric_limits<T>::max();
+  a = (s < a) ? hi : s;
+}
+
+template <typename T, typename V>
+SIMD_INLINE void arith_add(V& a, const V& b, std::integral_constant<int, ARITH_SIGNED>)
+{
+  typedef typename simd_rebind<V, typename std::make_unsigned<T>::type>::type U;
+  V s = (V)((U)a + (U)b);
+  V lo = V() + std::numeric_limits<T>::lowest(), hi = V() + std::numeric_limits<T>::max();
+  a = (((a ^ s) & (b ^ s)) < 0) ? ((a < 0) ? lo : hi) : s;
+}
+
+template <typename T, typename V>
+SIMD_INLINE void arith_sub(V& a, const V& b, std::integral_constant<int, ARITH_FLOAT>) { a = a - b; }
+
+template <typename T, typename V>
+SIMD_INLINE void arith_sub(V& a, const V& b, std::integral_constant<int, ARITH_UNSIGNED>)
+{
+  V zero = V();
+  a = (a > b) ? (V)(a - b) : zero;
+}
+
+template <typename T, typename V>
+SIMD_INLINE void arith_sub(V& a, const V& b, std::integral_constant<int, ARITH_SIGNED>)
+{
+  typedef typename simd_rebind<V, typename std::make_unsigned<T>::type>::type U;
+  V s = (V)((U)a - (U)b);
+  V lo = V() + std::numeric_limits<T>::lowest(), hi = V() + std::numeric_limits<T>::max();
+  a = (((a ^ b) & (a ^ s)) < 0) ? ((a < 0) ? lo : hi) : s;
+}
+
+template <typename T, typename V>
+SIMD_INLINE void arith_absdiff(V& a, const V& b, std::integral_constant<int, ARITH_FLOAT>)
+{
+  a = (a > b) ? (V)(a - b) : (V)(b - a);
+}
+
+template <typename T, typename V>
+SIMD_INLINE void arith_absdiff(V& a, const V& b, std::integral_constant<int, ARITH_UNSIGNED>)
+{
+  a = (a > b) ? (V)(a - b) : (V)(b - a);
+}
+
+template <typename T, typename V>
+SIMD_INLINE void arith_absdiff(V& a, const V& b, std::integral_constant<int, ARITH_SIGNED>)
+{
+  typedef typename simd_rebind<V, typename std::make_unsigned<T>::type>::type U;
+  U d = (a > b) ? (U)((U)a - (U)b) : (U)((U)b - (U)a);
+  U hi = U() + (typename std::make_unsigned<T>::type)std::numeric_limits<T>::max();
+  a = (V)((d > hi) ? hi : d);
+}
+
+// round to nearest (ties away from zero) and saturate a work-type value
+template <typename T, typename VW, typename V>
+SIMD_INLINE void arith_store(V& a, const VW& value, typename arith_traits<T>::work_type lo,
+			     typename arith_traits<T>::work_type hi, std::false_type)
+{
+  typedef typename arith_traits<T>::work_type W;
+  VW half = VW() + (W)0.5, zero = VW(), vlo = VW() + lo, vhi = VW() + hi;
+  VW f = (value == value) ? value : zero;
+  f = f + ((f < zero) ? -half : half);
+  f = (f < vlo) ? vlo : f;
+  f = (f > vhi) ? vhi : f;
+  simd_convert(a, f);
+}
+
+template <typename T, typename VW, typename V>
+SIMD_INLINE void arith_store(V& a, const VW& f, typename arith_traits<T>::work_type,
+			     typename arith_traits<T>::work_type, std::true_type)
+{
+  simd_convert(a, f);
+}
+
+template <typename T>
+struct arith_op_base {
+  typedef typename arith_traits<T>::work_type W;
+  typedef std::integral_constant<int, arith_kind<T>::value> kind;
+  typedef std::integral_constant<bool, !std::numeric_limits<T>::is_integer> floating;
+  W lo, hi;
+  arith_op_base() { convert_limits<T>(lo, hi); }
+};
+
+template <typename T>
+struct arith_add_op : arith_op_base<T> {
+  template <typename V> SIMD_INLINE void operator()(V& a, const V& b) const
+  {
+    arith_add<T>(a, b, typename arith_op_base<T>::kind());
+  }
+};
+
+template <typename T>
+struct arith_sub_op : arith_op_base<T> {
+  template <typename V> SIMD_INLINE void operator()(V& a, const V& b) const
+  {
+    arith_sub<T>(a, b, typename arith_op_base<T>::kind());
+  }
+};
+
+template <typename T>
+struct arith_absdiff_op : arith_op_base<T> {
+  template <typename V> SIMD_INLINE void operator()(V& a, const V& b) const
+  {
+    arith_absdiff<T>(a, b, typename arith_op_base<T>::kind());
+  }
+};
+
+template <typename T>
+struct arith_min_op {
+  template <typename V> SIMD_INLINE void operator()(V& a, const V& b) const { a = (b < a) ? b : a; }
+};
+
+template <typename T>
+struct arith_max_op {
+  template <typename V> SIMD_INLINE void operator()(V& a, const V& b) const { a = (b > a) ? b : a; }
+};
+
+// a = a * b * scale
+template <typename T>
+struct arith_mul_op : arith_op_base<T> {
+  typedef typename arith_op_base<T>::W W;
+  W scale;
+  explicit arith_mul_op(double s) : scale((W)s) {}
+  template <typename V> SIMD_INLINE void operator()(V& a, const V& b) const
+  {
+    typedef typename simd_rebind<V, W>::type VW;
+    VW fa, fb;
+    simd_convert(fa, a);
+    simd_convert(fb, b);
+    fa = fa * fb * scale;
+    arith_store<T>(a, fa, this->lo, this->hi, typename arith_op_base<T>::floating());
+  }
+};
+
+// a = a * alpha + b * beta + gamma
+template <typename T>
+struct arith_weighted_op : arith_op_base<T> {
+  typedef typename arith_op_base<T>::W W;
+  W alpha, beta, gamma;
+  arith_weighted_op(double a, double b, double g) : alpha((W)a), beta((W)b), gamma((W)g) {}
+  template <typename V> SIMD_INLINE void operator()(V& a, const V& b) const
+  {
+    typedef typename simd_rebind<V, W>::type VW;
+    VW fa, fb;
+    simd_convert(fa, a);
+    simd_convert(fb, b);
+    fa = fa * alpha + fb * beta + gamma;
+    arith_store<T>(a, fa, this->lo, this->hi,
+		   typename arith_op_base<T>::floating());
+  }
+};
+
+// binary operation with a constant second operand
+template <typename T, typename Op>
+struct arith_scalar_op {
+  Op op;
+  T value;
+  arith_scalar_op(const Op& o, T v) : op(o), value(v) {}
+  template <typename V> SIMD_INLINE void operator()(V& a) const
+  {
+    V b = V() + value;
+    op(a, b);
+  }
+};
+
+template <typename T, typename Op>
+inline void arith_apply(cpixmap<T>& dst, const cpixmap<T>& src, T value, const Op& op,
+			const cexecution_policy& policy)
+{
+  forEachRow(dst, src, arith_scalar_op<T, Op>(op, value), policy);
+}
+
+template <typename T> struct arith_identity { typedef T type; };
+
+template <typename T>
+void addPixmap(cpixmap<T>& dst, const cpixmap<T>& src1, const cpixmap<T>& src2,
+	       const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("addPixmap", src1, trace_bytes<T>(src1) * 3, trace_threads(policy));
+  forEachRow(dst, src1, src2, arith_add_op<T>(), policy);
+}
+
+template <typename T>
+void addPixmap(cpixmap<T>& dst, const cpixmap<T>& src, typename arith_identity<T>::type value,
+	       const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("addPixmap", src, trace_bytes<T>(src) * 2, trace_threads(policy));
+  arith_apply(dst, src, value, arith_add_op<T>(), policy);
+}
+
+template <typename T>
+void subtractPixmap(cpixmap<T>& dst, const cpixmap<T>& src1, const cpixmap<T>& src2,
+		    const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("subtractPixmap", src1, trace_bytes<T>(src1) * 3, trace_threads(policy));
+  forEachRow(dst, src1, src2, arith_sub_op<T>(), policy);
+}
+
+template <typename T>
+void subtractPixmap(cpixmap<T>& dst, const cpixmap<T>& src, typename arith_identity<T>::type value,
+		    const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("subtractPixmap", src, trace_bytes<T>(src) * 2, trace_threads(policy));
+  arith_apply(dst, src, value, arith_sub_op<T>(), policy);
+}
+
+template <typename T>
+void absdiffPixmap(cpixmap<T>& dst, const cpixmap<T>& src1, const cpixmap<T>& src2,
+		   const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("absdiffPixmap", src1, trace_bytes<T>(src1) * 3, trace_threads(policy));
+  forEachRow(dst, src1, src2, arith_absdiff_op<T>(), policy);
+}
+
+template <typename T>
+void absdiffPixmap(cpixmap<T>& dst, const cpixmap<T>& src, typename arith_identity<T>::type value,
+		   const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("absdiffPixmap", src, trace_bytes<T>(src) * 2, trace_threads(policy));
+  arith_apply(dst, src, value, arith_absdiff_op<T>(), policy);
+}
+
+template <typename T>
+void multiplyPixmap(cpixmap<T>& dst, const cpixmap<T>& src1, const cpixmap<T>& src2, double scale = 1.0,
+		    const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("multiplyPixmap", src1, trace_bytes<T>(src1) * 3, trace_threads(policy));
+  forEachRow(dst, src1, src2, arith_mul_op<T>(scale), policy);
+}
+
+template <typename T>
+void multiplyPixmap(cpixmap<T>& dst, const cpixmap<T>& src, typename arith_identity<T>::type value,
+		    double scale = 1.0, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("multiplyPixmap", src, trace_bytes<T>(src) * 2, trace_threads(policy));
+  arith_apply(dst, src, value, arith_mul_op<T>(scale), policy);
+}
+
+template <typename T>
+void minPixmap(cpixmap<T>& dst, const cpixmap<T>& src1, const cpixmap<T>& src2,
+	       const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("minPixmap", src1, trace_bytes<T>(src1) * 3, trace_threads(policy));
+  forEachRow(dst, src1, src2, arith_min_op<T>(), policy);
+}
+
+template <typename T>
+void minPixmap(cpixmap<T>& dst, const cpixmap<T>& src, typename arith_identity<T>::type value,
+	       const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("minPixmap", src, trace_bytes<T>(src) * 2, trace_threads(policy));
+  arith_apply(dst, src, value, arith_min_op<T>(), policy);
+}
+
+template <typename T>
+void maxPixmap(cpixmap<T>& dst, const cpixmap<T>& src1, const cpixmap<T>& src2,
+	       const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("maxPixmap", src1, trace_bytes<T>(src1) * 3, trace_threads(policy));
+  forEachRow(dst, src1, src2, arith_max_op<T>(), policy);
+}
+
+template <typename T>
+void maxPixmap(cpixmap<T>& dst, const cpixmap<T>& src, typename arith_identity<T>::type value,
+	       const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("maxPixmap", src, trace_bytes<T>(src) * 2, trace_threads(policy));
+  arith_apply(dst, src, value, arith_max_op<T>(), policy);
+}
+
+// dst = src1 * alpha + src2 * beta + gamma
+template <typename T>
+void addWeightedPixmap(cpixmap<T>& dst, const cpixmap<T>& src1, double alpha,
+		       const cpixmap<T>& src2, double beta, double gamma = 0.0,
+		       const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("addWeightedPixmap", src1, trace_bytes<T>(src1) * 3, trace_threads(policy));
+  forEachRow(dst, src1, src2, arith_weighted_op<T>(alpha, beta, gamma), policy);
+}
+
+// dst = src1 * (1 - alpha) + src2 * alpha
+template <typename T>
+void blendPixmap(cpixmap<T>& dst, const cpixmap<T>& src1, const cpixmap<T>& src2, double alpha,
+		 const cexecution_policy& policy = cexecution_policy())
+{
+  addWeightedPixmap(dst, src1, 1.0 - alpha, src2, alpha, 0.0, policy);
+}
+
+// Accumulation into a wider pixmap, e.g. cpixmap<float> or cpixmap<uint32_t>
+// over a stack of cpixmap<uint8_t> frames.  acc must already match src.
+
+template <typename W>
+struct arith_accumulate_op {
+  template <typename VW, typename V> SIMD_INLINE void operator()(VW& acc, const V& s) const
+  {
+    VW f;
+    simd_convert(f, s);
+    acc = acc + f;
+  }
+};
+
+template <typename W>
+struct arith_accumulate_square_op {
+  template <typename VW, typename V> SIMD_INLINE void operator()(VW& acc, const V& s) const
+  {
+    VW f;
+    simd_convert(f, s);
+    acc = acc + f * f;
+  }
+};
+
+// acc = acc + (src - acc) * alpha, the running average of a frame stream
+template <typename W>
+struct arith_accumulate_weighted_op {
+  W alpha;
+  explicit arith_accumulate_weighted_op(double a) : alpha((W)a) {}
+  template <typename VW, typename V> SIMD_INLINE void operator()(VW& acc, const V& s) const
+  {
+    VW f;
+    simd_convert(f, s);
+    acc = acc + (f - acc) * alpha;
+  }
+};
+
+template <typename W, typename T>
+void accumulatePixmap(cpixmap<W>& acc, const cpixmap<T>& src,
+		      const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("accumulatePixmap", src, trace_bytes<W>(acc) * 2 + trace_bytes<T>(src), trace_threads(policy));
+  forEachRowUpdate(acc, src, arith_accumulate_op<W>(), policy);
+}
+
+template <typename W, typename T>
+void accumulateSquarePixmap(cpixmap<W>& acc, const cpixmap<T>& src,
+			    const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("accumulateSquarePixmap", src, trace_bytes<W>(acc) * 2 + trace_bytes<T>(src), trace_threads(policy));
+  forEachRowUpdate(acc, src, arith_accumulate_square_op<W>(), policy);
+}
+
+template <typename W, typename T>
+void accumulateWeightedPixmap(cpixmap<W>& acc, const cpixmap<T>& src, double alpha,
+			      const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("accumulateWeightedPixmap", src, trace_bytes<W>(acc) * 2 + trace_bytes<T>(src), trace_threads(policy));
+  static_assert(!std::numeric_limits<W>::is_integer, "weighted accumulation needs a floating accumulator");
+  forEachRowUpdate(acc, src, arith_accumulate_weighted_op<W>(alpha), policy);
+}
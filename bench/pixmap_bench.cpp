@@ -0,0 +1,708 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Throughput of the pixmap kernels over pixel types, image sizes, band
+// counts, kernel sizes, thread counts and SIMD levels.  Every measurement
+// is one line of JSON (or CSV with --csv) on stdout:
+//
+//   {"op":"flipVertically","type":"u16","width":1024,"height":1024,
+//    "bands":3,"kernel":0,"threads":2,"simd":"avx2","build":"simd",
+//    "iterations":40,"seconds":0.00121,"mpix_s":2600.1,"gb_s":10.4,
+//    "efficiency":0.93}
+//
+// seconds is the best time of one call, gb_s counts the bytes the kernel
+// reads plus writes, and efficiency is mpix_s over threads times the
+// single-thread mpix_s of the same configuration.  Built with
+// CPIXMAP_BENCH_GENERIC the SIMD specialisations are left out, so that the
+// generic member templates can be compared against them.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include <cpixmap.hpp>
+#include <simd.hpp>
+#if !defined(CPIXMAP_BENCH_GENERIC)
+# include <cpixmap.lshiftPixel.SIMD.hpp>
+# include <cpixmap.rshiftPixel.SIMD.hpp>
+# include <cpixmap.reverseEndian.SIMD.hpp>
+#endif
+#include <cpixmap_raw.hpp>
+#include <arith.hpp>
+#include <convert.hpp>
+#include <colorspace.hpp>
+#include <convolve.hpp>
+#include <resize.hpp>
+#include <warp.hpp>
+#include <cremap.hpp>
+#include <cpyramid.hpp>
+#include <demosaic.hpp>
+#include <cchunk.hpp>
+#include <ctiledpixmap.hpp>
+#include <cpixmap_codec.hpp>
+#include <cbitmap.hpp>
+#include <label.hpp>
+#include <distance.hpp>
+#if defined(CPIXMAP_HAVE_MAGICK) && __has_include(<chistogram.hpp>)
+# include <cpixmap_io.hpp>
+# define BENCH_HAVE_COPY 1
+#endif
+
+#if defined(CPIXMAP_BENCH_GENERIC)
+static const char *bench_build = "generic";
+#else
+static const char *bench_build = "simd";
+#endif
+
+struct bench_options {
+  std::vector<size_t> sizes;
+  std::vector<size_t> bands;
+  std::vector<size_t> kernels;
+  std::vector<size_t> threads;
+  std::vector<std::string> types;
+  std::vector<std::string> ops;
+  std::vector<SIMD_LEVEL> levels;
+  double min_time;
+  bool csv;
+  std::string tmpdir;
+  std::string trace;
+};
+
+struct bench_case {
+  const char *op;
+  const char *type;
+  size_t width, height, bands, kernel, threads;
+  const char *simd;
+};
+
+// Prints the results and keeps the single-thread rate of every
+// configuration for the scaling efficiency of the multi-threaded runs.
+class bench_report {
+public:
+  explicit bench_report(bool csv) : m_csv(csv) {}
+
+  void header(void)
+  {
+    if (m_csv) {
+      std::printf("# build=%s simd=%s hardware_threads=%u numa_nodes=%zu\n", bench_build,
+		  getSimdLevelName(getSimdLevel()), std::thread::hardware_concurrency(), getNumaNodeCount());
+      std::printf("op,type,width,height,bands,kernel,threads,simd,build,iterations,seconds,mpix_s,gb_s,efficiency\n");
+    } else {
+      std::printf("{\"meta\":{\"build\":\"%s\",\"simd\":\"%s\",\"hardware_threads\":%u,\"numa_nodes\":%zu}}\n",
+		  bench_build, getSimdLevelName(getSimdLevel()), std::thread::hardware_concurrency(),
+		  getNumaNodeCount());
+    }
+    std::fflush(stdout);
+  }
+
+  void add(const bench_case& c, size_t iterations, double seconds, double pixels, double bytes)
+  {
+    const double mpix = pixels / seconds * 1e-6, gb = bytes / seconds * 1e-9;
+    std::ostringstream key;
+    key << c.op << '/' << c.type << '/' << c.width << '/' << c.height << '/' << c.bands << '/'
+	<< c.kernel << '/' << c.simd;
+    if (c.threads == 1) m_single[key.str()] = mpix;
+    std::map<std::string, double>::const_iterator base = m_single.find(key.str());
+    char efficiency[32] = "";
+    if (base != m_single.end()) std::snprintf(efficiency, sizeof(efficiency), "%.3f", mpix / (c.threads * base->second));
+
+    if (m_csv)
+      std::printf("%s,%s,%zu,%zu,%zu,%zu,%zu,%s,%s,%zu,%.6g,%.6g,%.6g,%s\n", c.op, c.type, c.width, c.height,
+		  c.bands, c.kernel, c.threads, c.simd, bench_build, iterations, seconds, mpix, gb, efficiency);
+    else
+      std::printf("{\"op\":\"%s\",\"type\":\"%s\",\"width\":%zu,\"height\":%zu,\"bands\":%zu,\"kernel\":%zu,"
+		  "\"threads\":%zu,\"simd\":\"%s\",\"build\":\"%s\",\"iterations\":%zu,\"seconds\":%.6g,"
+		  "\"mpix_s\":%.6g,\"gb_s\":%.6g,\"efficiency\":%s}\n", c.op, c.type, c.width, c.height,
+		  c.bands, c.kernel, c.threads, c.simd, bench_build, iterations, seconds, mpix, gb,
+		  efficiency[0] ? efficiency : "null");
+    std::fflush(stdout);
+  }
+
+private:
+  bool m_csv;
+  std::map<std::string, double> m_single;
+};
+
+// best time of one call of f, after a warm-up call, over at least three
+// calls and min_time seconds
+template <typename F>
+double bench_time(double min_time, size_t& iterations, const F& f)
+{
+  typedef std::chrono::steady_clock clock;
+  f();
+  double best = 1e30, total = 0.0;
+  iterations = 0;
+  while (iterations < 3 || total < min_time) {
+    const clock::time_point t0 = clock::now();
+    f();
+    const double t = std::chrono::duration<double>(clock::now() - t0).count();
+    best = std::min(best, t);
+    total += t;
+    ++iterations;
+  }
+  return best;
+}
+
+template <typename T> struct bench_type;
+template <> struct bench_type<uint8_t> { static const char *name(void) { return "u8"; } };
+template <> struct bench_type<uint16_t> { static const char *name(void) { return "u16"; } };
+template <> struct bench_type<int32_t> { static const char *name(void) { return "i32"; } };
+template <> struct bench_type<float> { static const char *name(void) { return "f32"; } };
+
+class bench_runner {
+public:
+  bench_runner(const bench_options& options, bench_report& report) : m_options(options), m_report(report) {}
+
+  template <typename T> void run(void);
+
+private:
+  bool enabled(const char *op) const
+  {
+    return m_options.ops.empty() ||
+      std::find(m_options.ops.begin(), m_options.ops.end(), std::string(op)) != m_options.ops.end();
+  }
+
+  cexecution_policy policy(size_t threads)
+  {
+    std::unique_ptr<cthread_pool>& pool = m_pools[threads];
+    if (!pool) pool.reset(new cthread_pool(threads));
+    return cexecution_policy(*pool);
+  }
+
+  std::string tempFile(const char *suffix) const
+  {
+    std::ostringstream path;
+    path << m_options.tmpdir << "/pixmap_bench_" << getpid() << suffix;
+    return path.str();
+  }
+
+  template <typename T, typename F>
+  void measure(bench_case c, double traffic, const F& f)
+  {
+    size_t iterations;
+    const double seconds = bench_time(m_options.min_time, iterations, f);
+    const double pixels = (double)c.width * c.height * c.bands;
+    m_report.add(c, iterations, seconds, pixels, traffic * pixels * sizeof(T));
+  }
+
+  template <typename T> void runPolicyOps(cpixmap<T>& img, bench_case c);
+  template <typename T> void runImageOps(const cpixmap<T>& img, bench_case c);
+  template <typename T> void runShiftOps(cpixmap<T>& img, bench_case c, std::true_type);
+  template <typename T> void runShiftOps(cpixmap<T>&, bench_case, std::false_type) {}
+  template <typename T> void runConvolveOps(cpixmap<T>& img, bench_case c, std::true_type);
+  template <typename T> void runConvolveOps(cpixmap<T>&, bench_case, std::false_type) {}
+  template <typename T> void runCodecOps(const cpixmap<T>& img, bench_case c, std::true_type);
+  template <typename T> void runCodecOps(const cpixmap<T>&, bench_case, std::false_type) {}
+  template <typename T> void runSingleOps(cpixmap<T>& img, bench_case c);
+  void runPackedOps(bench_case c, std::true_type);
+  void runPackedOps(bench_case, std::false_type) {}
+
+  const bench_options& m_options;
+  bench_report& m_report;
+  std::map<size_t, std::unique_ptr<cthread_pool> > m_pools;
+};
+
+template <typename T>
+void bench_fill(cpixmap<T>& img)
+{
+  for (size_t z = 0; z < img.getBands(); ++z)
+    for (size_t y = 0; y < img.getHeight(); ++y) {
+      T *line = img.getLine(y, z);
+      for (size_t x = 0; x < img.getWidth(); ++x) line[x] = (T)((x * 7 + y * 13 + z) & 0x7f);
+    }
+}
+
+template <typename T>
+void bench_runner::run(void)
+{
+  const char *type = bench_type<T>::name();
+  if (!m_options.types.empty() &&
+      std::find(m_options.types.begin(), m_options.types.end(), std::string(type)) == m_options.types.end())
+    return;
+
+  for (size_t s = 0; s < m_options.sizes.size(); ++s) {
+    const size_t size = m_options.sizes[s];
+    for (size_t b = 0; b < m_options.bands.size(); ++b) {
+      const size_t bands = m_options.bands[b];
+      cpixmap<T> img(size, size, bands);
+      bench_fill(img);
+      bench_case c = {"", type, size, size, bands, 0, 1, getSimdLevelName(getSimdLevel())};
+
+      for (size_t t = 0; t < m_options.threads.size(); ++t) {
+	c.threads = m_options.threads[t];
+	runPolicyOps(img, c);
+	runImageOps(img, c);
+	runShiftOps(img, c, std::integral_constant<bool, std::numeric_limits<T>::is_integer>());
+	runConvolveOps(img, c, std::integral_constant<bool, std::numeric_limits<T>::is_integer &&
+		       (std::numeric_limits<T>::digits < 24)>());
+	runCodecOps(img, c, std::integral_constant<bool, std::numeric_limits<T>::is_integer>());
+      }
+      c.threads = 1;
+      runSingleOps(img, c);
+    }
+    bench_case c = {"", type, size, size, 1, 0, 1, getSimdLevelName(getSimdLevel())};
+    runPackedOps(c, std::is_same<T, uint16_t>());
+  }
+}
+
+// kernels running on a cexecution_policy
+template <typename T>
+void bench_runner::runPolicyOps(cpixmap<T>& img, bench_case c)
+{
+  const cexecution_policy p = policy(c.threads);
+  if (enabled("flipHorizontally")) {
+    c.op = "flipHorizontally";
+    measure<T>(c, 2.0, [&] { img.flipHorizontally(p); });
+  }
+  if (enabled("flipVertically")) {
+    c.op = "flipVertically";
+    measure<T>(c, 2.0, [&] { img.flipVertically(p); });
+  }
+  if (enabled("reverseEndian") && sizeof(T) > 1) {
+    c.op = "reverseEndian";
+    for (size_t l = 0; l < m_options.levels.size(); ++l) {
+      c.simd = getSimdLevelName(setSimdLevel(m_options.levels[l]));
+      measure<T>(c, 2.0, [&] { img.reverseEndian(p); });
+    }
+    setSimdLevel(m_options.levels.back());
+  }
+#if defined(BENCH_HAVE_COPY)
+  if (enabled("copyPixmap")) {
+    cpixmap<T> dst(img);
+    c.op = "copyPixmap";
+    measure<T>(c, 2.0, [&] {
+	for (size_t z = 0; z < img.getBands(); ++z) copyPixmap(dst, 0, 0, img, z, p);
+      });
+  }
+#endif
+  if (enabled("convertToTiled") || enabled("transposeTiled")) {
+    ctiledpixmap<T> tiled(img.getWidth(), img.getHeight(), img.getBands());
+    c.op = "convertToTiled";
+    measure<T>(c, 2.0, [&] { convertToTiled(tiled, img, p); });
+    if (enabled("transposeTiled")) {
+      ctiledpixmap<T> transposed;
+      c.op = "transposeTiled";
+      measure<T>(c, 2.0, [&] { transposeTiled(transposed, tiled, p); });
+    }
+  }
+  if (enabled("thresholdPixmap") || enabled("erodeBitmap") || enabled("labelComponents") ||
+      enabled("distanceTransform")) {
+    const double bits = 1.0 / (8 * sizeof(T)); // traffic of a bitmap pixel
+    cbitmap mask(img.getWidth(), img.getHeight(), img.getBands());
+    const T level = img.getLine(img.getHeight() / 2)[img.getWidth() / 2];
+    thresholdPixmap(mask, img, level, p);
+    if (enabled("thresholdPixmap")) {
+      c.op = "thresholdPixmap";
+      for (size_t l = 0; l < m_options.levels.size(); ++l) {
+	c.simd = getSimdLevelName(setSimdLevel(m_options.levels[l]));
+	measure<T>(c, 1.0 + bits, [&] { thresholdPixmap(mask, img, level, p); });
+      }
+      setSimdLevel(m_options.levels.back());
+    }
+    if (enabled("erodeBitmap")) {
+      cbitmap eroded;
+      c.op = "erodeBitmap";
+      measure<T>(c, 2.0 * bits, [&] { erodeBitmap(eroded, mask, p); });
+    }
+    if (enabled("labelComponents") && img.getBands() == 1) {
+      cpixmap<uint32_t> labels;
+      std::vector<ccomponent> components;
+      c.op = "labelComponents";
+      measure<T>(c, bits + 3.0 * sizeof(uint32_t) / sizeof(T),
+		 [&] { labelComponents(labels, mask, CONNECT_8, &components, p); });
+    }
+    if (enabled("distanceTransform")) {
+      cpixmap<float> distance;
+      cpixmap<uint32_t> nearest;
+      c.op = "distanceTransform";
+      measure<T>(c, bits + 5.0 * sizeof(uint32_t) / sizeof(T),
+		 [&] { distanceTransform(distance, mask, DISTANCE_EUCLIDEAN, &nearest, p); });
+    }
+  }
+}
+
+// arithmetic, conversion, colour and geometry kernels that leave img as it is
+template <typename T>
+void bench_runner::runImageOps(const cpixmap<T>& img, bench_case c)
+{
+  const cexecution_policy p = policy(c.threads);
+  const size_t width = img.getWidth(), height = img.getHeight(), bands = img.getBands();
+  if (enabled("addPixmap") || enabled("addWeightedPixmap") || enabled("accumulatePixmap")) {
+    cpixmap<T> dst(width, height, bands);
+    if (enabled("addPixmap")) {
+      c.op = "addPixmap";
+      measure<T>(c, 3.0, [&] { addPixmap(dst, img, img, p); });
+    }
+    if (enabled("addWeightedPixmap")) {
+      c.op = "addWeightedPixmap";
+      measure<T>(c, 3.0, [&] { addWeightedPixmap(dst, img, 0.25, img, 0.5, 1.0, p); });
+    }
+    if (enabled("accumulatePixmap")) {
+      cpixmap<float> acc(width, height, bands);
+      convertPixmap(acc, img, 0.0, 0.0, CONVERT_ROUND_NEAREST, p); // zero
+      c.op = "accumulatePixmap";
+      measure<T>(c, 1.0 + 2.0 * sizeof(float) / sizeof(T), [&] { accumulatePixmap(acc, img, p); });
+    }
+  }
+  if (enabled("convertPixmap")) {
+    cpixmap<float> dst(width, height, bands);
+    c.op = "convertPixmap";
+    measure<T>(c, 1.0 + (double)sizeof(float) / sizeof(T), [&] { convertPixmap(dst, img, 0.5, 1.0, CONVERT_ROUND_NEAREST, p); });
+  }
+  if (bands >= 3 && (enabled("convertRGBToYCbCr") || enabled("convertRGBToLab"))) {
+    cpixmap<T> dst(width, height, 3);
+    if (enabled("convertRGBToYCbCr")) {
+      c.op = "convertRGBToYCbCr";
+      measure<T>(c, 2.0, [&] { convertRGBToYCbCr(dst, img, YCBCR_BT601, true, p); });
+    }
+    if (enabled("convertRGBToLab")) {
+      c.op = "convertRGBToLab";
+      measure<T>(c, 2.0, [&] { convertRGBToLab(dst, img, p); });
+    }
+  }
+  if (bands == 1 && enabled("demosaicBayer")) {
+    cpixmap<T> rgb(width, height, cpixmap<T>::RGB_BANDS);
+    c.op = "demosaicBayer";
+    measure<T>(c, 4.0, [&] { demosaicBayer(rgb, img, BAYER_RGGB, DEMOSAIC_MALVAR, 0, p); });
+  }
+  if (enabled("resizePixmap")) {
+    // halving, counted in source pixels
+    cpixmap<T> dst((width + 1) / 2, (height + 1) / 2, bands);
+    c.op = "resizePixmap";
+    measure<T>(c, 1.25, [&] { resizePixmap(dst, img, RESAMPLE_BILINEAR, p); });
+  }
+  if (enabled("buildGaussian") || enabled("buildLaplacian")) {
+    // five levels; the reduced levels add a third of the base level
+    if (enabled("buildGaussian")) {
+      cpyramid<T> pyramid(5);
+      c.op = "buildGaussian";
+      measure<T>(c, 2.0 + 2.0 / 3.0, [&] { pyramid.buildGaussian(img, p); });
+    }
+    if (enabled("buildLaplacian")) {
+      cpyramid<float> pyramid(5);
+      c.op = "buildLaplacian";
+      measure<T>(c, 1.0 + 4.0 * sizeof(float) / sizeof(T), [&] { pyramid.buildLaplacian(img, p); });
+    }
+  }
+  if (enabled("warpAffine") || enabled("cremap")) {
+    // rotation by 10 degrees about the centre
+    const double a = 10.0 * 3.14159265358979 / 180.0, cx = width / 2.0, cy = height / 2.0;
+    const double m[6] = { std::cos(a), -std::sin(a), cx - std::cos(a) * cx + std::sin(a) * cy,
+			  std::sin(a), std::cos(a), cy - std::sin(a) * cx - std::cos(a) * cy };
+    cpixmap<T> dst(width, height, bands);
+    if (enabled("warpAffine")) {
+      c.op = "warpAffine";
+      measure<T>(c, 2.0, [&] { warpAffine(dst, img, m, WARP_BILINEAR, WARP_BORDER_CONSTANT, (T)0, 64, p); });
+    }
+    if (enabled("cremap")) {
+      // the compiled map is read once for all bands
+      cpixmap<float> mapx(width, height, 1), mapy(width, height, 1);
+      for (size_t y = 0; y < height; ++y)
+	for (size_t x = 0; x < width; ++x) {
+	  mapx.getLine(y)[x] = (float)(m[0] * x + m[1] * y + m[2]);
+	  mapy.getLine(y)[x] = (float)(m[3] * x + m[4] * y + m[5]);
+	}
+      cremap<T> remap;
+      remap.compile(mapx, mapy, width, height);
+      c.op = "cremap";
+      measure<T>(c, 2.0 + 6.0 / (bands * sizeof(T)), [&] { remap.apply(dst, img, (T)0, p); });
+    }
+  }
+}
+
+template <typename T>
+void bench_runner::runShiftOps(cpixmap<T>& img, bench_case c, std::true_type)
+{
+  const cexecution_policy p = policy(c.threads);
+  for (size_t l = 0; l < m_options.levels.size(); ++l) {
+    c.simd = getSimdLevelName(setSimdLevel(m_options.levels[l]));
+    if (enabled("lshiftPixel")) {
+      c.op = "lshiftPixel";
+      measure<T>(c, 2.0, [&] { img.lshiftPixel(1, p); });
+    }
+    if (enabled("rshiftPixel")) {
+      c.op = "rshiftPixel";
+      measure<T>(c, 2.0, [&] { img.rshiftPixel(1, p); });
+    }
+  }
+  setSimdLevel(m_options.levels.back());
+  bench_fill(img);
+}
+
+template <typename T>
+void bench_runner::runConvolveOps(cpixmap<T>& img, bench_case c, std::true_type)
+{
+  const cexecution_policy p = policy(c.threads);
+  cpixmap<T> dst(img);
+  for (size_t k = 0; k < m_options.kernels.size(); ++k) {
+    const size_t size = m_options.kernels[k];
+    c.kernel = size;
+    if (enabled("convolve")) {
+      cpixmap<int> kernel(size, size, 1);
+      for (size_t y = 0; y < size; ++y)
+	for (size_t x = 0; x < size; ++x) kernel.putPixel(1, x, y);
+      c.op = "convolve";
+      measure<T>(c, 2.0, [&] { convolve(dst, img, kernel, 0, 0, p); });
+    }
+    if (enabled("convolveTiled")) {
+      // the conversions are not timed
+      cpixmap<int> kernel(size, size, 1);
+      for (size_t y = 0; y < size; ++y)
+	for (size_t x = 0; x < size; ++x) kernel.putPixel(1, x, y);
+      ctiledpixmap<T> tiled(img.getWidth(), img.getHeight(), img.getBands()), tiled_dst;
+      convertToTiled(tiled, img, p);
+      tiled_dst.setResolution(img.getWidth(), img.getHeight(), img.getBands());
+      c.op = "convolveTiled";
+      measure<T>(c, 2.0, [&] { convolveTiled(tiled_dst, tiled, kernel, 0, 0, p); });
+    }
+    if (enabled("convolveXYSeperately")) {
+      cpixmap<int> xkernel(size, 1, 1), ykernel(size, 1, 1);
+      for (size_t x = 0; x < size; ++x) xkernel.putPixel(1, x, 0), ykernel.putPixel(1, x, 0);
+      c.op = "convolveXYSeperately";
+      measure<T>(c, 4.0, [&] { convolveXYSeperately(dst, img, xkernel, ykernel, 0, 0, p); });
+    }
+  }
+}
+
+// lossless strip codec, on a smooth image with a little noise rather
+// than the pattern of bench_fill, which compresses unrealistically well
+template <typename T>
+void bench_runner::runCodecOps(const cpixmap<T>& img, bench_case c, std::true_type)
+{
+  if (!enabled("writeCompressedImage") && !enabled("readCompressedImage")) return;
+  cpixmap<T> frame(img), decoded;
+  uint32_t seed = 1;
+  for (size_t z = 0; z < frame.getBands(); ++z)
+    for (size_t y = 0; y < frame.getHeight(); ++y) {
+      T *line = frame.getLine(y, z);
+      for (size_t x = 0; x < frame.getWidth(); ++x) {
+	seed = seed * 1103515245u + 12345u;
+	line[x] = (T)(((x + y) >> 2) + ((seed >> 16) & 7));
+      }
+    }
+  const cexecution_policy p = policy(c.threads);
+  const std::string path = tempFile(".cpc");
+  c.op = "writeCompressedImage";
+  measure<T>(c, 1.0, [&] { writeCompressedImage(frame, path, 32, PREDICT_AUTO, p); });
+  if (enabled("readCompressedImage")) {
+    c.op = "readCompressedImage";
+    measure<T>(c, 1.0, [&] { readCompressedImage(path, decoded, p); });
+  }
+  std::remove(path.c_str());
+}
+
+// single-threaded kernels
+template <typename T>
+void bench_runner::runSingleOps(cpixmap<T>& img, bench_case c)
+{
+  if (enabled("writeRawImage") || enabled("readRawImage")) {
+    const std::string path = tempFile(".raw");
+    c.op = "writeRawImage";
+    measure<T>(c, 1.0, [&] {
+	for (size_t z = 0; z < img.getBands(); ++z) writeRawImage(img, z, path);
+      });
+    if (enabled("readRawImage")) {
+      c.op = "readRawImage";
+      measure<T>(c, 1.0, [&] {
+	  for (size_t z = 0; z < img.getBands(); ++z) readRawImage(path, img, z);
+	});
+    }
+    std::remove(path.c_str());
+  }
+
+  if (enabled("window3x3_frame")) {
+    // one pass of a 3x3 window over every band, as the filters of cchunk
+    // users do
+    c.op = "window3x3_frame";
+    volatile double sink = 0;
+    measure<T>(c, 1.0, [&] {
+	window3x3_frame<T> frame(img);
+	double sum = 0;
+	for (size_t z = 0; z < img.getBands(); ++z) {
+	  frame.draftFrame(img, z);
+	  for (int y = 0; y < (int)img.getHeight(); ++y) {
+	    for (int x = 0; x < (int)img.getWidth(); ++x)
+	      sum += (double)frame(y-1, x) + frame(y, x-1) + frame(y, x) + frame(y, x+1) + frame(y+1, x);
+	    frame.shiftFrame(img, z);
+	  }
+	}
+	sink = sink + sum;
+      });
+  }
+}
+
+// 10- and 12-bit packed frames, in memory and from a file
+void bench_runner::runPackedOps(bench_case c, std::true_type)
+{
+  cpixmap<uint16_t> img(c.width, c.height, 1);
+  bench_fill(img);
+  static const RAW_PACKING packings[] = {RAW_MIPI10, RAW_MIPI12};
+  static const char *names[] = {"unpackRawPixmap/mipi10", "unpackRawPixmap/mipi12"};
+  static const char *file_names[] = {"readPackedRawImage/mipi10", "readPackedRawImage/mipi12"};
+  for (size_t i = 0; i < 2; ++i) {
+    const size_t line_bytes = rawPackedLineBytes(packings[i], img.getWidth());
+    std::vector<uint8_t> packed(line_bytes * img.getHeight());
+    for (size_t y = 0; y < img.getHeight(); ++y)
+      packRawLine(&packed[y * line_bytes], img.getLine(y), img.getWidth(), packings[i]);
+
+    if (enabled("unpackRawPixmap")) {
+      c.op = names[i];
+      for (size_t t = 0; t < m_options.threads.size(); ++t) {
+	c.threads = m_options.threads[t];
+	const cexecution_policy p = policy(c.threads);
+	for (size_t l = 0; l < m_options.levels.size(); ++l) {
+	  c.simd = getSimdLevelName(setSimdLevel(m_options.levels[l]));
+	  measure<uint16_t>(c, 1.0 + (double)rawPackingBits(packings[i]) / 16,
+			    [&] { unpackRawPixmap(img, &packed[0], packings[i], 0, 0, 0, p); });
+	}
+      }
+      setSimdLevel(m_options.levels.back());
+      c.threads = 1;
+    }
+
+    if (enabled("readPackedRawImage")) {
+      const std::string path = tempFile(".packed");
+      if (FILE *fp = std::fopen(path.c_str(), "wb")) {
+	std::fwrite(&packed[0], 1, packed.size(), fp);
+	std::fclose(fp);
+      }
+      c.op = file_names[i];
+      c.simd = getSimdLevelName(getSimdLevel());
+      measure<uint16_t>(c, 1.0 + (double)rawPackingBits(packings[i]) / 16,
+			[&] { readPackedRawImage(path, img, packings[i]); });
+      std::remove(path.c_str());
+    }
+  }
+}
+
+static std::vector<std::string> bench_split(const std::string& text)
+{
+  std::vector<std::string> items;
+  std::istringstream stream(text);
+  std::string item;
+  while (std::getline(stream, item, ','))
+    if (!item.empty()) items.push_back(item);
+  return items;
+}
+
+static std::vector<size_t> bench_split_sizes(const std::string& text)
+{
+  std::vector<std::string> items = bench_split(text);
+  std::vector<size_t> sizes;
+  for (size_t i = 0; i < items.size(); ++i) sizes.push_back((size_t)std::strtoul(items[i].c_str(), NULL, 10));
+  return sizes;
+}
+
+static void bench_usage(const char *argv0)
+{
+  std::fprintf(stderr,
+	       "usage: %s [options]\n"
+	       "  --sizes N,...      square image edges (default 64,256,1024,4096)\n"
+	       "  --bands N,...      band counts (default 1,3)\n"
+	       "  --kernels N,...    convolution kernel sizes (default 3,5,7)\n"
+	       "  --threads N,...    thread counts (default 1,2,4,... up to the hardware)\n"
+	       "  --types T,...      u8,u16,i32,f32 (default all)\n"
+	       "  --ops NAME,...     operations to run (default all)\n"
+	       "  --simd L,...       SIMD levels for the dispatched kernels\n"
+	       "                     (default scalar and the best available)\n"
+	       "  --min-time S       seconds per measurement (default 0.1)\n"
+	       "  --tmpdir DIR       directory for the raw I/O files (default $TMPDIR or /tmp)\n"
+	       "  --quick            small sizes and short measurements\n"
+	       "  --csv              CSV instead of JSON lines\n"
+	       "  --trace FILE       with CPIXMAP_TRACE, write the Chrome trace to FILE\n"
+	       "                     and the per-operation summary to stderr\n", argv0);
+}
+
+int main(int argc, char *argv[])
+{
+  bench_options options;
+  options.sizes = bench_split_sizes("64,256,1024,4096");
+  options.bands = bench_split_sizes("1,3");
+  options.kernels = bench_split_sizes("3,5,7");
+  const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t t = 1; t < hardware; t <<= 1) options.threads.push_back(t);
+  options.threads.push_back(hardware);
+  options.min_time = 0.1;
+  options.csv = false;
+  options.tmpdir = std::getenv("TMPDIR") ? std::getenv("TMPDIR") : "/tmp";
+  // the generic build has no SIMD shifts to compare
+  const SIMD_LEVEL best = getSimdLevel();
+#if !defined(CPIXMAP_BENCH_GENERIC)
+  if (best != SIMD_SCALAR) options.levels.push_back(SIMD_SCALAR);
+#endif
+  options.levels.push_back(best);
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    const bool has_value = i + 1 < argc;
+    if (arg == "--sizes" && has_value) options.sizes = bench_split_sizes(argv[++i]);
+    else if (arg == "--bands" && has_value) options.bands = bench_split_sizes(argv[++i]);
+    else if (arg == "--kernels" && has_value) options.kernels = bench_split_sizes(argv[++i]);
+    else if (arg == "--threads" && has_value) options.threads = bench_split_sizes(argv[++i]);
+    else if (arg == "--types" && has_value) options.types = bench_split(argv[++i]);
+    else if (arg == "--ops" && has_value) options.ops = bench_split(argv[++i]);
+    else if (arg == "--min-time" && has_value) options.min_time = std::atof(argv[++i]);
+    else if (arg == "--tmpdir" && has_value) options.tmpdir = argv[++i];
+    else if (arg == "--trace" && has_value) options.trace = argv[++i];
+    else if (arg == "--csv") options.csv = true;
+    else if (arg == "--quick") {
+      options.sizes = bench_split_sizes("64,512");
+      options.kernels = bench_split_sizes("3");
+      options.min_time = 0.01;
+    } else if (arg == "--simd" && has_value) {
+      std::vector<std::string> names = bench_split(argv[++i]);
+      options.levels.clear();
+      for (size_t n = 0; n < names.size(); ++n)
+	for (int l = SIMD_SCALAR; l <= SIMD_NEON; ++l)
+	  if (names[n] == getSimdLevelName((SIMD_LEVEL)l)) options.levels.push_back((SIMD_LEVEL)l);
+    } else {
+      bench_usage(argv[0]);
+      return arg == "--help" ? 0 : 1;
+    }
+  }
+  if (options.sizes.empty() || options.bands.empty() || options.threads.empty() || options.levels.empty()) {
+    bench_usage(argv[0]);
+    return 1;
+  }
+
+  bench_report report(options.csv);
+  report.header();
+  bench_runner runner(options, report);
+  runner.run<uint8_t>();
+  runner.run<uint16_t>();
+  runner.run<int32_t>();
+  runner.run<float>();
+
+#if defined(CPIXMAP_TRACE)
+  if (!options.trace.empty()) {
+    writeTraceJSON(options.trace);
+    dumpTraceStats(std::cerr);
+  }
+#endif
+  return 0;
+}
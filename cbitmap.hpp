@@ -0,0 +1,568 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+#include <cpixmap.hpp>
+#include <cexecutor.hpp>
+#include <cmemory.hpp>
+#include <pixelop.hpp>
+#include <simd.hpp>
+
+#if defined(SIMD_X86)
+# include <immintrin.h>
+#endif
+
+// Binary image of one bit per pixel, 64 pixels to a word, pixel x of a
+// row in bit x % 64 of word x / 64.  Rows are whole words (8 bytes, as
+// the rows of cpixmap) and the bits past the width are kept clear, so
+// that whole words can be combined and counted.  An 8K mask takes 4 MB
+// where a cpixmap<uint8_t> takes 33.
+//
+// thresholdPixmap() builds one from a pixmap with the SIMD compare and
+// movemask of the dispatched level; the logic operations, counts and 3x3
+// morphology then work on 64 pixels per instruction or more.
+
+class cbitmap : public cregion<size_t> {
+public:
+  cbitmap(void);
+  cbitmap(size_t w, size_t h, size_t b = 1);
+  cbitmap(size_t w, size_t h, size_t b, const cmemory_policy& memory);
+  cbitmap(const cbitmap& bitmap);
+  virtual ~cbitmap(void);
+
+  void setResolution(size_t w, size_t h, size_t b = 1);
+  size_t getWordsPerLine(void) const { return m_words; }
+  uint64_t *getLine(size_t y, size_t z = 0) const { return m_buffer + (z * m_height + y) * m_words; }
+  // bits of the last word of a row that hold pixels
+  uint64_t getTailMask(void) const { return (m_width & 63) ? (((uint64_t)1 << (m_width & 63)) - 1) : ~(uint64_t)0; }
+
+  bool getPixel(size_t x, size_t y, size_t z = 0) const { return (getLine(y, z)[x >> 6] >> (x & 63)) & 1; }
+  void putPixel(bool val, size_t x, size_t y, size_t z = 0)
+  {
+    uint64_t& word = getLine(y, z)[x >> 6];
+    word = val ? (word | ((uint64_t)1 << (x & 63))) : (word & ~((uint64_t)1 << (x & 63)));
+  }
+  void fill(bool val);
+
+  bool isMatched(size_t w, size_t h, size_t b) const { return m_width == w && m_height == h && m_bands == b; }
+  bool isMatched(const cbitmap& bitmap) const { return isMatched(bitmap.m_width, bitmap.m_height, bitmap.m_bands); }
+
+private:
+  void reallocate(void);
+
+  size_t m_words; // per row
+  uint64_t *m_buffer;
+  cmemory_mapping m_mapping;
+  cmemory_policy m_memory;
+
+  cbitmap& operator=(const cbitmap&);
+};
+
+inline cmemory_policy bitmap_policy(void)
+{
+  cmemory_policy memory;
+  memory.tag = "cbitmap";
+  return memory;
+}
+
+inline cbitmap::cbitmap(void) : m_words(0), m_buffer(NULL), m_memory(bitmap_policy()) {}
+
+inline cbitmap::cbitmap(size_t w, size_t h, size_t b)
+  : cregion(w, h, b), m_words(0), m_buffer(NULL), m_memory(bitmap_policy())
+{
+  reallocate();
+}
+
+inline cbitmap::cbitmap(size_t w, size_t h, size_t b, const cmemory_policy& memory)
+  : cregion(w, h, b), m_words(0), m_buffer(NULL), m_memory(memory)
+{
+  reallocate();
+}
+
+// copies the dimensions and the memory policy, not the pixels, as cpixmap
+// does
+inline cbitmap::cbitmap(const cbitmap& bitmap)
+  : cregion(bitmap.getWidth(), bitmap.getHeight(), bitmap.getBands()), m_words(0), m_buffer(NULL),
+    m_memory(bitmap.m_memory)
+{
+  reallocate();
+}
+
+inline cbitmap::~cbitmap(void)
+{
+  freeMemory((uint8_t *)m_buffer, m_mapping);
+  m_buffer = NULL;
+}
+
+inline void cbitmap::setResolution(size_t w, size_t h, size_t b)
+{
+  cregion::setResolution(w, h, b);
+  reallocate();
+}
+
+// new bitmaps are clear, as allocateMemory zero-fills
+inline void cbitmap::reallocate(void)
+{
+  m_words = (m_width + 63) >> 6;
+  freeMemory((uint8_t *)m_buffer, m_mapping);
+  m_buffer = (uint64_t *)allocateMemory(m_bands * m_height * m_words * sizeof(uint64_t), m_memory, m_mapping);
+  assert(m_buffer);
+}
+
+inline void cbitmap::fill(bool val)
+{
+  const uint64_t tail = getTailMask();
+  for (size_t z = 0; z < m_bands; ++z)
+    for (size_t y = 0; y < m_height; ++y) {
+      uint64_t *line = getLine(y, z);
+      std::fill(line, line + m_words, val ? ~(uint64_t)0 : 0);
+      if (m_words) line[m_words - 1] &= tail;
+    }
+}
+
+// The 64 bits of src[x] > level, for x of 64 pixel runs; returns the
+// words done.  SSE2 and AVX2 compare as signed after flipping the sign
+// bit and gather the lane signs with movemask, AVX-512BW compares straight
+// into a mask register.  Only 8- and 16-bit unsigned pixels have a vector
+// path; other types go through the scalar loop of thresholdLine.
+template <typename T>
+inline size_t bitmap_threshold_words(SIMD_LEVEL, uint64_t *, const T *, size_t, T) { return 0; }
+
+#if defined(SIMD_X86)
+__attribute__((target("sse2"))) inline size_t bitmap_threshold_sse2(uint64_t *dst, const uint8_t *src, size_t words,
+								    uint8_t level)
+{
+  const __m128i sign = _mm_set1_epi8((char)0x80), t = _mm_xor_si128(_mm_set1_epi8((char)level), sign);
+  for (size_t w = 0; w < words; ++w) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 4; ++i) {
+      const __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&src[w * 64 + i * 16]), sign);
+      bits |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpgt_epi8(v, t)) << (16 * i);
+    }
+    dst[w] = bits;
+  }
+  return words;
+}
+
+__attribute__((target("sse2"))) inline size_t bitmap_threshold_sse2(uint64_t *dst, const uint16_t *src, size_t words,
+								    uint16_t level)
+{
+  const __m128i sign = _mm_set1_epi16((short)0x8000), t = _mm_xor_si128(_mm_set1_epi16((short)level), sign);
+  for (size_t w = 0; w < words; ++w) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 4; ++i) {
+      const __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&src[w * 64 + i * 16]), sign);
+      const __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&src[w * 64 + i * 16 + 8]), sign);
+      const __m128i m = _mm_packs_epi16(_mm_cmpgt_epi16(a, t), _mm_cmpgt_epi16(b, t));
+      bits |= (uint64_t)(uint32_t)_mm_movemask_epi8(m) << (16 * i);
+    }
+    dst[w] = bits;
+  }
+  return words;
+}
+
+__attribute__((target("avx2"))) inline size_t bitmap_threshold_avx2(uint64_t *dst, const uint8_t *src, size_t words,
+								    uint8_t level)
+{
+  const __m256i sign = _mm256_set1_epi8((char)0x80), t = _mm256_xor_si256(_mm256_set1_epi8((char)level), sign);
+  for (size_t w = 0; w < words; ++w) {
+    const __m256i a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&src[w * 64]), sign);
+    const __m256i b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&src[w * 64 + 32]), sign);
+    dst[w] = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(a, t)) |
+      ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(b, t)) << 32);
+  }
+  return words;
+}
+
+__attribute__((target("avx2"))) inline size_t bitmap_threshold_avx2(uint64_t *dst, const uint16_t *src, size_t words,
+								    uint16_t level)
+{
+  const __m256i sign = _mm256_set1_epi16((short)0x8000), t = _mm256_xor_si256(_mm256_set1_epi16((short)level), sign);
+  for (size_t w = 0; w < words; ++w) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 2; ++i) {
+      const __m256i a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&src[w * 64 + i * 32]), sign);
+      const __m256i b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&src[w * 64 + i * 32 + 16]), sign);
+      // packs works per 128-bit lane; the permute puts the quarters back in order
+      const __m256i m = _mm256_permute4x64_epi64(_mm256_packs_epi16(_mm256_cmpgt_epi16(a, t), _mm256_cmpgt_epi16(b, t)),
+						 0xd8);
+      bits |= (uint64_t)(uint32_t)_mm256_movemask_epi8(m) << (32 * i);
+    }
+    dst[w] = bits;
+  }
+  return words;
+}
+
+__attribute__((target("avx512f,avx512bw"))) inline size_t bitmap_threshold_avx512(uint64_t *dst, const uint8_t *src,
+										 size_t words, uint8_t level)
+{
+  const __m512i t = _mm512_set1_epi8((char)level);
+  for (size_t w = 0; w < words; ++w)
+    dst[w] = _mm512_cmpgt_epu8_mask(_mm512_loadu_si512(&src[w * 64]), t);
+  return words;
+}
+
+__attribute__((target("avx512f,avx512bw"))) inline size_t bitmap_threshold_avx512(uint64_t *dst, const uint16_t *src,
+										 size_t words, uint16_t level)
+{
+  const __m512i t = _mm512_set1_epi16((short)level);
+  for (size_t w = 0; w < words; ++w)
+    dst[w] = (uint64_t)_mm512_cmpgt_epu16_mask(_mm512_loadu_si512(&src[w * 64]), t) |
+      ((uint64_t)_mm512_cmpgt_epu16_mask(_mm512_loadu_si512(&src[w * 64 + 32]), t) << 32);
+  return words;
+}
+
+#define CBITMAP_THRESHOLD_WORDS(type)					\
+  inline size_t bitmap_threshold_words(SIMD_LEVEL level, uint64_t *dst, const type *src, size_t words, type t) \
+  {									\
+    switch (level) {							\
+    case SIMD_AVX512: return bitmap_threshold_avx512(dst, src, words, t); \
+    case SIMD_AVX2: return bitmap_threshold_avx2(dst, src, words, t);	\
+    case SIMD_SSE41:							\
+    case SIMD_SSE2: return bitmap_threshold_sse2(dst, src, words, t);	\
+    default: return 0;							\
+    }									\
+  }
+
+CBITMAP_THRESHOLD_WORDS(uint8_t)
+CBITMAP_THRESHOLD_WORDS(uint16_t)
+
+#undef CBITMAP_THRESHOLD_WORDS
+#endif
+
+// one row: dst[x / 64] bit x % 64 = src[x] > level, padding bits clear
+template <typename T>
+inline void thresholdLine(uint64_t *dst, const T *src, size_t width, T level, SIMD_LEVEL simd)
+{
+  size_t w = bitmap_threshold_words(simd, dst, src, width >> 6, level);
+  for (; (w << 6) < width; ++w) {
+    const size_t x0 = w << 6, n = std::min<size_t>(64, width - x0);
+    uint64_t bits = 0;
+    for (size_t i = 0; i < n; ++i) bits |= (uint64_t)(src[x0 + i] > level) << i;
+    dst[w] = bits;
+  }
+}
+
+// dst = src > level, band by band; dst is resized to match src
+template <typename T>
+void thresholdPixmap(cbitmap& dst, const cpixmap<T>& src, T level,
+		     const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("thresholdPixmap", src, trace_bytes<T>(src), trace_threads(policy));
+  if (!dst.isMatched(src.getWidth(), src.getHeight(), src.getBands()))
+    dst.setResolution(src.getWidth(), src.getHeight(), src.getBands());
+  const SIMD_LEVEL simd = getSimdLevel();
+  forEachStrip(policy, src.getBands(), src.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) thresholdLine(dst.getLine(y, z), src.getLine(y, z), src.getWidth(), level, simd);
+    });
+}
+
+// dst = src ? value : 0
+template <typename T>
+void expandBitmap(cpixmap<T>& dst, const cbitmap& src, T value = 1,
+		  const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("expandBitmap", src, trace_bytes<T>(src), trace_threads(policy));
+  if (!dst.isMatched(src.getWidth(), src.getHeight(), src.getBands()))
+    dst.setResolution(src.getWidth(), src.getHeight(), src.getBands());
+  forEachStrip(policy, src.getBands(), src.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	const uint64_t *bits = src.getLine(y, z);
+	T *line = dst.getLine(y, z);
+	for (size_t x = 0; x < src.getWidth(); ++x) line[x] = ((bits[x >> 6] >> (x & 63)) & 1) ? value : T();
+      }
+    });
+}
+
+// Word-wise logic through the pixelop kernels, on uint64_t "pixels".
+struct bitmap_and_op { template <typename V> SIMD_INLINE void operator()(V& a, const V& b) const { a &= b; } };
+struct bitmap_or_op { template <typename V> SIMD_INLINE void operator()(V& a, const V& b) const { a |= b; } };
+struct bitmap_xor_op { template <typename V> SIMD_INLINE void operator()(V& a, const V& b) const { a ^= b; } };
+struct bitmap_andnot_op { template <typename V> SIMD_INLINE void operator()(V& a, const V& b) const { a &= ~b; } };
+struct bitmap_not_op { template <typename V> SIMD_INLINE void operator()(V& a) const { a = ~a; } };
+
+template <typename Op>
+void bitmap_apply(cbitmap& dst, const cbitmap& src1, const cbitmap& src2, const Op& op,
+		  const cexecution_policy& policy)
+{
+  assert(src1.isMatched(src2));
+  if (!dst.isMatched(src1)) dst.setResolution(src1.getWidth(), src1.getHeight(), src1.getBands());
+  const SIMD_LEVEL level = getSimdLevel();
+  const size_t words = src1.getWordsPerLine();
+  forEachStrip(policy, src1.getBands(), src1.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y)
+	simdDispatchLevel<pixel_binary_kernel<Op> >(level, dst.getLine(y, z), (const uint64_t *)src1.getLine(y, z),
+						    (const uint64_t *)src2.getLine(y, z), words, &op);
+    });
+}
+
+inline void andBitmap(cbitmap& dst, const cbitmap& src1, const cbitmap& src2,
+		      const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("andBitmap", src1, src1.getBands() * src1.getHeight() * src1.getWordsPerLine() * 24,
+	       trace_threads(policy));
+  bitmap_apply(dst, src1, src2, bitmap_and_op(), policy);
+}
+
+inline void orBitmap(cbitmap& dst, const cbitmap& src1, const cbitmap& src2,
+		     const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("orBitmap", src1, src1.getBands() * src1.getHeight() * src1.getWordsPerLine() * 24,
+	       trace_threads(policy));
+  bitmap_apply(dst, src1, src2, bitmap_or_op(), policy);
+}
+
+inline void xorBitmap(cbitmap& dst, const cbitmap& src1, const cbitmap& src2,
+		      const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("xorBitmap", src1, src1.getBands() * src1.getHeight() * src1.getWordsPerLine() * 24,
+	       trace_threads(policy));
+  bitmap_apply(dst, src1, src2, bitmap_xor_op(), policy);
+}
+
+// dst = src1 & ~src2
+inline void andNotBitmap(cbitmap& dst, const cbitmap& src1, const cbitmap& src2,
+			 const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("andNotBitmap", src1, src1.getBands() * src1.getHeight() * src1.getWordsPerLine() * 24,
+	       trace_threads(policy));
+  bitmap_apply(dst, src1, src2, bitmap_andnot_op(), policy);
+}
+
+inline void notBitmap(cbitmap& dst, const cbitmap& src, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("notBitmap", src, src.getBands() * src.getHeight() * src.getWordsPerLine() * 16,
+	       trace_threads(policy));
+  if (!dst.isMatched(src)) dst.setResolution(src.getWidth(), src.getHeight(), src.getBands());
+  const SIMD_LEVEL level = getSimdLevel();
+  const size_t words = src.getWordsPerLine();
+  const uint64_t tail = src.getTailMask();
+  const bitmap_not_op op;
+  forEachStrip(policy, src.getBands(), src.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	uint64_t *line = dst.getLine(y, z);
+	simdDispatchLevel<pixel_unary_kernel<bitmap_not_op> >(level, line, (const uint64_t *)src.getLine(y, z),
+							      words, &op);
+	if (words) line[words - 1] &= tail;
+      }
+    });
+}
+
+// popcnt comes with the AVX2 and AVX-512 targets; below, the compiler's
+// bit-twiddling fallback
+struct bitmap_count_kernel {
+  template <SIMD_LEVEL L>
+  static SIMD_INLINE void run(uint64_t *count, const uint64_t *line, size_t words)
+  {
+    uint64_t n = 0;
+    for (size_t i = 0; i < words; ++i) n += (uint64_t)__builtin_popcountll(line[i]);
+    *count += n;
+  }
+};
+
+// set pixels of every band
+inline uint64_t countBitmap(const cbitmap& src, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("countBitmap", src, src.getBands() * src.getHeight() * src.getWordsPerLine() * 8,
+	       trace_threads(policy));
+  const SIMD_LEVEL level = getSimdLevel();
+  std::mutex mutex;
+  uint64_t total = 0;
+  forEachStrip(policy, src.getBands(), src.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      uint64_t count = 0;
+      for (size_t y = y0; y < y1; ++y)
+	simdDispatchLevel<bitmap_count_kernel>(level, &count, (const uint64_t *)src.getLine(y, z),
+					       src.getWordsPerLine());
+      std::lock_guard<std::mutex> lock(mutex);
+      total += count;
+    });
+  return total;
+}
+
+// set pixels inside roi (its origin, width and height) of band
+// roi.getZOrigin(); roi is clipped to the bitmap
+inline uint64_t countBitmap(const cbitmap& src, const cregion<size_t>& roi)
+{
+  const size_t x0 = std::min(roi.getXOrigin(), src.getWidth()), x1 = std::min(roi.getXEnd(), src.getWidth());
+  const size_t y0 = std::min(roi.getYOrigin(), src.getHeight()), y1 = std::min(roi.getYEnd(), src.getHeight());
+  const size_t z = roi.getZOrigin();
+  if (x0 >= x1 || y0 >= y1) return 0;
+  assert(z < src.getBands());
+  const size_t w0 = x0 >> 6, w1 = (x1 - 1) >> 6;
+  const uint64_t first = ~(uint64_t)0 << (x0 & 63);
+  const uint64_t last = ~(uint64_t)0 >> (63 - ((x1 - 1) & 63));
+  uint64_t count = 0;
+  for (size_t y = y0; y < y1; ++y) {
+    const uint64_t *line = src.getLine(y, z);
+    if (w0 == w1) {
+      count += (uint64_t)__builtin_popcountll(line[w0] & first & last);
+      continue;
+    }
+    count += (uint64_t)__builtin_popcountll(line[w0] & first);
+    for (size_t w = w0 + 1; w < w1; ++w) count += (uint64_t)__builtin_popcountll(line[w]);
+    count += (uint64_t)__builtin_popcountll(line[w1] & last);
+  }
+  return count;
+}
+
+// Row of the 3 pixel wide horizontal AND (erode) or OR (dilate): each word
+// is combined with itself shifted by one pixel either way, taking the
+// edge bits from the neighbouring words.  Outside the image counts as set
+// for erosion and clear for dilation, so the border neither erodes nor
+// dilates.
+template <bool erode>
+inline void bitmap_morph_row(uint64_t *dst, const uint64_t *src, size_t words, uint64_t tail)
+{
+  const uint64_t outside = erode ? ~(uint64_t)0 : 0;
+  uint64_t prev = outside, cur = words ? src[0] : 0;
+  for (size_t w = 0; w < words; ++w) {
+    if (w + 1 == words && erode) cur |= ~tail;
+    const uint64_t next = (w + 1 < words) ? src[w + 1] | ((w + 2 == words && erode) ? ~tail : 0) : outside;
+    const uint64_t left = (cur << 1) | (prev >> 63), right = (cur >> 1) | (next << 63);
+    dst[w] = erode ? (cur & left & right) : (cur | left | right);
+    prev = cur;
+    cur = next;
+  }
+}
+
+// dst = 3x3 erosion (erode) or dilation of src by the full square; the
+// horizontal pass of each source row is done once per strip and combined
+// down the rows
+template <bool erode>
+void bitmap_morph(cbitmap& dst, const cbitmap& src, const cexecution_policy& policy)
+{
+  assert(&dst != &src);
+  if (!dst.isMatched(src)) dst.setResolution(src.getWidth(), src.getHeight(), src.getBands());
+  const size_t words = src.getWordsPerLine(), height = src.getHeight();
+  const uint64_t tail = src.getTailMask(), outside = erode ? ~(uint64_t)0 : 0;
+  forEachStrip(policy, src.getBands(), height, [&](size_t z, size_t y0, size_t y1) {
+      std::vector<uint64_t> rows(3 * words);
+      uint64_t *h[3] = { &rows[0], &rows[words], &rows[2 * words] }; // rows y - 1, y, y + 1
+      if (y0 > 0) bitmap_morph_row<erode>(h[0], src.getLine(y0 - 1, z), words, tail);
+      else std::fill(h[0], h[0] + words, outside);
+      bitmap_morph_row<erode>(h[1], src.getLine(y0, z), words, tail);
+      for (size_t y = y0; y < y1; ++y) {
+	if (y + 1 < height) bitmap_morph_row<erode>(h[2], src.getLine(y + 1, z), words, tail);
+	else std::fill(h[2], h[2] + words, outside);
+	uint64_t *line = dst.getLine(y, z);
+	for (size_t w = 0; w < words; ++w)
+	  line[w] = erode ? (h[0][w] & h[1][w] & h[2][w]) : (h[0][w] | h[1][w] | h[2][w]);
+	if (words) line[words - 1] &= tail;
+	std::rotate(h, h + 1, h + 3);
+      }
+    });
+}
+
+inline void erodeBitmap(cbitmap& dst, const cbitmap& src, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("erodeBitmap", src, src.getBands() * src.getHeight() * src.getWordsPerLine() * 16,
+	       trace_threads(policy));
+  bitmap_morph<true>(dst, src, policy);
+}
+
+inline void dilateBitmap(cbitmap& dst, const cbitmap& src, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("dilateBitmap", src, src.getBands() * src.getHeight() * src.getWordsPerLine() * 16,
+	       trace_threads(policy));
+  bitmap_morph<false>(dst, src, policy);
+}
+
+// Row readers for the functions that take a mask either as a pixmap
+// (its nonzero pixels) or as a cbitmap.
+template <typename T>
+struct mask_pixmap_reader {
+  const cpixmap<T>& src;
+  const T *line;
+  explicit mask_pixmap_reader(const cpixmap<T>& s) : src(s), line(NULL) {}
+  void setLine(size_t y, size_t z = 0) { line = src.getLine(y, z); }
+  bool operator()(size_t x) const { return line[x] != T(); }
+};
+
+struct mask_bitmap_reader {
+  const cbitmap& src;
+  const uint64_t *line;
+  explicit mask_bitmap_reader(const cbitmap& s) : src(s), line(NULL) {}
+  void setLine(size_t y, size_t z = 0) { line = src.getLine(y, z); }
+  bool operator()(size_t x) const { return (line[x >> 6] >> (x & 63)) & 1; }
+};
+
+// Masked pixel operations.  A mask of one band applies to every band of
+// the pixmap, otherwise band z of the mask goes with band z.  Runs of 64
+// clear pixels are skipped and runs of 64 set pixels are copied or filled
+// whole, so sparse and solid masks cost little more than their words.
+
+template <typename T, typename Op>
+void bitmap_masked(cpixmap<T>& dst, const cbitmap& mask, const Op& op, const cexecution_policy& policy)
+{
+  assert(mask.getWidth() == dst.getWidth() && mask.getHeight() == dst.getHeight());
+  assert(mask.getBands() == 1 || mask.getBands() == dst.getBands());
+  const size_t width = dst.getWidth();
+  forEachStrip(policy, dst.getBands(), dst.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	const uint64_t *bits = mask.getLine(y, mask.getBands() == 1 ? 0 : z);
+	T *line = dst.getLine(y, z);
+	for (size_t w = 0; w < mask.getWordsPerLine(); ++w) {
+	  uint64_t word = bits[w];
+	  const size_t x0 = w << 6;
+	  if (word == 0) continue;
+	  if (word == ~(uint64_t)0) {
+	    op(line, y, z, x0, (size_t)64);
+	    continue;
+	  }
+	  while (word) {
+	    const size_t x = x0 + (size_t)__builtin_ctzll(word);
+	    // the run of set bits from x
+	    const uint64_t run = ~(word >> (x - x0));
+	    const size_t n = run ? (size_t)__builtin_ctzll(run) : 64 - (x - x0);
+	    op(line, y, z, x, std::min(n, width - x));
+	    word &= (n + (x - x0) >= 64) ? 0 : (~(uint64_t)0 << (n + (x - x0)));
+	  }
+	}
+      }
+    });
+}
+
+// dst = mask ? src : dst
+template <typename T>
+void maskedCopyPixmap(cpixmap<T>& dst, const cpixmap<T>& src, const cbitmap& mask,
+		      const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("maskedCopyPixmap", src, trace_bytes<T>(src) * 2, trace_threads(policy));
+  assert(dst.isMatched(src.getWidth(), src.getHeight(), src.getBands()));
+  bitmap_masked(dst, mask, [&](T *line, size_t y, size_t z, size_t x, size_t n) {
+      std::memcpy(line + x, src.getLine(y, z) + x, n * sizeof(T));
+    }, policy);
+}
+
+// dst = mask ? value : dst
+template <typename T>
+void maskedFillPixmap(cpixmap<T>& dst, T value, const cbitmap& mask,
+		      const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("maskedFillPixmap", dst, trace_bytes<T>(dst), trace_threads(policy));
+  bitmap_masked(dst, mask, [&](T *line, size_t, size_t, size_t x, size_t n) {
+      std::fill(line + x, line + x + n, value);
+    }, policy);
+}
@@ -19,14 +19,23 @@
 #include <iostream>
 #include <sstream>
 #include <cstring>
-//#include <cmemory>
+#include <string>
 #include <cassert>
 #include <cstdint>
 
 #include "cregion.hpp"
 #include "cpixmap.hpp"
+#include "cmemory.hpp"
 
 // so called a tile of image
+//
+// The lines form a ring: shiftByNextLines() advances the index of the
+// first line and reads only the new ones.  A line inside the image points
+// straight at the image row when the window and its padding lie within
+// the image width; otherwise it is copied with zeros past the image
+// edges.  Lines above or below the image share one line of zeros.  The
+// chunk is thus a view of the image while it is used, and its pixels are
+// read only.
 template <typename T>
 class cchunk {
 public:
@@ -36,9 +45,12 @@ public:
   void setDimension(size_t width, size_t height, size_t hpadding, size_t vpadding);
   void draft(const cpixmap<T>& image, size_t x = 0, size_t y = 0, size_t z = 0);
   void shiftByNextLines(size_t lines_to_read, const cpixmap<T>& image, size_t z = 0);
-  T& operator() (int y, int x);
+  const T& operator() (int y, int x) const;
+  void setMemoryTag(const std::string& tag);
 private:
   void reallocate(size_t lines, size_t stride);
+  void readLine(size_t i, int y, const cpixmap<T>& image, size_t z);
+  size_t getLines(void) const { return m_height + (m_vertical_padding<<1); }
   size_t m_width;
   size_t m_height;
   size_t m_horizontal_padding;
@@ -46,7 +58,11 @@ private:
   size_t m_stride;
   int m_horizontal_start;
   int m_vertical_start;
+  size_t m_first; // ring index of the line at m_vertical_start
+  bool m_direct; // lines inside the image point into it
   uint8_t *m_buffer;
+  cmemory_mapping m_mapping;
+  std::string m_tag;
   T **m_line_buffer;
 };
 
@@ -59,7 +75,10 @@ cchunk<T>::cchunk(void)
     m_stride(0),
     m_horizontal_start(0),
     m_vertical_start(0),
+    m_first(0),
+    m_direct(false),
     m_buffer(NULL),
+    m_tag("cchunk"),
     m_line_buffer(NULL) {}
 
 template <typename T>
@@ -71,7 +90,10 @@ cchunk<T>::cchunk(size_t width, size_t height, size_t hpadding, size_t vpadding)
     m_stride(0),
     m_horizontal_start(0),
     m_vertical_start(0),
+    m_first(0),
+    m_direct(false),
     m_buffer(NULL),
+    m_tag("cchunk"),
     m_line_buffer(NULL)
 {
   setDimension(width, height, hpadding, vpadding);
@@ -80,7 +102,7 @@ cchunk<T>::cchunk(size_t width, size_t height, size_t hpadding, size_t vpadding)
 template <typename T>
 cchunk<T>::~cchunk(void)
 {
-  if (m_buffer) delete [] m_buffer;
+  freeMemory(m_buffer, m_mapping);
   if (m_line_buffer) delete [] m_line_buffer;
 }
 
@@ -105,23 +127,15 @@ void cchunk<T>::draft(const cpixmap<T>& image, size_t x, size_t y, size_t z)
 
   m_horizontal_start = x - m_horizontal_padding;
   m_vertical_start = y - m_vertical_padding;
-    
-  size_t lines = m_height + (m_vertical_padding<<1);    
-  std::memset(m_buffer, 0, lines * m_stride);
-    
-  for (size_t i = 0; i < lines; i++)
-    m_line_buffer[i] = (T *)(m_buffer + i*m_stride);
-
-  size_t hoffset = std::max(m_horizontal_start, 0) - m_horizontal_start;
-  size_t voffset = std::max(m_vertical_start, 0) - m_vertical_start;
+  m_first = 0;
+  m_direct = m_horizontal_start >= 0 &&
+    m_horizontal_start + m_width + (m_horizontal_padding<<1) <= image.getWidth();
 
-  for (size_t i = voffset; i < lines; i++) {
-    image.readHLine(m_line_buffer[i] + hoffset,
-		    m_width + (m_horizontal_padding<<1) - hoffset,
-		    m_horizontal_start+hoffset,
-		    m_vertical_start+i,
-		    z);
-  }
+  const size_t lines = getLines();
+  PIXMAP_TRACE("cchunk::draft", image, m_direct ? 0 : (uint64_t)lines * m_stride, 1);
+  std::memset(m_buffer + lines * m_stride, 0, m_stride); // the line of zeros
+  for (size_t i = 0; i < lines; i++)
+    readLine(i, m_vertical_start + (int)i, image, z);
 }
 
 template <typename T>
@@ -130,56 +144,72 @@ void cchunk<T>::shiftByNextLines(size_t lines_to_read, const cpixmap<T>& image,
   //assert(m_stride == QWORD_ALIGN((image.getWidth()+(m_horizontal_padding<<1))*sizeof(T)));
   assert(m_buffer);
   assert(m_line_buffer);
-    
-  size_t lines_allocated = m_height + (m_vertical_padding<<1);
-    
-  assert(lines_to_read <= lines_allocated);
 
-  T *temp[lines_to_read];
-  for (size_t i = 0; i < lines_to_read; i++)
-    temp[i] = m_line_buffer[i];
-
-  for (size_t i = lines_to_read; i < lines_allocated; i++)
-    m_line_buffer[i - lines_to_read] = m_line_buffer[i];
-
-  for (size_t i = 0; i < lines_to_read; i++)
-    m_line_buffer[lines_allocated - lines_to_read + i] = temp[i];
+  const size_t lines = getLines();
+  assert(lines_to_read <= lines);
 
   m_vertical_start += lines_to_read;
+  m_first = (m_first + lines_to_read) % lines;
+
+  // the lines that left at the top come back as the last ones
+  for (size_t i = lines - lines_to_read; i < lines; i++) {
+    size_t slot = m_first + i;
+    if (slot >= lines) slot -= lines;
+    readLine(slot, m_vertical_start + (int)i, image, z);
+  }
+}
 
-  size_t hoffset = std::max(m_horizontal_start, 0) - m_horizontal_start;
-     
-  for (size_t i = 0; i < lines_to_read; i++) {
-    size_t voffset = lines_allocated - lines_to_read + i;
-    size_t line = (size_t)(m_vertical_start + voffset);
-    if (line < image.getHeight()) {
-      image.readHLine(m_line_buffer[voffset] + hoffset,
-		      m_width + (m_horizontal_padding<<1) - hoffset,
-		      m_horizontal_start + hoffset,
-		      m_vertical_start + voffset,
-		      z);
-    } else {
-      std::memset(m_line_buffer[voffset], 0, m_stride);
-    }
+// points line slot i at image row y, or fills it from that row
+template <typename T>
+void cchunk<T>::readLine(size_t i, int y, const cpixmap<T>& image, size_t z)
+{
+  const size_t lines = getLines();
+  T *line;
+  if (y < 0 || y >= (int)image.getHeight()) line = (T *)(m_buffer + lines * m_stride);
+  else if (m_direct) line = image.getLine(y, z) + m_horizontal_start;
+  else {
+    const size_t len = m_width + (m_horizontal_padding<<1);
+    const size_t hoffset = std::min((size_t)(std::max(m_horizontal_start, 0) - m_horizontal_start), len);
+    const size_t x = m_horizontal_start + hoffset;
+    const size_t count = (x < image.getWidth()) ? std::min(len - hoffset, image.getWidth() - x) : 0;
+    line = (T *)(m_buffer + i * m_stride);
+    std::memset(line, 0, hoffset * sizeof(T));
+    if (count) std::memcpy(line + hoffset, image.getLine(y, z) + x, count * sizeof(T));
+    std::memset(line + hoffset + count, 0, (len - hoffset - count) * sizeof(T));
   }
+  m_line_buffer[i] = m_line_buffer[i + lines] = line;
 }
 
 template <typename T>
-T& cchunk<T>::operator()(int y, int x)
+const T& cchunk<T>::operator()(int y, int x) const
 {
-  assert(y >= m_vertical_start && y < m_vertical_start + (int)(m_height + (m_vertical_padding<<1)));
+  assert(y >= m_vertical_start && y < m_vertical_start + (int)getLines());
   assert(x >= m_horizontal_start && x < m_horizontal_start + (int)(m_width + (m_horizontal_padding<<1)));
-    
-  return *(m_line_buffer[y-m_vertical_start] + x-m_horizontal_start);
+
+  return *(m_line_buffer[m_first + (y - m_vertical_start)] + x-m_horizontal_start);
+}
+
+template <typename T>
+void cchunk<T>::setMemoryTag(const std::string& tag)
+{
+  m_tag = tag;
+  if (m_buffer) retagMemory(m_mapping, tag);
 }
 
+// the line buffer goes through allocateMemory so that chunks show up in
+// the memory accounting, under "cchunk" unless tagged otherwise; one line
+// more than the chunk holds the zeros outside the image.  The line
+// pointers are kept twice over, so that the lines from any ring index on
+// are consecutive.
 template <typename T>
 void cchunk<T>::reallocate(size_t lines, size_t stride)
 {
-  if (m_buffer) delete [] m_buffer;
+  cmemory_policy memory;
+  memory.tag = m_tag;
+  freeMemory(m_buffer, m_mapping);
   if (m_line_buffer) delete [] m_line_buffer;
-  m_buffer = new uint8_t[lines * stride];
-  m_line_buffer = new T*[lines];
+  m_buffer = allocateMemory((lines + 1) * stride, memory, m_mapping);
+  m_line_buffer = new T*[lines << 1];
 }
 
 template <typename T>
@@ -202,7 +232,7 @@ public:
   {
     m_base->shiftByNextLines(lines_to_read, img, z);
   }
-  T& operator()(int y, int x) { return (*m_base)(y, x); }
+  const T& operator()(int y, int x) const { return (*m_base)(y, x); }
 private:
   cchunk<T> *m_base;
 };
@@ -221,7 +251,7 @@ public:
   void setFrame(const cpixmap<T>& img) { m_base->setDimension(img.getWidth(), 1, 1, 1); }
   void draftFrame(const cpixmap<T>& img, size_t z = 0) { m_base->draft(img, 0, 0, z); }
   void shiftFrame(const cpixmap<T>& img, size_t z = 0) { m_base->shiftByNextLines(1, img, z); }
-  T& operator() (int y, int x) { return (*m_base)(y, x); }
+  const T& operator() (int y, int x) const { return (*m_base)(y, x); }
 private:
   cchunk<T> *m_base;
 };
@@ -240,7 +270,7 @@ public:
   void setFrame(const cpixmap<T>& img) { m_base->setDimension(img.getWidth(), 1, 2, 2); }
   void draftFrame(const cpixmap<T>& img, size_t z = 0) { m_base->draft(img, 0, 0, z); }
   void shiftFrame(const cpixmap<T>& img, size_t z = 0) { m_base->shiftByNextLines(1, img, z); }
-  T& operator() (int y, int x) { return (*m_base)(y, x); }
+  const T& operator() (int y, int x) const { return (*m_base)(y, x); }
 private:
   cchunk<T> *m_base;
 };
@@ -0,0 +1,775 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <condition_variable>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cpixmap.hpp>
+#include <cexecutor.hpp>
+#include <ctiledpixmap.hpp>
+
+// Out-of-core pixmap: the tiles of a ctiledpixmap live in a file and only
+// a bounded number of them are held in memory.  The file is a 4 KiB
+// header followed by the tiles in ctiledpixmap order, tile * tile pixels
+// each, so a new image is a sparse file of zero tiles.
+//
+// Tiles are reached by pinning them (pinTile, or forEachTile below): the
+// returned ctile_ref keeps the tile in memory until it goes out of scope
+// and hands it out as a tile x tile cpixmap, on which the cpixmap kernels
+// run unchanged.  Unpinned tiles form an LRU list; when the cache is full
+// the least recently used one is evicted, and written back first if it
+// was pinned dirty.  Misses that continue a sequential run of tiles ask
+// the kernel to read the next ones ahead (posix_fadvise), so scans in tile
+// order overlap I/O with compute.  The cache is shared by all threads;
+// file I/O is done outside its lock.
+//
+// The cache must hold the tiles pinned at once: one per thread for
+// forEachTile, two for forEachTileWindow.  A pin that finds every slot
+// pinned waits for one to be released.
+//
+// A tile that cannot be read reads as zero, and one that cannot be
+// written back is lost; either is remembered until the file is closed
+// and reported by flush() and close().
+
+struct ctile_cache_stats {
+  uint64_t hits, misses;
+  uint64_t reads, writes; // tiles
+  uint64_t evictions;
+  uint64_t readaheads;    // tiles advised
+};
+
+template <typename T> class cdiskpixmap;
+
+// a pinned tile of a cdiskpixmap
+template <typename T>
+class ctile_ref {
+public:
+  ctile_ref(void) : m_owner(NULL), m_slot(0), m_pixmap(NULL), m_dirty(false) {}
+  ctile_ref(ctile_ref&& ref)
+    : m_owner(ref.m_owner), m_slot(ref.m_slot), m_pixmap(ref.m_pixmap), m_view(ref.m_view), m_dirty(ref.m_dirty)
+  {
+    ref.m_owner = NULL;
+  }
+  ~ctile_ref(void) { release(); }
+  ctile_ref& operator=(ctile_ref&& ref)
+  {
+    if (this != &ref) {
+      release();
+      m_owner = ref.m_owner, m_slot = ref.m_slot, m_pixmap = ref.m_pixmap;
+      m_view = ref.m_view, m_dirty = ref.m_dirty;
+      ref.m_owner = NULL;
+    }
+    return *this;
+  }
+
+  // the whole tile, tile x tile pixels; the part outside the image is
+  // getView().width x getView().height from the top left
+  cpixmap<T>& getPixmap(void) const { return *m_pixmap; }
+  const ctile<T>& getView(void) const { return m_view; }
+  // write the tile back before it is evicted
+  void setDirty(void) { m_dirty = true; }
+  void release(void);
+
+private:
+  friend class cdiskpixmap<T>;
+  const cdiskpixmap<T> *m_owner;
+  size_t m_slot;
+  cpixmap<T> *m_pixmap;
+  ctile<T> m_view;
+  bool m_dirty;
+
+  ctile_ref(const ctile_ref&);
+  ctile_ref& operator=(const ctile_ref&);
+};
+
+template <typename T>
+class cdiskpixmap : public cregion<size_t> {
+public:
+  explicit cdiskpixmap(size_t cache_bytes = (size_t)256 << 20);
+  virtual ~cdiskpixmap(void);
+
+  // a new zero image, replacing any file at path
+  bool create(const std::string& path, size_t w, size_t h, size_t b = 1, size_t tile = 256);
+  // an image written by create(); false if it is missing, of another T or
+  // shorter than its tiles
+  bool open(const std::string& path, bool writable = true);
+  // false if a tile failed to be read or written since open or create
+  bool close(void);
+  bool isOpen(void) const { return m_fd >= 0; }
+  // write the dirty tiles back; they stay cached.  False as close()
+  bool flush(void);
+
+  // drops the cached tiles, which must not be pinned
+  void setCacheSize(size_t bytes);
+  size_t getCacheSize(void) const { return m_capacity * m_tile_bytes; }
+  size_t getCacheTiles(void) const { return m_capacity; }
+  void setReadAhead(size_t tiles) { m_readahead = tiles; }
+  ctile_cache_stats getCacheStats(void) const;
+  void resetCacheStats(void);
+
+  size_t getTileSize(void) const { return m_tile; }
+  size_t getTilesX(void) const { return m_tiles_x; }
+  size_t getTilesY(void) const { return m_tiles_y; }
+  size_t getTileCount(void) const { return m_bands * m_tiles_y * m_tiles_x; }
+  ctile_ref<T> pinTile(size_t tx, size_t ty, size_t z = 0) const;
+  // the i-th tile in ctiledpixmap order
+  ctile_ref<T> pinTile(size_t i) const;
+
+  // w x h pixels at (x, y) to or from rows stride pixels apart; read
+  // blocks may reach outside the image, which reads as zero
+  void readBlock(T *data, size_t stride, long x, long y, size_t w, size_t h, size_t z = 0) const;
+  void writeBlock(const T *data, size_t stride, size_t x, size_t y, size_t w, size_t h, size_t z = 0);
+  void readHLine(T *line, size_t len, size_t x, size_t y, size_t z = 0) const;
+  void writeHLine(const T *line, size_t len, size_t x, size_t y, size_t z = 0);
+  T getPixel(size_t x, size_t y, size_t z = 0) const;
+  void putPixel(T val, size_t x, size_t y, size_t z = 0);
+  // tile (tx, ty) grown by padding pixels on each side into dst, zero
+  // outside the image, as cchunk::draft does for a cpixmap
+  void readPaddedTile(cpixmap<T>& dst, size_t tx, size_t ty, size_t z, size_t padding) const;
+
+  bool isMatched(size_t w, size_t h, size_t b) const { return m_width == w && m_height == h && m_bands == b; }
+
+private:
+  friend class ctile_ref<T>;
+
+  enum { HEADER_BYTES = 4096, READAHEAD_STREAMS = 8 };
+
+  struct cheader {
+    char magic[8];
+    uint64_t width, height, bands, tile, pixel_bytes;
+  };
+
+  struct cslot {
+    cpixmap<T> pixmap;
+    size_t key;   // tile index, NO_TILE when unused
+    size_t pins;
+    bool dirty;
+    bool ready;   // loaded
+    std::list<size_t>::iterator lru;
+    explicit cslot(size_t tile) : pixmap(tile, tile, 1, cdiskpixmap::slotPolicy()), key(NO_TILE), pins(0),
+				  dirty(false), ready(false) {}
+  };
+
+  struct cstream {
+    size_t next;    // the tile that continues the run
+    size_t advised; // end of the tiles advised for it
+  };
+
+  struct ccache {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::unique_ptr<cslot> > slots;
+    std::unordered_map<size_t, size_t> index; // tile -> slot
+    std::list<size_t> lru;                    // unpinned slots, least recent first
+    std::set<size_t> writing;                 // tiles being written back
+    cstream streams[READAHEAD_STREAMS];       // sequential runs of misses
+    size_t stream_next;                       // the one to replace next
+    ctile_cache_stats stats;
+    bool failed;                              // a short tile read or write
+  };
+
+  static const size_t NO_TILE = ~(size_t)0;
+
+  static cmemory_policy slotPolicy(void)
+  {
+    cmemory_policy memory;
+    memory.tag = "cdiskpixmap";
+    return memory;
+  }
+
+  static bool checkHeader(const cheader& header, uint64_t file_bytes);
+  void setup(size_t w, size_t h, size_t b, size_t tile);
+  off_t tileOffset(size_t key) const { return (off_t)HEADER_BYTES + (off_t)key * (off_t)m_tile_bytes; }
+  cslot *acquire(size_t key, size_t& index) const;
+  void unpin(size_t slot, bool dirty) const;
+  void readTile(size_t key, cpixmap<T>& pixmap) const;
+  void writeTile(size_t key, const cpixmap<T>& pixmap) const;
+  void readAhead(size_t key) const;
+  void dropCache(void);
+
+  int m_fd;
+  bool m_writable;
+  size_t m_tile, m_shift, m_mask;
+  size_t m_tiles_x, m_tiles_y;
+  size_t m_tile_bytes; // in the file
+  size_t m_cache_bytes, m_capacity;
+  size_t m_readahead;
+  std::unique_ptr<ccache> m_cache;
+
+  cdiskpixmap(const cdiskpixmap&);
+  cdiskpixmap& operator=(const cdiskpixmap&);
+};
+
+template <typename T>
+const size_t cdiskpixmap<T>::NO_TILE;
+
+template <typename T>
+void ctile_ref<T>::release(void)
+{
+  if (!m_owner) return;
+  m_owner->unpin(m_slot, m_dirty);
+  m_owner = NULL;
+}
+
+template <typename T>
+cdiskpixmap<T>::cdiskpixmap(size_t cache_bytes)
+  : m_fd(-1), m_writable(false), m_tile(0), m_shift(0), m_mask(0), m_tiles_x(0), m_tiles_y(0),
+    m_tile_bytes(0), m_cache_bytes(cache_bytes), m_capacity(0), m_readahead(8), m_cache(new ccache)
+{
+  m_cache->failed = false;
+  resetCacheStats();
+}
+
+template <typename T>
+cdiskpixmap<T>::~cdiskpixmap(void)
+{
+  close();
+}
+
+template <typename T>
+void cdiskpixmap<T>::setup(size_t w, size_t h, size_t b, size_t tile)
+{
+  // cpixmap rows are 8 byte aligned; from 8 bytes a tile row up, the slot
+  // pixmaps are contiguous and a tile is one pread
+  assert(tile > 0 && (tile & (tile - 1)) == 0 && tile * sizeof(T) % 8 == 0);
+  cregion::setResolution(w, h, b);
+  m_tile = tile;
+  m_mask = tile - 1;
+  m_shift = 0;
+  while (((size_t)1 << m_shift) < tile) ++m_shift;
+  m_tiles_x = (w + m_mask) >> m_shift;
+  m_tiles_y = (h + m_mask) >> m_shift;
+  m_tile_bytes = tile * tile * sizeof(T);
+  m_cache->failed = false;
+  setCacheSize(m_cache_bytes);
+}
+
+// the geometry setup() asserts, and every tile of it inside the file
+template <typename T>
+bool cdiskpixmap<T>::checkHeader(const cheader& header, uint64_t file_bytes)
+{
+  const uint64_t tile = header.tile;
+  if (std::memcmp(header.magic, "CPXTILE1", 8) != 0 || header.pixel_bytes != sizeof(T)) return false;
+  if (tile == 0 || (tile & (tile - 1)) != 0 || tile * sizeof(T) % 8 != 0 || tile > ((uint64_t)1 << 24))
+    return false;
+  if (file_bytes < HEADER_BYTES) return false;
+  const uint64_t tiles_x = header.width / tile + (header.width % tile != 0);
+  const uint64_t tiles_y = header.height / tile + (header.height % tile != 0);
+  const uint64_t tiles_room = (file_bytes - HEADER_BYTES) / (tile * tile * sizeof(T));
+  if (!tiles_x || !tiles_y || !header.bands) return true;
+  return tiles_x <= tiles_room && tiles_y <= tiles_room / tiles_x && header.bands <= tiles_room / tiles_x / tiles_y;
+}
+
+template <typename T>
+bool cdiskpixmap<T>::create(const std::string& path, size_t w, size_t h, size_t b, size_t tile)
+{
+  close();
+  m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (m_fd < 0) return false;
+  m_writable = true;
+  setup(w, h, b, tile);
+
+  char block[HEADER_BYTES];
+  std::memset(block, 0, sizeof(block));
+  cheader header;
+  std::memcpy(header.magic, "CPXTILE1", 8);
+  header.width = w, header.height = h, header.bands = b;
+  header.tile = tile, header.pixel_bytes = sizeof(T);
+  std::memcpy(block, &header, sizeof(header));
+  if (pwrite(m_fd, block, sizeof(block), 0) != (ssize_t)sizeof(block) ||
+      ftruncate(m_fd, tileOffset(getTileCount())) != 0) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+template <typename T>
+bool cdiskpixmap<T>::open(const std::string& path, bool writable)
+{
+  close();
+  m_fd = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+  if (m_fd < 0) return false;
+  cheader header;
+  struct stat st;
+  if (fstat(m_fd, &st) != 0 || pread(m_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+      !checkHeader(header, (uint64_t)st.st_size)) {
+    ::close(m_fd);
+    m_fd = -1;
+    return false;
+  }
+  m_writable = writable;
+  setup(header.width, header.height, header.bands, header.tile);
+  return true;
+}
+
+template <typename T>
+bool cdiskpixmap<T>::close(void)
+{
+  if (m_fd < 0) return true;
+  dropCache();
+  const bool ok = ::close(m_fd) == 0 && !m_cache->failed;
+  m_fd = -1;
+  return ok;
+}
+
+template <typename T>
+bool cdiskpixmap<T>::flush(void)
+{
+  std::unique_lock<std::mutex> lock(m_cache->mutex);
+  for (size_t i = 0; i < m_cache->slots.size(); ++i) {
+    cslot& slot = *m_cache->slots[i];
+    if (!slot.dirty || !slot.ready) continue;
+    // pinned so that it is not evicted meanwhile
+    if (slot.pins++ == 0) m_cache->lru.erase(slot.lru);
+    slot.dirty = false;
+    lock.unlock();
+    writeTile(slot.key, slot.pixmap);
+    lock.lock();
+    if (--slot.pins == 0) slot.lru = m_cache->lru.insert(m_cache->lru.end(), i);
+  }
+  m_cache->changed.notify_all();
+  return !m_cache->failed;
+}
+
+template <typename T>
+void cdiskpixmap<T>::dropCache(void)
+{
+  flush();
+  std::lock_guard<std::mutex> lock(m_cache->mutex);
+  for (size_t i = 0; i < m_cache->slots.size(); ++i) assert(m_cache->slots[i]->pins == 0);
+  m_cache->slots.clear();
+  m_cache->index.clear();
+  m_cache->lru.clear();
+}
+
+template <typename T>
+void cdiskpixmap<T>::setCacheSize(size_t bytes)
+{
+  if (m_fd >= 0) dropCache();
+  m_cache_bytes = bytes;
+  m_capacity = m_tile_bytes ? std::max<size_t>(1, bytes / m_tile_bytes) : 0;
+  m_cache->slots.reserve(m_capacity); // slots are never moved
+  for (size_t s = 0; s < READAHEAD_STREAMS; ++s) m_cache->streams[s].next = NO_TILE;
+  m_cache->stream_next = 0;
+}
+
+template <typename T>
+ctile_cache_stats cdiskpixmap<T>::getCacheStats(void) const
+{
+  std::lock_guard<std::mutex> lock(m_cache->mutex);
+  return m_cache->stats;
+}
+
+template <typename T>
+void cdiskpixmap<T>::resetCacheStats(void)
+{
+  std::lock_guard<std::mutex> lock(m_cache->mutex);
+  std::memset(&m_cache->stats, 0, sizeof(m_cache->stats));
+}
+
+// slot holding tile key, pinned and loaded
+template <typename T>
+typename cdiskpixmap<T>::cslot *cdiskpixmap<T>::acquire(size_t key, size_t& index) const
+{
+  ccache& cache = *m_cache;
+  std::unique_lock<std::mutex> lock(cache.mutex);
+  for (;;) {
+    std::unordered_map<size_t, size_t>::iterator found = cache.index.find(key);
+    if (found != cache.index.end()) {
+      const size_t i = found->second;
+      cslot& slot = *cache.slots[i];
+      if (slot.pins++ == 0) cache.lru.erase(slot.lru);
+      ++cache.stats.hits;
+      cache.changed.wait(lock, [&] { return slot.ready; });
+      index = i;
+      return &slot;
+    }
+    if (cache.writing.count(key)) { // its last contents are on the way out
+      cache.changed.wait(lock);
+      continue;
+    }
+
+    size_t i;
+    if (cache.slots.size() < m_capacity) {
+      i = cache.slots.size();
+      cache.slots.push_back(std::unique_ptr<cslot>(new cslot(m_tile)));
+    } else if (!cache.lru.empty()) {
+      i = cache.lru.front();
+      cache.lru.pop_front();
+      cache.index.erase(cache.slots[i]->key);
+      ++cache.stats.evictions;
+    } else {
+      cache.changed.wait(lock);
+      continue;
+    }
+
+    cslot& slot = *cache.slots[i];
+    const size_t old = slot.key;
+    const bool write = slot.dirty;
+    slot.key = key;
+    slot.pins = 1;
+    slot.dirty = false;
+    slot.ready = false;
+    cache.index[key] = i;
+    if (write) cache.writing.insert(old);
+    ++cache.stats.misses;
+    lock.unlock();
+
+    if (write) writeTile(old, slot.pixmap);
+    readAhead(key);
+    readTile(key, slot.pixmap);
+
+    lock.lock();
+    if (write) cache.writing.erase(old);
+    slot.ready = true;
+    cache.changed.notify_all();
+    index = i;
+    return &slot;
+  }
+}
+
+template <typename T>
+void cdiskpixmap<T>::unpin(size_t i, bool dirty) const
+{
+  ccache& cache = *m_cache;
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cslot& slot = *cache.slots[i];
+    assert(slot.pins > 0);
+    assert(!dirty || m_writable);
+    slot.dirty |= dirty;
+    if (--slot.pins > 0) return;
+    slot.lru = cache.lru.insert(cache.lru.end(), i);
+  }
+  cache.changed.notify_all();
+}
+
+template <typename T>
+void cdiskpixmap<T>::readTile(size_t key, cpixmap<T>& pixmap) const
+{
+  uint8_t *p = (uint8_t *)pixmap.getLine(0, 0);
+  size_t done = 0;
+  while (done < m_tile_bytes) {
+    const ssize_t n = pread(m_fd, p + done, m_tile_bytes - done, tileOffset(key) + (off_t)done);
+    if (n <= 0) break;
+    done += (size_t)n;
+  }
+  if (done < m_tile_bytes) std::memset(p + done, 0, m_tile_bytes - done);
+  std::lock_guard<std::mutex> lock(m_cache->mutex);
+  ++m_cache->stats.reads;
+  if (done < m_tile_bytes) m_cache->failed = true;
+}
+
+template <typename T>
+void cdiskpixmap<T>::writeTile(size_t key, const cpixmap<T>& pixmap) const
+{
+  const uint8_t *p = (const uint8_t *)pixmap.getLine(0, 0);
+  size_t done = 0;
+  while (done < m_tile_bytes) {
+    const ssize_t n = pwrite(m_fd, p + done, m_tile_bytes - done, tileOffset(key) + (off_t)done);
+    if (n <= 0) break;
+    done += (size_t)n;
+  }
+  std::lock_guard<std::mutex> lock(m_cache->mutex);
+  ++m_cache->stats.writes;
+  if (done < m_tile_bytes) m_cache->failed = true;
+}
+
+// A miss on the tile that continues one of a few runs of misses (one per
+// thread scanning its own range, say) extends that run, and the next
+// m_readahead tiles of the run are advised to the kernel once less than
+// half of them is left.
+template <typename T>
+void cdiskpixmap<T>::readAhead(size_t key) const
+{
+  if (m_readahead == 0) return;
+  ccache& cache = *m_cache;
+  size_t first, last;
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    size_t s = 0;
+    while (s < READAHEAD_STREAMS && cache.streams[s].next != key) ++s;
+    if (s == READAHEAD_STREAMS) {
+      cstream& stream = cache.streams[cache.stream_next];
+      cache.stream_next = (cache.stream_next + 1) % READAHEAD_STREAMS;
+      stream.next = key + 1;
+      stream.advised = key + 1;
+      return;
+    }
+    cstream& stream = cache.streams[s];
+    stream.next = key + 1;
+    if (stream.advised > key + 1 + m_readahead / 2) return;
+    first = std::max(stream.advised, key + 1);
+    last = std::min(key + 1 + m_readahead, getTileCount());
+    if (first >= last) return;
+    stream.advised = last;
+    cache.stats.readaheads += last - first;
+  }
+#if defined(POSIX_FADV_WILLNEED)
+  posix_fadvise(m_fd, tileOffset(first), (off_t)((last - first) * m_tile_bytes), POSIX_FADV_WILLNEED);
+#endif
+}
+
+template <typename T>
+ctile_ref<T> cdiskpixmap<T>::pinTile(size_t tx, size_t ty, size_t z) const
+{
+  assert(m_fd >= 0 && tx < m_tiles_x && ty < m_tiles_y && z < m_bands);
+  ctile_ref<T> ref;
+  ref.m_pixmap = &acquire((z * m_tiles_y + ty) * m_tiles_x + tx, ref.m_slot)->pixmap;
+  ref.m_owner = this;
+  ref.m_view.x = tx << m_shift;
+  ref.m_view.y = ty << m_shift;
+  ref.m_view.z = z;
+  ref.m_view.width = std::min(m_tile, m_width - ref.m_view.x);
+  ref.m_view.height = std::min(m_tile, m_height - ref.m_view.y);
+  ref.m_view.stride = m_tile;
+  ref.m_view.data = ref.m_pixmap->getLine(0, 0);
+  return ref;
+}
+
+template <typename T>
+ctile_ref<T> cdiskpixmap<T>::pinTile(size_t i) const
+{
+  const size_t per_band = m_tiles_x * m_tiles_y;
+  return pinTile((i % per_band) % m_tiles_x, (i % per_band) / m_tiles_x, i / per_band);
+}
+
+// one pin per tile crossed
+template <typename T>
+void cdiskpixmap<T>::readBlock(T *data, size_t stride, long x, long y, size_t w, size_t h, size_t z) const
+{
+  const long x0 = std::max(x, 0L), y0 = std::max(y, 0L);
+  const long x1 = std::min(x + (long)w, (long)m_width), y1 = std::min(y + (long)h, (long)m_height);
+  if (x0 >= x1 || y0 >= y1) {
+    for (size_t j = 0; j < h; ++j) std::fill(data + j * stride, data + j * stride + w, T());
+    return;
+  }
+  for (size_t j = 0; j < h; ++j) {
+    const long yy = y + (long)j;
+    T *row = data + j * stride;
+    if (yy < y0 || yy >= y1) { std::fill(row, row + w, T()); continue; }
+    std::fill(row, row + (x0 - x), T());
+    std::fill(row + (x1 - x), row + w, T());
+  }
+  for (size_t ty = (size_t)y0 >> m_shift; ty <= (size_t)(y1 - 1) >> m_shift; ++ty)
+    for (size_t tx = (size_t)x0 >> m_shift; tx <= (size_t)(x1 - 1) >> m_shift; ++tx) {
+      ctile_ref<T> ref = pinTile(tx, ty, z);
+      const ctile<T>& t = ref.getView();
+      const long bx0 = std::max(x0, (long)t.x), bx1 = std::min(x1, (long)(t.x + m_tile));
+      const long by0 = std::max(y0, (long)t.y), by1 = std::min(y1, (long)(t.y + m_tile));
+      for (long yy = by0; yy < by1; ++yy)
+	std::memcpy(data + (yy - y) * stride + (bx0 - x), t.getLine(yy - t.y) + (bx0 - t.x),
+		    (bx1 - bx0) * sizeof(T));
+    }
+}
+
+template <typename T>
+void cdiskpixmap<T>::writeBlock(const T *data, size_t stride, size_t x, size_t y, size_t w, size_t h, size_t z)
+{
+  assert(cregion::include(x, y, z));
+  const size_t x1 = std::min(x + w, m_width), y1 = std::min(y + h, m_height);
+  for (size_t ty = y >> m_shift; ty <= (y1 - 1) >> m_shift; ++ty)
+    for (size_t tx = x >> m_shift; tx <= (x1 - 1) >> m_shift; ++tx) {
+      ctile_ref<T> ref = pinTile(tx, ty, z);
+      const ctile<T>& t = ref.getView();
+      const size_t bx0 = std::max(x, t.x), bx1 = std::min(x1, t.x + m_tile);
+      const size_t by0 = std::max(y, t.y), by1 = std::min(y1, t.y + m_tile);
+      for (size_t yy = by0; yy < by1; ++yy)
+	std::memcpy(t.getLine(yy - t.y) + (bx0 - t.x), data + (yy - y) * stride + (bx0 - x),
+		    (bx1 - bx0) * sizeof(T));
+      ref.setDirty();
+    }
+}
+
+template <typename T>
+void cdiskpixmap<T>::readHLine(T *line, size_t len, size_t x, size_t y, size_t z) const
+{
+  assert(cregion::include(x, y, z));
+  readBlock(line, len, (long)x, (long)y, std::min(len, m_width - x), 1, z);
+}
+
+template <typename T>
+void cdiskpixmap<T>::writeHLine(const T *line, size_t len, size_t x, size_t y, size_t z)
+{
+  writeBlock(line, len, x, y, len, 1, z);
+}
+
+template <typename T>
+T cdiskpixmap<T>::getPixel(size_t x, size_t y, size_t z) const
+{
+  assert(cregion::include(x, y, z));
+  ctile_ref<T> ref = pinTile(x >> m_shift, y >> m_shift, z);
+  return ref.getView()(y & m_mask, x & m_mask);
+}
+
+template <typename T>
+void cdiskpixmap<T>::putPixel(T val, size_t x, size_t y, size_t z)
+{
+  assert(cregion::include(x, y, z));
+  ctile_ref<T> ref = pinTile(x >> m_shift, y >> m_shift, z);
+  ref.getView()(y & m_mask, x & m_mask) = val;
+  ref.setDirty();
+}
+
+template <typename T>
+void cdiskpixmap<T>::readPaddedTile(cpixmap<T>& dst, size_t tx, size_t ty, size_t z, size_t padding) const
+{
+  const size_t size = m_tile + 2 * padding;
+  if (!dst.isMatched(size, size, 1)) dst.setResolution(size, size, 1);
+  const size_t stride = (size_t)(dst.getLine(1, 0) - dst.getLine(0, 0));
+  readBlock(dst.getLine(0, 0), stride, (long)(tx << m_shift) - (long)padding,
+	    (long)(ty << m_shift) - (long)padding, size, size, z);
+}
+
+// Run body(ref) for every tile, pinned, the tiles being the tasks of
+// policy.  body calls ref.setDirty() if it changed the tile.
+template <typename T, typename Body>
+void forEachTile(const cdiskpixmap<T>& img, const Body& body,
+		 const cexecution_policy& policy = cexecution_policy())
+{
+  policy.getExecutor().run(img.getTileCount(), [&](size_t i) {
+      ctile_ref<T> ref = img.pinTile(i);
+      body(ref);
+    });
+}
+
+// forEachTileWindow() of ctiledpixmap.hpp out of core: op(window, out)
+// gets the block of src around each tile of dst, grown by radius pixels
+// and zero outside the image, and the tile of dst, which is written back.
+template <typename U, typename T, typename Op>
+void forEachTileWindow(cdiskpixmap<U>& dst, const cdiskpixmap<T>& src, size_t radius, const Op& op,
+		       const cexecution_policy& policy = cexecution_policy())
+{
+  assert((const void *)&dst != (const void *)&src);
+  assert(dst.isMatched(src.getWidth(), src.getHeight(), src.getBands()));
+
+  forEachTile(dst, [&](ctile_ref<U>& ref) {
+      const ctile<U>& out = ref.getView();
+      const size_t stride = out.width + 2 * radius, rows = out.height + 2 * radius;
+      static thread_local std::vector<T> storage;
+      storage.resize(stride * rows);
+      src.readBlock(&storage[0], stride, (long)out.x - (long)radius, (long)out.y - (long)radius,
+		    stride, rows, out.z);
+      ctile<const T> window;
+      window.x = out.x;
+      window.y = out.y;
+      window.z = out.z;
+      window.width = stride;
+      window.height = rows;
+      window.stride = stride;
+      window.data = &storage[0];
+      op(window, out);
+      ref.setDirty();
+    }, policy);
+}
+
+// convolve() of an image larger than memory, into dst of the same size
+template <typename T>
+void convolveTiled(cdiskpixmap<T>& dst, const cdiskpixmap<T>& src, const cpixmap<int>& kernel,
+		   int rshift = 0, int offset = 0, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("convolveTiled(disk)", src, trace_bytes<T>(src) * 2, trace_threads(policy));
+  assert(std::numeric_limits<T>::is_integer);
+  assert(std::numeric_limits<T>::digits < std::numeric_limits<int>::digits);
+
+  const size_t radius = std::max(kernel.getWidth(), kernel.getHeight()) >> 1;
+  forEachTileWindow(dst, src, radius, [&](const ctile<const T>& window, const ctile<T>& out) {
+      convolve_tile(window, out, kernel, rshift, offset);
+    }, policy);
+}
+
+struct cpixmap_statistics {
+  uint64_t count;
+  double min, max;
+  double mean, stddev;
+};
+
+// Statistics of band z in one pass over the tiles.  Every tile gives its
+// count, mean and sum of squared deviations, merged as Chan et al. do so
+// that the variance of 10^10 pixels keeps its precision.
+template <typename T>
+cpixmap_statistics computeStatistics(const cdiskpixmap<T>& img, size_t z = 0,
+				     const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("computeStatistics", img, trace_bytes<T>(img) / std::max<size_t>(1, img.getBands()),
+	       trace_threads(policy));
+  std::mutex mutex;
+  uint64_t count = 0;
+  double mean = 0.0, m2 = 0.0;
+  double minval = std::numeric_limits<double>::infinity(), maxval = -minval;
+
+  const size_t per_band = img.getTilesX() * img.getTilesY();
+  policy.getExecutor().run(per_band, [&](size_t i) {
+      ctile_ref<T> ref = img.pinTile(z * per_band + i);
+      const ctile<T>& t = ref.getView();
+      // shared state is only touched under the lock below
+      double tsum = 0.0, tmin = std::numeric_limits<double>::infinity(), tmax = -tmin;
+      for (size_t y = 0; y < t.height; ++y) {
+	const T *line = t.getLine(y);
+	for (size_t x = 0; x < t.width; ++x) {
+	  const double v = (double)line[x];
+	  tsum += v;
+	  tmin = std::min(tmin, v);
+	  tmax = std::max(tmax, v);
+	}
+      }
+      const uint64_t n = (uint64_t)t.width * t.height;
+      const double tmean = tsum / n;
+      double tm2 = 0.0;
+      for (size_t y = 0; y < t.height; ++y) {
+	const T *line = t.getLine(y);
+	for (size_t x = 0; x < t.width; ++x) {
+	  const double d = (double)line[x] - tmean;
+	  tm2 += d * d;
+	}
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      const double delta = tmean - mean;
+      const uint64_t total = count + n;
+      mean += delta * n / total;
+      m2 += tm2 + delta * delta * ((double)count * n / total);
+      count = total;
+      minval = std::min(minval, tmin);
+      maxval = std::max(maxval, tmax);
+    });
+
+  cpixmap_statistics stats;
+  stats.count = count;
+  stats.min = minval;
+  stats.max = maxval;
+  stats.mean = mean;
+  stats.stddev = count ? std::sqrt(m2 / count) : 0.0;
+  return stats;
+}
@@ -0,0 +1,289 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cstdlib>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include "cmemory.hpp"
+
+#if defined(__linux__)
+# include <pthread.h>
+# include <sched.h>
+#endif
+
+// Execution of the row loops of the pixmap kernels.  A kernel describes
+// its work as a number of independent tasks and hands it to a cexecutor:
+// either inline (csequential_executor), a persistent work-stealing pool
+// (cthread_pool) or any executor of the caller's.  cexecution_policy picks
+// the executor and the grain, the number of rows in one task.
+
+class cexecutor {
+public:
+  virtual ~cexecutor(void) {}
+  // call task(i) for every i in [0, count), in any order and on any thread;
+  // returns when all calls have returned.  If tasks throw, the first
+  // exception is rethrown once the calls under way have returned
+  virtual void run(size_t count, const std::function<void(size_t)>& task) = 0;
+  virtual size_t getConcurrency(void) const = 0;
+};
+
+class csequential_executor : public cexecutor {
+public:
+  void run(size_t count, const std::function<void(size_t)>& task)
+  {
+    for (size_t i = 0; i < count; ++i) task(i);
+  }
+  size_t getConcurrency(void) const { return 1; }
+};
+
+// Workers persist across calls.  The tasks of a call are split into one
+// contiguous range per participant (the workers plus the calling thread);
+// each takes tasks from the front of its own range and, once that is
+// empty, steals from the others.  Several threads may submit at once and
+// their calls share the workers.  A call made from inside a task runs
+// inline, so nested kernels never oversubscribe the machine.  Pinned
+// workers are spread over the NUMA nodes in task order, matching the
+// NUMA_STRIPS placement of pixmap buffers.
+class cthread_pool : public cexecutor {
+public:
+  explicit cthread_pool(size_t threads = 0, bool pin = false);
+  ~cthread_pool(void);
+
+  void run(size_t count, const std::function<void(size_t)>& task);
+  size_t getConcurrency(void) const { return m_workers.size() + 1; }
+
+private:
+  struct cjob {
+    const std::function<void(size_t)> *task;
+    size_t count;
+    std::vector<std::atomic<size_t> > next; // per participant range
+    std::vector<size_t> end;
+    std::atomic<size_t> done;
+    size_t users; // workers inside the job, guarded by m_mutex
+    std::exception_ptr error; // the first task that threw, guarded by m_mutex
+    cjob(size_t n, size_t parts) : task(NULL), count(n), next(parts), end(parts), done(0), users(0) {}
+  };
+
+  static bool& insideTask(void)
+  {
+    static thread_local bool inside = false;
+    return inside;
+  }
+
+  // marks the thread as running pool tasks while in scope
+  struct cinside_task {
+    bool was;
+    cinside_task(void) : was(insideTask()) { insideTask() = true; }
+    ~cinside_task(void) { insideTask() = was; }
+  };
+
+  static bool pending(cjob& job)
+  {
+    for (size_t p = 0; p < job.end.size(); ++p)
+      if (job.next[p].load() < job.end[p]) return true;
+    return false;
+  }
+
+  void work(cjob& job, size_t self);
+  void loop(size_t self);
+
+  std::vector<std::thread> m_workers;
+  std::list<cjob *> m_jobs;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_finished;
+  bool m_stop;
+
+  cthread_pool(const cthread_pool&);
+  cthread_pool& operator=(const cthread_pool&);
+};
+
+inline cthread_pool::cthread_pool(size_t threads, bool pin)
+  : m_stop(false)
+{
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  const size_t nodes = getNumaNodeCount();
+  std::vector<size_t> used(nodes, 0);
+  for (size_t i = 0; i + 1 < threads; ++i) {
+    m_workers.push_back(std::thread(&cthread_pool::loop, this, i));
+#if defined(__linux__)
+    if (pin) {
+      // worker i owns the i-th of the contiguous task ranges; put it on the
+      // node holding that part of a NUMA_STRIPS buffer
+      const size_t node = i * nodes / threads;
+      std::vector<int> cpus = getNumaNodeCpus((int)node);
+      int cpu = cpus.empty() ? (int)((i + 1) % std::max(1u, std::thread::hardware_concurrency()))
+	: cpus[used[node]++ % cpus.size()];
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      pthread_setaffinity_np(m_workers.back().native_handle(), sizeof(set), &set);
+    }
+#else
+    (void)pin;
+#endif
+  }
+}
+
+inline cthread_pool::~cthread_pool(void)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+  for (size_t i = 0; i < m_workers.size(); ++i) m_workers[i].join();
+}
+
+inline void cthread_pool::work(cjob& job, size_t self)
+{
+  const size_t parts = job.end.size();
+  cinside_task inside;
+  for (size_t k = 0; k < parts; ++k) {
+    const size_t p = (self + k) % parts;
+    for (;;) {
+      const size_t i = job.next[p].fetch_add(1);
+      if (i >= job.end[p]) break;
+      // a throwing task still counts as done; run() rethrows the first
+      try {
+	(*job.task)(i);
+      } catch (...) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!job.error) job.error = std::current_exception();
+      }
+      job.done.fetch_add(1);
+    }
+  }
+}
+
+inline void cthread_pool::loop(size_t self)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  for (;;) {
+    cjob *job = NULL;
+    m_wake.wait(lock, [&] {
+	if (m_stop) return true;
+	for (std::list<cjob *>::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it)
+	  if (pending(**it)) { job = *it; return true; }
+	return false;
+      });
+    if (!job) return; // stopping
+    ++job->users;
+    lock.unlock();
+    work(*job, self);
+    lock.lock();
+    if (--job->users == 0) m_finished.notify_all();
+  }
+}
+
+inline void cthread_pool::run(size_t count, const std::function<void(size_t)>& task)
+{
+  if (count == 0) return;
+  if (count == 1 || m_workers.empty() || insideTask()) {
+    for (size_t i = 0; i < count; ++i) task(i);
+    return;
+  }
+
+  const size_t parts = m_workers.size() + 1;
+  cjob job(count, parts);
+  job.task = &task;
+  for (size_t p = 0; p < parts; ++p) {
+    job.next[p].store(count * p / parts);
+    job.end[p] = count * (p + 1) / parts;
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.push_back(&job);
+  }
+  m_wake.notify_all();
+
+  work(job, parts - 1);
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_finished.wait(lock, [&] { return job.done.load() >= job.count && job.users == 0; });
+  m_jobs.remove(&job);
+  if (job.error) std::rethrow_exception(job.error);
+}
+
+inline cthread_pool& getDefaultThreadPool(void)
+{
+  static cthread_pool pool;
+  return pool;
+}
+
+enum EXECUTION_MODE {
+  EXECUTE_SEQUENTIAL = 0,
+  EXECUTE_POOL = 1,     // the process-wide default cthread_pool
+  EXECUTE_EXECUTOR = 2  // an executor given by the caller
+};
+
+class cexecution_policy {
+public:
+  explicit cexecution_policy(EXECUTION_MODE mode = EXECUTE_POOL, size_t grain = 0)
+    : m_mode(mode), m_executor(NULL), m_grain(grain) { assert(mode != EXECUTE_EXECUTOR); }
+  explicit cexecution_policy(cexecutor& executor, size_t grain = 0)
+    : m_mode(EXECUTE_EXECUTOR), m_executor(&executor), m_grain(grain) {}
+
+  EXECUTION_MODE getMode(void) const { return m_mode; }
+  size_t getGrain(void) const { return m_grain; }
+  void setGrain(size_t grain) { m_grain = grain; }
+
+  cexecutor& getExecutor(void) const
+  {
+    static csequential_executor sequential;
+    switch (m_mode) {
+    case EXECUTE_SEQUENTIAL: return sequential;
+    case EXECUTE_EXECUTOR: return *m_executor;
+    default: return getDefaultThreadPool();
+    }
+  }
+
+private:
+  EXECUTION_MODE m_mode;
+  cexecutor *m_executor;
+  size_t m_grain; // rows per task, 0 picks about four tasks per thread
+};
+
+// Run body(z, y0, y1) over row strips [y0, y1) of every band z, all
+// (band, strip) pairs forming one task space.
+inline void forEachStrip(const cexecution_policy& policy, size_t bands, size_t height,
+			 const std::function<void(size_t, size_t, size_t)>& body)
+{
+  if (bands == 0 || height == 0) return;
+  cexecutor& executor = policy.getExecutor();
+  size_t grain = policy.getGrain();
+  if (grain == 0) {
+    const size_t tasks = 4 * executor.getConcurrency();
+    grain = std::max<size_t>(1, (bands * height + tasks - 1) / tasks);
+  }
+  grain = std::min(grain, height);
+  const size_t strips = (height + grain - 1) / grain;
+  executor.run(bands * strips, [&](size_t t) {
+      const size_t z = t / strips, y0 = (t % strips) * grain;
+      body(z, y0, std::min(y0 + grain, height));
+    });
+}
@@ -0,0 +1,453 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#if defined(__linux__)
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+
+// Placement of pixmap buffers on NUMA machines.  Anything but
+// NUMA_FIRST_TOUCH maps the buffer with mmap and applies an mbind policy
+// before the first page is touched; without NUMA support (one node, no
+// mbind, not Linux) the buffer is allocated as usual.
+enum NUMA_PLACEMENT {
+  NUMA_FIRST_TOUCH = 0, // pages land on the node of the thread touching them
+  NUMA_INTERLEAVE = 1,  // pages round-robin over all nodes
+  NUMA_BIND = 2,        // all pages on one node
+  NUMA_STRIPS = 3       // contiguous row strips, node n holding the n-th of N
+};
+
+// With huge_pages set, buffers of at least one huge page are mapped with
+// MAP_HUGETLB from the reserved pool or, when the pool is empty, aligned to
+// the huge page size and madvise()d for transparent huge pages.  Both go
+// with any NUMA placement.  tag names the owner of the buffer in the
+// memory accounting below.
+struct cmemory_policy {
+  NUMA_PLACEMENT numa;
+  int node; // for NUMA_BIND
+  bool huge_pages;
+  std::string tag;
+  explicit cmemory_policy(NUMA_PLACEMENT placement = NUMA_FIRST_TOUCH, int n = 0, bool huge = false)
+    : numa(placement), node(n), huge_pages(huge) {}
+};
+
+// Source of the buffers that are not mmap()ed (first-touch placement
+// without huge pages).  Buffers must be aligned to 8 bytes; they are
+// zero-filled by allocateMemory.  A buffer always returns to the allocator
+// it came from, even after the hook has been changed.
+class cmemory_allocator {
+public:
+  virtual ~cmemory_allocator(void) {}
+  virtual void *allocate(size_t bytes) = 0;
+  virtual void deallocate(void *p, size_t bytes) = 0;
+};
+
+inline std::atomic<cmemory_allocator *>& memory_allocator_hook(void)
+{
+  static std::atomic<cmemory_allocator *> allocator(NULL);
+  return allocator;
+}
+
+// NULL restores operator new[]
+inline void setMemoryAllocator(cmemory_allocator *allocator) { memory_allocator_hook().store(allocator); }
+inline cmemory_allocator *getMemoryAllocator(void) { return memory_allocator_hook().load(); }
+
+// what backs an allocated buffer
+enum HUGE_PAGE_STATUS {
+  HUGE_PAGES_NONE = 0,     // base pages
+  HUGE_PAGES_ADVISED = 1,  // aligned and advised; khugepaged or the fault
+                           // path may or may not have used huge pages
+  HUGE_PAGES_HUGETLB = 2   // hugetlbfs pages, guaranteed
+};
+
+struct cmemory_mapping {
+  size_t length; // mmap length, 0 when the buffer came from an allocator
+  HUGE_PAGE_STATUS huge;
+  size_t bytes; // accounted size
+  std::string tag;
+  cmemory_allocator *allocator; // NULL for operator new[]
+  cmemory_mapping(void) : length(0), huge(HUGE_PAGES_NONE), bytes(0), allocator(NULL) {}
+};
+
+// Accounting of every buffer obtained through allocateMemory: live and
+// peak bytes and allocation counts, in total and per tag.
+struct cmemory_usage {
+  std::string tag;
+  size_t live, peak;
+  size_t allocations, frees;
+  cmemory_usage(void) : live(0), peak(0), allocations(0), frees(0) {}
+};
+
+class cmemory_accounting {
+public:
+  static cmemory_accounting& instance(void)
+  {
+    static cmemory_accounting accounting;
+    return accounting;
+  }
+
+  void allocated(const std::string& tag, size_t bytes)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    add(m_total, bytes);
+    add(usage(tag), bytes);
+  }
+  void freed(const std::string& tag, size_t bytes)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    remove(m_total, bytes);
+    remove(usage(tag), bytes);
+  }
+  // move a live buffer to another tag; counts as neither allocation nor free
+  void retag(const std::string& from, const std::string& to, size_t bytes)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    cmemory_usage& a = usage(from);
+    cmemory_usage& b = usage(to);
+    a.live -= bytes;
+    b.live += bytes;
+    b.peak = std::max(b.peak, b.live);
+  }
+  void resetPeak(void)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_total.peak = m_total.live;
+    for (std::map<std::string, cmemory_usage>::iterator it = m_tags.begin(); it != m_tags.end(); ++it)
+      it->second.peak = it->second.live;
+  }
+  cmemory_usage total(void)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_total;
+  }
+  std::vector<cmemory_usage> tags(void)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<cmemory_usage> all;
+    for (std::map<std::string, cmemory_usage>::const_iterator it = m_tags.begin(); it != m_tags.end(); ++it)
+      all.push_back(it->second);
+    return all;
+  }
+
+private:
+  cmemory_accounting(void) {}
+
+  cmemory_usage& usage(const std::string& tag)
+  {
+    cmemory_usage& u = m_tags[tag];
+    u.tag = tag;
+    return u;
+  }
+  static void add(cmemory_usage& u, size_t bytes)
+  {
+    u.live += bytes;
+    u.peak = std::max(u.peak, u.live);
+    ++u.allocations;
+  }
+  static void remove(cmemory_usage& u, size_t bytes)
+  {
+    assert(u.live >= bytes);
+    u.live -= bytes;
+    ++u.frees;
+  }
+
+  std::mutex m_mutex;
+  cmemory_usage m_total;
+  std::map<std::string, cmemory_usage> m_tags;
+};
+
+inline cmemory_usage getMemoryUsage(void) { return cmemory_accounting::instance().total(); }
+inline std::vector<cmemory_usage> getMemoryUsageByTag(void) { return cmemory_accounting::instance().tags(); }
+inline void resetMemoryPeak(void) { cmemory_accounting::instance().resetPeak(); }
+
+inline void dumpMemoryUsage(std::ostream& stream)
+{
+  const cmemory_usage total = getMemoryUsage();
+  std::vector<cmemory_usage> tags = getMemoryUsageByTag();
+  char text[256];
+  std::snprintf(text, sizeof(text), "%-24s %14s %14s %12s %12s\n", "tag", "live bytes", "peak bytes",
+		"allocations", "frees");
+  stream << text;
+  for (size_t i = 0; i < tags.size(); ++i) {
+    std::snprintf(text, sizeof(text), "%-24s %14zu %14zu %12zu %12zu\n",
+		  tags[i].tag.empty() ? "(untagged)" : tags[i].tag.c_str(), tags[i].live, tags[i].peak,
+		  tags[i].allocations, tags[i].frees);
+    stream << text;
+  }
+  std::snprintf(text, sizeof(text), "%-24s %14zu %14zu %12zu %12zu\n", "total", total.live, total.peak,
+		total.allocations, total.frees);
+  stream << text;
+}
+
+// "0-3,8,10-11" as in /sys/devices/system/node/*
+inline std::vector<int> memory_parse_list(const std::string& text)
+{
+  std::vector<int> ids;
+  size_t pos = 0;
+  while (pos < text.size()) {
+    int a = 0, b = 0, n = 0;
+    if (std::sscanf(text.c_str() + pos, "%d-%d%n", &a, &b, &n) == 2) {
+      for (int i = a; i <= b; ++i) ids.push_back(i);
+    } else if (std::sscanf(text.c_str() + pos, "%d%n", &a, &n) == 1) {
+      ids.push_back(a);
+    } else {
+      break;
+    }
+    pos += n;
+    while (pos < text.size() && (text[pos] == ',' || text[pos] == '\n')) ++pos;
+  }
+  return ids;
+}
+
+inline std::string memory_read_file(const char *path)
+{
+  std::string text;
+  if (FILE *fp = std::fopen(path, "r")) {
+    char buffer[4096];
+    size_t n;
+    while ((n = std::fread(buffer, 1, sizeof(buffer), fp)) > 0) text.append(buffer, n);
+    std::fclose(fp);
+  }
+  return text;
+}
+
+inline size_t getNumaNodeCount(void)
+{
+  static const size_t count = [] {
+    std::vector<int> nodes = memory_parse_list(memory_read_file("/sys/devices/system/node/online"));
+    return nodes.empty() ? (size_t)1 : (size_t)(*std::max_element(nodes.begin(), nodes.end()) + 1);
+  }();
+  return count;
+}
+
+// CPUs of a node, empty when unknown
+inline std::vector<int> getNumaNodeCpus(int node)
+{
+  std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+  return memory_parse_list(memory_read_file(path.c_str()));
+}
+
+inline size_t getPageSize(void)
+{
+#if defined(__linux__)
+  static const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return page;
+#else
+  return 4096;
+#endif
+}
+
+// default huge page size from /proc/meminfo, 2 MB when unknown
+inline size_t getHugePageSize(void)
+{
+  static const size_t size = [] {
+    std::string text = memory_read_file("/proc/meminfo");
+    size_t pos = text.find("Hugepagesize:"), kb = 0;
+    if (pos != std::string::npos) std::sscanf(text.c_str() + pos, "Hugepagesize: %zu", &kb);
+    return kb ? kb * 1024 : (size_t)2 << 20;
+  }();
+  return size;
+}
+
+// Bytes of [addr, addr + bytes) currently backed by huge pages, transparent
+// or hugetlbfs, as accounted in /proc/self/smaps for the mapping holding
+// addr; 0 when unknown.
+inline size_t getHugePageBytes(const void *addr)
+{
+  std::string text = memory_read_file("/proc/self/smaps");
+  const uintptr_t a = (uintptr_t)addr;
+  size_t pos = 0;
+  bool inside = false;
+  size_t total = 0;
+  while (pos < text.size()) {
+    size_t eol = text.find('\n', pos);
+    if (eol == std::string::npos) eol = text.size();
+    const std::string line = text.substr(pos, eol - pos);
+    pos = eol + 1;
+    unsigned long lo, hi;
+    size_t kb;
+    char dash;
+    if (std::sscanf(line.c_str(), "%lx%c%lx", &lo, &dash, &hi) == 3 && dash == '-') {
+      if (inside) break; // past our mapping
+      inside = (a >= lo && a < hi);
+    } else if (inside && (std::sscanf(line.c_str(), "AnonHugePages: %zu", &kb) == 1 ||
+			  std::sscanf(line.c_str(), "Private_Hugetlb: %zu", &kb) == 1 ||
+			  std::sscanf(line.c_str(), "Shared_Hugetlb: %zu", &kb) == 1)) {
+      total += kb * 1024;
+    }
+  }
+  return total;
+}
+
+// mbind(2) through the raw system call so that libnuma is not needed at
+// link time; false when the kernel refuses or has no NUMA support
+inline bool memory_mbind(void *addr, size_t len, int mode, const std::vector<unsigned long>& mask)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+  const unsigned long maxnode = mask.size() * 8 * sizeof(unsigned long);
+  return syscall(SYS_mbind, addr, len, mode, mask.empty() ? NULL : &mask[0], maxnode, 0) == 0;
+#else
+  (void)addr, (void)len, (void)mode, (void)mask;
+  return false;
+#endif
+}
+
+enum { MEMORY_MPOL_BIND = 2, MEMORY_MPOL_INTERLEAVE = 3 }; // <numaif.h> values
+
+inline std::vector<unsigned long> memory_node_mask(int first, int last)
+{
+  const size_t bits = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask((getNumaNodeCount() + bits - 1) / bits, 0);
+  for (int n = first; n <= last; ++n) mask[n / bits] |= 1UL << (n % bits);
+  return mask;
+}
+
+// Apply policy to [addr, addr + bytes), which must be page aligned and not
+// yet touched.  Returns false if nothing could be applied.
+inline bool placeMemory(void *addr, size_t bytes, const cmemory_policy& policy)
+{
+  const int nodes = (int)getNumaNodeCount();
+  switch (policy.numa) {
+  case NUMA_INTERLEAVE:
+    return nodes > 1 && memory_mbind(addr, bytes, MEMORY_MPOL_INTERLEAVE, memory_node_mask(0, nodes - 1));
+  case NUMA_BIND:
+    assert(policy.node >= 0 && policy.node < nodes);
+    return memory_mbind(addr, bytes, MEMORY_MPOL_BIND, memory_node_mask(policy.node, policy.node));
+  case NUMA_STRIPS: {
+    if (nodes < 2) return false;
+    const size_t page = getPageSize(), pages = (bytes + page - 1) / page;
+    bool ok = true;
+    for (int n = 0; n < nodes; ++n) {
+      const size_t p0 = pages * n / nodes, p1 = pages * (n + 1) / nodes;
+      if (p1 > p0)
+	ok &= memory_mbind((uint8_t *)addr + p0 * page, (p1 - p0) * page, MEMORY_MPOL_BIND,
+			   memory_node_mask(n, n));
+    }
+    return ok;
+  }
+  default:
+    return false;
+  }
+}
+
+#if defined(__linux__)
+// huge page backed mapping of length bytes (a multiple of the huge page
+// size), NULL on failure
+inline void *memory_map_huge(size_t length, HUGE_PAGE_STATUS& huge)
+{
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+# if defined(MAP_HUGETLB)
+  void *p = mmap(NULL, length, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    huge = HUGE_PAGES_HUGETLB;
+    return p;
+  }
+# endif
+# if defined(MADV_HUGEPAGE)
+  // over-map by one huge page and trim both ends so that the buffer
+  // starts on a huge page boundary, which THP needs to use the first page
+  const size_t align = getHugePageSize();
+  uint8_t *q = (uint8_t *)mmap(NULL, length + align, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (q == MAP_FAILED) return NULL;
+  uint8_t *start = (uint8_t *)(((uintptr_t)q + align - 1) & ~(uintptr_t)(align - 1));
+  if (start > q) munmap(q, start - q);
+  munmap(start + length, q + align - start);
+  huge = (madvise(start, length, MADV_HUGEPAGE) == 0) ? HUGE_PAGES_ADVISED : HUGE_PAGES_NONE;
+  return start;
+# else
+  (void)length, (void)huge;
+  return NULL;
+# endif
+}
+#endif
+
+// A zero-filled buffer placed according to policy; mapping records how it
+// was obtained for freeMemory, for reporting and for the accounting.
+inline uint8_t *allocateMemory(size_t bytes, const cmemory_policy& policy, cmemory_mapping& mapping)
+{
+  mapping = cmemory_mapping();
+  mapping.tag = policy.tag;
+  uint8_t *p = NULL;
+#if defined(__linux__)
+  if (policy.huge_pages && bytes >= getHugePageSize()) {
+    const size_t page = getHugePageSize(), length = (bytes + page - 1) / page * page;
+    HUGE_PAGE_STATUS huge = HUGE_PAGES_NONE;
+    if (void *q = memory_map_huge(length, huge)) {
+      if (policy.numa != NUMA_FIRST_TOUCH) placeMemory(q, length, policy);
+      mapping.length = length;
+      mapping.huge = huge;
+      p = (uint8_t *)q;
+    }
+  }
+  if (!p && policy.numa != NUMA_FIRST_TOUCH && bytes > 0) {
+    const size_t page = getPageSize(), length = (bytes + page - 1) / page * page;
+    void *q = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (q != MAP_FAILED) {
+      placeMemory(q, length, policy); // best effort; fresh pages are zero
+      mapping.length = length;
+      p = (uint8_t *)q;
+    }
+  }
+#endif
+  if (p) {
+    mapping.bytes = mapping.length;
+  } else {
+    mapping.bytes = (bytes + 7) / 8 * 8;
+    mapping.allocator = getMemoryAllocator();
+    if (mapping.allocator) p = (uint8_t *)mapping.allocator->allocate(mapping.bytes);
+    else p = reinterpret_cast<uint8_t *>(new double[mapping.bytes / 8]);
+    assert(p && ((uintptr_t)p & 7) == 0);
+    memset(p, 0, bytes);
+  }
+  cmemory_accounting::instance().allocated(mapping.tag, mapping.bytes);
+  return p;
+}
+
+inline void freeMemory(uint8_t *p, const cmemory_mapping& mapping)
+{
+  if (!p) return;
+  cmemory_accounting::instance().freed(mapping.tag, mapping.bytes);
+#if defined(__linux__)
+  if (mapping.length) {
+    munmap(p, mapping.length);
+    return;
+  }
+#endif
+  if (mapping.allocator) mapping.allocator->deallocate(p, mapping.bytes);
+  else delete [] reinterpret_cast<double *>(p);
+}
+
+// account a live buffer to another tag
+inline void retagMemory(cmemory_mapping& mapping, const std::string& tag)
+{
+  cmemory_accounting::instance().retag(mapping.tag, tag, mapping.bytes);
+  mapping.tag = tag;
+}
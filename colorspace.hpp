@@ -0,0 +1,423 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include <cpixmap.hpp>
+
+// Colour planes follow the BGR band order of readRGBImage.  Converted
+// images keep three planes in the order the name suggests:
+//   YCbCr: 0 = Y, 1 = Cb, 2 = Cr
+//   HSV:   0 = H, 1 = S, 2 = V
+//   Lab:   0 = L, 1 = a, 2 = b
+// Integer pixmaps use the full type range (0 .. max) for every channel;
+// H wraps once around the circle over that range, L maps 0..100 to 0..max,
+// and chroma / a / b are centred on (max + 1) / 2 with a and b scaled like
+// 8-bit Lab (one unit per 1/256 of the range).  Floating-point pixmaps use
+// 0..1 for RGB, Y, S, V and H (0..1 for a full turn), 0..100 for L and
+// unbounded a, b.
+//
+// Every conversion may be done in place, with the source as destination.
+
+enum YCBCR_STANDARD {
+  YCBCR_BT601 = 0,
+  YCBCR_BT709 = 1
+};
+
+template <typename T> struct color_traits {
+  typedef double acc_type;
+  static const int coef_bits = 0;
+};
+template <> struct color_traits<uint8_t> { typedef int32_t acc_type; static const int coef_bits = 14; };
+template <> struct color_traits<int8_t> { typedef int32_t acc_type; static const int coef_bits = 14; };
+template <> struct color_traits<uint16_t> { typedef int64_t acc_type; static const int coef_bits = 16; };
+template <> struct color_traits<int16_t> { typedef int64_t acc_type; static const int coef_bits = 16; };
+template <> struct color_traits<float> { typedef float acc_type; static const int coef_bits = 0; };
+
+template <typename T>
+inline double color_full(void)
+{
+  return std::numeric_limits<T>::is_integer ? (double)std::numeric_limits<T>::max() : 1.0;
+}
+
+template <typename T>
+inline double color_mid(void)
+{
+  return std::numeric_limits<T>::is_integer ? (color_full<T>() + 1.0) / 2.0 : 0.5;
+}
+
+template <typename T, typename A>
+inline T color_saturate(A v)
+{
+  if (std::numeric_limits<T>::is_integer) {
+    if (!std::numeric_limits<A>::is_integer) v = std::floor(v + (A)0.5);
+    if (v < (A)0) return 0;
+    if (v > (A)std::numeric_limits<T>::max()) return std::numeric_limits<T>::max();
+  }
+  return (T)v;
+}
+
+template <typename A>
+inline A color_descale(A v, int) { return v; }
+inline int32_t color_descale(int32_t v, int bits) { return (v + (1 << (bits-1))) >> bits; }
+inline int64_t color_descale(int64_t v, int bits) { return (v + ((int64_t)1 << (bits-1))) >> bits; }
+
+// The pixmap a conversion to bands planes of src's size writes: dst, or
+// staged when dst is src with another band count, as resizing dst would
+// free src before it is read.  color_unstage moves the result into dst.
+template <typename T>
+cpixmap<T>& color_target(cpixmap<T>& dst, const cpixmap<T>& src, size_t bands, cpixmap<T>& staged)
+{
+  const size_t width = src.getWidth(), height = src.getHeight();
+  cpixmap<T>& out = (&dst == &src && !src.isMatched(width, height, bands)) ? staged : dst;
+  if (!out.isMatched(width, height, bands)) out.setResolution(width, height, bands);
+  return out;
+}
+
+template <typename T>
+void color_unstage(cpixmap<T>& dst, const cpixmap<T>& out, const cexecution_policy& policy)
+{
+  if (&out == &dst) return;
+  dst.setResolution(out.getWidth(), out.getHeight(), out.getBands());
+  forEachStrip(policy, out.getBands(), out.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) std::memcpy(dst.getLine(y, z), out.getLine(y, z), out.getWidth() * sizeof(T));
+    });
+}
+
+// dst(k) = sum_j m[k][j] * src(j) + off[k] for k < outputs, in pixel units,
+// evaluated in fixed point for 8/16-bit pixmaps.  In place, each row is
+// computed into a scratch row first, as every output reads all inputs.
+template <typename T>
+void colorTransformLinear(cpixmap<T>& dst, const cpixmap<T>& src, const double m[3][3], const double off[3],
+			  size_t outputs, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("colorTransformLinear", src,
+	       (uint64_t)src.getWidth() * src.getHeight() * sizeof(T) * (3 + outputs), trace_threads(policy));
+  typedef typename color_traits<T>::acc_type A;
+  const int bits = color_traits<T>::coef_bits;
+  const double one = (double)((int64_t)1 << bits);
+
+  assert(src.getBands() >= 3);
+  cpixmap<T> staged;
+  cpixmap<T>& out = color_target(dst, src, outputs, staged);
+  const bool inplace = &out == &src;
+
+  A c[3][3], o[3];
+  for (size_t k = 0; k < outputs; ++k) {
+    for (size_t j = 0; j < 3; ++j)
+      c[k][j] = std::numeric_limits<A>::is_integer ? (A)std::llround(m[k][j] * one) : (A)m[k][j];
+    o[k] = std::numeric_limits<A>::is_integer ? (A)std::llround(off[k] * one) : (A)off[k];
+  }
+
+  const size_t width = src.getWidth();
+
+  forEachStrip(policy, 1, src.getHeight(), [&](size_t, size_t y0, size_t y1) {
+      std::vector<T> scratch(inplace ? outputs * width : 0);
+      for (size_t y = y0; y < y1; ++y) {
+	const T *s0 = src.getLine(y, 0), *s1 = src.getLine(y, 1), *s2 = src.getLine(y, 2);
+	for (size_t k = 0; k < outputs; ++k) {
+	  const A c0 = c[k][0], c1 = c[k][1], c2 = c[k][2], ok = o[k];
+	  T *d = inplace ? &scratch[k * width] : out.getLine(y, k);
+#pragma omp simd
+	  for (size_t x = 0; x < width; ++x)
+	    d[x] = color_saturate<T>(color_descale(c0*(A)s0[x] + c1*(A)s1[x] + c2*(A)s2[x] + ok, bits));
+	}
+	if (inplace)
+	  for (size_t k = 0; k < outputs; ++k) std::memcpy(out.getLine(y, k), &scratch[k * width], width * sizeof(T));
+      }
+    });
+  color_unstage(dst, out, policy);
+}
+
+inline void color_invert(const double m[3][3], const double off[3], double im[3][3], double ioff[3])
+{
+  double det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+    - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+    + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+  assert(det != 0.0);
+  for (int i = 0; i < 3; ++i)
+    for (int j = 0; j < 3; ++j) {
+      int a = (j + 1) % 3, b = (j + 2) % 3, p = (i + 1) % 3, q = (i + 2) % 3;
+      im[i][j] = (m[a][p]*m[b][q] - m[a][q]*m[b][p]) / det;
+    }
+  for (int i = 0; i < 3; ++i)
+    ioff[i] = -(im[i][0]*off[0] + im[i][1]*off[1] + im[i][2]*off[2]);
+}
+
+// YCbCr matrix in pixel units with BGR band order as input
+template <typename T>
+void color_ycbcr_matrix(YCBCR_STANDARD standard, bool full_range, double m[3][3], double off[3])
+{
+  const double kr = (standard == YCBCR_BT709) ? 0.2126 : 0.299;
+  const double kb = (standard == YCBCR_BT709) ? 0.0722 : 0.114;
+  const double kg = 1.0 - kr - kb;
+  const double full = color_full<T>(), mid = color_mid<T>();
+  double ys = 1.0, cs = 1.0, yo = 0.0;
+
+  if (!full_range) {
+    double unit = std::numeric_limits<T>::is_integer ? (full + 1.0) / 256.0 : 1.0 / 255.0;
+    ys = 219.0 * unit / full, cs = 224.0 * unit / full, yo = 16.0 * unit;
+  }
+  // rows Y, Cb, Cr; columns B, G, R
+  m[0][0] = ys*kb, m[0][1] = ys*kg, m[0][2] = ys*kr;
+  m[1][0] = cs*0.5, m[1][1] = -cs*0.5*kg/(1.0 - kb), m[1][2] = -cs*0.5*kr/(1.0 - kb);
+  m[2][0] = -cs*0.5*kb/(1.0 - kr), m[2][1] = -cs*0.5*kg/(1.0 - kr), m[2][2] = cs*0.5;
+  off[0] = yo, off[1] = mid, off[2] = mid;
+}
+
+template <typename T>
+void convertRGBToGray(cpixmap<T>& gray, const cpixmap<T>& rgb, const cexecution_policy& policy = cexecution_policy())
+{
+  double m[3][3], off[3];
+  color_ycbcr_matrix<T>(YCBCR_BT601, true, m, off);
+  colorTransformLinear(gray, rgb, m, off, 1, policy);
+}
+
+template <typename T>
+void convertGrayToRGB(cpixmap<T>& rgb, const cpixmap<T>& gray, size_t z = 0,
+		      const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("convertGrayToRGB", gray, (uint64_t)gray.getWidth() * gray.getHeight() * sizeof(T) * 4,
+	       trace_threads(policy));
+  cpixmap<T> staged;
+  cpixmap<T>& out = color_target(rgb, gray, cpixmap<T>::RGB_BANDS, staged);
+
+  forEachStrip(policy, 1, gray.getHeight(), [&](size_t, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y)
+	for (size_t k = 0; k < cpixmap<T>::RGB_BANDS; ++k)
+	  if (out.getLine(y, k) != gray.getLine(y, z))
+	    std::memcpy(out.getLine(y, k), gray.getLine(y, z), gray.getWidth() * sizeof(T));
+    });
+  color_unstage(rgb, out, policy);
+}
+
+template <typename T>
+void convertRGBToYCbCr(cpixmap<T>& ycc, const cpixmap<T>& rgb,
+		       YCBCR_STANDARD standard = YCBCR_BT601, bool full_range = true,
+		       const cexecution_policy& policy = cexecution_policy())
+{
+  double m[3][3], off[3];
+  color_ycbcr_matrix<T>(standard, full_range, m, off);
+  colorTransformLinear(ycc, rgb, m, off, 3, policy);
+}
+
+template <typename T>
+void convertYCbCrToRGB(cpixmap<T>& rgb, const cpixmap<T>& ycc,
+		       YCBCR_STANDARD standard = YCBCR_BT601, bool full_range = true,
+		       const cexecution_policy& policy = cexecution_policy())
+{
+  double m[3][3], off[3], im[3][3], ioff[3];
+  color_ycbcr_matrix<T>(standard, full_range, m, off);
+  color_invert(m, off, im, ioff);
+  colorTransformLinear(rgb, ycc, im, ioff, 3, policy);
+}
+
+// The nonlinear spaces are evaluated in float for every pixel type.
+template <typename T>
+void convertRGBToHSV(cpixmap<T>& hsv, const cpixmap<T>& rgb, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("convertRGBToHSV", rgb, trace_bytes<T>(rgb) * 2, trace_threads(policy));
+  assert(rgb.getBands() >= 3);
+  cpixmap<T> staged;
+  cpixmap<T>& out = color_target(hsv, rgb, 3, staged);
+
+  const float full = (float)color_full<T>();
+  const float hscale = std::numeric_limits<T>::is_integer ? (full + 1.0f) : 1.0f;
+
+  forEachStrip(policy, 1, rgb.getHeight(), [&](size_t, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	const T *bl = rgb.getLine(y, cpixmap<T>::BLUE_BAND);
+	const T *gl = rgb.getLine(y, cpixmap<T>::GREEN_BAND);
+	const T *rl = rgb.getLine(y, cpixmap<T>::RED_BAND);
+	T *hl = out.getLine(y, 0), *sl = out.getLine(y, 1), *vl = out.getLine(y, 2);
+	for (size_t x = 0; x < rgb.getWidth(); ++x) {
+	  float r = (float)rl[x], g = (float)gl[x], b = (float)bl[x];
+	  float v = std::max(r, std::max(g, b));
+	  float d = v - std::min(r, std::min(g, b));
+	  float h = 0.0f;
+	  if (d > 0.0f) {
+	    if (v == r) h = (g - b) / d;
+	    else if (v == g) h = 2.0f + (b - r) / d;
+	    else h = 4.0f + (r - g) / d;
+	    h /= 6.0f;
+	    if (h < 0.0f) h += 1.0f;
+	  }
+	  float hv = h * hscale;
+	  if (std::numeric_limits<T>::is_integer && hv >= full + 0.5f) hv = 0.0f; // wrap
+	  hl[x] = color_saturate<T>(hv);
+	  sl[x] = color_saturate<T>((v > 0.0f) ? d / v * full : 0.0f);
+	  vl[x] = color_saturate<T>(v);
+	}
+      }
+    });
+  color_unstage(hsv, out, policy);
+}
+
+template <typename T>
+void convertHSVToRGB(cpixmap<T>& rgb, const cpixmap<T>& hsv, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("convertHSVToRGB", hsv, trace_bytes<T>(hsv) * 2, trace_threads(policy));
+  assert(hsv.getBands() >= 3);
+  cpixmap<T> staged;
+  cpixmap<T>& out = color_target(rgb, hsv, cpixmap<T>::RGB_BANDS, staged);
+
+  const float full = (float)color_full<T>();
+  const float hscale = std::numeric_limits<T>::is_integer ? (full + 1.0f) : 1.0f;
+
+  forEachStrip(policy, 1, hsv.getHeight(), [&](size_t, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	const T *hl = hsv.getLine(y, 0), *sl = hsv.getLine(y, 1), *vl = hsv.getLine(y, 2);
+	T *bl = out.getLine(y, cpixmap<T>::BLUE_BAND);
+	T *gl = out.getLine(y, cpixmap<T>::GREEN_BAND);
+	T *rl = out.getLine(y, cpixmap<T>::RED_BAND);
+	for (size_t x = 0; x < hsv.getWidth(); ++x) {
+	  float h = (float)hl[x] / hscale * 6.0f;
+	  float s = (float)sl[x] / full, v = (float)vl[x];
+	  h -= 6.0f * std::floor(h / 6.0f);
+	  int sector = std::min((int)h, 5);
+	  float f = h - sector;
+	  float p = v * (1.0f - s), q = v * (1.0f - s * f), t = v * (1.0f - s * (1.0f - f));
+	  float r, g, b;
+	  switch (sector) {
+	  case 0: r = v, g = t, b = p; break;
+	  case 1: r = q, g = v, b = p; break;
+	  case 2: r = p, g = v, b = t; break;
+	  case 3: r = p, g = q, b = v; break;
+	  case 4: r = t, g = p, b = v; break;
+	  default: r = v, g = p, b = q; break;
+	  }
+	  rl[x] = color_saturate<T>(r), gl[x] = color_saturate<T>(g), bl[x] = color_saturate<T>(b);
+	}
+      }
+    });
+  color_unstage(rgb, out, policy);
+}
+
+// sRGB transfer function, tabulated for 8/16-bit input
+template <typename T>
+class color_linearizer {
+public:
+  color_linearizer(void)
+  {
+    if (std::numeric_limits<T>::is_integer && sizeof(T) <= 2) {
+      m_table.resize((size_t)color_full<T>() + 1);
+      for (size_t i = 0; i < m_table.size(); ++i) m_table[i] = compute((float)i / (float)color_full<T>());
+    }
+  }
+  float operator()(T v) const
+  {
+    if (!m_table.empty()) return m_table[std::max((long)v, 0L)];
+    return compute((float)v / (float)color_full<T>());
+  }
+  static float compute(float c) { return (c <= 0.04045f) ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f); }
+  static float inverse(float c) { return (c <= 0.0031308f) ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f; }
+private:
+  std::vector<float> m_table;
+};
+
+inline float color_lab_f(float t)
+{
+  const float e = 216.0f / 24389.0f, k = 24389.0f / 27.0f;
+  return (t > e) ? std::cbrt(t) : (k * t + 16.0f) / 116.0f;
+}
+
+inline float color_lab_finv(float f)
+{
+  const float e = 6.0f / 29.0f;
+  return (f > e) ? f * f * f : 3.0f * e * e * (f - 4.0f / 29.0f);
+}
+
+// sRGB (D65) to CIE L*a*b*
+template <typename T>
+void convertRGBToLab(cpixmap<T>& lab, const cpixmap<T>& rgb, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("convertRGBToLab", rgb, trace_bytes<T>(rgb) * 2, trace_threads(policy));
+  assert(rgb.getBands() >= 3);
+  cpixmap<T> staged;
+  cpixmap<T>& out = color_target(lab, rgb, 3, staged);
+
+  static const color_linearizer<T> linear; // tabulated once per type
+  const bool integer = std::numeric_limits<T>::is_integer;
+  const float lscale = integer ? (float)color_full<T>() / 100.0f : 1.0f;
+  const float abscale = integer ? ((float)color_full<T>() + 1.0f) / 256.0f : 1.0f;
+  const float aboff = integer ? (float)color_mid<T>() : 0.0f;
+
+  forEachStrip(policy, 1, rgb.getHeight(), [&](size_t, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	const T *bl = rgb.getLine(y, cpixmap<T>::BLUE_BAND);
+	const T *gl = rgb.getLine(y, cpixmap<T>::GREEN_BAND);
+	const T *rl = rgb.getLine(y, cpixmap<T>::RED_BAND);
+	T *ll = out.getLine(y, 0), *al = out.getLine(y, 1), *bbl = out.getLine(y, 2);
+	for (size_t x = 0; x < rgb.getWidth(); ++x) {
+	  float r = linear(rl[x]), g = linear(gl[x]), b = linear(bl[x]);
+	  float X = (0.4124564f*r + 0.3575761f*g + 0.1804375f*b) / 0.95047f;
+	  float Y = 0.2126729f*r + 0.7151522f*g + 0.0721750f*b;
+	  float Z = (0.0193339f*r + 0.1191920f*g + 0.9503041f*b) / 1.08883f;
+	  float fx = color_lab_f(X), fy = color_lab_f(Y), fz = color_lab_f(Z);
+	  ll[x] = color_saturate<T>((116.0f*fy - 16.0f) * lscale);
+	  al[x] = color_saturate<T>(500.0f*(fx - fy) * abscale + aboff);
+	  bbl[x] = color_saturate<T>(200.0f*(fy - fz) * abscale + aboff);
+	}
+      }
+    });
+  color_unstage(lab, out, policy);
+}
+
+template <typename T>
+void convertLabToRGB(cpixmap<T>& rgb, const cpixmap<T>& lab, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("convertLabToRGB", lab, trace_bytes<T>(lab) * 2, trace_threads(policy));
+  assert(lab.getBands() >= 3);
+  cpixmap<T> staged;
+  cpixmap<T>& out = color_target(rgb, lab, cpixmap<T>::RGB_BANDS, staged);
+
+  const bool integer = std::numeric_limits<T>::is_integer;
+  const float full = (float)color_full<T>();
+  const float lscale = integer ? full / 100.0f : 1.0f;
+  const float abscale = integer ? (full + 1.0f) / 256.0f : 1.0f;
+  const float aboff = integer ? (float)color_mid<T>() : 0.0f;
+
+  forEachStrip(policy, 1, lab.getHeight(), [&](size_t, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	const T *ll = lab.getLine(y, 0), *al = lab.getLine(y, 1), *bbl = lab.getLine(y, 2);
+	T *bl = out.getLine(y, cpixmap<T>::BLUE_BAND);
+	T *gl = out.getLine(y, cpixmap<T>::GREEN_BAND);
+	T *rl = out.getLine(y, cpixmap<T>::RED_BAND);
+	for (size_t x = 0; x < lab.getWidth(); ++x) {
+	  float fy = ((float)ll[x] / lscale + 16.0f) / 116.0f;
+	  float fx = fy + ((float)al[x] - aboff) / abscale / 500.0f;
+	  float fz = fy - ((float)bbl[x] - aboff) / abscale / 200.0f;
+	  float X = color_lab_finv(fx) * 0.95047f, Y = color_lab_finv(fy), Z = color_lab_finv(fz) * 1.08883f;
+	  float r = 3.2404542f*X - 1.5371385f*Y - 0.4985314f*Z;
+	  float g = -0.9692660f*X + 1.8760108f*Y + 0.0415560f*Z;
+	  float b = 0.0556434f*X - 0.2040259f*Y + 1.0572252f*Z;
+	  r = color_linearizer<T>::inverse(std::min(std::max(r, 0.0f), 1.0f));
+	  g = color_linearizer<T>::inverse(std::min(std::max(g, 0.0f), 1.0f));
+	  b = color_linearizer<T>::inverse(std::min(std::max(b, 0.0f), 1.0f));
+	  rl[x] = color_saturate<T>(r * full), gl[x] = color_saturate<T>(g * full), bl[x] = color_saturate<T>(b * full);
+	}
+      }
+    });
+  color_unstage(rgb, out, policy);
+}
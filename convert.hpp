@@ -0,0 +1,186 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <algorithm>
+
+#include <cpixmap.hpp>
+#include <cexecutor.hpp>
+
+enum CONVERT_ROUNDING {
+  CONVERT_ROUND_NEAREST = 0, // ties to even, as the vector conversion instructions do
+  CONVERT_ROUND_TRUNCATE = 1,
+  CONVERT_ROUND_FLOOR = 2
+};
+
+// Arithmetic type for the scaled path: float holds every value up to 16-bit
+// integers exactly (scale factors that are not dyadic may move exact .5 ties
+// by one), wider types need double.
+template <typename T> struct convert_traits { typedef double work_type; };
+template <> struct convert_traits<int8_t> { typedef float work_type; };
+template <> struct convert_traits<uint8_t> { typedef float work_type; };
+template <> struct convert_traits<int16_t> { typedef float work_type; };
+template <> struct convert_traits<uint16_t> { typedef float work_type; };
+template <> struct convert_traits<float> { typedef float work_type; };
+
+// true if every value of T is exactly representable in U
+template <typename T, typename U>
+inline bool convert_is_widening(void)
+{
+  typedef std::numeric_limits<T> LT;
+  typedef std::numeric_limits<U> LU;
+  if (!LT::is_integer && LU::is_integer) return false;
+  return (!LT::is_signed || LU::is_signed) && LT::digits <= LU::digits;
+}
+
+// largest / smallest W not beyond the range of U, so that clamping in W and
+// then converting can never overflow
+template <typename U, typename W>
+inline void convert_limits(W& lo, W& hi)
+{
+  lo = (W)std::numeric_limits<U>::lowest();
+  hi = (W)std::numeric_limits<U>::max();
+  if (std::numeric_limits<U>::is_integer) {
+    if ((long double)hi > (long double)std::numeric_limits<U>::max()) hi = std::nextafter(hi, (W)0);
+    if ((long double)lo < (long double)std::numeric_limits<U>::lowest()) lo = std::nextafter(lo, (W)0);
+  }
+}
+
+template <typename U, typename T>
+void convertLineCast(U *dst, const T *src, size_t n)
+{
+#pragma omp simd
+  for (size_t x = 0; x < n; ++x) dst[x] = (U)src[x];
+}
+
+// integer to integer with saturation only, exact for every width
+template <typename U, typename T>
+void convertLineClamp(U *dst, const T *src, size_t n)
+{
+  typedef std::numeric_limits<U> LU;
+#pragma omp simd
+  for (size_t x = 0; x < n; ++x) {
+    T v = src[x];
+    U u;
+    if (std::numeric_limits<T>::is_signed && (int64_t)v < 0) {
+      if (!LU::is_signed) u = 0;
+      else u = ((int64_t)v < (int64_t)LU::lowest()) ? LU::lowest() : (U)v;
+    } else {
+      u = ((uint64_t)v > (uint64_t)LU::max()) ? LU::max() : (U)v;
+    }
+    dst[x] = u;
+  }
+}
+
+// integer to integer by a power of two: v >> bits (rounded) or v << bits,
+// saturated to U; covers the common 12-in-16 to 8-bit style conversions
+template <typename U, typename T>
+void convertLineShift(U *dst, const T *src, size_t n, int bits, CONVERT_ROUNDING rounding)
+{
+  const int64_t lo = (int64_t)std::numeric_limits<U>::lowest();
+  const int64_t hi = (int64_t)std::numeric_limits<U>::max();
+
+  if (bits >= 0) {
+    // a multiply, as a left shift of a negative value is undefined
+    const int64_t factor = (int64_t)1 << bits;
+#pragma omp simd
+    for (size_t x = 0; x < n; ++x) {
+      int64_t v = (int64_t)src[x] * factor;
+      dst[x] = (U)std::min(std::max(v, lo), hi);
+    }
+  } else {
+    const int shift = -bits;
+    // ties to even, as std::rint in convertLineScale: the bias is one less
+    // than half unless the kept part is odd
+    const int64_t bias = (rounding == CONVERT_ROUND_NEAREST) ? ((int64_t)1 << (shift - 1)) - 1 : 0;
+#pragma omp simd
+    for (size_t x = 0; x < n; ++x) {
+      int64_t v = (int64_t)src[x];
+      if (rounding == CONVERT_ROUND_TRUNCATE && v < 0) v = -((-v) >> shift);
+      else if (rounding == CONVERT_ROUND_NEAREST) v = (v + bias + ((v >> shift) & 1)) >> shift;
+      else v = v >> shift;
+      dst[x] = (U)std::min(std::max(v, lo), hi);
+    }
+  }
+}
+
+template <typename U, typename T, typename W>
+void convertLineScale(U *dst, const T *src, size_t n, W scale, W offset, CONVERT_ROUNDING rounding)
+{
+  if (!std::numeric_limits<U>::is_integer) {
+#pragma omp simd
+    for (size_t x = 0; x < n; ++x) dst[x] = (U)((W)src[x] * scale + offset);
+    return;
+  }
+
+  W lo, hi;
+  convert_limits<U>(lo, hi);
+  for (size_t x = 0; x < n; ++x) {
+    W v = (W)src[x] * scale + offset;
+    if (rounding == CONVERT_ROUND_NEAREST) v = std::rint(v);
+    else if (rounding == CONVERT_ROUND_FLOOR) v = std::floor(v);
+    else v = std::trunc(v);
+    v = (v == v) ? v : (W)0; // NaN
+    dst[x] = (U)std::min(std::max(v, lo), hi);
+  }
+}
+
+// dst = saturate(round(src * scale + offset)) for every band.  dst is
+// resized to match src when needed; dst may alias src when U == T.
+template <typename U, typename T>
+void convertPixmap(cpixmap<U>& dst, const cpixmap<T>& src, double scale = 1.0, double offset = 0.0,
+		   CONVERT_ROUNDING rounding = CONVERT_ROUND_NEAREST,
+		   const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("convertPixmap", src, trace_bytes<T>(src) + trace_bytes<U>(src), trace_threads(policy));
+  typedef typename convert_traits<T>::work_type W1;
+  typedef typename convert_traits<U>::work_type W2;
+  typedef typename std::conditional<sizeof(W1) >= sizeof(W2), W1, W2>::type W;
+
+  if (!dst.isMatched(src.getWidth(), src.getHeight(), src.getBands()))
+    dst.setResolution(src.getWidth(), src.getHeight(), src.getBands());
+
+  // pick the cheapest exact kernel for the requested mapping
+  const bool integers = std::numeric_limits<T>::is_integer && std::numeric_limits<U>::is_integer;
+  int bits = 0;
+  bool shift = false;
+  bool cast = (scale == 1.0 && offset == 0.0 && convert_is_widening<T, U>());
+  bool clamp = (scale == 1.0 && offset == 0.0 && integers && !cast);
+  if (!cast && !clamp && offset == 0.0 && scale > 0.0 &&
+      integers && sizeof(T) <= 4 && sizeof(U) <= 4) {
+    int e;
+    double m = std::frexp(scale, &e);
+    if (m == 0.5 && e - 1 >= -31 && e - 1 <= 31) shift = true, bits = e - 1;
+  }
+
+  const size_t width = src.getWidth();
+  forEachStrip(policy, src.getBands(), src.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	const T *srcline = src.getLine(y, z);
+	U *dstline = dst.getLine(y, z);
+	if (cast) convertLineCast(dstline, srcline, width);
+	else if (clamp) convertLineClamp(dstline, srcline, width);
+	else if (shift) convertLineShift(dstline, srcline, width, bits, rounding);
+	else convertLineScale(dstline, srcline, width, (W)scale, (W)offset, rounding);
+      }
+    });
+}
@@ -25,8 +25,10 @@
 #include <cpixmap.hpp>
 
 template <typename T>
-void convolve(cpixmap<T>& dst, cpixmap<T>& src, cpixmap<int>& kernel, int rshift = 0, int offset = 0)
+void convolve(cpixmap<T>& dst, cpixmap<T>& src, cpixmap<int>& kernel, int rshift = 0, int offset = 0,
+	      const cexecution_policy& policy = cexecution_policy())
 {
+  PIXMAP_TRACE("convolve", src, trace_bytes<T>(src) * 2, trace_threads(policy));
   assert(dst.isMatched(src));
   assert(std::numeric_limits<T>::is_integer);
   assert(std::numeric_limits<T>::digits < std::numeric_limits<int>::digits);
@@ -43,26 +45,25 @@ void convolve(cpixmap<T>& dst, cpixmap<T>& src, cpixmap<int>& kernel, int rshift
   bool do_scale = (rshift != 0) || (offset != 0);
   bool do_clip = (minval != std::numeric_limits<int>::lowest()) || (maxval != std::numeric_limits<int>::max());
   
-  for (int z = 0; z < src.getBands(); z++) {
-#pragma omp parallel for
-    for (int y = 0; y < src.getHeight(); y++) {
-      T *dstline = dst.getLine(y, z);
-      //float *outline = output.getLine(y, z);
-      for (int x = 0; x < src.getWidth(); x++) {
-	int sum = 0;
-	for (int j = std::max(uoff, -y); j < std::min(doff, src.getHeight()-y); j++) {
-	  int *kline = kernel.getLine(j-uoff, 0);
-	  T *srcline = src.getLine(y+j, z);
-	  for (int i = std::max(loff, -x); i < std::min(roff, src.getWidth()-x); i++)
-	    sum += *(kline + (i-loff)) * (int)(*(srcline + (x+i)));
+  forEachStrip(policy, src.getBands(), src.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      for (int y = (int)y0; y < (int)y1; y++) {
+	T *dstline = dst.getLine(y, z);
+	//float *outline = output.getLine(y, z);
+	for (int x = 0; x < (int)src.getWidth(); x++) {
+	  int sum = 0;
+	  for (int j = std::max(uoff, -y); j < std::min(doff, (int)src.getHeight()-y); j++) {
+	    int *kline = kernel.getLine(j-uoff, 0);
+	    T *srcline = src.getLine(y+j, z);
+	    for (int i = std::max(loff, -x); i < std::min(roff, (int)src.getWidth()-x); i++)
+	      sum += *(kline + (i-loff)) * (int)(*(srcline + (x+i)));
+	  }
+	  //output.putPixel(sum, x, y, z);
+	  if (do_scale) sum = (sum>>rshift) + offset;
+	  if (do_clip) *(dstline + x) = std::min(std::max(sum, minval), maxval);
+	  else *(dstline + x) = sum;
 	}
-	//output.putPixel(sum, x, y, z);
-	if (do_scale) sum = (sum>>rshift) + offset;
-	if (do_clip) *(dstline + x) = std::min(std::max(sum, minval), maxval);
-	else *(dstline + x) = sum;
       }
-    }
-  }
+    });
 }
 
 #if 0
@@ -91,10 +92,10 @@ void convolve(cpixmap<T>& dst, cpixmap<T>& src, cpixmap<float>& kernel, float sc
       T *dstline = dst.getLine(y, z);
       for (int x = 0; x < src.getWidth(); x++) {
 	float sum = 0.0f;
-	for (int j = std::max(uoff, -y); j < std::min(doff, src.getHeight()-y); j++) {
+	for (int j = std::max(uoff, -y); j < std::min(doff, (int)src.getHeight()-y); j++) {
 	  T *srcline = src.getLine(y+j, z);
 	  float *kline = kernel.getLine(j-uoff, 0);
-	  for (int i = std::max(loff, -x); i < std::min(roff, src.getWidth()-x); i++)
+	  for (int i = std::max(loff, -x); i < std::min(roff, (int)src.getWidth()-x); i++)
 	    sum += (float)*(srcline + (x+i)) * *(kline + (i-loff));
 	}
 	//output.putPixel(sum, x, y, z);
@@ -111,8 +112,9 @@ void convolve(cpixmap<T>& dst, cpixmap<T>& src, cpixmap<float>& kernel, float sc
 template <typename T>
 void convolveXYSeperately(cpixmap<T>& dst, cpixmap<T>& src,
 			  cpixmap<int>& xkernel, cpixmap<int>& ykernel,
-			  int rshift = 0, int offset = 0)
+			  int rshift = 0, int offset = 0, const cexecution_policy& policy = cexecution_policy())
 {
+  PIXMAP_TRACE("convolveXYSeperately", src, trace_bytes<T>(src) * 4, trace_threads(policy));
   assert(dst.isMatched(src));
   assert(xkernel.getWidth() > 1 && xkernel.getHeight() == 1);
   assert(ykernel.getWidth() > 1 && ykernel.getHeight() == 1);
@@ -124,8 +126,8 @@ void convolveXYSeperately(cpixmap<T>& dst, cpixmap<T>& src,
   for (int i = 0; i < ykernel.getWidth(); i++)
     vkernel.putPixel(ykernel.getPixel(i, 0), 0, i);
 
-  convolve(temp, src, xkernel, 0, 0);
-  convolve(dst, temp, vkernel, rshift, offset);
+  convolve(temp, src, xkernel, 0, 0, policy);
+  convolve(dst, temp, vkernel, rshift, offset, policy);
 }
 
 /*
@@ -20,20 +20,61 @@
 #include <iostream>
 #include <sstream>
 #include <cstring>
-//#include <cmemory>
 #include <cassert>
 #include <cstdint>
+#include <algorithm>
 
 #include "cregion.hpp"
+#include "cexecutor.hpp"
+#include "cmemory.hpp"
+#include "ctrace.hpp"
 
 #define QWORD_ALIGN(bytes) (((bytes) + 7) & -8)
 
+// byte order of pixel data in files and buffers outside the pixmap
+enum PIXMAP_ENDIAN {
+  PIXMAP_NATIVE_ENDIAN = 0,
+  PIXMAP_LITTLE_ENDIAN = 1,
+  PIXMAP_BIG_ENDIAN = 2
+};
+
+inline bool isNativeEndian(PIXMAP_ENDIAN endian)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+  return endian != PIXMAP_LITTLE_ENDIAN;
+#else
+  return endian != PIXMAP_BIG_ENDIAN;
+#endif
+}
+
+template <typename T>
+inline T reverseEndianPixel(T v)
+{
+  switch (sizeof(T)) {
+  case 2: { uint16_t u; std::memcpy(&u, &v, 2); u = __builtin_bswap16(u); std::memcpy(&v, &u, 2); break; }
+  case 4: { uint32_t u; std::memcpy(&u, &v, 4); u = __builtin_bswap32(u); std::memcpy(&v, &u, 4); break; }
+  case 8: { uint64_t u; std::memcpy(&u, &v, 8); u = __builtin_bswap64(u); std::memcpy(&v, &u, 8); break; }
+  default: break;
+  }
+  return v;
+}
+
+// Swap the bytes of len pixels in place.  cpixmap.reverseEndian.SIMD.hpp
+// specializes this for the multi-byte pixel types.
+template <typename T>
+inline void reverseEndianLine(T *line, size_t len)
+{
+  if (sizeof(T) == 1) return;
+  for (size_t x = 0; x < len; ++x) line[x] = reverseEndianPixel(line[x]);
+}
+
 template <typename T>
 class cpixmap : public cregion<size_t> {
   //
 public:
   cpixmap(void);
   cpixmap(size_t w, size_t h, size_t b = 1);
+  cpixmap(size_t w, size_t h, size_t b, const cmemory_policy& memory);
   cpixmap(const cpixmap& pixmap);
   cpixmap(const cregion& dim);
   virtual ~cpixmap(void);
@@ -42,15 +83,24 @@ public:
   T& getPixel(size_t x, size_t y, size_t z = 0) const;
   void putPixel(T val, size_t x, size_t y, size_t z = 0);
   void setResolution(size_t w, size_t h, size_t b = 1);
+  void setMemoryPolicy(const cmemory_policy& memory);
+  const cmemory_policy& getMemoryPolicy(void) const { return m_memory; }
+  // name under which the buffer is accounted, see getMemoryUsageByTag()
+  void setMemoryTag(const std::string& tag);
+  const std::string& getMemoryTag(void) const { return m_memory.tag; }
+  // how the buffer is backed, and how much of it is on huge pages right now
+  HUGE_PAGE_STATUS getHugePageStatus(void) const { return m_mapping.huge; }
+  size_t getHugePageBytes(void) const { return m_buffer ? ::getHugePageBytes(m_buffer) : 0; }
   bool isMatched(const cpixmap& pixmap) const;
   bool isMatched(const cregion& a) const;
   bool isMatched(size_t w, size_t h, size_t b = 1) const;
   void readVLine(T *line, size_t len, size_t x, size_t y, size_t z = 0) const;
   void readHLine(T *line, size_t len, size_t x, size_t y, size_t z = 0) const;
-  void flipHorizontally(void);
-  void flipVertically(void);
-  void lshiftPixel(size_t bits = 1);
-  void rshiftPixel(size_t bits = 1);
+  void flipHorizontally(const cexecution_policy& policy = cexecution_policy());
+  void flipVertically(const cexecution_policy& policy = cexecution_policy());
+  void lshiftPixel(size_t bits = 1, const cexecution_policy& policy = cexecution_policy());
+  void rshiftPixel(size_t bits = 1, const cexecution_policy& policy = cexecution_policy());
+  void reverseEndian(const cexecution_policy& policy = cexecution_policy());
   //  cpixmap<T> operator=(const cpixmap<T>& m);
   T& operator() (size_t z, size_t y, size_t x) { return *(T *)(m_buffer + z*m_band_stride + y*m_height_stride + x*sizeof(T)); }
   T& operator() (size_t y, size_t x) { return *(T *)(m_buffer + y*m_height_stride + x*sizeof(T)); }
@@ -68,23 +118,33 @@ private:
   size_t m_height_stride;
   size_t m_band_stride;
   uint8_t *m_buffer;
+  cmemory_mapping m_mapping;
+  cmemory_policy m_memory;
 };
 
 template <typename T> 
 cpixmap<T>::cpixmap(void)
-  : m_height_stride(0), m_band_stride(0), m_buffer(NULL) {}
+  : m_height_stride(0), m_band_stride(0), m_buffer(NULL), m_mapping() {}
 
 template <typename T>
 cpixmap<T>::cpixmap(size_t w, size_t h, size_t b)
-  : cregion(w, h, b), m_height_stride(0), m_band_stride(0), m_buffer(NULL)
+  : cregion(w, h, b), m_height_stride(0), m_band_stride(0), m_buffer(NULL), m_mapping()
 {
   //setResolution(w, h, b);
   reallocate(w, h, b);
 }
 
+template <typename T>
+cpixmap<T>::cpixmap(size_t w, size_t h, size_t b, const cmemory_policy& memory)
+  : cregion(w, h, b), m_height_stride(0), m_band_stride(0), m_buffer(NULL), m_mapping(), m_memory(memory)
+{
+  reallocate(w, h, b);
+}
+
+// copies the dimensions and the memory policy, not the pixels
 template <typename T>
 cpixmap<T>::cpixmap(const cpixmap& pixmap)
-  : m_height_stride(0), m_band_stride(0), m_buffer(NULL)
+  : m_height_stride(0), m_band_stride(0), m_buffer(NULL), m_mapping(), m_memory(pixmap.m_memory)
 {
   const cregion dim = static_cast<const cregion>(pixmap);
   setResolution(dim.getWidth(), dim.getHeight(), dim.getBands());
@@ -92,7 +152,7 @@ cpixmap<T>::cpixmap(const cpixmap& pixmap)
   
 template <typename T>
 cpixmap<T>::cpixmap(const cregion& dim)
-  : m_height_stride(0), m_band_stride(0), m_buffer(NULL)
+  : m_height_stride(0), m_band_stride(0), m_buffer(NULL), m_mapping()
 {
   setResolution(dim.getWidth(), dim.getHeight(), dim.getBands());
 }
@@ -102,7 +162,7 @@ cpixmap<T>::~cpixmap(void)
 {
   //std::cout << static_cast<void *>(this) << " paraent" <<std::endl;
   //std::cout << static_cast<void *>(m_buffer) << " is freed!" << std::endl;
-  if (m_buffer) delete [] reinterpret_cast<double *>(m_buffer);
+  freeMemory(m_buffer, m_mapping);
   m_buffer = NULL;
 }
 
@@ -113,6 +173,30 @@ void cpixmap<T>::setResolution(size_t w, size_t h, size_t b)
   reallocate(w, h, b);
 }
 
+// Moves the pixels into a buffer placed by the new policy; with a policy
+// of NUMA_STRIPS the row strips of every band follow the executor's
+// contiguous split of (band, strip) tasks across pinned workers.
+template <typename T>
+void cpixmap<T>::setMemoryPolicy(const cmemory_policy& memory)
+{
+  m_memory = memory;
+  if (!m_buffer) return;
+  const size_t bytes = m_bands * m_band_stride;
+  cmemory_mapping mapping;
+  uint8_t *buffer = allocateMemory(bytes, m_memory, mapping);
+  memcpy(buffer, m_buffer, bytes);
+  freeMemory(m_buffer, m_mapping);
+  m_buffer = buffer;
+  m_mapping = mapping;
+}
+
+template <typename T>
+void cpixmap<T>::setMemoryTag(const std::string& tag)
+{
+  m_memory.tag = tag;
+  if (m_buffer) retagMemory(m_mapping, tag);
+}
+
 template <typename T>
 void cpixmap<T>::reallocate(size_t w, size_t h, size_t b)
 {
@@ -123,10 +207,9 @@ void cpixmap<T>::reallocate(size_t w, size_t h, size_t b)
   
   bytes = b * m_band_stride;
 
-  if (m_buffer) delete (double *)m_buffer;
-  m_buffer = reinterpret_cast<uint8_t *>(new double[(bytes + 7) / 8]);
+  freeMemory(m_buffer, m_mapping);
+  m_buffer = allocateMemory(bytes, m_memory, m_mapping);
   assert(m_buffer);
-  memset(m_buffer, 0, bytes);
   //std::cout << static_cast<void *>(this) << " paraent" <<std::endl;
   //std::cout << bytes << " bytes are allocated at " << static_cast<void *>(m_buffer) << std::endl;
 }
@@ -212,57 +295,62 @@ cpixmap<T> cpixmap<T>::operator=(const cpixmap<T>& m)
 */
 
 template <typename T>
-void cpixmap<T>::flipHorizontally(void)
+void cpixmap<T>::flipHorizontally(const cexecution_policy& policy)
 {
-  for (size_t z = 0; z < m_bands; ++z) {
-#pragma omp parallel for
-    for (size_t y = 0; y < m_height; ++y) {
-      uint8_t *p = m_buffer + z*m_band_stride + y*m_height_stride;
-      for (size_t x = 0; x < (m_width>>1); ++x) {
-	T temp = *((T *)p + x);
-	*((T *)p + x) = *((T *)p + (m_width-1) - x);
-	*((T *)p + (m_width-1) - x) = temp;
+  PIXMAP_TRACE("flipHorizontally", *this, trace_bytes<T>(*this) * 2, trace_threads(policy));
+  forEachStrip(policy, m_bands, m_height, [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	T *p = (T *)(m_buffer + z*m_band_stride + y*m_height_stride);
+	std::reverse(p, p + m_width);
       }
-    }
-  }
+    });
 }
 
+// swaps whole rows of the upper half with their mirror in the lower half
 template <typename T>
-void cpixmap<T>::flipVertically(void)
+void cpixmap<T>::flipVertically(const cexecution_policy& policy)
 {
-  for (size_t z = 0; z < m_bands; ++z) {
-#pragma omp parallel for
-    for (size_t x = 0; x < m_width; ++x) {
-      uint8_t *p = m_buffer + z*m_band_stride + x*sizeof(T);
-      for (size_t y = 0; y < (m_height>>1); ++y) {
-	T temp = *((T *)p + y*m_height_stride);
-	*(T *)(p + y*m_height_stride) = *(T *)(p + ((m_height-1) - y)*m_height_stride);
-	*(T *)(p + ((m_height-1)-y)*m_height_stride) = temp;
+  PIXMAP_TRACE("flipVertically", *this, trace_bytes<T>(*this) * 2, trace_threads(policy));
+  forEachStrip(policy, m_bands, m_height >> 1, [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	T *p = (T *)(m_buffer + z*m_band_stride + y*m_height_stride);
+	T *q = (T *)(m_buffer + z*m_band_stride + ((m_height-1) - y)*m_height_stride);
+	std::swap_ranges(p, p + m_width, q);
       }
-    }
-  }
+    });
 }
 
 template <typename T>
-void cpixmap<T>::lshiftPixel(size_t bits)
+void cpixmap<T>::lshiftPixel(size_t bits, const cexecution_policy& policy)
 {
-  for (size_t z = 0; z < m_bands; ++z) {
-#pragma omp parallel for
-    for (size_t y = 0; y < m_height; ++y) {
-      T *p = (T *)(m_buffer + z*m_band_stride + y*m_height_stride);
-      for (size_t x = 0; x < m_width; ++x) *p++ <<= bits;
-    }
-  }
+  PIXMAP_TRACE("lshiftPixel", *this, trace_bytes<T>(*this) * 2, trace_threads(policy));
+  forEachStrip(policy, m_bands, m_height, [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	T *p = (T *)(m_buffer + z*m_band_stride + y*m_height_stride);
+	for (size_t x = 0; x < m_width; ++x) *p++ <<= bits;
+      }
+    });
 }
 
 template <typename T>
-void cpixmap<T>::rshiftPixel(size_t bits)
+void cpixmap<T>::rshiftPixel(size_t bits, const cexecution_policy& policy)
 {
-  for (size_t z = 0; z < m_bands; ++z) {
-#pragma omp parallel for
-    for (size_t y = 0; y < m_height; ++y) {
-      T *p = (T *)(m_buffer + z*m_band_stride + y*m_height_stride);
-      for (size_t x = 0; x < m_width; ++x) *p++ >>= bits;
-    }
-  }
+  PIXMAP_TRACE("rshiftPixel", *this, trace_bytes<T>(*this) * 2, trace_threads(policy));
+  forEachStrip(policy, m_bands, m_height, [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	T *p = (T *)(m_buffer + z*m_band_stride + y*m_height_stride);
+	for (size_t x = 0; x < m_width; ++x) *p++ >>= bits;
+      }
+    });
+}
+
+template <typename T>
+void cpixmap<T>::reverseEndian(const cexecution_policy& policy)
+{
+  PIXMAP_TRACE("reverseEndian", *this, trace_bytes<T>(*this) * 2, trace_threads(policy));
+  if (sizeof(T) == 1) return;
+  forEachStrip(policy, m_bands, m_height, [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y)
+	reverseEndianLine((T *)(m_buffer + z*m_band_stride + y*m_height_stride), m_width);
+    });
 }
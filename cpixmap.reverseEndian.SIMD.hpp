@@ -20,95 +20,77 @@
 #include <iostream>
 #include <cstring>
 #include <cstdint>
+#include <algorithm>
 
 #include <cpixmap.hpp>
+#include <simd.hpp>
 
-#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
-# define MAX_VECTOR_SIZE 512
-# include <vectorclass/vectorclass.h>
-# if INSTRSET < 2
-#  error "Unsupported x86-SIMD! Please comment USE_SIMD on!"
-# endif
-#elif defined(__GNUC__) && defined (__ARM_NEON__)
-# include <arm_neon.h>
-#else
-# error "Undefined SIMD!"
-#endif
-
-template <>
-inline void cpixmap<int16_t>::reverseEndian(void)
-{
-  for (size_t z = 0; z < m_bands; ++z) {
-#pragma omp parallel for
-    for (size_t y = 0; y < m_height; ++y) {
-      uint16_t *pixLine = (uint16_t *)(m_buffer + z*m_band_stride + y*m_height_stride);
-# if defined(__x86_64__) || defined(__i386__)
-#  if INSTRSET >= 8 // AVX2 - 256bits
-      Vec16us pixVec;
-      for (size_t x = 0; x < m_width; x += 16) {
-	pixVec.load(&pixLine[x]);
-	//pixVec = reverse_endian(pixVec);
-	pixVec = rotate_left(pixVec, 8);
-	pixVec.store(&pixLine[x]);
-      }
-#  elif INSTRSET >= 2 // SSE2 - 128bits
-      Vec8us pixVec;
-      for (size_t x = 0; x < m_width; x += 8) {
-	pixVec.load(&pixLine[x]);
-	//pixVec = reverse_endian(pixVec);
-	pixVec = rotate_left(pixVec, 8);
-	pixVec.store(&pixLine[x]);
-      }
-#  endif
-# elif defined(__ARM_NEON__)
-      uint16x8_t pixVec;
-      for (size_t x = 0; x < m_width; x += 2) {
-	pixVec = vld1q_u16((const uint16_t *)&pixLine[x]);
-	uint16x4_t lowVec = vget_high_u16(pixVec);
-	uint16x4_t highVec = vget_low_u16(pixVec);
-	pixVec = vcombine_u16(lowVec, highVec);
-	vst1q_u16((uint16_t *)&pixLine[x], pixVec);
+// Byte reversal inside N-byte pixels over W-byte vectors; returns the number
+// of bytes done.  From SSE4.1 on (and on NEON) a constant byte shuffle maps
+// to a single pshufb/vpshufb/vrev, plain SSE2 swaps by lane shifts.
+template <size_t W, size_t N, bool shuffle>
+struct simd_bswap_impl {
+  static SIMD_INLINE size_t apply(uint8_t *line, size_t bytes)
+  {
+    typedef typename simd_vector<uint8_t, W>::type V;
+    typedef typename simd_vector<uint16_t, W>::type V16;
+    typedef typename simd_vector<uint32_t, W>::type V32;
+    typedef typename simd_vector<uint64_t, W>::type V64;
+    size_t x = 0;
+#if !defined(__clang__)
+    if (shuffle) {
+      V mask;
+      for (size_t i = 0; i < W; ++i) mask[i] = (uint8_t)(i ^ (N - 1));
+      for (; x + W <= bytes; x += W) {
+	V v;
+	simd_load(v, &line[x]);
+	v = __builtin_shuffle(v, mask);
+	simd_store(&line[x], v);
       }
-# endif
+      return x;
     }
+#endif
+    for (; x + W <= bytes; x += W) {
+      V16 v;
+      simd_load(v, &line[x]);
+      v = (v << 8) | (v >> 8);
+      if (N >= 4) { V32 u = (V32)v; v = (V16)((u << 16) | (u >> 16)); }
+      if (N >= 8) { V64 u = (V64)v; v = (V16)((u << 32) | (u >> 32)); }
+      simd_store(&line[x], v);
+    }
+    return x;
   }
-}
+};
 
-template <>
-inline void cpixmap<uint16_t>::reverseEndian(void)
-{
-  for (size_t z = 0; z < m_bands; ++z) {
-#pragma omp parallel for
-    for (size_t y = 0; y < m_height; ++y) {
-      uint16_t *pixLine = (uint16_t *)(m_buffer + z*m_band_stride + y*m_height_stride);
-# if defined(__x86_64__) || defined(__i386__)
-#  if INSTRSET >= 8 // AVX2 - 256bits
-      Vec16us pixVec;
-      for (size_t x = 0; x < m_width; x += 16) {
-	pixVec.load(&pixLine[x]);
-	//pixVec = reverse_endian(pixVec);
-	pixVec = rotate_left(pixVec, 8);
-	pixVec.store(&pixLine[x]);
-      }
-#  elif INSTRSET >= 2 // SSE2 - 128bits
-      Vec8us pixVec;
-      for (size_t x = 0; x < m_width; x += 8) {
-	pixVec.load(&pixLine[x]);
-	//pixVec = reverse_endian(pixVec);
-	pixVec = roate_left(pixVec, 8);
-	pixVec.store(&pixLine[x]);
-      }
-#  endif
-# elif defined(__ARM_NEON__)
-      uint16x8_t pixVec;
-      for (size_t x = 0; x < m_width; x += 2) {
-	pixVec = vld1q_u16((const uint16_t *)&pixLine[x]);
-	uint16x4_t lowVec = vget_high_u16(pixVec);
-	uint16x4_t highVec = vget_low_u16(pixVec);
-	pixVec = vcombine_u16(lowVec, highVec);
-	vst1q_u16((uint16_t *)&pixLine[x], pixVec);
-      }
-# endif
-    }
+template <size_t N, bool shuffle>
+struct simd_bswap_impl<0, N, shuffle> {
+  static SIMD_INLINE size_t apply(uint8_t *, size_t) { return 0; }
+};
+
+struct simd_reverse_endian {
+  template <SIMD_LEVEL L, typename T>
+  static SIMD_INLINE void run(T *line, size_t len)
+  {
+    const size_t done = simd_bswap_impl<simd_width<L>::bytes, sizeof(T), (L != SIMD_SSE2)>
+      ::apply((uint8_t *)line, len * sizeof(T)) / sizeof(T);
+    for (size_t x = done; x < len; ++x) line[x] = reverseEndianPixel(line[x]);
   }
-}
+};
+
+#define CPIXMAP_REVERSE_ENDIAN_SIMD(type)				\
+  template <>								\
+  inline void reverseEndianLine<type>(type *line, size_t len)		\
+  {									\
+    simdDispatch<simd_reverse_endian>(line, len);			\
+  }
+
+CPIXMAP_REVERSE_ENDIAN_SIMD(int16_t)
+CPIXMAP_REVERSE_ENDIAN_SIMD(uint16_t)
+CPIXMAP_REVERSE_ENDIAN_SIMD(int32_t)
+CPIXMAP_REVERSE_ENDIAN_SIMD(uint32_t)
+CPIXMAP_REVERSE_ENDIAN_SIMD(int64_t)
+CPIXMAP_REVERSE_ENDIAN_SIMD(uint64_t)
+CPIXMAP_REVERSE_ENDIAN_SIMD(float)
+CPIXMAP_REVERSE_ENDIAN_SIMD(double)
+
+#undef CPIXMAP_REVERSE_ENDIAN_SIMD
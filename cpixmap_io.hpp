@@ -25,36 +25,12 @@
 #include <Magick++.h>
 
 #include <cpixmap.hpp>
+#include <cpixmap_raw.hpp>
+#include <convert.hpp>
 #include <chistogram.hpp>
 
 template <typename T>
-void readRawImage(std::string filename, cpixmap<T>& img, size_t z = 0)
-{
-  std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
-
-  assert(file.is_open());
-  //size_t imagesize = file.tellg();
-  file.seekg(0, std::ios::beg);
-  for (size_t i = 0; i < img.getHeight(); ++i) {
-    file.read(reinterpret_cast<char *>(img.getLine(i, z)), img.getWidth()*sizeof(T));
-  }
-  file.close();
-}
-
-template <typename T>
-void writeRawImage(cpixmap<T>& img, size_t z, std::string filename)
-{
-  std::ofstream file(filename.c_str(), std::ofstream::binary);
-
-  assert(file.is_open());
-  for (size_t i = 0; i < img.getHeight(); ++i) {
-    file.write(reinterpret_cast<char *>(img.getLine(i, z)), img.getWidth()*sizeof(T));
-  }
-  file.close();
-}
-
-template <typename T>
-void readImage(std::string filename, cpixmap<T>& img, size_t z = 0)
+void readImage(std::string filename, cpixmap<T>& img, size_t z = 0, const cexecution_policy& policy = cexecution_policy())
 {
   Magick::Image image;
   
@@ -66,18 +42,19 @@ void readImage(std::string filename, cpixmap<T>& img, size_t z = 0)
   Magick::PixelPacket *pixels;
 
   pixels = image.getPixels(0, 0, image.columns(), image.rows());
-#pragma omp parallel for
-  for (ssize_t i = 0; i < image.rows(); ++i) {
-    for (ssize_t j = 0; j < image.columns(); ++j) {
-      Magick::ColorGray gray;
-      gray = pixels[i*image.columns() + j];
-      img.putPixel((T)(gray.shade() * ((double)std::numeric_limits<T>::max() - (double)std::numeric_limits<T>::min())) + std::numeric_limits<T>::min(), j, i, z);
-    }
-  }
+  forEachStrip(policy, 1, (size_t)image.rows(), [&](size_t, size_t y0, size_t y1) {
+      for (ssize_t i = (ssize_t)y0; i < (ssize_t)y1; ++i) {
+	for (ssize_t j = 0; j < image.columns(); ++j) {
+	  Magick::ColorGray gray;
+	  gray = pixels[i*image.columns() + j];
+	  img.putPixel((T)(gray.shade() * ((double)std::numeric_limits<T>::max() - (double)std::numeric_limits<T>::min())) + std::numeric_limits<T>::min(), j, i, z);
+	}
+      }
+    });
 }
 
 template <typename T>
-void readRGBImage(std::string filename, cpixmap<T>& img)
+void readRGBImage(std::string filename, cpixmap<T>& img, const cexecution_policy& policy = cexecution_policy())
 {
   Magick::Image image;
   
@@ -89,21 +66,22 @@ void readRGBImage(std::string filename, cpixmap<T>& img)
   Magick::PixelPacket *pixels;
 
   pixels = image.getPixels(0, 0, image.columns(), image.rows());
-#pragma omp parallel for
-  for (ssize_t i = 0; i < image.rows(); ++i) {
-    for (ssize_t j = 0; j < image.columns(); ++j) {
-      Magick::ColorRGB color;
-      color = pixels[i*image.columns() + j];
-      img.putPixel((T)(color.red() * ((double)std::numeric_limits<T>::max() - (double)std::numeric_limits<T>::min()) + std::numeric_limits<T>::min()), j, i, cpixmap<T>::RED_BAND);
-      img.putPixel((T)(color.green() * ((double)std::numeric_limits<T>::max() - (double)std::numeric_limits<T>::min()) + std::numeric_limits<T>::min()), j, i, cpixmap<T>::GREEN_BAND);
-      img.putPixel((T)(color.blue() * ((double)std::numeric_limits<T>::max() - (double)std::numeric_limits<T>::min()) + std::numeric_limits<T>::min()), j, i, cpixmap<T>::BLUE_BAND);
-      //img.putPixel((T)(gray.shade() * ((double)std::numeric_limits<T>::max() - (double)std::numeric_limits<T>::min())) + std::numeric_limits<T>::min(), j, i, z);
-    }
-  }
+  forEachStrip(policy, 1, (size_t)image.rows(), [&](size_t, size_t y0, size_t y1) {
+      for (ssize_t i = (ssize_t)y0; i < (ssize_t)y1; ++i) {
+	for (ssize_t j = 0; j < image.columns(); ++j) {
+	  Magick::ColorRGB color;
+	  color = pixels[i*image.columns() + j];
+	  img.putPixel((T)(color.red() * ((double)std::numeric_limits<T>::max() - (double)std::numeric_limits<T>::min()) + std::numeric_limits<T>::min()), j, i, cpixmap<T>::RED_BAND);
+	  img.putPixel((T)(color.green() * ((double)std::numeric_limits<T>::max() - (double)std::numeric_limits<T>::min()) + std::numeric_limits<T>::min()), j, i, cpixmap<T>::GREEN_BAND);
+	  img.putPixel((T)(color.blue() * ((double)std::numeric_limits<T>::max() - (double)std::numeric_limits<T>::min()) + std::numeric_limits<T>::min()), j, i, cpixmap<T>::BLUE_BAND);
+	  //img.putPixel((T)(gray.shade() * ((double)std::numeric_limits<T>::max() - (double)std::numeric_limits<T>::min())) + std::numeric_limits<T>::min(), j, i, z);
+	}
+      }
+    });
 }
 
 template <typename T>
-void displayRGBPixmap(cpixmap<T>& img, bool do_scale = false)
+void displayRGBPixmap(cpixmap<T>& img, bool do_scale = false, const cexecution_policy& policy = cexecution_policy())
 {
   T minval, maxval, val;
 
@@ -140,31 +118,33 @@ void displayRGBPixmap(cpixmap<T>& img, bool do_scale = false)
   Magick::PixelPacket *pixels;
 
   pixels = view.get(0, 0, disp_image.columns(), disp_image.rows());
-#pragma omp parallel for
-  for (ssize_t i = 0; i < disp_image.rows(); ++i) {
-    for (ssize_t j = 0; j < disp_image.columns(); ++j) {
-
-      Magick::ColorRGB color((double)((int)img.getPixel(j, i, cpixmap<T>::RED_BAND) - (int)minval) /
-			     (double)((int)maxval - (int)minval),
-			     (double)((int)img.getPixel(j, i, cpixmap<T>::GREEN_BAND) - (int)minval) /
-			     (double)((int)maxval - (int)minval),
-			     (double)((int)img.getPixel(j, i, cpixmap<T>::BLUE_BAND) - (int)minval) /
-			     (double)((int)maxval - (int)minval));
-      /*
-      Magick::ColorRGB color((double)img.getPixel(j, i, 0)/std::numeric_limits<T>::max(),
-			     (double)img.getPixel(j, i, 1)/std::numeric_limits<T>::max(),
-			     (double)img.getPixel(j, i, 2)/std::numeric_limits<T>::max());
-      */
-      pixels[i*disp_image.columns() + j] = color;
-    }
-  }
+  forEachStrip(policy, 1, (size_t)disp_image.rows(), [&](size_t, size_t y0, size_t y1) {
+      for (ssize_t i = (ssize_t)y0; i < (ssize_t)y1; ++i) {
+	for (ssize_t j = 0; j < disp_image.columns(); ++j) {
+
+	  Magick::ColorRGB color((double)((int)img.getPixel(j, i, cpixmap<T>::RED_BAND) - (int)minval) /
+			       (double)((int)maxval - (int)minval),
+			       (double)((int)img.getPixel(j, i, cpixmap<T>::GREEN_BAND) - (int)minval) /
+			       (double)((int)maxval - (int)minval),
+			       (double)((int)img.getPixel(j, i, cpixmap<T>::BLUE_BAND) - (int)minval) /
+			       (double)((int)maxval - (int)minval));
+	  /*
+	  Magick::ColorRGB color((double)img.getPixel(j, i, 0)/std::numeric_limits<T>::max(),
+			       (double)img.getPixel(j, i, 1)/std::numeric_limits<T>::max(),
+			       (double)img.getPixel(j, i, 2)/std::numeric_limits<T>::max());
+	  */
+	  pixels[i*disp_image.columns() + j] = color;
+	}
+      }
+    });
   view.sync();
   //disp_image.write("test_g.pgm");
   disp_image.display();
 }
 
 template <typename T>
-void displayRGBPixmap(cpixmap<T>& rimg, cpixmap<T>& gimg, cpixmap<T>& bimg, bool do_scale = false)
+void displayRGBPixmap(cpixmap<T>& rimg, cpixmap<T>& gimg, cpixmap<T>& bimg, bool do_scale = false,
+		      const cexecution_policy& policy = cexecution_policy())
 {
   assert(rimg.isMatched(gimg));
   assert(gimg.isMatched(bimg));
@@ -202,25 +182,27 @@ void displayRGBPixmap(cpixmap<T>& rimg, cpixmap<T>& gimg, cpixmap<T>& bimg, bool
   Magick::PixelPacket *pixels;
 
   pixels = view.get(0, 0, disp_image.columns(), disp_image.rows());
-#pragma omp parallel for
-  for (ssize_t i = 0; i < disp_image.rows(); ++i) {
-    for (ssize_t j = 0; j < disp_image.columns(); ++j) {
-      Magick::ColorRGB color((double)((int)rimg.getPixel(j, i, 0) - (int)minval) /
-			     (double)((int)maxval - (int)minval),
-			     (double)((int)gimg.getPixel(j, i, 0) - (int)minval) /
-			     (double)((int)maxval - (int)minval),
-			     (double)((int)bimg.getPixel(j, i, 0) - (int)minval) /
-			     (double)((int)maxval - (int)minval));
-      pixels[i*disp_image.columns() + j] = color;
-    }
-  }
+  forEachStrip(policy, 1, (size_t)disp_image.rows(), [&](size_t, size_t y0, size_t y1) {
+      for (ssize_t i = (ssize_t)y0; i < (ssize_t)y1; ++i) {
+	for (ssize_t j = 0; j < disp_image.columns(); ++j) {
+	  Magick::ColorRGB color((double)((int)rimg.getPixel(j, i, 0) - (int)minval) /
+			       (double)((int)maxval - (int)minval),
+			       (double)((int)gimg.getPixel(j, i, 0) - (int)minval) /
+			       (double)((int)maxval - (int)minval),
+			       (double)((int)bimg.getPixel(j, i, 0) - (int)minval) /
+			       (double)((int)maxval - (int)minval));
+	  pixels[i*disp_image.columns() + j] = color;
+	}
+      }
+    });
   view.sync();
   //disp_image.write("test_g.pgm");
   disp_image.display();
 }
 
 template <typename T>
-void displayPixmap(cpixmap<T>& img, size_t band = 0, bool do_scale = false)
+void displayPixmap(cpixmap<T>& img, size_t band = 0, bool do_scale = false,
+		   const cexecution_policy& policy = cexecution_policy())
 {
   Magick::Image disp_image(Magick::Geometry(img.getWidth(), img.getHeight()), "black");
   disp_image.classType(Magick::DirectClass);
@@ -247,22 +229,23 @@ void displayPixmap(cpixmap<T>& img, size_t band = 0, bool do_scale = false)
   }
   
   pixels = view.get(0, 0, disp_image.columns(), disp_image.rows());
-#pragma omp parallel for
-  for (ssize_t i = 0; i < disp_image.rows(); ++i) {
-    for (ssize_t j = 0; j < disp_image.columns(); ++j) {
-      double value = (double)img.getPixel(j, i, band);
-      Magick::ColorGray gray;
-      gray.shade((value - minval) / (maxval - minval));
-      pixels[i*disp_image.columns() + j] = gray;
-    }
-  }
+  forEachStrip(policy, 1, (size_t)disp_image.rows(), [&](size_t, size_t y0, size_t y1) {
+      for (ssize_t i = (ssize_t)y0; i < (ssize_t)y1; ++i) {
+	for (ssize_t j = 0; j < disp_image.columns(); ++j) {
+	  double value = (double)img.getPixel(j, i, band);
+	  Magick::ColorGray gray;
+	  gray.shade((value - minval) / (maxval - minval));
+	  pixels[i*disp_image.columns() + j] = gray;
+	}
+      }
+    });
   view.sync();
   //disp_image.write("test_g.pgm");
   disp_image.display();
 }
 
 template <typename T>
-void writePixmap(cpixmap<T>& img, int band, std::string filename)
+void writePixmap(cpixmap<T>& img, int band, std::string filename, const cexecution_policy& policy = cexecution_policy())
 {
   Magick::Image write_image(Magick::Geometry(img.getWidth(), img.getHeight()), "black");
   write_image.classType(Magick::DirectClass);
@@ -277,48 +260,46 @@ void writePixmap(cpixmap<T>& img, int band, std::string filename)
   double maxval = (double)std::numeric_limits<T>::max();
   
   pixels = view.get(0, 0, write_image.columns(), write_image.rows());
-#pragma omp parallel for
-  for (ssize_t i = 0; i < write_image.rows(); ++i) {
-    for (ssize_t j = 0; j < write_image.columns(); ++j) {
-      Magick::ColorGray gray(((double)img.getPixel(j, i, band) - minval) / (maxval - minval));
-      pixels[i*write_image.columns() + j] = gray;
-    }
-  }
+  forEachStrip(policy, 1, (size_t)write_image.rows(), [&](size_t, size_t y0, size_t y1) {
+      for (ssize_t i = (ssize_t)y0; i < (ssize_t)y1; ++i) {
+	for (ssize_t j = 0; j < write_image.columns(); ++j) {
+	  Magick::ColorGray gray(((double)img.getPixel(j, i, band) - minval) / (maxval - minval));
+	  pixels[i*write_image.columns() + j] = gray;
+	}
+      }
+    });
   view.sync();
   write_image.write(filename.c_str());
   //write_image.display();
 }
 
 template <typename T>
-void copyPixmap(cpixmap<T>& dst, size_t xoff, size_t yoff, cpixmap<T>& src, size_t z = 0)
+void copyPixmap(cpixmap<T>& dst, size_t xoff, size_t yoff, cpixmap<T>& src, size_t z = 0,
+		const cexecution_policy& policy = cexecution_policy())
 {
+  PIXMAP_TRACE("copyPixmap", src, (uint64_t)src.getWidth() * src.getHeight() * sizeof(T) * 2, trace_threads(policy));
   size_t height = std::min(src.getHeight(), dst.getHeight()+yoff);
   size_t width = std::min(src.getWidth(), dst.getWidth()+xoff);
 
-#pragma omp parallel for
-  for (size_t y = 0; y < height; ++y) {
-    T *dstline = dst.getLine(y+yoff, z);
-    T *srcline = src.getLine(y, z);
-    std::memcpy(dstline+xoff, srcline, width*sizeof(T));
-  }
+  forEachStrip(policy, 1, height, [&](size_t, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	T *dstline = dst.getLine(y+yoff, z);
+	T *srcline = src.getLine(y, z);
+	std::memcpy(dstline+xoff, srcline, width*sizeof(T));
+      }
+    });
 }
 
 template <typename T>
 void condensePixmap(cpixmap<T>& img, T minvalue, T maxvalue)
 {
-  for (size_t k = 0; k < img.getBands(); ++k) {
-    for (size_t j = 0; j < img.getHeight(); ++j) {
-      for (size_t i = 0; i < img.getWidth(); ++i) {
-	T value = img.getPixel(i, j, k);
-	value = (T)((float)value * ((float)maxvalue - (float)minvalue) / (float)std::numeric_limits<T>::max() + (float)minvalue);
-	img.putPixel(value, i, j, k);
-      }
-    }
-  }
+  convertPixmap(img, img,
+		((double)maxvalue - (double)minvalue) / (double)std::numeric_limits<T>::max(),
+		(double)minvalue, CONVERT_ROUND_TRUNCATE);
 }
 
 template <typename T>
-void comparePixmap(cpixmap<T>& img1, cpixmap<T>& img2)
+void comparePixmap(cpixmap<T>& img1, cpixmap<T>& img2, const cexecution_policy& policy = cexecution_policy())
 {
   double manhattan_norm = 0.0l;
   double zero_norm = 0.0l;
@@ -349,7 +330,7 @@ void comparePixmap(cpixmap<T>& img1, cpixmap<T>& img2)
   std::cout << "L1 norm(Manhattan norm):" << manhattan_norm << ", per pixel:" << manhattan_norm/(img1.getHeight()*img1.getWidth()) << std::endl;
   std::cout << "L0 norm(Zero norm):" << zero_norm << ", per pixel:" << zero_norm/(img1.getHeight()*img1.getWidth()) << std::endl;
 
-  displayPixmap(diffimg, 0, true);
+  displayPixmap(diffimg, 0, true, policy);
 }
 
 template <typename T>
@@ -368,11 +349,12 @@ void statisticPixmap(cpixmap<T>& img)
 }
 
 template <typename T>
-void trimPixmap(cpixmap<T>& img, int min_limit, int max_limit)
+void trimPixmap(cpixmap<T>& img, int min_limit, int max_limit, const cexecution_policy& policy = cexecution_policy())
 {
-#pragma omp parallel for
-  for (size_t i = 0; i < img.getHeight(); ++i)
-    for (size_t j = 0; j < img.getWidth(); ++j)
-      if ((int)img(i, j) > max_limit) img(i, j) = static_cast<T>(max_limit);
-      else if ((int)img(i, j) < min_limit) img(i, j) = static_cast<T>(min_limit);
+  forEachStrip(policy, 1, img.getHeight(), [&](size_t, size_t y0, size_t y1) {
+      for (size_t i = y0; i < y1; ++i)
+	for (size_t j = 0; j < img.getWidth(); ++j)
+	  if ((int)img(i, j) > max_limit) img(i, j) = static_cast<T>(max_limit);
+	  else if ((int)img(i, j) < min_limit) img(i, j) = static_cast<T>(min_limit);
+    });
 }
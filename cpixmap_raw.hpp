@@ -0,0 +1,360 @@
+/*
+  Copyright (C) 2014 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <cpixmap.hpp>
+#include <simd.hpp>
+
+#if defined(SIMD_X86)
+# include <tmmintrin.h>
+#endif
+
+// Raw headerless pixel files, one band per file, rows of width*sizeof(T)
+// bytes.  endian gives the byte order of the file; rows are swapped right
+// after they are read (or into a scratch row before they are written) so
+// that no second pass over the image is needed.
+
+template <typename T>
+void readRawImage(std::string filename, cpixmap<T>& img, size_t z = 0,
+		  PIXMAP_ENDIAN endian = PIXMAP_NATIVE_ENDIAN)
+{
+  PIXMAP_TRACE("readRawImage", img, (uint64_t)img.getWidth() * img.getHeight() * sizeof(T), 1);
+  std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+
+  assert(file.is_open());
+  //size_t imagesize = file.tellg();
+  file.seekg(0, std::ios::beg);
+  const bool swap = !isNativeEndian(endian);
+  for (size_t i = 0; i < img.getHeight(); ++i) {
+    file.read(reinterpret_cast<char *>(img.getLine(i, z)), img.getWidth()*sizeof(T));
+    if (swap) reverseEndianLine(img.getLine(i, z), img.getWidth());
+  }
+  file.close();
+}
+
+template <typename T>
+void writeRawImage(cpixmap<T>& img, size_t z, std::string filename,
+		   PIXMAP_ENDIAN endian = PIXMAP_NATIVE_ENDIAN)
+{
+  PIXMAP_TRACE("writeRawImage", img, (uint64_t)img.getWidth() * img.getHeight() * sizeof(T), 1);
+  std::ofstream file(filename.c_str(), std::ofstream::binary);
+
+  assert(file.is_open());
+  const bool swap = !isNativeEndian(endian);
+  std::vector<T> line(swap ? img.getWidth() : 0);
+  for (size_t i = 0; i < img.getHeight(); ++i) {
+    const T *src = img.getLine(i, z);
+    if (swap) {
+      std::copy(src, src + img.getWidth(), line.begin());
+      reverseEndianLine(line.data(), img.getWidth());
+      src = line.data();
+    }
+    file.write(reinterpret_cast<const char *>(src), img.getWidth()*sizeof(T));
+  }
+  file.close();
+}
+
+// Bit-packed sensor layouts decoded into cpixmap<uint16_t>.  The MIPI CSI-2
+// formats store the most significant 8 bits of each pixel first and gather
+// the remaining bits of the group in trailing bytes, first pixel lowest.
+enum RAW_PACKING {
+  RAW_MIPI10 = 0,      // 4 pixels in 5 bytes
+  RAW_MIPI12 = 1,      // 2 pixels in 3 bytes
+  RAW_MIPI14 = 2,      // 4 pixels in 7 bytes
+  RAW_PACKED12_LE = 3, // 2 pixels in 3 bytes, LSB-first bitstream
+  RAW_PACKED12_BE = 4  // 2 pixels in 3 bytes, MSB-first bitstream
+};
+
+inline void rawPackingGroup(RAW_PACKING packing, size_t& pixels, size_t& bytes)
+{
+  switch (packing) {
+  case RAW_MIPI10: pixels = 4, bytes = 5; break;
+  case RAW_MIPI14: pixels = 4, bytes = 7; break;
+  default: pixels = 2, bytes = 3; break;
+  }
+}
+
+inline size_t rawPackingBits(RAW_PACKING packing)
+{
+  return (packing == RAW_MIPI10) ? 10 : (packing == RAW_MIPI14) ? 14 : 12;
+}
+
+// bytes of a packed line of width pixels, the last group padded out
+inline size_t rawPackedLineBytes(RAW_PACKING packing, size_t width)
+{
+  size_t pixels, bytes;
+  rawPackingGroup(packing, pixels, bytes);
+  return (width + pixels - 1) / pixels * bytes;
+}
+
+inline void raw_unpack_group(uint16_t *p, const uint8_t *b, RAW_PACKING packing)
+{
+  switch (packing) {
+  case RAW_MIPI10:
+    for (int k = 0; k < 4; ++k) p[k] = (uint16_t)((b[k] << 2) | ((b[4] >> (2*k)) & 0x3));
+    break;
+  case RAW_MIPI12:
+    p[0] = (uint16_t)((b[0] << 4) | (b[2] & 0xf));
+    p[1] = (uint16_t)((b[1] << 4) | (b[2] >> 4));
+    break;
+  case RAW_MIPI14: {
+    uint32_t lsb = b[4] | (b[5] << 8) | (b[6] << 16);
+    for (int k = 0; k < 4; ++k) p[k] = (uint16_t)((b[k] << 6) | ((lsb >> (6*k)) & 0x3f));
+    break;
+  }
+  case RAW_PACKED12_LE:
+    p[0] = (uint16_t)(b[0] | ((b[1] & 0xf) << 8));
+    p[1] = (uint16_t)((b[1] >> 4) | (b[2] << 4));
+    break;
+  case RAW_PACKED12_BE:
+    p[0] = (uint16_t)((b[0] << 4) | (b[1] >> 4));
+    p[1] = (uint16_t)(((b[1] & 0xf) << 8) | b[2]);
+    break;
+  }
+}
+
+inline void raw_pack_group(uint8_t *b, const uint16_t *p, RAW_PACKING packing)
+{
+  switch (packing) {
+  case RAW_MIPI10:
+    b[4] = 0;
+    for (int k = 0; k < 4; ++k) {
+      b[k] = (uint8_t)(p[k] >> 2);
+      b[4] |= (uint8_t)((p[k] & 0x3) << (2*k));
+    }
+    break;
+  case RAW_MIPI12:
+    b[0] = (uint8_t)(p[0] >> 4);
+    b[1] = (uint8_t)(p[1] >> 4);
+    b[2] = (uint8_t)((p[0] & 0xf) | ((p[1] & 0xf) << 4));
+    break;
+  case RAW_MIPI14: {
+    uint32_t lsb = 0;
+    for (int k = 0; k < 4; ++k) {
+      b[k] = (uint8_t)(p[k] >> 6);
+      lsb |= (uint32_t)(p[k] & 0x3f) << (6*k);
+    }
+    b[4] = (uint8_t)lsb, b[5] = (uint8_t)(lsb >> 8), b[6] = (uint8_t)(lsb >> 16);
+    break;
+  }
+  case RAW_PACKED12_LE:
+    b[0] = (uint8_t)p[0];
+    b[1] = (uint8_t)(((p[0] >> 8) & 0xf) | (p[1] << 4));
+    b[2] = (uint8_t)(p[1] >> 4);
+    break;
+  case RAW_PACKED12_BE:
+    b[0] = (uint8_t)(p[0] >> 4);
+    b[1] = (uint8_t)((p[0] << 4) | ((p[1] >> 8) & 0xf));
+    b[2] = (uint8_t)p[1];
+    break;
+  }
+}
+
+#if defined(SIMD_X86)
+// Eight pixels per step: one pshufb spreads the bytes of two groups (or four
+// pairs) into 16-bit lanes, shifts and masks then merge the trailing bits.
+// Returns the number of pixels decoded; never reads past line_bytes.
+__attribute__((target("ssse3"))) inline size_t raw_unpack_ssse3(uint16_t *dst, const uint8_t *src, size_t width,
+			       size_t line_bytes, RAW_PACKING packing, size_t shift)
+{
+  size_t pixels, bytes;
+  rawPackingGroup(packing, pixels, bytes);
+  const size_t step = 8 / pixels * bytes; // source bytes per 8 pixels
+
+  alignas(16) int8_t shuf[16] = {}, shuf2[16] = {};
+  alignas(16) uint16_t mult[8] = {}, even[8] = {};
+  for (int i = 0; i < 8; ++i) {
+    const int g = i / (int)pixels, k = i % (int)pixels, base = g * (int)bytes;
+    even[i] = (k & 1) ? 0 : 0xffff;
+    switch (packing) {
+    case RAW_MIPI10:
+      shuf[2*i] = (int8_t)(base + 4), shuf[2*i+1] = (int8_t)(base + k);
+      mult[i] = (uint16_t)(1 << (6 - 2*k));
+      break;
+    case RAW_MIPI12:
+      shuf[2*i] = (int8_t)(base + 2), shuf[2*i+1] = (int8_t)(base + k);
+      break;
+    case RAW_MIPI14: {
+      static const int lo[4] = {4, 4, 5, 6}, hi[4] = {-1, 5, 6, -1}, s[4] = {0, 6, 4, 2};
+      shuf[2*i] = (int8_t)(base + k), shuf[2*i+1] = (int8_t)0x80;
+      shuf2[2*i] = (int8_t)(base + lo[k]);
+      shuf2[2*i+1] = (hi[k] < 0) ? (int8_t)0x80 : (int8_t)(base + hi[k]);
+      mult[i] = (uint16_t)(1 << (6 - s[k]));
+      break;
+    }
+    case RAW_PACKED12_LE:
+      shuf[2*i] = (int8_t)(base + k), shuf[2*i+1] = (int8_t)(base + k + 1);
+      break;
+    case RAW_PACKED12_BE:
+      shuf[2*i] = (int8_t)(base + k + 1), shuf[2*i+1] = (int8_t)(base + k);
+      break;
+    }
+  }
+
+  const __m128i vshuf = _mm_load_si128((const __m128i *)shuf);
+  const __m128i vshuf2 = _mm_load_si128((const __m128i *)shuf2);
+  const __m128i vmult = _mm_load_si128((const __m128i *)mult);
+  const __m128i veven = _mm_load_si128((const __m128i *)even);
+  const __m128i vshift = _mm_cvtsi32_si128((int)shift);
+  const __m128i m3 = _mm_set1_epi16(0x3), mf = _mm_set1_epi16(0xf), m3f = _mm_set1_epi16(0x3f);
+  const __m128i m3fc = _mm_set1_epi16(0x3fc), mff0 = _mm_set1_epi16(0xff0), mfff = _mm_set1_epi16(0xfff);
+
+  size_t x = 0, offset = 0;
+  for (; x + 8 <= width && offset + 16 <= line_bytes; x += 8, offset += step) {
+    const __m128i in = _mm_loadu_si128((const __m128i *)&src[offset]);
+    const __m128i t = _mm_shuffle_epi8(in, vshuf);
+    __m128i r;
+    switch (packing) {
+    case RAW_MIPI10: // msb << 2 | (lsb >> 2k) & 3
+      r = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(t, 6), m3fc),
+		       _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(t, vmult), 6), m3));
+      break;
+    case RAW_MIPI12: { // msb << 4 | low or high nibble
+      const __m128i a = _mm_srli_epi16(t, 4);
+      const __m128i n = _mm_or_si128(_mm_and_si128(veven, t), _mm_andnot_si128(veven, a));
+      r = _mm_or_si128(_mm_and_si128(a, mff0), _mm_and_si128(n, mf));
+      break;
+    }
+    case RAW_MIPI14: {
+      const __m128i l = _mm_shuffle_epi8(in, vshuf2);
+      r = _mm_or_si128(_mm_slli_epi16(t, 6),
+		       _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(l, vmult), 6), m3f));
+      break;
+    }
+    default: { // 12-bit bitstreams: one lane parity is masked, the other shifted
+      const __m128i a = _mm_and_si128(t, mfff), s = _mm_srli_epi16(t, 4);
+      const __m128i sel = (packing == RAW_PACKED12_LE) ? veven : _mm_xor_si128(veven, _mm_set1_epi16(-1));
+      r = _mm_or_si128(_mm_and_si128(sel, a), _mm_andnot_si128(sel, s));
+      break;
+    }
+    }
+    _mm_storeu_si128((__m128i *)&dst[x], _mm_sll_epi16(r, vshift));
+  }
+  return x;
+}
+#endif
+
+// pshufb needs SSSE3, which every dispatch level from SSE4.1 up includes
+struct raw_unpack_kernel {
+  template <SIMD_LEVEL L>
+  static SIMD_INLINE void run(size_t *done, uint16_t *dst, const uint8_t *src, size_t width,
+			      size_t line_bytes, RAW_PACKING packing, size_t shift)
+  {
+#if defined(SIMD_X86)
+    if (L >= SIMD_SSE41 && L <= SIMD_AVX512) {
+      *done = raw_unpack_ssse3(dst, src, width, line_bytes, packing, shift);
+      return;
+    }
+#endif
+    *done = 0;
+  }
+};
+
+// Decode one packed line into width pixels, shifted left by shift bits
+// (left-justified as lshiftPixel(shift) would) in the same pass.
+inline void unpackRawLine(uint16_t *dst, const uint8_t *src, size_t width, RAW_PACKING packing,
+			  size_t shift = 0)
+{
+  size_t pixels, bytes;
+  rawPackingGroup(packing, pixels, bytes);
+  assert(shift + rawPackingBits(packing) <= 16);
+
+  size_t x = 0;
+  simdDispatch<raw_unpack_kernel>(&x, dst, src, width, rawPackedLineBytes(packing, width), packing, shift);
+  for (; x + pixels <= width; x += pixels) {
+    raw_unpack_group(&dst[x], &src[x / pixels * bytes], packing);
+    for (size_t k = 0; k < pixels; ++k) dst[x + k] <<= shift;
+  }
+  if (x < width) {
+    uint16_t tail[4];
+    raw_unpack_group(tail, &src[x / pixels * bytes], packing);
+    for (size_t k = 0; x + k < width; ++k) dst[x + k] = (uint16_t)(tail[k] << shift);
+  }
+}
+
+// Encode width pixels, shifted right by shift bits first; the padding of a
+// partial last group is written as zeros.
+inline void packRawLine(uint8_t *dst, const uint16_t *src, size_t width, RAW_PACKING packing,
+			size_t shift = 0)
+{
+  size_t pixels, bytes;
+  rawPackingGroup(packing, pixels, bytes);
+  assert(shift + rawPackingBits(packing) <= 16);
+
+  uint16_t group[4];
+  for (size_t x = 0; x < width; x += pixels) {
+    for (size_t k = 0; k < pixels; ++k) group[k] = (x + k < width) ? (uint16_t)(src[x + k] >> shift) : 0;
+    raw_pack_group(&dst[x / pixels * bytes], group, packing);
+  }
+}
+
+// Decode a packed frame already in memory; line_bytes of 0 means the lines
+// are contiguous without padding.
+inline void unpackRawPixmap(cpixmap<uint16_t>& img, const uint8_t *buffer, RAW_PACKING packing,
+			    size_t line_bytes = 0, size_t z = 0, size_t shift = 0,
+			    const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("unpackRawPixmap", img, (uint64_t)img.getWidth() * img.getHeight() * sizeof(uint16_t) * 2,
+	       trace_threads(policy));
+  if (line_bytes == 0) line_bytes = rawPackedLineBytes(packing, img.getWidth());
+  assert(line_bytes >= rawPackedLineBytes(packing, img.getWidth()));
+  forEachStrip(policy, 1, img.getHeight(), [&](size_t, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y)
+	unpackRawLine(img.getLine(y, z), buffer + y*line_bytes, img.getWidth(), packing, shift);
+    });
+}
+
+// Read a packed raw file into band z of img, whose resolution gives the
+// frame size.  Each line is decoded straight out of a single line buffer.
+inline void readPackedRawImage(std::string filename, cpixmap<uint16_t>& img, RAW_PACKING packing,
+			       size_t z = 0, size_t shift = 0, size_t line_bytes = 0)
+{
+  PIXMAP_TRACE("readPackedRawImage", img, (uint64_t)img.getWidth() * img.getHeight() * sizeof(uint16_t), 1);
+  std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+
+  assert(file.is_open());
+  const size_t packed_bytes = rawPackedLineBytes(packing, img.getWidth());
+  if (line_bytes == 0) line_bytes = packed_bytes;
+  assert(line_bytes >= packed_bytes);
+  std::vector<uint8_t> line(line_bytes);
+  for (size_t i = 0; i < img.getHeight(); ++i) {
+    file.read(reinterpret_cast<char *>(line.data()), line_bytes);
+    unpackRawLine(img.getLine(i, z), line.data(), img.getWidth(), packing, shift);
+  }
+  file.close();
+}
+
+inline void writePackedRawImage(cpixmap<uint16_t>& img, size_t z, std::string filename,
+				RAW_PACKING packing, size_t shift = 0)
+{
+  PIXMAP_TRACE("writePackedRawImage", img, (uint64_t)img.getWidth() * img.getHeight() * sizeof(uint16_t), 1);
+  std::ofstream file(filename.c_str(), std::ofstream::binary);
+
+  assert(file.is_open());
+  std::vector<uint8_t> line(rawPackedLineBytes(packing, img.getWidth()));
+  for (size_t i = 0; i < img.getHeight(); ++i) {
+    packRawLine(line.data(), img.getLine(i, z), img.getWidth(), packing, shift);
+    file.write(reinterpret_cast<const char *>(line.data()), line.size());
+  }
+  file.close();
+}
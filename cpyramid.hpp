@@ -0,0 +1,265 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include <cpixmap.hpp>
+
+// Accumulator used by the 5-tap binomial kernel [1 4 6 4 1]/16 in each
+// direction; a full reduce gathers 256x the input range, an expand 64x.
+template <typename T>
+struct pyramid_traits {
+  typedef int32_t acc_type;
+};
+
+template <> struct pyramid_traits<int32_t> { typedef int64_t acc_type; };
+template <> struct pyramid_traits<uint32_t> { typedef int64_t acc_type; };
+template <> struct pyramid_traits<int64_t> { typedef double acc_type; };
+template <> struct pyramid_traits<uint64_t> { typedef double acc_type; };
+template <> struct pyramid_traits<float> { typedef float acc_type; };
+template <> struct pyramid_traits<double> { typedef double acc_type; };
+
+// mirror without repeating the edge sample: -1 -> 1, n -> n-2
+inline size_t pyramid_reflect(long i, long n)
+{
+  if (n == 1) return 0;
+  if (i < 0) i = -i;
+  if (i >= n) i = 2*n - 2 - i;
+  return (size_t)i;
+}
+
+// divide by 2^shift, rounding half up for integer accumulators
+template <typename A>
+inline A pyramid_descale(A v, int shift) { return v / (A)((int64_t)1 << shift); }
+inline int32_t pyramid_descale(int32_t v, int shift) { return (v + (1 << (shift-1))) >> shift; }
+inline int64_t pyramid_descale(int64_t v, int shift) { return (v + ((int64_t)1 << (shift-1))) >> shift; }
+
+template <typename T, typename A>
+inline T pyramid_saturate(A v)
+{
+  if (std::numeric_limits<T>::is_integer) {
+    if (!std::numeric_limits<A>::is_integer) v = std::floor(v + (A)0.5);
+    if (v < (A)std::numeric_limits<T>::lowest()) return std::numeric_limits<T>::lowest();
+    if (v > (A)std::numeric_limits<T>::max()) return std::numeric_limits<T>::max();
+  }
+  return (T)v;
+}
+
+// Gaussian blur and 2:1 decimation in one pass: only the kept rows are
+// filtered vertically and only the kept columns horizontally, so each
+// output pixel costs 5 + 5 multiply-adds instead of a full-resolution blur.
+template <typename T, typename S>
+void pyramidReduce(cpixmap<T>& dst, const cpixmap<S>& src, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("pyramidReduce", src, trace_bytes<S>(src) + trace_bytes<T>(dst), trace_threads(policy));
+  typedef typename pyramid_traits<S>::acc_type A;
+  const long sw = src.getWidth(), sh = src.getHeight();
+  const long dw = dst.getWidth();
+
+  assert(dst.getBands() == src.getBands());
+  assert(dst.getWidth() == (src.getWidth() + 1) / 2);
+  assert(dst.getHeight() == (src.getHeight() + 1) / 2);
+
+  forEachStrip(policy, dst.getBands(), dst.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      std::vector<A> column(sw);
+
+      for (long y = (long)y0; y < (long)y1; ++y) {
+	const S *l0 = src.getLine(pyramid_reflect(2*y - 2, sh), z);
+	const S *l1 = src.getLine(pyramid_reflect(2*y - 1, sh), z);
+	const S *l2 = src.getLine(pyramid_reflect(2*y, sh), z);
+	const S *l3 = src.getLine(pyramid_reflect(2*y + 1, sh), z);
+	const S *l4 = src.getLine(pyramid_reflect(2*y + 2, sh), z);
+	A *c = &column[0];
+
+#pragma omp simd
+	for (long x = 0; x < sw; ++x)
+	  c[x] = (A)l0[x] + (A)l4[x] + (A)4*((A)l1[x] + (A)l3[x]) + (A)6*(A)l2[x];
+
+	T *dstline = dst.getLine(y, z);
+	for (long x = 0; x < dw; ++x) {
+	  A sum = c[pyramid_reflect(2*x - 2, sw)] + c[pyramid_reflect(2*x + 2, sw)] +
+	    (A)4*(c[pyramid_reflect(2*x - 1, sw)] + c[pyramid_reflect(2*x + 1, sw)]) + (A)6*c[2*x];
+	  dstline[x] = pyramid_saturate<T>(pyramid_descale(sum, 8));
+	}
+      }
+    });
+}
+
+// 1:2 upsampling with the same kernel, evaluated polyphase (even outputs use
+// taps 1 6 1, odd outputs 4 4), and added to dst scaled by sign.  With
+// sign = -1 this turns a Gaussian level into a Laplacian one, with +1 it
+// undoes it.
+template <typename T>
+void pyramidExpandAdd(cpixmap<T>& dst, const cpixmap<T>& src, int sign,
+		      const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("pyramidExpandAdd", dst, trace_bytes<T>(src) + trace_bytes<T>(dst) * 2, trace_threads(policy));
+  typedef typename pyramid_traits<T>::acc_type A;
+  const long sw = src.getWidth(), sh = src.getHeight();
+  const long dw = dst.getWidth();
+
+  assert(dst.getBands() == src.getBands());
+  assert((dst.getWidth() + 1) / 2 == src.getWidth());
+  assert((dst.getHeight() + 1) / 2 == src.getHeight());
+
+  forEachStrip(policy, dst.getBands(), dst.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      std::vector<A> row(sw);
+
+      for (long y = (long)y0; y < (long)y1; ++y) {
+	long cy = y >> 1;
+	A *v = &row[0];
+
+	if (y & 1) {
+	  const T *l0 = src.getLine(std::min(cy, sh - 1), z);
+	  const T *l1 = src.getLine(std::min(cy + 1, sh - 1), z);
+#pragma omp simd
+	  for (long x = 0; x < sw; ++x) v[x] = (A)4*((A)l0[x] + (A)l1[x]);
+	} else {
+	  const T *l0 = src.getLine(std::max(cy - 1, 0L), z);
+	  const T *l1 = src.getLine(cy, z);
+	  const T *l2 = src.getLine(std::min(cy + 1, sh - 1), z);
+#pragma omp simd
+	  for (long x = 0; x < sw; ++x) v[x] = (A)l0[x] + (A)6*(A)l1[x] + (A)l2[x];
+	}
+
+	T *dstline = dst.getLine(y, z);
+	for (long x = 0; x < dw; ++x) {
+	  long cx = x >> 1;
+	  A sum;
+	  if (x & 1) sum = (A)4*(v[cx] + v[std::min(cx + 1, sw - 1)]);
+	  else sum = v[std::max(cx - 1, 0L)] + (A)6*v[cx] + v[std::min(cx + 1, sw - 1)];
+	  // round the expansion on its own so that collapse exactly inverts build
+	  dstline[x] = pyramid_saturate<T>((A)dstline[x] + (A)sign * pyramid_descale(sum, 6));
+	}
+      }
+    });
+}
+
+// Gaussian / Laplacian image pyramid.  Level buffers are kept between
+// builds and only reallocated when the input geometry changes, so building
+// a pyramid per frame does not touch the allocator.
+template <typename T>
+class cpyramid {
+public:
+  cpyramid(void) {}
+  cpyramid(size_t levels) : m_levels(levels, (cpixmap<T> *)NULL) {}
+  virtual ~cpyramid(void);
+  void setLevels(size_t levels);
+  size_t getLevels(void) const { return m_levels.size(); }
+  cpixmap<T>& getLevel(size_t l) const { assert(l < m_levels.size() && m_levels[l]); return *m_levels[l]; }
+  cpixmap<T>& operator[] (size_t l) const { return getLevel(l); }
+  template <typename S> void buildGaussian(const cpixmap<S>& image, const cexecution_policy& policy = cexecution_policy());
+  template <typename S> void buildLaplacian(const cpixmap<S>& image, const cexecution_policy& policy = cexecution_policy());
+  void collapse(const cexecution_policy& policy = cexecution_policy());
+  template <typename S> void collapse(cpixmap<S>& image, const cexecution_policy& policy = cexecution_policy());
+private:
+  cpyramid(const cpyramid&);
+  cpyramid& operator=(const cpyramid&);
+  void prepare(size_t w, size_t h, size_t b);
+  std::vector<cpixmap<T> *> m_levels;
+};
+
+template <typename T>
+cpyramid<T>::~cpyramid(void)
+{
+  for (size_t l = 0; l < m_levels.size(); ++l) delete m_levels[l];
+}
+
+template <typename T>
+void cpyramid<T>::setLevels(size_t levels)
+{
+  for (size_t l = levels; l < m_levels.size(); ++l) delete m_levels[l];
+  m_levels.resize(levels, (cpixmap<T> *)NULL);
+}
+
+template <typename T>
+void cpyramid<T>::prepare(size_t w, size_t h, size_t b)
+{
+  assert(m_levels.size() > 0);
+  for (size_t l = 0; l < m_levels.size(); ++l) {
+    if (!m_levels[l]) m_levels[l] = new cpixmap<T>(w, h, b);
+    else if (!m_levels[l]->isMatched(w, h, b)) m_levels[l]->setResolution(w, h, b);
+    w = (w + 1) / 2, h = (h + 1) / 2;
+  }
+}
+
+template <typename T>
+template <typename S>
+void cpyramid<T>::buildGaussian(const cpixmap<S>& image, const cexecution_policy& policy)
+{
+  prepare(image.getWidth(), image.getHeight(), image.getBands());
+
+  cpixmap<T>& base = *m_levels[0];
+  forEachStrip(policy, image.getBands(), image.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	const S *srcline = image.getLine(y, z);
+	T *dstline = base.getLine(y, z);
+	for (size_t x = 0; x < image.getWidth(); ++x)
+	  dstline[x] = pyramid_saturate<T>((typename pyramid_traits<S>::acc_type)srcline[x]);
+      }
+    });
+
+  for (size_t l = 1; l < m_levels.size(); ++l)
+    pyramidReduce(*m_levels[l], *m_levels[l-1], policy);
+}
+
+template <typename T>
+template <typename S>
+void cpyramid<T>::buildLaplacian(const cpixmap<S>& image, const cexecution_policy& policy)
+{
+  assert(std::numeric_limits<T>::is_signed);
+
+  buildGaussian(image, policy);
+  // L(l) = G(l) - expand(G(l+1)); ascending order keeps G(l+1) intact
+  for (size_t l = 0; l + 1 < m_levels.size(); ++l)
+    pyramidExpandAdd(*m_levels[l], *m_levels[l+1], -1, policy);
+}
+
+// Turn a Laplacian pyramid back into Gaussian levels in place; level 0 then
+// holds the reconstructed image.
+template <typename T>
+void cpyramid<T>::collapse(const cexecution_policy& policy)
+{
+  for (size_t l = m_levels.size() - 1; l > 0; --l)
+    pyramidExpandAdd(*m_levels[l-1], *m_levels[l], +1, policy);
+}
+
+template <typename T>
+template <typename S>
+void cpyramid<T>::collapse(cpixmap<S>& image, const cexecution_policy& policy)
+{
+  collapse(policy);
+
+  const cpixmap<T>& base = *m_levels[0];
+  if (!image.isMatched(base.getWidth(), base.getHeight(), base.getBands()))
+    image.setResolution(base.getWidth(), base.getHeight(), base.getBands());
+
+  forEachStrip(policy, base.getBands(), base.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	const T *srcline = base.getLine(y, z);
+	S *dstline = image.getLine(y, z);
+	for (size_t x = 0; x < base.getWidth(); ++x)
+	  dstline[x] = pyramid_saturate<S>((typename pyramid_traits<T>::acc_type)srcline[x]);
+      }
+    });
+}
@@ -0,0 +1,349 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include <cpixmap.hpp>
+#include <warp.hpp>
+
+#define REMAP_FRAC_BITS 8
+#define REMAP_FRAC_ONE (1 << REMAP_FRAC_BITS)
+
+// Pixels whose bilinear footprint leaves the source are kept aside with
+// their four taps already resolved against the border mode; a negative tap
+// reads the constant border value.
+struct cremap_exception {
+  int32_t tap[4];
+  uint16_t frac;
+  uint16_t skip; // transparent border, leave dst as is
+};
+
+// A per-pixel coordinate map (mapx, mapy: source position of every dst
+// pixel) compiled once into an element offset and a packed 8+8-bit
+// fraction per pixel, stored tile by tile in the order apply() visits them.
+// The compiled form depends on the source geometry and the pixel type, and
+// can be saved and loaded to skip compilation at start-up.
+template <typename T>
+class cremap {
+public:
+  cremap(void);
+  virtual ~cremap(void) {}
+  void compile(const cpixmap<float>& mapx, const cpixmap<float>& mapy,
+	       size_t src_width, size_t src_height,
+	       WARP_INTERPOLATION interp = WARP_BILINEAR, WARP_BORDER border = WARP_BORDER_CONSTANT,
+	       size_t tile = 0);
+  void apply(cpixmap<T>& dst, const cpixmap<T>& src, T value = 0,
+	     const cexecution_policy& policy = cexecution_policy()) const;
+  bool isCompiled(void) const { return m_width > 0; }
+  size_t getWidth(void) const { return m_width; }
+  size_t getHeight(void) const { return m_height; }
+  bool save(std::ostream& stream) const;
+  // false, leaving the map uncompiled, if the stream does not hold a map
+  // of this pixel type whose offsets all stay inside its source
+  bool load(std::istream& stream);
+  bool save(std::string filename) const;
+  bool load(std::string filename);
+private:
+  bool checkMap(void) const;
+  size_t getTiles(void) const;
+  void getTile(size_t t, size_t& x0, size_t& y0, size_t& w, size_t& h, size_t& start) const;
+  int32_t resolve(long x, long y) const;
+  size_t m_width, m_height;
+  size_t m_src_width, m_src_height, m_src_stride; // stride in elements
+  size_t m_tile_width, m_tile_height;
+  WARP_INTERPOLATION m_interp;
+  WARP_BORDER m_border;
+  std::vector<int32_t> m_offset; // < 0: -(index into m_exception) - 1
+  std::vector<uint16_t> m_frac;   // fy << 8 | fx
+  std::vector<cremap_exception> m_exception;
+};
+
+template <typename T>
+cremap<T>::cremap(void)
+  : m_width(0), m_height(0),
+    m_src_width(0), m_src_height(0), m_src_stride(0),
+    m_tile_width(0), m_tile_height(0),
+    m_interp(WARP_BILINEAR), m_border(WARP_BORDER_CONSTANT) {}
+
+template <typename T>
+size_t cremap<T>::getTiles(void) const
+{
+  return ((m_width + m_tile_width - 1) / m_tile_width) * ((m_height + m_tile_height - 1) / m_tile_height);
+}
+
+template <typename T>
+void cremap<T>::getTile(size_t t, size_t& x0, size_t& y0, size_t& w, size_t& h, size_t& start) const
+{
+  size_t tiles_x = (m_width + m_tile_width - 1) / m_tile_width;
+  x0 = (t % tiles_x) * m_tile_width;
+  y0 = (t / tiles_x) * m_tile_height;
+  w = std::min(m_tile_width, m_width - x0);
+  h = std::min(m_tile_height, m_height - y0);
+  start = y0 * m_width + x0 * h;
+}
+
+template <typename T>
+int32_t cremap<T>::resolve(long x, long y) const
+{
+  const long w = m_src_width, h = m_src_height;
+  if (x < 0 || x >= w || y < 0 || y >= h) {
+    if (m_border == WARP_BORDER_CONSTANT) return -1;
+    x = warp_border_index(x, w, m_border);
+    y = warp_border_index(y, h, m_border);
+  }
+  return (int32_t)(y * m_src_stride + x);
+}
+
+template <typename T>
+void cremap<T>::compile(const cpixmap<float>& mapx, const cpixmap<float>& mapy,
+			size_t src_width, size_t src_height,
+			WARP_INTERPOLATION interp, WARP_BORDER border, size_t tile)
+{
+  assert(mapx.isMatched(mapy));
+  assert(interp != WARP_BICUBIC);
+  assert(src_width > 0 && src_height > 0);
+
+  m_width = mapx.getWidth(), m_height = mapx.getHeight();
+  m_src_width = src_width, m_src_height = src_height;
+  m_src_stride = QWORD_ALIGN(src_width * sizeof(T)) / sizeof(T);
+  m_tile_width = tile ? tile : std::max<size_t>(m_width, 1);
+  m_tile_height = tile ? tile : 1;
+  m_interp = interp, m_border = border;
+  assert(m_src_stride * src_height <= (size_t)std::numeric_limits<int32_t>::max());
+
+  m_offset.assign(m_width * m_height, 0);
+  m_frac.assign(m_width * m_height, 0);
+  m_exception.clear();
+
+  const long w = src_width, h = src_height;
+  const size_t tiles = getTiles();
+  for (size_t t = 0; t < tiles; ++t) {
+    size_t x0, y0, tw, th, i;
+    getTile(t, x0, y0, tw, th, i);
+    for (size_t y = y0; y < y0 + th; ++y) {
+      const float *mx = mapx.getLine(y), *my = mapy.getLine(y);
+      for (size_t x = x0; x < x0 + tw; ++x, ++i) {
+	// NaN goes outside the source, as a position off any side does
+	double sx = std::isnan(mx[x]) ? -1e9 : std::min(std::max((double)mx[x], -1e9), 1e9);
+	double sy = std::isnan(my[x]) ? -1e9 : std::min(std::max((double)my[x], -1e9), 1e9);
+	long ix, iy;
+	int32_t fx = 0, fy = 0;
+	if (interp == WARP_NEAREST) {
+	  ix = (long)std::floor(sx + 0.5), iy = (long)std::floor(sy + 0.5);
+	} else {
+	  long X = (long)std::floor(sx * REMAP_FRAC_ONE + 0.5), Y = (long)std::floor(sy * REMAP_FRAC_ONE + 0.5);
+	  ix = X >> REMAP_FRAC_BITS, iy = Y >> REMAP_FRAC_BITS;
+	  fx = X & (REMAP_FRAC_ONE - 1), fy = Y & (REMAP_FRAC_ONE - 1);
+	}
+	long span = (interp == WARP_NEAREST) ? 0 : 1;
+	m_frac[i] = (uint16_t)((fy << REMAP_FRAC_BITS) | fx);
+	if (ix >= 0 && ix + span < w && iy >= 0 && iy + span < h) {
+	  m_offset[i] = (int32_t)(iy * m_src_stride + ix);
+	} else {
+	  cremap_exception e;
+	  e.frac = m_frac[i];
+	  e.skip = (border == WARP_BORDER_TRANSPARENT) && (ix < 0 || ix >= w || iy < 0 || iy >= h);
+	  e.tap[0] = resolve(ix, iy);
+	  e.tap[1] = resolve(ix + span, iy);
+	  e.tap[2] = resolve(ix, iy + span);
+	  e.tap[3] = resolve(ix + span, iy + span);
+	  m_offset[i] = -(int32_t)m_exception.size() - 1;
+	  m_exception.push_back(e);
+	}
+      }
+    }
+  }
+}
+
+template <typename A>
+inline A remap_bilinear(A p00, A p01, A p10, A p11, uint16_t frac)
+{
+  const int32_t fx = frac & (REMAP_FRAC_ONE - 1), fy = frac >> REMAP_FRAC_BITS;
+  A ax = (A)fx / REMAP_FRAC_ONE, ay = (A)fy / REMAP_FRAC_ONE;
+  A top = p00 + (p01 - p00) * ax;
+  A bottom = p10 + (p11 - p10) * ax;
+  return top + (bottom - top) * ay;
+}
+
+inline int32_t remap_bilinear(int32_t p00, int32_t p01, int32_t p10, int32_t p11, uint16_t frac)
+{
+  const int32_t fx = frac & (REMAP_FRAC_ONE - 1), fy = frac >> REMAP_FRAC_BITS;
+  int32_t top = p00 * (REMAP_FRAC_ONE - fx) + p01 * fx;
+  int32_t bottom = p10 * (REMAP_FRAC_ONE - fx) + p11 * fx;
+  return (top * (REMAP_FRAC_ONE - fy) + bottom * fy + (1 << (2*REMAP_FRAC_BITS - 1))) >> (2*REMAP_FRAC_BITS);
+}
+
+inline int64_t remap_bilinear(int64_t p00, int64_t p01, int64_t p10, int64_t p11, uint16_t frac)
+{
+  const int64_t fx = frac & (REMAP_FRAC_ONE - 1), fy = frac >> REMAP_FRAC_BITS;
+  int64_t top = p00 * (REMAP_FRAC_ONE - fx) + p01 * fx;
+  int64_t bottom = p10 * (REMAP_FRAC_ONE - fx) + p11 * fx;
+  return (top * (REMAP_FRAC_ONE - fy) + bottom * fy + ((int64_t)1 << (2*REMAP_FRAC_BITS - 1))) >> (2*REMAP_FRAC_BITS);
+}
+
+// Resample every band of src through the compiled map.  Tiles are the unit
+// of parallel work; within a tile all bands are processed before moving on
+// so that the map entries are read from cache after the first band.
+template <typename T>
+void cremap<T>::apply(cpixmap<T>& dst, const cpixmap<T>& src, T value, const cexecution_policy& policy) const
+{
+  PIXMAP_TRACE("cremap::apply", dst, trace_bytes<T>(dst) * 2, trace_threads(policy));
+  typedef typename warp_traits<T>::acc_type A;
+
+  assert(isCompiled());
+  assert(dst.getWidth() == m_width && dst.getHeight() == m_height);
+  assert(src.getWidth() == m_src_width && src.getHeight() == m_src_height);
+  assert(dst.getBands() == src.getBands());
+  assert(src.getHeight() < 2 || (size_t)(src.getLine(1) - src.getLine(0)) == m_src_stride);
+
+  const size_t tiles = getTiles();
+  const size_t row_step = m_src_stride;
+
+  policy.getExecutor().run(tiles, [&](size_t t) {
+      size_t x0, y0, tw, th, start;
+      getTile(t, x0, y0, tw, th, start);
+      for (size_t z = 0; z < src.getBands(); ++z) {
+	const T *base = src.getImage(z);
+	size_t i = start;
+	for (size_t y = y0; y < y0 + th; ++y) {
+	  T *dstline = dst.getLine(y, z) + x0;
+	  for (size_t x = 0; x < tw; ++x, ++i) {
+	    int32_t off = m_offset[i];
+	    if (off >= 0) {
+	      const T *p = base + off;
+	      if (m_interp == WARP_NEAREST) dstline[x] = *p;
+	      else dstline[x] = warp_saturate<T>(remap_bilinear((A)p[0], (A)p[1], (A)p[row_step], (A)p[row_step + 1], m_frac[i]));
+	    } else {
+	      const cremap_exception& e = m_exception[-off - 1];
+	      if (e.skip) continue;
+	      A p[4];
+	      for (int k = 0; k < 4; ++k) p[k] = (e.tap[k] < 0) ? (A)value : (A)base[e.tap[k]];
+	      if (m_interp == WARP_NEAREST) dstline[x] = (T)p[0];
+	      else dstline[x] = warp_saturate<T>(remap_bilinear(p[0], p[1], p[2], p[3], e.frac));
+	    }
+	  }
+	}
+      }
+    });
+}
+
+template <typename T>
+bool cremap<T>::save(std::ostream& stream) const
+{
+  const char magic[8] = { 'C', 'R', 'E', 'M', 'A', 'P', '0', '1' };
+  uint64_t header[11] = {
+    sizeof(T), m_width, m_height, m_src_width, m_src_height, m_src_stride,
+    m_tile_width, m_tile_height, (uint64_t)m_interp, (uint64_t)m_border, m_exception.size()
+  };
+
+  stream.write(magic, sizeof(magic));
+  stream.write(reinterpret_cast<const char *>(header), sizeof(header));
+  stream.write(reinterpret_cast<const char *>(m_offset.data()), m_offset.size() * sizeof(int32_t));
+  stream.write(reinterpret_cast<const char *>(m_frac.data()), m_frac.size() * sizeof(uint16_t));
+  stream.write(reinterpret_cast<const char *>(m_exception.data()), m_exception.size() * sizeof(cremap_exception));
+  return stream.good();
+}
+
+template <typename T>
+bool cremap<T>::load(std::istream& stream)
+{
+  char magic[8];
+  uint64_t header[11];
+
+  stream.read(magic, sizeof(magic));
+  stream.read(reinterpret_cast<char *>(header), sizeof(header));
+  m_width = m_height = 0;
+  if (!stream.good() || std::memcmp(magic, "CREMAP01", 8) != 0 || header[0] != sizeof(T))
+    return false;
+
+  // the tables must fit in what is left of the stream, where it can tell
+  const uint64_t pixels = header[1], exceptions = header[10];
+  uint64_t left = std::numeric_limits<uint64_t>::max();
+  const std::streampos here = stream.tellg();
+  if (here != std::streampos(-1) && stream.seekg(0, std::ios::end)) {
+    left = (uint64_t)(stream.tellg() - here);
+    stream.seekg(here);
+  }
+  if (pixels && header[2] > left / pixels / (sizeof(int32_t) + sizeof(uint16_t))) return false;
+  if (exceptions > left / sizeof(cremap_exception) || exceptions > pixels * header[2]) return false;
+  if (header[8] > WARP_BILINEAR || header[9] > WARP_BORDER_TRANSPARENT) return false;
+
+  m_src_width = header[3], m_src_height = header[4], m_src_stride = header[5];
+  m_tile_width = header[6], m_tile_height = header[7];
+  m_interp = (WARP_INTERPOLATION)header[8], m_border = (WARP_BORDER)header[9];
+  m_offset.resize(header[1] * header[2]);
+  m_frac.resize(header[1] * header[2]);
+  m_exception.resize(exceptions);
+  stream.read(reinterpret_cast<char *>(m_offset.data()), m_offset.size() * sizeof(int32_t));
+  stream.read(reinterpret_cast<char *>(m_frac.data()), m_frac.size() * sizeof(uint16_t));
+  stream.read(reinterpret_cast<char *>(m_exception.data()), m_exception.size() * sizeof(cremap_exception));
+  if (!stream.good()) return false;
+  m_width = header[1], m_height = header[2];
+  if (!checkMap()) {
+    m_width = m_height = 0;
+    return false;
+  }
+  return true;
+}
+
+// every tap apply() reads lies inside a source of the compiled geometry
+template <typename T>
+bool cremap<T>::checkMap(void) const
+{
+  if (m_tile_width == 0 || m_tile_height == 0 || m_src_width == 0 || m_src_height == 0) return false;
+  if (m_src_stride < m_src_width || m_src_stride > (size_t)std::numeric_limits<int32_t>::max() / m_src_height)
+    return false;
+  const size_t size = m_src_stride * m_src_height;
+  const size_t reach = (m_interp == WARP_NEAREST) ? 0 : m_src_stride + 1; // of the last tap
+  for (size_t i = 0; i < m_offset.size(); ++i) {
+    const int32_t off = m_offset[i];
+    if (off >= 0 ? (size_t)off + reach >= size : (size_t)-(int64_t)off - 1 >= m_exception.size()) return false;
+  }
+  for (size_t i = 0; i < m_exception.size(); ++i)
+    for (int k = 0; k < 4; ++k)
+      if (m_exception[i].tap[k] >= 0 && (size_t)m_exception[i].tap[k] >= size) return false;
+  return true;
+}
+
+template <typename T>
+bool cremap<T>::save(std::string filename) const
+{
+  std::ofstream file(filename.c_str(), std::ofstream::binary);
+
+  if (!file.good() || !save(file)) return false;
+  file.close();
+  return !file.fail();
+}
+
+template <typename T>
+bool cremap<T>::load(std::string filename)
+{
+  std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+
+  m_width = m_height = 0;
+  return file.good() && load(file);
+}
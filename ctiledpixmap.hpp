@@ -0,0 +1,397 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include <cpixmap.hpp>
+#include <cexecutor.hpp>
+#include <cmemory.hpp>
+
+// Pixmap stored as square tiles of tile x tile pixels (a power of two),
+// each tile contiguous with rows of tile pixels.  Tiles run left to right,
+// top to bottom, band after band; the tiles on the right and bottom edges
+// are allocated in full, so every tile has the same size and the image is
+// padded up to a multiple of the tile.  A 2D neighbourhood, a column or a
+// transposition then touches a few pages instead of one per row.
+//
+// The linear cpixmap stays the exchange format: convertToTiled() and
+// convertFromTiled() move whole tile rows with memcpy, and the tile-wise
+// kernels below work on ctile views.
+
+// one tile: (x, y) is its top left pixel in the image, width x height the
+// part inside the image, stride the distance between rows in pixels
+template <typename T>
+struct ctile {
+  size_t x, y, z;
+  size_t width, height;
+  size_t stride;
+  T *data;
+  T& operator()(size_t ty, size_t tx) const { return data[ty * stride + tx]; }
+  T *getLine(size_t ty) const { return data + ty * stride; }
+};
+
+template <typename T> class ctile_iterator;
+
+template <typename T>
+class ctiledpixmap : public cregion<size_t> {
+public:
+  typedef ctile_iterator<T> iterator;
+
+  explicit ctiledpixmap(size_t tile = 64);
+  ctiledpixmap(size_t w, size_t h, size_t b = 1, size_t tile = 64,
+	       const cmemory_policy& memory = cmemory_policy());
+  ctiledpixmap(const ctiledpixmap& pixmap);
+  virtual ~ctiledpixmap(void);
+
+  void setResolution(size_t w, size_t h, size_t b = 1);
+  size_t getTileSize(void) const { return m_tile; }
+  size_t getTilesX(void) const { return m_tiles_x; }
+  size_t getTilesY(void) const { return m_tiles_y; }
+  size_t getTileCount(void) const { return m_bands * m_tiles_y * m_tiles_x; }
+  T *getTile(size_t tx, size_t ty, size_t z = 0) const
+  {
+    return (T *)(m_buffer + ((z * m_tiles_y + ty) * m_tiles_x + tx) * m_tile_bytes);
+  }
+  ctile<T> getTileView(size_t tx, size_t ty, size_t z = 0) const;
+  // the i-th tile in iteration order
+  ctile<T> getTileView(size_t i) const;
+  iterator begin(void) const;
+  iterator end(void) const;
+
+  T& getPixel(size_t x, size_t y, size_t z = 0) const
+  {
+    return getTile(x >> m_shift, y >> m_shift, z)[((y & m_mask) << m_shift) | (x & m_mask)];
+  }
+  void putPixel(T val, size_t x, size_t y, size_t z = 0) { getPixel(x, y, z) = val; }
+  T& operator() (size_t z, size_t y, size_t x) { return getPixel(x, y, z); }
+  T& operator() (size_t y, size_t x) { return getPixel(x, y, 0); }
+
+  void readHLine(T *line, size_t len, size_t x, size_t y, size_t z = 0) const;
+  void readVLine(T *line, size_t len, size_t x, size_t y, size_t z = 0) const;
+  void writeHLine(const T *line, size_t len, size_t x, size_t y, size_t z = 0);
+
+  bool isMatched(const ctiledpixmap& pixmap) const
+  {
+    return cregion::isMatched(static_cast<const cregion&>(pixmap)) && m_tile == pixmap.m_tile;
+  }
+  bool isMatched(size_t w, size_t h, size_t b) const { return m_width == w && m_height == h && m_bands == b; }
+
+private:
+  void reallocate(void);
+
+  size_t m_tile, m_shift, m_mask;
+  size_t m_tiles_x, m_tiles_y;
+  size_t m_tile_bytes;
+  uint8_t *m_buffer;
+  cmemory_mapping m_mapping;
+  cmemory_policy m_memory;
+
+  ctiledpixmap& operator=(const ctiledpixmap&);
+};
+
+template <typename T>
+class ctile_iterator {
+public:
+  ctile_iterator(const ctiledpixmap<T> *pixmap, size_t index) : m_pixmap(pixmap), m_index(index) {}
+  ctile<T> operator*(void) const { return m_pixmap->getTileView(m_index); }
+  ctile_iterator& operator++(void) { ++m_index; return *this; }
+  bool operator==(const ctile_iterator& it) const { return m_index == it.m_index; }
+  bool operator!=(const ctile_iterator& it) const { return m_index != it.m_index; }
+private:
+  const ctiledpixmap<T> *m_pixmap;
+  size_t m_index;
+};
+
+template <typename T>
+ctiledpixmap<T>::ctiledpixmap(size_t tile)
+  : m_tile(tile), m_shift(0), m_mask(tile - 1), m_tiles_x(0), m_tiles_y(0), m_tile_bytes(0), m_buffer(NULL)
+{
+  assert(tile > 0 && (tile & (tile - 1)) == 0);
+  while (((size_t)1 << m_shift) < tile) ++m_shift;
+}
+
+template <typename T>
+ctiledpixmap<T>::ctiledpixmap(size_t w, size_t h, size_t b, size_t tile, const cmemory_policy& memory)
+  : cregion(w, h, b), m_tile(tile), m_shift(0), m_mask(tile - 1), m_tiles_x(0), m_tiles_y(0),
+    m_tile_bytes(0), m_buffer(NULL), m_memory(memory)
+{
+  assert(tile > 0 && (tile & (tile - 1)) == 0);
+  while (((size_t)1 << m_shift) < tile) ++m_shift;
+  reallocate();
+}
+
+// copies the dimensions, the tile size and the memory policy, not the
+// pixels, as cpixmap does
+template <typename T>
+ctiledpixmap<T>::ctiledpixmap(const ctiledpixmap& pixmap)
+  : cregion(pixmap.getWidth(), pixmap.getHeight(), pixmap.getBands()), m_tile(pixmap.m_tile),
+    m_shift(pixmap.m_shift), m_mask(pixmap.m_mask), m_tiles_x(0), m_tiles_y(0), m_tile_bytes(0),
+    m_buffer(NULL), m_memory(pixmap.m_memory)
+{
+  reallocate();
+}
+
+template <typename T>
+ctiledpixmap<T>::~ctiledpixmap(void)
+{
+  freeMemory(m_buffer, m_mapping);
+  m_buffer = NULL;
+}
+
+template <typename T>
+void ctiledpixmap<T>::setResolution(size_t w, size_t h, size_t b)
+{
+  cregion::setResolution(w, h, b);
+  reallocate();
+}
+
+template <typename T>
+void ctiledpixmap<T>::reallocate(void)
+{
+  m_tiles_x = (m_width + m_mask) >> m_shift;
+  m_tiles_y = (m_height + m_mask) >> m_shift;
+  m_tile_bytes = (m_tile * m_tile * sizeof(T) + 7) & ~(size_t)7;
+  freeMemory(m_buffer, m_mapping);
+  m_buffer = allocateMemory(m_bands * m_tiles_y * m_tiles_x * m_tile_bytes, m_memory, m_mapping);
+  assert(m_buffer);
+}
+
+template <typename T>
+ctile<T> ctiledpixmap<T>::getTileView(size_t tx, size_t ty, size_t z) const
+{
+  assert(tx < m_tiles_x && ty < m_tiles_y && z < m_bands);
+  ctile<T> tile;
+  tile.x = tx << m_shift;
+  tile.y = ty << m_shift;
+  tile.z = z;
+  tile.width = std::min(m_tile, m_width - tile.x);
+  tile.height = std::min(m_tile, m_height - tile.y);
+  tile.stride = m_tile;
+  tile.data = getTile(tx, ty, z);
+  return tile;
+}
+
+template <typename T>
+ctile<T> ctiledpixmap<T>::getTileView(size_t i) const
+{
+  const size_t per_band = m_tiles_x * m_tiles_y;
+  return getTileView((i % per_band) % m_tiles_x, (i % per_band) / m_tiles_x, i / per_band);
+}
+
+template <typename T>
+ctile_iterator<T> ctiledpixmap<T>::begin(void) const { return iterator(this, 0); }
+
+template <typename T>
+ctile_iterator<T> ctiledpixmap<T>::end(void) const { return iterator(this, getTileCount()); }
+
+// as cpixmap::readHLine, one memcpy per tile crossed
+template <typename T>
+void ctiledpixmap<T>::readHLine(T *line, size_t len, size_t x, size_t y, size_t z) const
+{
+  assert(cregion::include(x, y, z));
+  len = std::min(len, m_width - x);
+  const T *row = getTile(0, y >> m_shift, z) + ((y & m_mask) << m_shift);
+  const size_t row_step = m_tile_bytes / sizeof(T);
+  while (len > 0) {
+    const size_t n = std::min(len, m_tile - (x & m_mask));
+    std::memcpy(line, row + (x >> m_shift) * row_step + (x & m_mask), n * sizeof(T));
+    line += n, x += n, len -= n;
+  }
+}
+
+template <typename T>
+void ctiledpixmap<T>::writeHLine(const T *line, size_t len, size_t x, size_t y, size_t z)
+{
+  assert(cregion::include(x, y, z));
+  len = std::min(len, m_width - x);
+  T *row = getTile(0, y >> m_shift, z) + ((y & m_mask) << m_shift);
+  const size_t row_step = m_tile_bytes / sizeof(T);
+  while (len > 0) {
+    const size_t n = std::min(len, m_tile - (x & m_mask));
+    std::memcpy(row + (x >> m_shift) * row_step + (x & m_mask), line, n * sizeof(T));
+    line += n, x += n, len -= n;
+  }
+}
+
+// a column stays inside one tile for tile pixels, tile * sizeof(T) apart
+template <typename T>
+void ctiledpixmap<T>::readVLine(T *line, size_t len, size_t x, size_t y, size_t z) const
+{
+  assert(cregion::include(x, y, z));
+  len = std::min(len, m_height - y);
+  while (len > 0) {
+    const size_t n = std::min(len, m_tile - (y & m_mask));
+    const T *p = getTile(x >> m_shift, y >> m_shift, z) + ((y & m_mask) << m_shift) + (x & m_mask);
+    for (size_t i = 0; i < n; ++i) line[i] = p[i << m_shift];
+    line += n, y += n, len -= n;
+  }
+}
+
+// Run body(tile) for every tile, the tiles being the tasks of policy.
+template <typename T, typename Body>
+void forEachTile(const ctiledpixmap<T>& img, const Body& body,
+		 const cexecution_policy& policy = cexecution_policy())
+{
+  policy.getExecutor().run(img.getTileCount(), [&](size_t i) {
+      ctile<T> tile = img.getTileView(i);
+      body(tile);
+    });
+}
+
+template <typename T>
+void convertToTiled(ctiledpixmap<T>& dst, const cpixmap<T>& src,
+		    const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("convertToTiled", src, trace_bytes<T>(src) * 2, trace_threads(policy));
+  if (!dst.isMatched(src.getWidth(), src.getHeight(), src.getBands()))
+    dst.setResolution(src.getWidth(), src.getHeight(), src.getBands());
+
+  const size_t tile = dst.getTileSize();
+  forEachStrip(policy, dst.getBands(), dst.getTilesY(), [&](size_t z, size_t ty0, size_t ty1) {
+      for (size_t y = ty0 * tile; y < std::min(ty1 * tile, src.getHeight()); ++y)
+	dst.writeHLine(src.getLine(y, z), src.getWidth(), 0, y, z);
+    });
+}
+
+template <typename T>
+void convertFromTiled(cpixmap<T>& dst, const ctiledpixmap<T>& src,
+		      const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("convertFromTiled", src, trace_bytes<T>(src) * 2, trace_threads(policy));
+  if (!dst.isMatched(src.getWidth(), src.getHeight(), src.getBands()))
+    dst.setResolution(src.getWidth(), src.getHeight(), src.getBands());
+
+  const size_t tile = src.getTileSize();
+  forEachStrip(policy, src.getBands(), src.getTilesY(), [&](size_t z, size_t ty0, size_t ty1) {
+      for (size_t y = ty0 * tile; y < std::min(ty1 * tile, src.getHeight()); ++y)
+	src.readHLine(dst.getLine(y, z), src.getWidth(), 0, y, z);
+    });
+}
+
+// dst = src^T band by band; tile (tx, ty) of src becomes tile (ty, tx) of
+// dst, so both sides are read and written one tile at a time
+template <typename T>
+void transposeTiled(ctiledpixmap<T>& dst, const ctiledpixmap<T>& src,
+		    const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("transposeTiled", src, trace_bytes<T>(src) * 2, trace_threads(policy));
+  assert(&dst != &src);
+  assert(dst.getTileSize() == src.getTileSize());
+  if (!dst.isMatched(src.getHeight(), src.getWidth(), src.getBands()))
+    dst.setResolution(src.getHeight(), src.getWidth(), src.getBands());
+
+  const size_t tile = src.getTileSize();
+  forEachTile(src, [&](const ctile<T>& s) {
+      T *d = dst.getTile(s.y / tile, s.x / tile, s.z);
+      for (size_t y = 0; y < s.height; ++y)
+	for (size_t x = 0; x < s.width; ++x) d[x * tile + y] = s(y, x);
+    }, policy);
+}
+
+// Neighbourhood kernels tile by tile.  For every tile of dst, op(window,
+// out) gets window, the matching block of src grown by radius pixels on
+// each side (zero outside the image, window(radius, radius) being the
+// first pixel of the tile), and out, the tile of dst.  The window is
+// gathered once per tile into a buffer of the worker thread.
+template <typename U, typename T, typename Op>
+void forEachTileWindow(ctiledpixmap<U>& dst, const ctiledpixmap<T>& src, size_t radius, const Op& op,
+		       const cexecution_policy& policy = cexecution_policy())
+{
+  if (!dst.isMatched(src.getWidth(), src.getHeight(), src.getBands()))
+    dst.setResolution(src.getWidth(), src.getHeight(), src.getBands());
+
+  const long width = (long)src.getWidth(), height = (long)src.getHeight();
+  const long r = (long)radius;
+  forEachTile(dst, [&](const ctile<U>& out) {
+      const size_t stride = out.width + 2 * radius, rows = out.height + 2 * radius;
+      static thread_local std::vector<T> storage;
+      storage.assign(stride * rows, T());
+      const long x0 = (long)out.x - r, x1 = std::min((long)(out.x + out.width) + r, width);
+      const long xs = std::max(x0, 0L);
+      for (size_t j = 0; j < rows; ++j) {
+	const long y = (long)out.y - r + (long)j;
+	if (y < 0 || y >= height || x1 <= xs) continue;
+	src.readHLine(&storage[j * stride + (xs - x0)], x1 - xs, xs, y, out.z);
+      }
+      ctile<const T> window; // (x, y) of out, radius pixels inside the window
+      window.x = out.x;
+      window.y = out.y;
+      window.z = out.z;
+      window.width = stride;
+      window.height = rows;
+      window.stride = stride;
+      window.data = &storage[0];
+      op(window, out);
+    }, policy);
+}
+
+// One tile of convolve(): window holds the source around out with the
+// margins of forEachTileWindow for the given kernel.
+template <typename T>
+void convolve_tile(const ctile<const T>& window, const ctile<T>& out, const cpixmap<int>& kernel,
+		   int rshift, int offset)
+{
+  const size_t kw = kernel.getWidth(), kh = kernel.getHeight();
+  const size_t radius = std::max(kw, kh) >> 1;
+  // taps run from -(kw-1)/2 to kw/2 as in convolve()
+  const size_t left = radius - ((kw - 1) >> 1), up = radius - ((kh - 1) >> 1);
+  const int minval = std::numeric_limits<T>::lowest();
+  const int maxval = std::numeric_limits<T>::max();
+  const bool do_scale = (rshift != 0) || (offset != 0);
+
+  std::vector<int> sum(out.width);
+  for (size_t y = 0; y < out.height; ++y) {
+    std::fill(sum.begin(), sum.end(), 0);
+    for (size_t j = 0; j < kh; ++j) {
+      const int *kline = kernel.getLine(j, 0);
+      const T *wline = window.getLine(y + up + j) + left;
+      for (size_t i = 0; i < kw; ++i) {
+	const int k = kline[i];
+	for (size_t x = 0; x < out.width; ++x) sum[x] += k * (int)wline[x + i];
+      }
+    }
+    T *dstline = out.getLine(y);
+    for (size_t x = 0; x < out.width; ++x) {
+      int s = sum[x];
+      if (do_scale) s = (s >> rshift) + offset;
+      dstline[x] = (T)std::min(std::max(s, minval), maxval);
+    }
+  }
+}
+
+// convolve() on the tiled layout, with the same integer arithmetic,
+// zero-extended borders and rounding
+template <typename T>
+void convolveTiled(ctiledpixmap<T>& dst, const ctiledpixmap<T>& src, const cpixmap<int>& kernel,
+		   int rshift = 0, int offset = 0, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("convolveTiled", src, trace_bytes<T>(src) * 2, trace_threads(policy));
+  assert(&dst != &src);
+  assert(std::numeric_limits<T>::is_integer);
+  assert(std::numeric_limits<T>::digits < std::numeric_limits<int>::digits);
+
+  const size_t radius = std::max(kernel.getWidth(), kernel.getHeight()) >> 1;
+  forEachTileWindow(dst, src, radius, [&](const ctile<const T>& window, const ctile<T>& out) {
+      convolve_tile(window, out, kernel, rshift, offset);
+    }, policy);
+}
@@ -0,0 +1,301 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// Timing of the public pixmap operations.  Built with CPIXMAP_TRACE
+// defined, every operation opens a PIXMAP_TRACE scope that records its
+// duration, the bytes it touches, the image dimensions and its thread
+// count; without it the macro expands to nothing and its arguments are
+// never evaluated.  Records go to a buffer of the calling thread, so
+// tracing takes no shared lock.  They are aggregated into per-operation
+// log2 histograms (getTraceStats, dumpTraceStats) and kept as events for
+// the Chrome trace viewer (writeTraceJSON), up to a capacity per thread.
+// A scope costs about two clock reads plus 50 ns, so operations on
+// frames above some 10^5 pixels see well under 1%; setTraceEnabled(false)
+// leaves a single relaxed load.
+//
+//   PIXMAP_TRACE("flipVertically", *this, bytes, threads);
+
+enum { TRACE_BUCKETS = 40 }; // bucket i counts durations in [2^i, 2^(i+1)) ns
+
+struct ctrace_event {
+  const char *name;
+  uint64_t start; // ns since the tracer was created
+  uint64_t duration;
+  uint32_t width, height, bands, threads;
+  uint64_t bytes;
+};
+
+struct ctrace_stats {
+  std::string name;
+  uint64_t count;
+  uint64_t total; // ns
+  uint64_t min, max;
+  uint64_t bytes;
+  uint64_t histogram[TRACE_BUCKETS];
+
+  ctrace_stats(void) : count(0), total(0), min(~(uint64_t)0), max(0), bytes(0)
+  {
+    std::fill(histogram, histogram + TRACE_BUCKETS, 0);
+  }
+  void add(uint64_t duration, uint64_t nbytes)
+  {
+    ++count;
+    total += duration;
+    min = std::min(min, duration);
+    max = std::max(max, duration);
+    bytes += nbytes;
+    const size_t bucket = 63 - __builtin_clzll(duration | 1);
+    ++histogram[std::min<size_t>(bucket, TRACE_BUCKETS - 1)];
+  }
+  void merge(const ctrace_stats& s)
+  {
+    count += s.count;
+    total += s.total;
+    min = std::min(min, s.min);
+    max = std::max(max, s.max);
+    bytes += s.bytes;
+    for (size_t i = 0; i < TRACE_BUCKETS; ++i) histogram[i] += s.histogram[i];
+  }
+  // upper bound in ns of the bucket holding the p-th fraction of the calls
+  uint64_t percentile(double p) const
+  {
+    const uint64_t rank = (uint64_t)(p * count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < TRACE_BUCKETS; ++i) {
+      seen += histogram[i];
+      if (seen > rank) return std::min(max, ((uint64_t)2 << i) - 1);
+    }
+    return max;
+  }
+};
+
+class ctracer {
+public:
+  static ctracer& instance(void)
+  {
+    static ctracer tracer;
+    return tracer;
+  }
+
+  bool isEnabled(void) const { return m_enabled.load(std::memory_order_relaxed); }
+  void setEnabled(bool enabled) { m_enabled.store(enabled, std::memory_order_relaxed); }
+  void setCapacity(size_t events) { m_capacity.store(events, std::memory_order_relaxed); }
+
+  uint64_t now(void) const
+  {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+									 m_origin).count();
+  }
+
+  void record(const ctrace_event& event)
+  {
+    cbuffer& buffer = local();
+    std::lock_guard<std::mutex> lock(buffer.mutex); // only contended while reporting
+    size_t i = 0;
+    while (i < buffer.stats.size() && buffer.names[i] != event.name) ++i;
+    if (i == buffer.stats.size()) {
+      buffer.names.push_back(event.name);
+      buffer.stats.push_back(ctrace_stats());
+      buffer.stats.back().name = event.name;
+    }
+    buffer.stats[i].add(event.duration, event.bytes);
+    if (buffer.events.size() < m_capacity.load(std::memory_order_relaxed)) buffer.events.push_back(event);
+    else ++buffer.dropped;
+  }
+
+  std::vector<ctrace_stats> getStats(void)
+  {
+    std::vector<ctrace_stats> all;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (std::list<std::unique_ptr<cbuffer> >::iterator b = m_buffers.begin(); b != m_buffers.end(); ++b) {
+      std::lock_guard<std::mutex> block((*b)->mutex);
+      for (size_t i = 0; i < (*b)->stats.size(); ++i) {
+	size_t j = 0;
+	while (j < all.size() && all[j].name != (*b)->stats[i].name) ++j;
+	if (j == all.size()) all.push_back((*b)->stats[i]);
+	else all[j].merge((*b)->stats[i]);
+      }
+    }
+    std::sort(all.begin(), all.end(), [](const ctrace_stats& a, const ctrace_stats& b) { return a.total > b.total; });
+    return all;
+  }
+
+  // events as Chrome trace-event JSON (chrome://tracing, Perfetto)
+  void writeJSON(std::ostream& stream)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    stream << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    size_t tid = 0, dropped = 0;
+    char text[512];
+    for (std::list<std::unique_ptr<cbuffer> >::iterator b = m_buffers.begin(); b != m_buffers.end(); ++b, ++tid) {
+      std::lock_guard<std::mutex> block((*b)->mutex);
+      dropped += (*b)->dropped;
+      for (size_t i = 0; i < (*b)->events.size(); ++i) {
+	const ctrace_event& e = (*b)->events[i];
+	std::snprintf(text, sizeof(text),
+		      "%s\n{\"name\":\"%s\",\"cat\":\"cpixmap\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,"
+		      "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"width\":%u,\"height\":%u,\"bands\":%u,"
+		      "\"bytes\":%llu,\"threads\":%u}}", first ? "" : ",", e.name, tid, e.start * 1e-3,
+		      e.duration * 1e-3, e.width, e.height, e.bands, (unsigned long long)e.bytes, e.threads);
+	stream << text;
+	first = false;
+      }
+    }
+    stream << "\n],\"otherData\":{\"dropped_events\":" << dropped << "}}\n";
+  }
+
+  void clear(void)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (std::list<std::unique_ptr<cbuffer> >::iterator b = m_buffers.begin(); b != m_buffers.end(); ++b) {
+      std::lock_guard<std::mutex> block((*b)->mutex);
+      (*b)->names.clear();
+      (*b)->stats.clear();
+      (*b)->events.clear();
+      (*b)->dropped = 0;
+    }
+  }
+
+private:
+  // one per thread, owned by the tracer so that it outlives the thread
+  struct cbuffer {
+    std::mutex mutex;
+    std::vector<const char *> names; // op names as passed, parallel to stats
+    std::vector<ctrace_stats> stats;
+    std::vector<ctrace_event> events;
+    size_t dropped;
+    cbuffer(void) : dropped(0) {}
+  };
+
+  ctracer(void) : m_enabled(true), m_capacity(1 << 16), m_origin(std::chrono::steady_clock::now()) {}
+
+  cbuffer& local(void)
+  {
+    static thread_local cbuffer *buffer = NULL;
+    if (!buffer) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_buffers.push_back(std::unique_ptr<cbuffer>(new cbuffer));
+      buffer = m_buffers.back().get();
+    }
+    return *buffer;
+  }
+
+  std::atomic<bool> m_enabled;
+  std::atomic<size_t> m_capacity;
+  std::chrono::steady_clock::time_point m_origin;
+  std::mutex m_mutex;
+  std::list<std::unique_ptr<cbuffer> > m_buffers;
+};
+
+class ctrace_scope {
+public:
+  template <typename R>
+  ctrace_scope(const char *name, const R& region, uint64_t bytes, size_t threads)
+    : m_active(ctracer::instance().isEnabled())
+  {
+    if (!m_active) return;
+    m_event.name = name;
+    m_event.width = (uint32_t)region.getWidth();
+    m_event.height = (uint32_t)region.getHeight();
+    m_event.bands = (uint32_t)region.getBands();
+    m_event.threads = (uint32_t)threads;
+    m_event.bytes = bytes;
+    m_event.start = ctracer::instance().now();
+  }
+  ~ctrace_scope(void)
+  {
+    if (!m_active) return;
+    m_event.duration = ctracer::instance().now() - m_event.start;
+    ctracer::instance().record(m_event);
+  }
+
+private:
+  bool m_active;
+  ctrace_event m_event;
+
+  ctrace_scope(const ctrace_scope&);
+  ctrace_scope& operator=(const ctrace_scope&);
+};
+
+// bytes of a w x h x b image of T, for the bytes argument
+template <typename T, typename R>
+inline uint64_t trace_bytes(const R& region)
+{
+  return (uint64_t)region.getWidth() * region.getHeight() * region.getBands() * sizeof(T);
+}
+
+// threads running the tasks of a cexecution_policy
+template <typename P>
+inline size_t trace_threads(const P& policy)
+{
+  return policy.getExecutor().getConcurrency();
+}
+
+#if defined(CPIXMAP_TRACE)
+# define PIXMAP_TRACE_CONCAT_(a, b) a##b
+# define PIXMAP_TRACE_CONCAT(a, b) PIXMAP_TRACE_CONCAT_(a, b)
+# define PIXMAP_TRACE(name, region, bytes, threads)			\
+  ctrace_scope PIXMAP_TRACE_CONCAT(pixmap_trace_, __LINE__)((name), (region), (bytes), (threads))
+#else
+# define PIXMAP_TRACE(name, region, bytes, threads) ((void)0)
+#endif
+
+inline void setTraceEnabled(bool enabled) { ctracer::instance().setEnabled(enabled); }
+inline bool isTraceEnabled(void) { return ctracer::instance().isEnabled(); }
+inline void setTraceCapacity(size_t events) { ctracer::instance().setCapacity(events); }
+inline void clearTrace(void) { ctracer::instance().clear(); }
+inline std::vector<ctrace_stats> getTraceStats(void) { return ctracer::instance().getStats(); }
+
+inline void dumpTraceStats(std::ostream& stream)
+{
+  std::vector<ctrace_stats> stats = getTraceStats();
+  char text[256];
+  std::snprintf(text, sizeof(text), "%-28s %10s %12s %10s %10s %10s %10s %10s\n", "operation", "calls",
+		"total ms", "mean us", "min us", "p50 us", "p99 us", "GB/s");
+  stream << text;
+  for (size_t i = 0; i < stats.size(); ++i) {
+    const ctrace_stats& s = stats[i];
+    std::snprintf(text, sizeof(text), "%-28s %10llu %12.3f %10.2f %10.2f %10.2f %10.2f %10.3f\n", s.name.c_str(),
+		  (unsigned long long)s.count, s.total * 1e-6, (double)s.total / s.count * 1e-3, s.min * 1e-3,
+		  s.percentile(0.5) * 1e-3, s.percentile(0.99) * 1e-3, s.total ? (double)s.bytes / s.total : 0.0);
+    stream << text;
+  }
+}
+
+inline void writeTraceJSON(std::ostream& stream) { ctracer::instance().writeJSON(stream); }
+
+inline void writeTraceJSON(std::string filename)
+{
+  std::ofstream file(filename.c_str());
+  writeTraceJSON(file);
+}
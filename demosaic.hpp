@@ -0,0 +1,195 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include <cpixmap.hpp>
+
+// colour of the top-left 2x2 cell, read row by row
+enum BAYER_PATTERN {
+  BAYER_RGGB = 0,
+  BAYER_BGGR = 1,
+  BAYER_GRBG = 2,
+  BAYER_GBRG = 3
+};
+
+enum DEMOSAIC_METHOD {
+  DEMOSAIC_BILINEAR = 0,
+  DEMOSAIC_MALVAR = 1 // Malvar-He-Cutler gradient-corrected 5x5
+};
+
+template <typename T> struct demosaic_traits { typedef int32_t acc_type; };
+template <> struct demosaic_traits<int32_t> { typedef int64_t acc_type; };
+template <> struct demosaic_traits<uint32_t> { typedef int64_t acc_type; };
+template <> struct demosaic_traits<int64_t> { typedef double acc_type; };
+template <> struct demosaic_traits<uint64_t> { typedef double acc_type; };
+template <> struct demosaic_traits<float> { typedef float acc_type; };
+template <> struct demosaic_traits<double> { typedef double acc_type; };
+
+template <typename A> inline A demosaic_descale(A v) { return v / (A)16; }
+inline int32_t demosaic_descale(int32_t v) { return (v + 8) >> 4; }
+inline int64_t demosaic_descale(int64_t v) { return (v + 8) >> 4; }
+
+template <typename T, typename A>
+inline T demosaic_saturate(A v)
+{
+  v = demosaic_descale(v);
+  if (std::numeric_limits<T>::is_integer) {
+    if (!std::numeric_limits<A>::is_integer) v = std::floor(v + (A)0.5);
+    if (v < (A)std::numeric_limits<T>::lowest()) return std::numeric_limits<T>::lowest();
+    if (v > (A)std::numeric_limits<T>::max()) return std::numeric_limits<T>::max();
+  }
+  return (T)v;
+}
+
+// Interpolation kernels on a 5-line window l[0..4] centred on l[2][i], all
+// scaled by 16.  "horizontal" estimates a colour whose samples sit left and
+// right of the centre, "vertical" above and below, "diagonal" on the corners.
+template <typename A, typename T>
+struct demosaic_kernels {
+  static A cross(const T *const *l, long i, bool malvar)
+  {
+    A n = (A)l[1][i] + (A)l[3][i] + (A)l[2][i-1] + (A)l[2][i+1];
+    if (!malvar) return (A)4*n;
+    A far = (A)l[0][i] + (A)l[4][i] + (A)l[2][i-2] + (A)l[2][i+2];
+    return (A)8*(A)l[2][i] + (A)4*n - (A)2*far;
+  }
+  static A horizontal(const T *const *l, long i, bool malvar)
+  {
+    A n = (A)l[2][i-1] + (A)l[2][i+1];
+    if (!malvar) return (A)8*n;
+    A diag = (A)l[1][i-1] + (A)l[1][i+1] + (A)l[3][i-1] + (A)l[3][i+1];
+    return (A)10*(A)l[2][i] + (A)8*n - (A)2*((A)l[2][i-2] + (A)l[2][i+2]) - (A)2*diag
+      + (A)l[0][i] + (A)l[4][i];
+  }
+  static A vertical(const T *const *l, long i, bool malvar)
+  {
+    A n = (A)l[1][i] + (A)l[3][i];
+    if (!malvar) return (A)8*n;
+    A diag = (A)l[1][i-1] + (A)l[1][i+1] + (A)l[3][i-1] + (A)l[3][i+1];
+    return (A)10*(A)l[2][i] + (A)8*n - (A)2*((A)l[0][i] + (A)l[4][i]) - (A)2*diag
+      + (A)l[2][i-2] + (A)l[2][i+2];
+  }
+  static A diagonal(const T *const *l, long i, bool malvar)
+  {
+    A diag = (A)l[1][i-1] + (A)l[1][i+1] + (A)l[3][i-1] + (A)l[3][i+1];
+    if (!malvar) return (A)4*diag;
+    A far = (A)l[0][i] + (A)l[4][i] + (A)l[2][i-2] + (A)l[2][i+2];
+    return (A)12*(A)l[2][i] + (A)4*diag - (A)3*far;
+  }
+};
+
+// copy raw row y into a line padded by two mirrored samples on each side;
+// mirroring without repeating the edge keeps the CFA phase intact
+template <typename T>
+inline void demosaic_load(T *line, const cpixmap<T>& raw, long y, size_t z)
+{
+  const long w = raw.getWidth(), h = raw.getHeight();
+  if (h > 1) {
+    if (y < 0) y = -y;
+    if (y >= h) y = 2*h - 2 - y;
+    y = std::min(std::max(y, 0L), h - 1);
+  } else {
+    y = 0;
+  }
+  const T *src = raw.getLine(y, z);
+  std::memcpy(line + 2, src, w * sizeof(T));
+  for (long k = 1; k <= 2; ++k) {
+    line[2 - k] = src[std::min(k, w - 1)];
+    line[w + 1 + k] = src[std::max(w - 1 - k, 0L)];
+  }
+}
+
+// Bayer mosaic (band z of raw) to BGR planes.  Each strip of output rows of
+// the policy streams through a rolling window of five padded lines, so the
+// mosaic is read once and no full-frame temporary is made.
+template <typename T>
+void demosaicBayer(cpixmap<T>& rgb, const cpixmap<T>& raw, BAYER_PATTERN pattern,
+		   DEMOSAIC_METHOD method = DEMOSAIC_MALVAR, size_t z = 0,
+		   const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("demosaicBayer", raw, (uint64_t)raw.getWidth() * raw.getHeight() * sizeof(T) * 4, trace_threads(policy));
+  typedef typename demosaic_traits<T>::acc_type A;
+  typedef demosaic_kernels<A, T> K;
+
+  if (!rgb.isMatched(raw.getWidth(), raw.getHeight(), cpixmap<T>::RGB_BANDS))
+    rgb.setResolution(raw.getWidth(), raw.getHeight(), cpixmap<T>::RGB_BANDS);
+
+  // position of red inside the 2x2 cell
+  const long rx = (pattern == BAYER_GRBG || pattern == BAYER_BGGR) ? 1 : 0;
+  const long ry = (pattern == BAYER_GBRG || pattern == BAYER_BGGR) ? 1 : 0;
+  const bool malvar = (method == DEMOSAIC_MALVAR);
+  const long width = raw.getWidth();
+  const size_t stride = width + 4;
+
+  forEachStrip(policy, 1, raw.getHeight(), [&](size_t, size_t first, size_t last) {
+      std::vector<T> storage(5 * stride);
+      const T *l[5];
+      T *slot[5];
+      const long y0 = (long)first, y1 = (long)last;
+
+      for (int k = 0; k < 5; ++k) {
+	slot[k] = &storage[k * stride];
+	demosaic_load(slot[k], raw, y0 - 2 + k, z);
+      }
+
+      for (long y = y0; y < y1; ++y) {
+	if (y > y0) { // rotate the window by one line
+	  T *oldest = slot[0];
+	  for (int k = 0; k < 4; ++k) slot[k] = slot[k+1];
+	  slot[4] = oldest;
+	  demosaic_load(slot[4], raw, y + 2, z);
+	}
+	for (int k = 0; k < 5; ++k) l[k] = slot[k];
+
+	T *bl = rgb.getLine(y, cpixmap<T>::BLUE_BAND);
+	T *gl = rgb.getLine(y, cpixmap<T>::GREEN_BAND);
+	T *rl = rgb.getLine(y, cpixmap<T>::RED_BAND);
+	const bool red_row = ((y & 1) == ry);
+
+	for (long x = 0; x < width; ++x) {
+	  const long i = x + 2;
+	  const bool red_col = ((x & 1) == rx);
+	  const T c = l[2][i];
+	  if (red_row && red_col) {        // R site
+	    rl[x] = c;
+	    gl[x] = demosaic_saturate<T>(K::cross(l, i, malvar));
+	    bl[x] = demosaic_saturate<T>(K::diagonal(l, i, malvar));
+	  } else if (!red_row && !red_col) { // B site
+	    bl[x] = c;
+	    gl[x] = demosaic_saturate<T>(K::cross(l, i, malvar));
+	    rl[x] = demosaic_saturate<T>(K::diagonal(l, i, malvar));
+	  } else if (red_row) {            // G between reds
+	    gl[x] = c;
+	    rl[x] = demosaic_saturate<T>(K::horizontal(l, i, malvar));
+	    bl[x] = demosaic_saturate<T>(K::vertical(l, i, malvar));
+	  } else {                         // G between blues
+	    gl[x] = c;
+	    rl[x] = demosaic_saturate<T>(K::vertical(l, i, malvar));
+	    bl[x] = demosaic_saturate<T>(K::horizontal(l, i, malvar));
+	  }
+	}
+      }
+    });
+}
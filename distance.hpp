@@ -0,0 +1,262 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include <cpixmap.hpp>
+#include <cbitmap.hpp>
+#include <cexecutor.hpp>
+
+// Distance of every pixel to the nearest feature pixel (nonzero pixel of
+// a cpixmap, set pixel of a cbitmap), band by band.
+//
+// The Euclidean and city-block transforms are exact and separable.  The
+// first pass finds the nearest feature of every column, sweeping down and
+// up the rows over blocks of columns in parallel.  The second pass works
+// on rows in parallel: for the Euclidean distance it takes the lower
+// envelope of the parabolas (x - q)^2 + g(q)^2 of the column distances g
+// (Felzenszwalb and Huttenlocher), for the city-block distance two sweeps
+// along the row.  Both are linear in the pixels.  The chamfer transform is
+// the classical 3-4 two-pass raster scan, an approximation within 8% of
+// the Euclidean distance; its passes run in sequence, bands in parallel.
+//
+// Pixels of a band without features get infinity, and NO_FEATURE in the
+// nearest-feature map, whose entries are y * width + x of the feature.
+
+enum DISTANCE_METRIC {
+  DISTANCE_EUCLIDEAN = 0,
+  DISTANCE_CITYBLOCK = 1,
+  DISTANCE_CHAMFER = 2 // 3-4 weights
+};
+
+const uint32_t NO_FEATURE = ~(uint32_t)0;
+
+enum { DISTANCE_COLUMNS = 256 }; // columns per task of the column pass
+
+// rows[y][x] = row of the nearest feature of column x, for the columns
+// [x0, x1); ties go to the feature above
+template <typename R>
+void distance_columns(cpixmap<uint32_t>& rows, R mask, size_t z, size_t x0, size_t x1)
+{
+  const size_t height = rows.getHeight();
+  for (size_t y = 0; y < height; ++y) {
+    mask.setLine(y, z);
+    uint32_t *line = rows.getLine(y, z);
+    const uint32_t *up = y ? rows.getLine(y - 1, z) : NULL;
+    for (size_t x = x0; x < x1; ++x) line[x] = mask(x) ? (uint32_t)y : (up ? up[x] : NO_FEATURE);
+  }
+  for (size_t y = height - 1; y-- > 0;) {
+    uint32_t *line = rows.getLine(y, z);
+    const uint32_t *down = rows.getLine(y + 1, z);
+    for (size_t x = x0; x < x1; ++x)
+      if (down[x] != NO_FEATURE && (line[x] == NO_FEATURE || down[x] - y < y - line[x])) line[x] = down[x];
+  }
+}
+
+// Lower envelope of the parabolas of one row: site[k] is the column of
+// the k-th, f[k] its squared column distance and num[k] / den[k] the
+// abscissa where it starts to be the lowest.  Breakpoints are compared
+// by cross-multiplication, exact in 64 bits up to 2^20 pixels a side.
+struct distance_envelope {
+  std::vector<int64_t> site, f, num, den;
+};
+
+// one row of the Euclidean transform from the nearest features of its
+// columns
+inline void distance_euclidean_row(float *dst, uint32_t *nearest, const uint32_t *rows, size_t y, size_t width,
+				   distance_envelope& e)
+{
+  e.site.resize(width);
+  e.f.resize(width);
+  e.num.resize(width);
+  e.den.resize(width);
+  long k = -1;
+  for (size_t x = 0; x < width; ++x) {
+    if (rows[x] == NO_FEATURE) continue;
+    const int64_t q = (int64_t)x, g = (int64_t)y - rows[x], fq = g * g;
+    int64_t num = 0, den = 1;
+    while (k >= 0) {
+      // where parabola q gets below parabola site[k]
+      num = fq + q * q - e.f[k] - e.site[k] * e.site[k];
+      den = 2 * (q - e.site[k]);
+      if (k == 0 || num * e.den[k] > e.num[k] * den) break;
+      --k;
+    }
+    ++k;
+    e.site[k] = q;
+    e.f[k] = fq;
+    e.num[k] = num;
+    e.den[k] = den;
+  }
+  if (k < 0) {
+    std::fill(dst, dst + width, std::numeric_limits<float>::infinity());
+    if (nearest) std::fill(nearest, nearest + width, NO_FEATURE);
+    return;
+  }
+  long j = 0;
+  for (size_t x = 0; x < width; ++x) {
+    while (j < k && e.num[j + 1] < (int64_t)x * e.den[j + 1]) ++j;
+    const int64_t dx = (int64_t)x - e.site[j];
+    dst[x] = std::sqrt((float)(dx * dx + e.f[j]));
+    if (nearest) nearest[x] = rows[e.site[j]] * (uint32_t)width + (uint32_t)e.site[j];
+  }
+}
+
+// one row of the city-block transform: the column distances relaxed by
+// one per step, left to right and back; sites holds the column of the
+// nearest feature
+inline void distance_cityblock_row(float *dst, uint32_t *nearest, const uint32_t *rows, size_t y, size_t width,
+				   std::vector<size_t>& sites)
+{
+  const uint64_t none = std::numeric_limits<uint64_t>::max();
+  uint64_t best = none;
+  size_t site = 0;
+  sites.resize(width);
+  for (size_t pass = 0; pass < 2; ++pass) {
+    best = none;
+    for (size_t i = 0; i < width; ++i) {
+      const size_t x = pass ? width - 1 - i : i;
+      if (best != none) ++best;
+      if (rows[x] != NO_FEATURE) {
+	const uint64_t d = (y > rows[x]) ? y - rows[x] : rows[x] - y;
+	if (d <= best) best = d, site = x;
+      }
+      if (pass == 0) {
+	dst[x] = (best == none) ? std::numeric_limits<float>::infinity() : (float)best;
+	sites[x] = site;
+      } else if (best != none && (float)best < dst[x]) {
+	dst[x] = (float)best;
+	sites[x] = site;
+      }
+    }
+  }
+  if (nearest)
+    for (size_t x = 0; x < width; ++x)
+      nearest[x] = (dst[x] == std::numeric_limits<float>::infinity()) ? NO_FEATURE :
+	rows[sites[x]] * (uint32_t)width + (uint32_t)sites[x];
+}
+
+// 3-4 chamfer of band z: a forward pass over the upper and left
+// neighbours, a backward one over the lower and right, in units of 3
+template <typename R>
+void distance_chamfer(cpixmap<float>& dst, cpixmap<uint32_t>& index, R mask, size_t z)
+{
+  const size_t width = dst.getWidth(), height = dst.getHeight();
+  const uint32_t none = std::numeric_limits<uint32_t>::max();
+  cpixmap<uint32_t> cost(width, height, 1);
+  for (size_t y = 0; y < height; ++y) {
+    mask.setLine(y, z);
+    uint32_t *c = cost.getLine(y), *n = index.getLine(y, z);
+    for (size_t x = 0; x < width; ++x) {
+      c[x] = mask(x) ? 0 : none;
+      n[x] = mask(x) ? (uint32_t)(y * width + x) : NO_FEATURE;
+    }
+  }
+  for (size_t pass = 0; pass < 2; ++pass)
+    for (size_t i = 0; i < height; ++i) {
+      const size_t y = pass ? height - 1 - i : i;
+      const long dy = pass ? 1 : -1;
+      const bool has_row = pass ? y + 1 < height : y > 0;
+      uint32_t *c = cost.getLine(y), *n = index.getLine(y, z);
+      const uint32_t *cr = has_row ? cost.getLine(y + dy) : NULL, *nr = has_row ? index.getLine(y + dy, z) : NULL;
+      for (size_t j = 0; j < width; ++j) {
+	const size_t x = pass ? width - 1 - j : j;
+	const bool has_prev = pass ? x + 1 < width : x > 0;
+	const size_t xp = pass ? x + 1 : x - 1, xn = pass ? x - 1 : x + 1;
+	const bool has_next = pass ? x > 0 : x + 1 < width;
+	uint32_t best = c[x], site = n[x];
+	// (neighbour cost, its feature) pairs: previous pixel of the row, then
+	// the three of the row already done
+	if (has_prev && c[xp] != none && c[xp] + 3 < best) best = c[xp] + 3, site = n[xp];
+	if (cr) {
+	  if (cr[x] != none && cr[x] + 3 < best) best = cr[x] + 3, site = nr[x];
+	  if (has_prev && cr[xp] != none && cr[xp] + 4 < best) best = cr[xp] + 4, site = nr[xp];
+	  if (has_next && cr[xn] != none && cr[xn] + 4 < best) best = cr[xn] + 4, site = nr[xn];
+	}
+	c[x] = best;
+	n[x] = site;
+      }
+    }
+  for (size_t y = 0; y < height; ++y) {
+    const uint32_t *c = cost.getLine(y);
+    float *d = dst.getLine(y, z);
+    for (size_t x = 0; x < width; ++x)
+      d[x] = (c[x] == none) ? std::numeric_limits<float>::infinity() : (float)c[x] / 3.0f;
+  }
+}
+
+template <typename R>
+void distance_transform(cpixmap<float>& dst, const R& mask, size_t width, size_t height, size_t bands,
+			DISTANCE_METRIC metric, cpixmap<uint32_t> *nearest, const cexecution_policy& policy)
+{
+  if (!dst.isMatched(width, height, bands)) dst.setResolution(width, height, bands);
+  if (nearest && !nearest->isMatched(width, height, bands)) nearest->setResolution(width, height, bands);
+  if (width == 0 || height == 0 || bands == 0) return;
+  cexecutor& executor = policy.getExecutor();
+
+  if (metric == DISTANCE_CHAMFER) {
+    cpixmap<uint32_t> scratch;
+    if (!nearest) scratch.setResolution(width, height, bands);
+    cpixmap<uint32_t>& index = nearest ? *nearest : scratch;
+    executor.run(bands, [&](size_t z) { distance_chamfer(dst, index, mask, z); });
+    return;
+  }
+
+  cpixmap<uint32_t> rows(width, height, bands);
+  const size_t blocks = (width + DISTANCE_COLUMNS - 1) / DISTANCE_COLUMNS;
+  executor.run(bands * blocks, [&](size_t t) {
+      const size_t z = t / blocks, x0 = (t % blocks) * DISTANCE_COLUMNS;
+      distance_columns(rows, mask, z, x0, std::min(x0 + DISTANCE_COLUMNS, width));
+    });
+  forEachStrip(policy, bands, height, [&](size_t z, size_t y0, size_t y1) {
+      distance_envelope envelope;
+      std::vector<size_t> sites;
+      for (size_t y = y0; y < y1; ++y) {
+	uint32_t *n = nearest ? nearest->getLine(y, z) : NULL;
+	if (metric == DISTANCE_EUCLIDEAN)
+	  distance_euclidean_row(dst.getLine(y, z), n, rows.getLine(y, z), y, width, envelope);
+	else distance_cityblock_row(dst.getLine(y, z), n, rows.getLine(y, z), y, width, sites);
+      }
+    });
+}
+
+// dst = distance of each pixel to the nearest nonzero pixel of its band of
+// src; nearest, when given, receives y * width + x of that pixel
+template <typename T>
+void distanceTransform(cpixmap<float>& dst, const cpixmap<T>& src, DISTANCE_METRIC metric = DISTANCE_EUCLIDEAN,
+		       cpixmap<uint32_t> *nearest = NULL, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("distanceTransform", src, trace_bytes<T>(src) + trace_bytes<uint32_t>(src) * 3 +
+	       trace_bytes<float>(src), trace_threads(policy));
+  distance_transform(dst, mask_pixmap_reader<T>(src), src.getWidth(), src.getHeight(), src.getBands(), metric,
+		     nearest, policy);
+}
+
+inline void distanceTransform(cpixmap<float>& dst, const cbitmap& src, DISTANCE_METRIC metric = DISTANCE_EUCLIDEAN,
+			      cpixmap<uint32_t> *nearest = NULL, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("distanceTransform", src, trace_bytes<uint32_t>(src) * 3 + trace_bytes<float>(src),
+	       trace_threads(policy));
+  distance_transform(dst, mask_bitmap_reader(src), src.getWidth(), src.getHeight(), src.getBands(), metric,
+		     nearest, policy);
+}
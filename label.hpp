@@ -0,0 +1,247 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include <cpixmap.hpp>
+#include <cbitmap.hpp>
+#include <cexecutor.hpp>
+
+// Connected-component labelling of a one-band mask (nonzero pixels of a
+// cpixmap, set pixels of a cbitmap).  The rows are cut into strips that
+// are scanned in parallel, each with a union-find over labels of its own
+// and the sums of the blob statistics per label.  The strips are then
+// joined along their seams in one pass over the boundary rows, and a
+// second parallel pass rewrites the labels.  Components are numbered from
+// 1 in raster order of their first pixel; background is 0.
+
+enum PIXMAP_CONNECTIVITY {
+  CONNECT_4 = 4,
+  CONNECT_8 = 8
+};
+
+struct ccomponent {
+  uint32_t label;
+  size_t area;
+  cregion<size_t> bbox; // origin and size
+  double cx, cy; // centroid
+  double mu20, mu11, mu02; // second central moments, per pixel
+};
+
+// running sums of one label
+struct component_sums {
+  uint64_t area;
+  size_t x0, y0, x1, y1; // bounds, inclusive
+  uint64_t sx, sy, sxx, sxy, syy;
+
+  component_sums(void)
+    : area(0), x0(~(size_t)0), y0(~(size_t)0), x1(0), y1(0), sx(0), sy(0), sxx(0), sxy(0), syy(0) {}
+  // pixels [xa, xb) of row y
+  void addRun(size_t xa, size_t xb, size_t y)
+  {
+    const uint64_t n = xb - xa;
+    const uint64_t s1 = (uint64_t)(xa + xb - 1) * n / 2; // sum of x
+    const uint64_t s2 = (sumOfSquares(xb) - sumOfSquares(xa)); // sum of x^2
+    area += n;
+    x0 = std::min(x0, xa); x1 = std::max(x1, xb - 1);
+    y0 = std::min(y0, y); y1 = std::max(y1, y);
+    sx += s1; sy += n * y;
+    sxx += s2; sxy += s1 * y; syy += n * y * y;
+  }
+  // sum of x^2 for x < n
+  static uint64_t sumOfSquares(uint64_t n) { return n ? (n - 1) * n * (2 * n - 1) / 6 : 0; }
+  void merge(const component_sums& s)
+  {
+    area += s.area;
+    x0 = std::min(x0, s.x0); x1 = std::max(x1, s.x1);
+    y0 = std::min(y0, s.y0); y1 = std::max(y1, s.y1);
+    sx += s.sx; sy += s.sy;
+    sxx += s.sxx; sxy += s.sxy; syy += s.syy;
+  }
+};
+
+// Roots are the smallest label of their set, so that numbering the roots
+// in order gives the raster order of the components.
+inline uint32_t component_find(std::vector<uint32_t>& parent, uint32_t a)
+{
+  uint32_t root = a;
+  while (parent[root] != root) root = parent[root];
+  while (parent[a] != root) {
+    const uint32_t next = parent[a];
+    parent[a] = root;
+    a = next;
+  }
+  return root;
+}
+
+inline uint32_t component_union(std::vector<uint32_t>& parent, uint32_t a, uint32_t b)
+{
+  a = component_find(parent, a);
+  b = component_find(parent, b);
+  if (a < b) parent[b] = a;
+  else parent[a] = b;
+  return std::min(a, b);
+}
+
+// Scan of rows [y0, y1) with labels local to the strip, by runs of set
+// pixels: a run takes the label of the runs above it that it touches,
+// joining them when there are several, and adds its pixels to the sums
+// in closed form.  The row above y0 is not looked at.
+template <typename S>
+void component_scan(cpixmap<uint32_t>& labels, S source, size_t y0, size_t y1, bool eight,
+		    std::vector<uint32_t>& parent, std::vector<component_sums>& sums)
+{
+  const size_t width = labels.getWidth();
+  parent.assign(1, 0);
+  sums.assign(1, component_sums());
+  for (size_t y = y0; y < y1; ++y) {
+    source.setLine(y);
+    uint32_t *line = labels.getLine(y);
+    const uint32_t *up = (y > y0) ? labels.getLine(y - 1) : NULL;
+    size_t x = 0;
+    while (x < width) {
+      if (!source(x)) {
+	line[x++] = 0;
+	continue;
+      }
+      const size_t xs = x;
+      while (x < width && source(x)) ++x;
+      // run [xs, x); the pixels above it, widened by one for 8-connectivity
+      uint32_t label = 0;
+      if (up) {
+	const size_t ua = (eight && xs) ? xs - 1 : xs, ub = (eight && x < width) ? x + 1 : x;
+	for (size_t u = ua; u < ub; ++u)
+	  if (up[u] && up[u] != label) label = label ? component_union(parent, label, up[u]) : up[u];
+      }
+      if (!label) {
+	label = (uint32_t)parent.size();
+	parent.push_back(label);
+	sums.push_back(component_sums());
+      }
+      std::fill(line + xs, line + x, label);
+      sums[label].addRun(xs, x, y);
+    }
+  }
+}
+
+template <typename S>
+size_t component_label(cpixmap<uint32_t>& labels, const S& source, size_t width, size_t height,
+		       PIXMAP_CONNECTIVITY connectivity, std::vector<ccomponent> *components,
+		       const cexecution_policy& policy)
+{
+  if (!labels.isMatched(width, height, 1))
+    labels.setResolution(width, height, 1);
+  if (components) components->clear();
+  if (width == 0 || height == 0) return 0;
+  const bool eight = connectivity == CONNECT_8;
+
+  cexecutor& executor = policy.getExecutor();
+  size_t grain = policy.getGrain();
+  if (grain == 0) grain = std::max<size_t>(1, (height + 4 * executor.getConcurrency() - 1) /
+					   (4 * executor.getConcurrency()));
+  grain = std::min(grain, height);
+  const size_t strips = (height + grain - 1) / grain;
+
+  std::vector<std::vector<uint32_t> > parents(strips);
+  std::vector<std::vector<component_sums> > sums(strips);
+  executor.run(strips, [&](size_t s) {
+      component_scan(labels, source, s * grain, std::min((s + 1) * grain, height), eight, parents[s], sums[s]);
+    });
+
+  // global label of local label l of strip s: base[s] + l
+  std::vector<size_t> base(strips + 1, 0);
+  for (size_t s = 0; s < strips; ++s) base[s + 1] = base[s] + parents[s].size() - 1;
+  std::vector<uint32_t> parent(base[strips] + 1, 0);
+  for (size_t s = 0; s < strips; ++s)
+    for (size_t l = 1; l < parents[s].size(); ++l)
+      parent[base[s] + l] = (uint32_t)(base[s] + component_find(parents[s], (uint32_t)l));
+
+  // seams
+  for (size_t s = 1; s < strips; ++s) {
+    const uint32_t *line = labels.getLine(s * grain), *up = labels.getLine(s * grain - 1);
+    for (size_t x = 0; x < width; ++x) {
+      if (!line[x]) continue;
+      const uint32_t a = (uint32_t)(base[s] + line[x]);
+      const size_t xa = (eight && x) ? x - 1 : x, xb = (eight && x + 1 < width) ? x + 1 : x;
+      for (size_t u = xa; u <= xb; ++u)
+	if (up[u]) component_union(parent, a, (uint32_t)(base[s - 1] + up[u]));
+    }
+  }
+
+  std::vector<uint32_t> number(parent.size(), 0);
+  uint32_t count = 0;
+  for (size_t g = 1; g < parent.size(); ++g) {
+    const uint32_t root = component_find(parent, (uint32_t)g);
+    number[g] = (root == g) ? ++count : number[root];
+  }
+
+  executor.run(strips, [&](size_t s) {
+      for (size_t y = s * grain; y < std::min((s + 1) * grain, height); ++y) {
+	uint32_t *line = labels.getLine(y);
+	for (size_t x = 0; x < width; ++x)
+	  if (line[x]) line[x] = number[base[s] + line[x]];
+      }
+    });
+
+  if (components) {
+    std::vector<component_sums> total(count + 1);
+    for (size_t s = 0; s < strips; ++s)
+      for (size_t l = 1; l < sums[s].size(); ++l) total[number[base[s] + l]].merge(sums[s][l]);
+    components->resize(count);
+    for (uint32_t i = 1; i <= count; ++i) {
+      const component_sums& t = total[i];
+      ccomponent& c = (*components)[i - 1];
+      const double n = (double)t.area;
+      c.label = i;
+      c.area = (size_t)t.area;
+      c.bbox = cregion<size_t>(t.x0, t.y0, t.x1 - t.x0 + 1, t.y1 - t.y0 + 1);
+      c.cx = t.sx / n;
+      c.cy = t.sy / n;
+      c.mu20 = t.sxx / n - c.cx * c.cx;
+      c.mu11 = t.sxy / n - c.cx * c.cy;
+      c.mu02 = t.syy / n - c.cy * c.cy;
+    }
+  }
+  return count;
+}
+
+// labels = components of the nonzero pixels of src, which must have one
+// band; returns their count and, with components, their statistics
+template <typename T>
+size_t labelComponents(cpixmap<uint32_t>& labels, const cpixmap<T>& src,
+		       PIXMAP_CONNECTIVITY connectivity = CONNECT_8, std::vector<ccomponent> *components = NULL,
+		       const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("labelComponents", src, trace_bytes<T>(src) + trace_bytes<uint32_t>(src) * 3, trace_threads(policy));
+  assert(src.getBands() == 1);
+  return component_label(labels, mask_pixmap_reader<T>(src), src.getWidth(),
+			 src.getHeight(), connectivity, components, policy);
+}
+
+inline size_t labelComponents(cpixmap<uint32_t>& labels, const cbitmap& src,
+			      PIXMAP_CONNECTIVITY connectivity = CONNECT_8, std::vector<ccomponent> *components = NULL,
+			      const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("labelComponents", src, trace_bytes<uint32_t>(src) * 3, trace_threads(policy));
+  assert(src.getBands() == 1);
+  return component_label(labels, mask_bitmap_reader(src), src.getWidth(), src.getHeight(), connectivity,
+			 components, policy);
+}
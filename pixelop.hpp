@@ -0,0 +1,226 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <utility>
+#include <type_traits>
+
+#include <cpixmap.hpp>
+#include <cexecutor.hpp>
+#include <simd.hpp>
+
+// Point operations written once for every pixel type and SIMD level.  An
+// operation is a functor whose operator() is a template over its operand
+// type and updates its first argument, e.g.
+//
+//   struct pixel_lshift {
+//     int bits;
+//     template <typename V> SIMD_INLINE void operator()(V& a) const { a = (V)(a << bits); }
+//   };
+//
+// (operands go by reference so that wide vectors never cross a call
+// boundary of a function built for a narrower ABI)
+//
+// forEachVector calls it with whole GCC vectors of the dispatched width
+// over the body of a line and with plain pixels over the remaining tail,
+// so nothing is read or written past the end of a row.  forEachRow runs a
+// line operation over every (band, row-strip) of a pixmap as one task
+// space of the given execution policy, picking the SIMD level once.
+
+template <typename T, SIMD_LEVEL L>
+struct simd_traits {
+  typedef simd_vector<T, simd_width<L>::bytes> vec;
+  typedef typename vec::type vector_type;
+  enum { lanes = vec::lanes };
+};
+
+// The same lane count with elements of U: V itself when V is a plain pixel,
+// otherwise a vector of sizeof(U) * lanes bytes.
+template <typename V, typename U, bool scalar = std::is_arithmetic<V>::value>
+struct simd_rebind { typedef U type; };
+
+template <typename V, typename U>
+struct simd_rebind<V, U, false> {
+  typedef typename std::remove_reference<decltype(std::declval<V>()[0])>::type elem_type;
+  typedef U type __attribute__((vector_size(sizeof(V) / sizeof(elem_type) * sizeof(U))));
+};
+
+// lane-wise value conversion (truncating towards zero for float to integer)
+template <typename VU, typename V>
+SIMD_INLINE void simd_convert(VU& dst, const V& src, std::true_type) { dst = (VU)src; }
+
+template <typename VU, typename V>
+SIMD_INLINE void simd_convert(VU& dst, const V& src, std::false_type) { dst = __builtin_convertvector(src, VU); }
+
+template <typename VU, typename V>
+SIMD_INLINE void simd_convert(VU& dst, const V& src)
+{
+  simd_convert(dst, src, std::integral_constant<bool, std::is_arithmetic<V>::value>());
+}
+
+template <SIMD_LEVEL L, typename T, typename Op>
+SIMD_INLINE void forEachVector(T *dst, const T *src, size_t n, const Op& op)
+{
+  typedef simd_traits<T, L> VT;
+  typedef typename VT::vector_type V;
+  size_t x = 0;
+  for (; x + VT::lanes <= n; x += VT::lanes) {
+    V a;
+    simd_load(a, &src[x]);
+    op(a);
+    simd_store(&dst[x], a);
+  }
+  for (; x < n; ++x) {
+    T a = src[x];
+    op(a);
+    dst[x] = a;
+  }
+}
+
+template <SIMD_LEVEL L, typename T, typename Op>
+SIMD_INLINE void forEachVector(T *dst, const T *src1, const T *src2, size_t n, const Op& op)
+{
+  typedef simd_traits<T, L> VT;
+  typedef typename VT::vector_type V;
+  size_t x = 0;
+  for (; x + VT::lanes <= n; x += VT::lanes) {
+    V a, b;
+    simd_load(a, &src1[x]);
+    simd_load(b, &src2[x]);
+    op(a, b);
+    simd_store(&dst[x], a);
+  }
+  for (; x < n; ++x) {
+    T a = src1[x];
+    op(a, src2[x]);
+    dst[x] = a;
+  }
+}
+
+// dst = op(dst, src) across pixel types, e.g. accumulating into a wider
+// type; lanes are counted on the wider of the two
+template <SIMD_LEVEL L, typename D, typename S, typename Op>
+SIMD_INLINE void forEachVectorUpdate(D *dst, const S *src, size_t n, const Op& op)
+{
+  typedef simd_traits<typename std::conditional<(sizeof(D) >= sizeof(S)), D, S>::type, L> VT;
+  typedef typename simd_rebind<typename VT::vector_type, D>::type DV;
+  typedef typename simd_rebind<typename VT::vector_type, S>::type SV;
+  size_t x = 0;
+  for (; x + VT::lanes <= n; x += VT::lanes) {
+    DV a;
+    SV b;
+    simd_load(a, &dst[x]);
+    simd_load(b, &src[x]);
+    op(a, b);
+    simd_store(&dst[x], a);
+  }
+  for (; x < n; ++x) op(dst[x], src[x]);
+}
+
+template <typename Op>
+struct pixel_unary_kernel {
+  template <SIMD_LEVEL L, typename T>
+  static SIMD_INLINE void run(T *dst, const T *src, size_t n, const Op *op)
+  {
+    forEachVector<L>(dst, src, n, *op);
+  }
+};
+
+template <typename Op>
+struct pixel_binary_kernel {
+  template <SIMD_LEVEL L, typename T>
+  static SIMD_INLINE void run(T *dst, const T *src1, const T *src2, size_t n, const Op *op)
+  {
+    forEachVector<L>(dst, src1, src2, n, *op);
+  }
+};
+
+template <typename Op>
+struct pixel_update_kernel {
+  template <SIMD_LEVEL L, typename D, typename S>
+  static SIMD_INLINE void run(D *dst, const S *src, size_t n, const Op *op)
+  {
+    forEachVectorUpdate<L>(dst, src, n, *op);
+  }
+};
+
+// img = op(img)
+template <typename T, typename Op>
+void forEachRow(cpixmap<T>& img, const Op& op, const cexecution_policy& policy = cexecution_policy())
+{
+  const SIMD_LEVEL level = getSimdLevel();
+  const size_t width = img.getWidth();
+  forEachStrip(policy, img.getBands(), img.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	T *line = img.getLine(y, z);
+	simdDispatchLevel<pixel_unary_kernel<Op> >(level, line, (const T *)line, width, &op);
+      }
+    });
+}
+
+// dst = op(src); dst is resized to match src when needed and may be src
+template <typename T, typename Op>
+void forEachRow(cpixmap<T>& dst, const cpixmap<T>& src, const Op& op,
+		const cexecution_policy& policy = cexecution_policy())
+{
+  if (!dst.isMatched(src.getWidth(), src.getHeight(), src.getBands()))
+    dst.setResolution(src.getWidth(), src.getHeight(), src.getBands());
+
+  const SIMD_LEVEL level = getSimdLevel();
+  const size_t width = src.getWidth();
+  forEachStrip(policy, src.getBands(), src.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y)
+	simdDispatchLevel<pixel_unary_kernel<Op> >(level, dst.getLine(y, z), (const T *)src.getLine(y, z),
+						   width, &op);
+    });
+}
+
+// dst = op(src1, src2); the sources must agree in size, dst may be either
+template <typename T, typename Op>
+void forEachRow(cpixmap<T>& dst, const cpixmap<T>& src1, const cpixmap<T>& src2, const Op& op,
+		const cexecution_policy& policy = cexecution_policy())
+{
+  assert(src1.isMatched(src2.getWidth(), src2.getHeight(), src2.getBands()));
+  if (!dst.isMatched(src1.getWidth(), src1.getHeight(), src1.getBands()))
+    dst.setResolution(src1.getWidth(), src1.getHeight(), src1.getBands());
+
+  const SIMD_LEVEL level = getSimdLevel();
+  const size_t width = src1.getWidth();
+  forEachStrip(policy, src1.getBands(), src1.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y)
+	simdDispatchLevel<pixel_binary_kernel<Op> >(level, dst.getLine(y, z), (const T *)src1.getLine(y, z),
+						    (const T *)src2.getLine(y, z), width, &op);
+    });
+}
+
+// dst = op(dst, src) with dst of another pixel type; sizes must agree
+template <typename D, typename S, typename Op>
+void forEachRowUpdate(cpixmap<D>& dst, const cpixmap<S>& src, const Op& op,
+		      const cexecution_policy& policy = cexecution_policy())
+{
+  assert(dst.isMatched(src.getWidth(), src.getHeight(), src.getBands()));
+
+  const SIMD_LEVEL level = getSimdLevel();
+  const size_t width = src.getWidth();
+  forEachStrip(policy, src.getBands(), src.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y)
+	simdDispatchLevel<pixel_update_kernel<Op> >(level, dst.getLine(y, z), (const S *)src.getLine(y, z),
+						    width, &op);
+    });
+}
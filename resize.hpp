@@ -0,0 +1,383 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#include <algorithm>
+
+#include <cpixmap.hpp>
+
+enum RESAMPLE_FILTER {
+  RESAMPLE_NEAREST = 0,
+  RESAMPLE_BILINEAR = 1,
+  RESAMPLE_BICUBIC = 2,
+  RESAMPLE_LANCZOS3 = 3,
+  RESAMPLE_AREA = 4
+};
+
+// Coefficient table for resampling one axis from src_len to dst_len samples.
+// Every output sample reads m_taps consecutive input samples starting at
+// getStart(i); windows that would cross the border are shifted inwards and
+// the outside weights are folded onto the edge sample (clamp-to-edge).
+class cresample_table {
+public:
+  cresample_table(size_t src_len, size_t dst_len, RESAMPLE_FILTER filter, int coef_bits = 0);
+  size_t getSourceLength(void) const { return m_src_len; }
+  size_t getLength(void) const { return m_dst_len; }
+  size_t getTaps(void) const { return m_taps; }
+  int getCoefBits(void) const { return m_coef_bits; }
+  size_t getStart(size_t i) const { return m_start[i]; }
+  const float *getWeights(size_t i, float) const { return &m_fweights[i*m_taps]; }
+  const double *getWeights(size_t i, double) const { return &m_dweights[i*m_taps]; }
+  const int32_t *getWeights(size_t i, int32_t) const { return &m_iweights[i*m_taps]; }
+  const int64_t *getWeights(size_t i, int64_t) const { return &m_lweights[i*m_taps]; }
+
+  // Tables are immutable once built, so a single copy per
+  // (src_len, dst_len, filter, coef_bits) is shared by all callers.
+  static std::shared_ptr<const cresample_table> lookup(size_t src_len, size_t dst_len,
+						       RESAMPLE_FILTER filter, int coef_bits = 0);
+  static void flushCache(void);
+
+private:
+  typedef std::tuple<size_t, size_t, int, int> cache_key;
+  static std::mutex& getCacheLock(void);
+  static std::map<cache_key, std::shared_ptr<const cresample_table> >& getCache(void);
+  static double kernel(RESAMPLE_FILTER filter, double x);
+  static double support(RESAMPLE_FILTER filter);
+  size_t m_src_len;
+  size_t m_dst_len;
+  size_t m_taps;
+  int m_coef_bits;
+  std::vector<size_t> m_start;
+  std::vector<double> m_dweights;
+  std::vector<float> m_fweights;
+  std::vector<int32_t> m_iweights;
+  std::vector<int64_t> m_lweights;
+};
+
+inline double cresample_table::support(RESAMPLE_FILTER filter)
+{
+  switch (filter) {
+  case RESAMPLE_BILINEAR: return 1.0;
+  case RESAMPLE_BICUBIC: return 2.0;
+  case RESAMPLE_LANCZOS3: return 3.0;
+  default: return 0.5;
+  }
+}
+
+inline double cresample_table::kernel(RESAMPLE_FILTER filter, double x)
+{
+  x = std::fabs(x);
+  switch (filter) {
+  case RESAMPLE_BILINEAR:
+    return (x < 1.0) ? 1.0 - x : 0.0;
+  case RESAMPLE_BICUBIC: { // Keys, a = -0.5
+    const double a = -0.5;
+    if (x < 1.0) return ((a + 2.0)*x - (a + 3.0))*x*x + 1.0;
+    if (x < 2.0) return (((x - 5.0)*x + 8.0)*x - 4.0)*a;
+    return 0.0;
+  }
+  case RESAMPLE_LANCZOS3: {
+    if (x < 1e-8) return 1.0;
+    if (x >= 3.0) return 0.0;
+    double px = M_PI * x;
+    return 3.0 * std::sin(px) * std::sin(px / 3.0) / (px * px);
+  }
+  default:
+    return (x < 0.5) ? 1.0 : 0.0;
+  }
+}
+
+inline cresample_table::cresample_table(size_t src_len, size_t dst_len, RESAMPLE_FILTER filter, int coef_bits)
+  : m_src_len(src_len), m_dst_len(dst_len), m_taps(0), m_coef_bits(coef_bits)
+{
+  assert(src_len > 0 && dst_len > 0);
+  assert(coef_bits >= 0 && coef_bits < 31);
+
+  double scale = (double)src_len / (double)dst_len;
+  double fscale = std::max(scale, 1.0);
+  std::vector<double> raw;
+  std::vector<long> left(dst_len);
+  size_t ntaps;
+
+  if (filter == RESAMPLE_NEAREST) {
+    ntaps = 1;
+  } else if (filter == RESAMPLE_AREA) {
+    ntaps = (size_t)std::ceil(scale) + 1;
+  } else {
+    ntaps = (size_t)std::ceil(support(filter) * fscale) * 2 + 1;
+  }
+  raw.assign(dst_len * ntaps, 0.0);
+
+  for (size_t i = 0; i < dst_len; ++i) {
+    double *w = &raw[i*ntaps];
+    if (filter == RESAMPLE_NEAREST) {
+      left[i] = std::min((long)std::floor((i + 0.5) * scale), (long)src_len - 1);
+      w[0] = 1.0;
+    } else if (filter == RESAMPLE_AREA) {
+      // exact coverage of [i*scale, (i+1)*scale) by unit-wide source pixels
+      double x0 = i * scale, x1 = (i + 1) * scale;
+      left[i] = (long)std::floor(x0);
+      for (size_t k = 0; k < ntaps; ++k) {
+	double a = std::max(x0, (double)(left[i] + k));
+	double b = std::min(x1, (double)(left[i] + k + 1));
+	w[k] = (b > a) ? (b - a) : 0.0;
+      }
+    } else {
+      double center = (i + 0.5) * scale - 0.5;
+      left[i] = (long)std::floor(center - support(filter) * fscale) + 1;
+      for (size_t k = 0; k < ntaps; ++k)
+	w[k] = kernel(filter, ((double)(left[i] + k) - center) / fscale);
+    }
+  }
+
+  // fold the window into [0, src_len) and trim it to the taps actually used
+  m_taps = std::min(ntaps, src_len);
+  m_start.resize(dst_len);
+  m_dweights.assign(dst_len * m_taps, 0.0);
+  for (size_t i = 0; i < dst_len; ++i) {
+    long start = std::min(std::max(left[i], 0L), (long)(src_len - m_taps));
+    double sum = 0.0;
+    m_start[i] = start;
+    for (size_t k = 0; k < ntaps; ++k) {
+      long j = std::min(std::max(left[i] + (long)k, 0L), (long)src_len - 1);
+      m_dweights[i*m_taps + (j - start)] += raw[i*ntaps + k];
+      sum += raw[i*ntaps + k];
+    }
+    for (size_t k = 0; k < m_taps; ++k) m_dweights[i*m_taps + k] /= sum;
+  }
+
+  m_fweights.assign(m_dweights.begin(), m_dweights.end());
+
+  if (m_coef_bits > 0) {
+    const int64_t one = (int64_t)1 << m_coef_bits;
+    m_iweights.resize(m_dweights.size());
+    m_lweights.resize(m_dweights.size());
+    for (size_t i = 0; i < dst_len; ++i) {
+      int64_t sum = 0;
+      size_t peak = 0;
+      for (size_t k = 0; k < m_taps; ++k) {
+	int64_t q = (int64_t)std::lround(m_dweights[i*m_taps + k] * one);
+	m_lweights[i*m_taps + k] = q;
+	sum += q;
+	if (std::fabs(m_dweights[i*m_taps + k]) > std::fabs(m_dweights[i*m_taps + peak])) peak = k;
+      }
+      // keep flat regions flat: the quantized weights must sum to exactly one
+      m_lweights[i*m_taps + peak] += one - sum;
+      for (size_t k = 0; k < m_taps; ++k)
+	m_iweights[i*m_taps + k] = (int32_t)m_lweights[i*m_taps + k];
+    }
+  }
+}
+
+inline std::shared_ptr<const cresample_table> cresample_table::lookup(size_t src_len, size_t dst_len,
+								       RESAMPLE_FILTER filter, int coef_bits)
+{
+  cache_key key(src_len, dst_len, (int)filter, coef_bits);
+  std::lock_guard<std::mutex> guard(getCacheLock());
+  std::shared_ptr<const cresample_table>& entry = getCache()[key];
+  if (!entry) entry = std::make_shared<const cresample_table>(src_len, dst_len, filter, coef_bits);
+  return entry;
+}
+
+inline void cresample_table::flushCache(void)
+{
+  std::lock_guard<std::mutex> guard(getCacheLock());
+  getCache().clear();
+}
+
+inline std::mutex& cresample_table::getCacheLock(void)
+{
+  static std::mutex lock;
+  return lock;
+}
+
+inline std::map<cresample_table::cache_key, std::shared_ptr<const cresample_table> >& cresample_table::getCache(void)
+{
+  static std::map<cache_key, std::shared_ptr<const cresample_table> > cache;
+  return cache;
+}
+
+// How each pixel type is carried between the horizontal and vertical passes.
+// 8/16-bit data run in fixed point: coefficients have coef_bits fraction bits
+// and the intermediate rows keep extra_bits of the horizontal result's
+// fraction, sized so that neither pass can overflow its accumulator.  16-bit
+// data need more coefficient precision than an int32 accumulator leaves room
+// for, hence the 64-bit accumulator.
+template <typename T>
+struct resample_traits {
+  typedef double inter_type;
+  typedef double acc_type;
+  static const int coef_bits = 0;
+  static const int extra_bits = 0;
+};
+
+template <>
+struct resample_traits<float> {
+  typedef float inter_type;
+  typedef float acc_type;
+  static const int coef_bits = 0;
+  static const int extra_bits = 0;
+};
+
+template <>
+struct resample_traits<uint8_t> {
+  typedef int32_t inter_type;
+  typedef int32_t acc_type;
+  static const int coef_bits = 14;
+  static const int extra_bits = 6;
+};
+
+template <>
+struct resample_traits<int8_t> : resample_traits<uint8_t> {};
+
+template <>
+struct resample_traits<uint16_t> {
+  typedef int32_t inter_type;
+  typedef int64_t acc_type;
+  static const int coef_bits = 20;
+  static const int extra_bits = 6;
+};
+
+template <>
+struct resample_traits<int16_t> : resample_traits<uint16_t> {};
+
+// drop the fixed-point fraction with round-half-up; no-op for floating point
+template <typename A>
+inline A resample_descale(A v, int) { return v; }
+inline int32_t resample_descale(int32_t v, int shift) { return (shift > 0) ? (v + (1 << (shift-1))) >> shift : v; }
+inline int64_t resample_descale(int64_t v, int shift) { return (shift > 0) ? (v + ((int64_t)1 << (shift-1))) >> shift : v; }
+
+template <typename T, typename A>
+inline T resample_saturate(A v, int shift)
+{
+  v = resample_descale(v, shift);
+  if (std::numeric_limits<T>::is_integer) {
+    if (!std::numeric_limits<A>::is_integer) v = std::floor(v + (A)0.5);
+    if (v < (A)std::numeric_limits<T>::lowest()) return std::numeric_limits<T>::lowest();
+    if (v > (A)std::numeric_limits<T>::max()) return std::numeric_limits<T>::max();
+  }
+  return (T)v;
+}
+
+template <typename T>
+void resampleHLine(typename resample_traits<T>::inter_type *dst, const T *src, const cresample_table& table)
+{
+  typedef typename resample_traits<T>::inter_type I;
+  typedef typename resample_traits<T>::acc_type A;
+  const int shift = resample_traits<T>::coef_bits - resample_traits<T>::extra_bits;
+  const size_t taps = table.getTaps();
+
+  for (size_t x = 0; x < table.getLength(); ++x) {
+    const T *s = src + table.getStart(x);
+    const A *w = table.getWeights(x, A());
+    A sum = 0;
+#pragma omp simd reduction(+:sum)
+    for (size_t k = 0; k < taps; ++k) sum += (A)s[k] * w[k];
+    dst[x] = (I)resample_descale(sum, shift);
+  }
+}
+
+template <typename T>
+void resizePixmapNearest(cpixmap<T>& dst, const cpixmap<T>& src,
+			 const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("resizePixmapNearest", dst, trace_bytes<T>(src) + trace_bytes<T>(dst), trace_threads(policy));
+  std::shared_ptr<const cresample_table> xtab =
+    cresample_table::lookup(src.getWidth(), dst.getWidth(), RESAMPLE_NEAREST);
+  std::shared_ptr<const cresample_table> ytab =
+    cresample_table::lookup(src.getHeight(), dst.getHeight(), RESAMPLE_NEAREST);
+
+  forEachStrip(policy, dst.getBands(), dst.getHeight(), [&](size_t z, size_t y0, size_t y1) {
+      for (size_t y = y0; y < y1; ++y) {
+	const T *srcline = src.getLine(ytab->getStart(y), z);
+	T *dstline = dst.getLine(y, z);
+	for (size_t x = 0; x < dst.getWidth(); ++x)
+	  dstline[x] = srcline[xtab->getStart(x)];
+      }
+    });
+}
+
+// Separable resize of every band of src into dst; the output size is taken
+// from dst.  Output rows are processed in the strips of the policy, each of
+// which keeps only a rolling window of horizontally resampled source rows
+// (as many as the vertical filter has taps) instead of a full intermediate
+// frame.
+template <typename T>
+void resizePixmap(cpixmap<T>& dst, const cpixmap<T>& src, RESAMPLE_FILTER filter = RESAMPLE_BILINEAR,
+		  const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("resizePixmap", dst, trace_bytes<T>(src) + trace_bytes<T>(dst), trace_threads(policy));
+  typedef typename resample_traits<T>::inter_type I;
+  typedef typename resample_traits<T>::acc_type A;
+  const int coef_bits = resample_traits<T>::coef_bits;
+  const int out_shift = coef_bits + resample_traits<T>::extra_bits;
+
+  assert(dst.getBands() == src.getBands());
+  assert(src.getWidth() > 0 && src.getHeight() > 0);
+
+  if (dst.getWidth() == 0 || dst.getHeight() == 0) return;
+  if (filter == RESAMPLE_NEAREST) {
+    resizePixmapNearest(dst, src, policy);
+    return;
+  }
+
+  std::shared_ptr<const cresample_table> xtab =
+    cresample_table::lookup(src.getWidth(), dst.getWidth(), filter, coef_bits);
+  std::shared_ptr<const cresample_table> ytab =
+    cresample_table::lookup(src.getHeight(), dst.getHeight(), filter, coef_bits);
+
+  const size_t width = dst.getWidth();
+  const size_t height = dst.getHeight();
+  const size_t ytaps = ytab->getTaps();
+
+  forEachStrip(policy, dst.getBands(), height, [&](size_t z, size_t y0, size_t y1) {
+      std::vector<I> ring(ytaps * width);
+      std::vector<A> acc(width);
+      size_t next = ytab->getStart(y0); // first source row not yet in the ring
+
+      for (size_t y = y0; y < y1; ++y) {
+	size_t start = ytab->getStart(y);
+	const A *w = ytab->getWeights(y, A());
+
+	next = std::max(next, start);
+	for (; next < start + ytaps; ++next)
+	  resampleHLine<T>(&ring[(next % ytaps) * width], src.getLine(next, z), *xtab);
+
+	std::fill(acc.begin(), acc.end(), (A)0);
+	for (size_t k = 0; k < ytaps; ++k) {
+	  const I *row = &ring[((start + k) % ytaps) * width];
+	  const A wk = w[k];
+	  A *a = &acc[0];
+#pragma omp simd
+	  for (size_t x = 0; x < width; ++x) a[x] += (A)row[x] * wk;
+	}
+
+	T *dstline = dst.getLine(y, z);
+	for (size_t x = 0; x < width; ++x)
+	  dstline[x] = resample_saturate<T>(acc[x], out_shift);
+      }
+    });
+}
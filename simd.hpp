@@ -0,0 +1,176 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+// Runtime selection of the instruction set used by the SIMD kernels.  A
+// kernel is a struct with a static member template
+//
+//   template <SIMD_LEVEL L, typename... A> static void run(A... args);
+//
+// marked SIMD_INLINE; simdDispatch<Kernel>(args...) compiles it once per
+// level with the matching target attribute and calls the variant picked
+// for this machine.  The level is detected once, can be lowered through
+// the CPIXMAP_SIMD environment variable (scalar, sse2, sse41, avx2,
+// avx512, neon) and forced with setSimdLevel() for testing.
+
+enum SIMD_LEVEL {
+  SIMD_SCALAR = 0,
+  SIMD_SSE2 = 1,
+  SIMD_SSE41 = 2,
+  SIMD_AVX2 = 3,
+  SIMD_AVX512 = 4, // F + BW
+  SIMD_NEON = 5
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define SIMD_X86 1
+#elif defined(__GNUC__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+# define SIMD_ARM 1
+#endif
+
+#define SIMD_INLINE inline __attribute__((always_inline))
+
+// vector register width in bytes, 0 for scalar code
+template <SIMD_LEVEL L> struct simd_width { enum { bytes = 16 }; };
+template <> struct simd_width<SIMD_SCALAR> { enum { bytes = 0 }; };
+template <> struct simd_width<SIMD_AVX2> { enum { bytes = 32 }; };
+template <> struct simd_width<SIMD_AVX512> { enum { bytes = 64 }; };
+
+// GCC vector extension of W bytes of T; with W == 0 it degenerates to T so
+// that the same kernel body also serves as the scalar variant
+template <typename T, size_t W>
+struct simd_vector {
+  typedef T type __attribute__((vector_size(W)));
+  enum { lanes = W / sizeof(T) };
+};
+template <typename T> struct simd_vector<T, 0> { typedef T type; enum { lanes = 1 }; };
+
+// unaligned access; vectors go by reference so that no wide vector crosses a
+// call boundary of a function built for a narrower ABI
+template <typename V, typename T>
+SIMD_INLINE void simd_load(V& v, const T *p) { std::memcpy(&v, p, sizeof(V)); }
+
+template <typename V, typename T>
+SIMD_INLINE void simd_store(T *p, const V& v) { std::memcpy(p, &v, sizeof(V)); }
+
+inline const char *getSimdLevelName(SIMD_LEVEL level)
+{
+  static const char *names[] = {"scalar", "sse2", "sse41", "avx2", "avx512", "neon"};
+  return names[level];
+}
+
+inline SIMD_LEVEL detectSimdLevel(void)
+{
+#if defined(SIMD_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return SIMD_AVX512;
+  if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+  if (__builtin_cpu_supports("sse4.1")) return SIMD_SSE41;
+  if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+  return SIMD_SCALAR;
+#elif defined(SIMD_ARM)
+  return SIMD_NEON;
+#else
+  return SIMD_SCALAR;
+#endif
+}
+
+// the best level this machine runs that does not exceed the requested one
+inline SIMD_LEVEL simd_clamp_level(SIMD_LEVEL level)
+{
+  static const SIMD_LEVEL detected = detectSimdLevel();
+  if (level == SIMD_SCALAR || level == detected) return level;
+  if (detected == SIMD_NEON || level == SIMD_NEON) return SIMD_SCALAR;
+  return (level < detected) ? level : detected;
+}
+
+inline std::atomic<int>& simd_level_state(void)
+{
+  static std::atomic<int> level(-1);
+  return level;
+}
+
+inline SIMD_LEVEL getSimdLevel(void)
+{
+  int level = simd_level_state().load(std::memory_order_relaxed);
+  if (level < 0) {
+    level = (int)simd_clamp_level(detectSimdLevel());
+    if (const char *env = std::getenv("CPIXMAP_SIMD")) {
+      for (int l = SIMD_SCALAR; l <= SIMD_NEON; ++l)
+	if (std::strcmp(env, getSimdLevelName((SIMD_LEVEL)l)) == 0) level = (int)simd_clamp_level((SIMD_LEVEL)l);
+    }
+    simd_level_state().store(level, std::memory_order_relaxed);
+  }
+  return (SIMD_LEVEL)level;
+}
+
+// Force a level; requests beyond what the CPU supports are lowered.
+// Returns the level actually in effect.
+inline SIMD_LEVEL setSimdLevel(SIMD_LEVEL level)
+{
+  level = simd_clamp_level(level);
+  simd_level_state().store((int)level, std::memory_order_relaxed);
+  return level;
+}
+
+template <typename K, typename... A>
+void simd_run_scalar(A... args) { K::template run<SIMD_SCALAR>(args...); }
+
+#if defined(SIMD_X86)
+template <typename K, typename... A>
+__attribute__((target("sse2"))) void simd_run_sse2(A... args) { K::template run<SIMD_SSE2>(args...); }
+
+template <typename K, typename... A>
+__attribute__((target("sse4.1"))) void simd_run_sse41(A... args) { K::template run<SIMD_SSE41>(args...); }
+
+template <typename K, typename... A>
+__attribute__((target("avx2"))) void simd_run_avx2(A... args) { K::template run<SIMD_AVX2>(args...); }
+
+template <typename K, typename... A>
+__attribute__((target("avx512f,avx512bw"))) void simd_run_avx512(A... args) { K::template run<SIMD_AVX512>(args...); }
+#elif defined(SIMD_ARM)
+template <typename K, typename... A>
+void simd_run_neon(A... args) { K::template run<SIMD_NEON>(args...); }
+#endif
+
+// run K at a level fetched once by the caller, e.g. outside a parallel loop
+template <typename K, typename... A>
+inline void simdDispatchLevel(SIMD_LEVEL level, A... args)
+{
+  switch (level) {
+#if defined(SIMD_X86)
+  case SIMD_AVX512: simd_run_avx512<K>(args...); break;
+  case SIMD_AVX2: simd_run_avx2<K>(args...); break;
+  case SIMD_SSE41: simd_run_sse41<K>(args...); break;
+  case SIMD_SSE2: simd_run_sse2<K>(args...); break;
+#elif defined(SIMD_ARM)
+  case SIMD_NEON: simd_run_neon<K>(args...); break;
+#endif
+  default: simd_run_scalar<K>(args...); break;
+  }
+}
+
+template <typename K, typename... A>
+inline void simdDispatch(A... args)
+{
+  simdDispatchLevel<K>(getSimdLevel(), args...);
+}
@@ -0,0 +1,1532 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Checks of the kernels against plain reference implementations.  Every
+// test is run by name (pixmap_test codec), or all of them without an
+// argument; the exit status is the number of failed tests.
+
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include <cpixmap.hpp>
+#include <simd.hpp>
+#include <cpixmap.reverseEndian.SIMD.hpp>
+#include <cpixmap_raw.hpp>
+#include <cpixmap_codec.hpp>
+#include <colorspace.hpp>
+#include <warp.hpp>
+#include <cremap.hpp>
+#include <resize.hpp>
+#include <cpyramid.hpp>
+#include <convert.hpp>
+#include <demosaic.hpp>
+#include <arith.hpp>
+#include <convolve.hpp>
+#include <ctiledpixmap.hpp>
+#include <cchunk.hpp>
+#include <cdiskpixmap.hpp>
+#include <cbitmap.hpp>
+#include <label.hpp>
+#include <distance.hpp>
+
+static size_t test_failures = 0;
+
+#define TEST_CHECK(cond)						\
+  do {									\
+    if (!(cond)) {							\
+      if (test_failures++ < 20)						\
+	std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    }									\
+  } while (0)
+
+static std::string test_temp_file(const char *suffix)
+{
+  std::ostringstream path;
+  path << (std::getenv("TMPDIR") ? std::getenv("TMPDIR") : "/tmp") << "/pixmap_test_" << getpid() << suffix;
+  return path.str();
+}
+
+// the executors every test runs on
+static std::vector<cexecution_policy> test_policies(cthread_pool& pool)
+{
+  std::vector<cexecution_policy> policies;
+  policies.push_back(cexecution_policy(EXECUTE_SEQUENTIAL));
+  policies.push_back(cexecution_policy(pool));
+  policies.push_back(cexecution_policy(pool, 3)); // short strips, many seams
+  return policies;
+}
+
+template <typename T>
+void test_fill(cpixmap<T>& img, std::mt19937& rng, unsigned range)
+{
+  for (size_t z = 0; z < img.getBands(); ++z)
+    for (size_t y = 0; y < img.getHeight(); ++y) {
+      T *line = img.getLine(y, z);
+      for (size_t x = 0; x < img.getWidth(); ++x) line[x] = (T)(rng() % range);
+    }
+}
+
+template <typename T>
+bool test_equal(const cpixmap<T>& a, const cpixmap<T>& b)
+{
+  if (!a.isMatched(b)) return false;
+  for (size_t z = 0; z < a.getBands(); ++z)
+    for (size_t y = 0; y < a.getHeight(); ++y)
+      if (!std::equal(a.getLine(y, z), a.getLine(y, z) + a.getWidth(), b.getLine(y, z))) return false;
+  return true;
+}
+
+// dst with the size and pixels of src
+template <typename T>
+void test_copy(cpixmap<T>& dst, const cpixmap<T>& src)
+{
+  dst.setResolution(src.getWidth(), src.getHeight(), src.getBands());
+  for (size_t z = 0; z < src.getBands(); ++z)
+    for (size_t y = 0; y < src.getHeight(); ++y)
+      std::copy(src.getLine(y, z), src.getLine(y, z) + src.getWidth(), dst.getLine(y, z));
+}
+
+// lossless codec: noise, smooth ramps and constant images of every
+// predictor survive a write and read
+template <typename T>
+void test_codec_type(cthread_pool& pool, std::mt19937& rng)
+{
+  const std::string path = test_temp_file(".cpc");
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  static const PIXMAP_PREDICTOR predictors[] = {PREDICT_LEFT, PREDICT_UP, PREDICT_MEDIAN, PREDICT_AUTO};
+  for (int it = 0; it < 24; ++it) {
+    cpixmap<T> img(1 + rng() % 150, 1 + rng() % 90, 1 + rng() % 3), decoded;
+    switch (it % 3) {
+    case 0: test_fill(img, rng, (unsigned)std::numeric_limits<T>::max() + 1u); break;
+    case 1:
+      for (size_t z = 0; z < img.getBands(); ++z)
+	for (size_t y = 0; y < img.getHeight(); ++y)
+	  for (size_t x = 0; x < img.getWidth(); ++x) img.getLine(y, z)[x] = (T)((x + 2 * y + z) / 3 + rng() % 4);
+      break;
+    default: test_fill(img, rng, 1); break;
+    }
+    const cexecution_policy& policy = policies[it % policies.size()];
+    TEST_CHECK(writeCompressedImage(img, path, 1 + rng() % 40, predictors[it % 4], policy));
+    TEST_CHECK(readCompressedImage(path, decoded, policy));
+    TEST_CHECK(test_equal(img, decoded));
+  }
+  std::remove(path.c_str());
+}
+
+// damaged archives are refused rather than decoded into garbage
+static void test_codec_damaged(void)
+{
+  const std::string path = test_temp_file(".cpc");
+  std::mt19937 rng(7);
+  cpixmap<uint8_t> img(97, 61, 2), decoded;
+  cpixmap<uint16_t> wide;
+  test_fill(img, rng, 256);
+  TEST_CHECK(writeCompressedImage(img, path, 16));
+  TEST_CHECK(!readCompressedImage(path, wide));
+  ccompressed_image file;
+  TEST_CHECK(file.open(path));
+  const size_t bytes = file.getCompressedBytes();
+  const uint64_t index = sizeof(ccodec_header);
+  file.close();
+
+  std::vector<char> data(bytes);
+  std::FILE *fp = std::fopen(path.c_str(), "rb");
+  TEST_CHECK(fp && std::fread(&data[0], 1, bytes, fp) == bytes);
+  if (fp) std::fclose(fp);
+  const auto rewrite = [&](const std::vector<char>& contents) {
+    std::FILE *out = std::fopen(path.c_str(), "wb");
+    std::fwrite(contents.data(), 1, contents.size(), out);
+    std::fclose(out);
+  };
+
+  std::vector<char> damaged(data.begin(), data.begin() + bytes / 2); // truncated
+  rewrite(damaged);
+  TEST_CHECK(!file.open(path));
+  damaged = data; // an offset far past the end
+  const uint64_t huge = (uint64_t)1 << 40;
+  std::memcpy(&damaged[index + 3 * sizeof(uint64_t)], &huge, sizeof(huge));
+  rewrite(damaged);
+  TEST_CHECK(!file.open(path));
+  damaged = data; // strips that do not cover the rows
+  uint64_t strip_rows = 1;
+  std::memcpy(&damaged[offsetof(ccodec_header, strip_rows)], &strip_rows, sizeof(strip_rows));
+  rewrite(damaged);
+  TEST_CHECK(!file.open(path));
+  damaged = data; // a predictor byte out of range
+  uint64_t first;
+  std::memcpy(&first, &damaged[index], sizeof(first));
+  damaged[first] = (char)PREDICT_AUTO;
+  rewrite(damaged);
+  TEST_CHECK(file.open(path));
+  TEST_CHECK(!file.read(decoded));
+  file.close();
+  rewrite(data);
+  TEST_CHECK(readCompressedImage(path, decoded) && test_equal(img, decoded));
+  std::remove(path.c_str());
+}
+
+static void test_codec(void)
+{
+  cthread_pool pool(3);
+  std::mt19937 rng(1);
+  test_codec_type<uint8_t>(pool, rng);
+  test_codec_type<uint16_t>(pool, rng);
+}
+
+// every task runs once, nested calls run inline, and a throwing task is
+// rethrown by run() after the others, leaving the pool usable
+static void test_thread_pool(void)
+{
+  cthread_pool pool(3);
+  for (size_t count = 0; count < 200; count += 1 + count / 4) {
+    std::vector<std::atomic<int> > hits(count * 5);
+    pool.run(count, [&](size_t i) {
+	pool.run(5, [&](size_t j) { hits[i * 5 + j]++; });
+      });
+    for (size_t i = 0; i < hits.size(); ++i) TEST_CHECK(hits[i].load() == 1);
+  }
+
+  // from several threads at once
+  std::atomic<size_t> sum(0);
+  std::vector<std::thread> submitters;
+  for (int t = 0; t < 4; ++t)
+    submitters.push_back(std::thread([&] {
+	  for (int it = 0; it < 20; ++it) pool.run(50, [&](size_t i) { sum += i; });
+	}));
+  for (size_t t = 0; t < submitters.size(); ++t) submitters[t].join();
+  TEST_CHECK(sum.load() == 4 * 20 * (49 * 50 / 2));
+
+  for (int it = 0; it < 20; ++it) {
+    std::atomic<size_t> done(0);
+    bool thrown = false;
+    try {
+      pool.run(100, [&](size_t i) {
+	  if (i % 7 == 3) throw std::runtime_error("task");
+	  done++;
+	});
+    } catch (const std::runtime_error&) {
+      thrown = true;
+    }
+    TEST_CHECK(thrown && done.load() == 100 - 14);
+  }
+  // no job of the failed calls is left behind
+  std::atomic<size_t> done(0);
+  pool.run(64, [&](size_t) { done++; });
+  TEST_CHECK(done.load() == 64);
+}
+
+// the vector raw decoder against raw_unpack_group, at every SIMD level,
+// packing, width and shift
+static void test_raw_unpack(void)
+{
+  static const RAW_PACKING packings[] = {RAW_MIPI10, RAW_MIPI12, RAW_MIPI14, RAW_PACKED12_LE, RAW_PACKED12_BE};
+  std::mt19937 rng(2);
+  const SIMD_LEVEL best = getSimdLevel();
+  for (int l = SIMD_SCALAR; l <= best; ++l) {
+    setSimdLevel((SIMD_LEVEL)l);
+    for (size_t p = 0; p < sizeof(packings) / sizeof(packings[0]); ++p) {
+      size_t pixels, bytes;
+      rawPackingGroup(packings[p], pixels, bytes);
+      for (size_t width = 1; width <= 70; ++width)
+	for (size_t shift = 0; shift + rawPackingBits(packings[p]) <= 16; shift += 2) {
+	  std::vector<uint8_t> packed(rawPackedLineBytes(packings[p], width));
+	  for (size_t i = 0; i < packed.size(); ++i) packed[i] = (uint8_t)rng();
+	  std::vector<uint16_t> got(width + 1, 0xdead), group(pixels);
+	  unpackRawLine(&got[0], &packed[0], width, packings[p], shift);
+	  for (size_t x = 0; x < width; ++x) {
+	    raw_unpack_group(&group[0], &packed[x / pixels * bytes], packings[p]);
+	    TEST_CHECK(got[x] == (uint16_t)(group[x % pixels] << shift));
+	  }
+	  TEST_CHECK(got[width] == 0xdead);
+	}
+    }
+  }
+  setSimdLevel(best);
+
+  // and the frame decoder, whose rows are split over the policy
+  cthread_pool pool(3);
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  cpixmap<uint16_t> img(333, 41, 1), decoded(333, 41, 1);
+  for (size_t y = 0; y < img.getHeight(); ++y)
+    for (size_t x = 0; x < img.getWidth(); ++x) img.getLine(y)[x] = (uint16_t)(rng() & 0xfff);
+  const size_t line_bytes = rawPackedLineBytes(RAW_MIPI12, img.getWidth()) + 7;
+  std::vector<uint8_t> frame(line_bytes * img.getHeight());
+  for (size_t y = 0; y < img.getHeight(); ++y)
+    packRawLine(&frame[y * line_bytes], img.getLine(y), img.getWidth(), RAW_MIPI12);
+  for (size_t i = 0; i < policies.size(); ++i) {
+    unpackRawPixmap(decoded, &frame[0], RAW_MIPI12, line_bytes, 0, 0, policies[i]);
+    TEST_CHECK(test_equal(img, decoded));
+  }
+}
+
+// breadth-first flood fill from every unlabelled pixel in raster order,
+// which numbers the components as labelComponents does
+static uint32_t test_flood_fill(const cpixmap<uint8_t>& mask, std::vector<uint32_t>& labels, bool eight)
+{
+  const long width = (long)mask.getWidth(), height = (long)mask.getHeight();
+  labels.assign(width * height, 0);
+  uint32_t count = 0;
+  std::vector<long> queue;
+  for (long start = 0; start < width * height; ++start) {
+    if (!mask.getLine(start / width)[start % width] || labels[start]) continue;
+    labels[start] = ++count;
+    queue.assign(1, start);
+    for (size_t q = 0; q < queue.size(); ++q) {
+      const long x = queue[q] % width, y = queue[q] / width;
+      for (long dy = -1; dy <= 1; ++dy)
+	for (long dx = -1; dx <= 1; ++dx) {
+	  const long nx = x + dx, ny = y + dy;
+	  if ((!dx && !dy) || (!eight && dx && dy)) continue;
+	  if (nx < 0 || ny < 0 || nx >= width || ny >= height) continue;
+	  if (mask.getLine(ny)[nx] && !labels[ny * width + nx]) {
+	    labels[ny * width + nx] = count;
+	    queue.push_back(ny * width + nx);
+	  }
+	}
+    }
+  }
+  return count;
+}
+
+static void test_label(void)
+{
+  cthread_pool pool(3);
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  std::mt19937 rng(3);
+  for (int it = 0; it < 120; ++it) {
+    const size_t width = 1 + rng() % 80, height = 1 + rng() % 70;
+    const unsigned density = 1 + rng() % 9;
+    cpixmap<uint8_t> mask(width, height, 1);
+    for (size_t y = 0; y < height; ++y)
+      for (size_t x = 0; x < width; ++x) mask.getLine(y)[x] = (rng() % 10) < density;
+    cbitmap bits;
+    thresholdPixmap(bits, mask, (uint8_t)0);
+
+    for (int eight = 0; eight < 2; ++eight) {
+      std::vector<uint32_t> expected;
+      const uint32_t count = test_flood_fill(mask, expected, eight != 0);
+      std::vector<size_t> area(count + 1, 0);
+      for (size_t i = 0; i < expected.size(); ++i) area[expected[i]]++;
+
+      for (size_t p = 0; p < policies.size(); ++p) {
+	cpixmap<uint32_t> labels;
+	std::vector<ccomponent> components;
+	const PIXMAP_CONNECTIVITY connectivity = eight ? CONNECT_8 : CONNECT_4;
+	const size_t found = (p & 1) ? labelComponents(labels, bits, connectivity, &components, policies[p])
+	  : labelComponents(labels, mask, connectivity, &components, policies[p]);
+	TEST_CHECK(found == count);
+	TEST_CHECK(components.size() == count);
+	for (size_t y = 0; y < height; ++y)
+	  TEST_CHECK(std::equal(labels.getLine(y), labels.getLine(y) + width, &expected[y * width]));
+	for (size_t i = 0; i < components.size() && i < count; ++i) {
+	  TEST_CHECK(components[i].label == i + 1);
+	  TEST_CHECK(components[i].area == area[i + 1]);
+	}
+      }
+    }
+  }
+}
+
+// every metric against the distance to each feature pixel in turn
+static void test_distance(void)
+{
+  cthread_pool pool(3);
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  std::mt19937 rng(4);
+  for (int it = 0; it < 60; ++it) {
+    const size_t width = 1 + rng() % 60, height = 1 + rng() % 45;
+    const unsigned density = (it % 5 == 0) ? 0 : 1 + rng() % 50; // per mille, none at all now and then
+    cpixmap<uint8_t> mask(width, height, 1);
+    for (size_t y = 0; y < height; ++y)
+      for (size_t x = 0; x < width; ++x) mask.getLine(y)[x] = (rng() % 1000) < density;
+
+    for (int metric = DISTANCE_EUCLIDEAN; metric <= DISTANCE_CHAMFER; ++metric) {
+      cpixmap<float> distance;
+      cpixmap<uint32_t> nearest;
+      distanceTransform(distance, mask, (DISTANCE_METRIC)metric, &nearest, policies[it % policies.size()]);
+      for (size_t y = 0; y < height; ++y)
+	for (size_t x = 0; x < width; ++x) {
+	  double best = INFINITY;
+	  for (size_t fy = 0; fy < height; ++fy)
+	    for (size_t fx = 0; fx < width; ++fx) {
+	      if (!mask.getLine(fy)[fx]) continue;
+	      const double dx = (double)x - fx, dy = (double)y - fy;
+	      best = std::min(best, metric == DISTANCE_CITYBLOCK ? std::fabs(dx) + std::fabs(dy) :
+			      std::sqrt(dx * dx + dy * dy));
+	    }
+	  const float got = distance.getLine(y)[x];
+	  const uint32_t feature = nearest.getLine(y)[x];
+	  if (best == INFINITY) {
+	    TEST_CHECK(std::isinf(got) && feature == NO_FEATURE);
+	    continue;
+	  }
+	  TEST_CHECK(feature != NO_FEATURE && mask.getLine(feature / width)[feature % width]);
+	  if (metric == DISTANCE_EUCLIDEAN) TEST_CHECK(std::fabs(got - best) < 1e-4);
+	  else if (metric == DISTANCE_CITYBLOCK) TEST_CHECK(got == best);
+	  else TEST_CHECK(got >= best * 0.92 - 1e-6 && got <= best * 1.09 + 1e-6); // 3-4 chamfer bounds
+	}
+    }
+  }
+}
+
+template <typename T>
+void test_disk_write(cdiskpixmap<T>& dst, cpixmap<T>& src)
+{
+  for (size_t z = 0; z < src.getBands(); ++z)
+    dst.writeBlock(src.getLine(0, z), src.getHeight() > 1 ? src.getLine(1, z) - src.getLine(0, z) : src.getWidth(),
+		   0, 0, src.getWidth(), src.getHeight(), z);
+}
+
+template <typename T>
+bool test_disk_equal(const cdiskpixmap<T>& img, const cpixmap<T>& expected)
+{
+  std::vector<T> line(img.getWidth());
+  for (size_t z = 0; z < img.getBands(); ++z)
+    for (size_t y = 0; y < img.getHeight(); ++y) {
+      img.readHLine(&line[0], line.size(), 0, y, z);
+      if (!std::equal(line.begin(), line.end(), expected.getLine(y, z))) return false;
+    }
+  return true;
+}
+
+// convolveTiled of the in-memory and the out-of-core tiled layouts
+// against convolve
+template <typename T>
+void test_convolve_tiled_type(cthread_pool& pool, std::mt19937& rng)
+{
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  const std::string path = test_temp_file(".src.tiles"), dst_path = test_temp_file(".dst.tiles");
+  for (int it = 0; it < 12; ++it) {
+    const size_t width = 1 + rng() % 140, height = 1 + rng() % 100, bands = 1 + rng() % 2;
+    cpixmap<T> img(width, height, bands), expected(width, height, bands), got;
+    test_fill(img, rng, (unsigned)std::numeric_limits<T>::max() + 1u);
+    cpixmap<int> kernel(1 + 2 * (rng() % 3), 1 + 2 * (rng() % 3), 1);
+    for (size_t y = 0; y < kernel.getHeight(); ++y)
+      for (size_t x = 0; x < kernel.getWidth(); ++x) kernel.putPixel((int)(rng() % 7) - 2, x, y);
+    const int rshift = rng() % 4;
+    convolve(expected, img, kernel, rshift, 0);
+
+    const cexecution_policy& policy = policies[it % policies.size()];
+    ctiledpixmap<T> tiled(width, height, bands), tiled_dst(width, height, bands);
+    convertToTiled(tiled, img, policy);
+    convolveTiled(tiled_dst, tiled, kernel, rshift, 0, policy);
+    convertFromTiled(got, tiled_dst, policy);
+    TEST_CHECK(test_equal(expected, got));
+
+    cdiskpixmap<T> disk, disk_dst;
+    TEST_CHECK(disk.create(path, width, height, bands, 32));
+    TEST_CHECK(disk_dst.create(dst_path, width, height, bands, 32));
+    test_disk_write(disk, img);
+    convolveTiled(disk_dst, disk, kernel, rshift, 0, policy);
+    TEST_CHECK(test_disk_equal(disk_dst, expected));
+  }
+  std::remove(path.c_str());
+  std::remove(dst_path.c_str());
+}
+
+static void test_convolve_tiled(void)
+{
+  cthread_pool pool(3);
+  std::mt19937 rng(5);
+  test_convolve_tiled_type<uint8_t>(pool, rng);
+  test_convolve_tiled_type<uint16_t>(pool, rng);
+}
+
+// tiles written through a cache far smaller than the image are evicted
+// and written back, and are in the file after it is reopened
+static void test_disk_pixmap(void)
+{
+  const std::string path = test_temp_file(".tiles");
+  std::mt19937 rng(6);
+  const size_t tile = 32;
+  cpixmap<uint16_t> expected(250, 170, 2);
+  test_fill(expected, rng, 65536);
+  {
+    cdiskpixmap<uint16_t> img(3 * tile * tile * sizeof(uint16_t));
+    TEST_CHECK(img.create(path, expected.getWidth(), expected.getHeight(), expected.getBands(), tile));
+    TEST_CHECK(img.getCacheTiles() == 3);
+    test_disk_write(img, expected);
+    TEST_CHECK(test_disk_equal(img, expected));
+
+    // pixels, and a whole pinned tile, changed in place
+    for (int i = 0; i < 200; ++i) {
+      const size_t x = rng() % expected.getWidth(), y = rng() % expected.getHeight(), z = rng() % 2;
+      const uint16_t value = (uint16_t)rng();
+      img.putPixel(value, x, y, z);
+      expected.putPixel(value, x, y, z);
+    }
+    {
+      ctile_ref<uint16_t> ref = img.pinTile(1, 2, 1);
+      const ctile<uint16_t>& view = ref.getView();
+      for (size_t y = 0; y < view.height; ++y)
+	for (size_t x = 0; x < view.width; ++x) {
+	  view(y, x) = (uint16_t)(x * y);
+	  expected.putPixel((uint16_t)(x * y), view.x + x, view.y + y, 1);
+	}
+      ref.setDirty();
+    }
+    TEST_CHECK(test_disk_equal(img, expected));
+  }
+
+  cdiskpixmap<uint16_t> reopened(2 * tile * tile * sizeof(uint16_t));
+  TEST_CHECK(reopened.open(path, false));
+  TEST_CHECK(reopened.isMatched(expected.getWidth(), expected.getHeight(), expected.getBands()));
+  TEST_CHECK(test_disk_equal(reopened, expected));
+  TEST_CHECK(reopened.close());
+
+  // a file cut short is refused, and one cut short while open reports
+  // the tiles it could not read
+  TEST_CHECK(reopened.open(path, false));
+  TEST_CHECK(truncate(path.c_str(), 4096 + 20 * tile * tile * sizeof(uint16_t)) == 0);
+  TEST_CHECK(reopened.flush());
+  reopened.getPixel(expected.getWidth() - 1, expected.getHeight() - 1, 1);
+  TEST_CHECK(!reopened.flush());
+  TEST_CHECK(!reopened.close());
+  TEST_CHECK(!reopened.open(path, false));
+  std::remove(path.c_str());
+}
+
+// src converted by fn into a new pixmap and in place, which must agree
+template <typename T, typename F>
+bool test_in_place(const cpixmap<T>& src, F fn)
+{
+  cpixmap<T> expected, img;
+  fn(expected, src);
+  test_copy(img, src);
+  fn(img, img);
+  return test_equal(expected, img);
+}
+
+// YCbCr round trips within a rounding step or two, and every conversion
+// agrees with itself in place
+template <typename T>
+void test_colorspace_type(cthread_pool& pool, std::mt19937& rng, int tolerance)
+{
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  for (int it = 0; it < 12; ++it) {
+    const cexecution_policy& policy = policies[it % policies.size()];
+    cpixmap<T> rgb(1 + rng() % 90, 1 + rng() % 60, 3 + it % 2), ycc, back;
+    test_fill(rgb, rng, (unsigned)std::numeric_limits<T>::max() + 1u);
+    for (int standard = YCBCR_BT601; standard <= YCBCR_BT709; ++standard) {
+      convertRGBToYCbCr(ycc, rgb, (YCBCR_STANDARD)standard, true, policy);
+      convertYCbCrToRGB(back, ycc, (YCBCR_STANDARD)standard, true, policy);
+      int worst = 0;
+      for (size_t z = 0; z < 3; ++z)
+	for (size_t y = 0; y < rgb.getHeight(); ++y)
+	  for (size_t x = 0; x < rgb.getWidth(); ++x)
+	    worst = std::max(worst, std::abs((int)rgb.getLine(y, z)[x] - (int)back.getLine(y, z)[x]));
+      TEST_CHECK(worst <= tolerance);
+    }
+
+    TEST_CHECK(test_in_place(rgb, [&](cpixmap<T>& d, const cpixmap<T>& s) {
+	  convertRGBToYCbCr(d, s, YCBCR_BT709, false, policy);
+	}));
+    TEST_CHECK(test_in_place(ycc, [&](cpixmap<T>& d, const cpixmap<T>& s) {
+	  convertYCbCrToRGB(d, s, YCBCR_BT709, true, policy);
+	}));
+    TEST_CHECK(test_in_place(rgb, [&](cpixmap<T>& d, const cpixmap<T>& s) { convertRGBToGray(d, s, policy); }));
+    TEST_CHECK(test_in_place(rgb, [&](cpixmap<T>& d, const cpixmap<T>& s) { convertGrayToRGB(d, s, 1, policy); }));
+    TEST_CHECK(test_in_place(rgb, [&](cpixmap<T>& d, const cpixmap<T>& s) { convertRGBToHSV(d, s, policy); }));
+    TEST_CHECK(test_in_place(ycc, [&](cpixmap<T>& d, const cpixmap<T>& s) { convertHSVToRGB(d, s, policy); }));
+    TEST_CHECK(test_in_place(rgb, [&](cpixmap<T>& d, const cpixmap<T>& s) { convertRGBToLab(d, s, policy); }));
+    TEST_CHECK(test_in_place(ycc, [&](cpixmap<T>& d, const cpixmap<T>& s) { convertLabToRGB(d, s, policy); }));
+  }
+}
+
+static void test_colorspace(void)
+{
+  cthread_pool pool(3);
+  std::mt19937 rng(8);
+  test_colorspace_type<uint8_t>(pool, rng, 2);
+  test_colorspace_type<uint16_t>(pool, rng, 2);
+}
+
+// identity and whole-pixel shifts reproduce the source under every
+// interpolation, and positions the map sends nowhere read the border
+static void test_warp(void)
+{
+  cthread_pool pool(3);
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  std::mt19937 rng(9);
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  for (int it = 0; it < 18; ++it) {
+    const cexecution_policy& policy = policies[it % policies.size()];
+    const WARP_INTERPOLATION interp = (WARP_INTERPOLATION)(it % 3);
+    const size_t tile = 1 + rng() % 40;
+    cpixmap<uint8_t> src(1 + rng() % 90, 1 + rng() % 60, 1 + rng() % 2);
+    cpixmap<uint8_t> dst(src.getWidth(), src.getHeight(), src.getBands());
+    test_fill(src, rng, 256);
+
+    const double identity[6] = {1, 0, 0, 0, 1, 0};
+    warpAffine(dst, src, identity, interp, WARP_BORDER_CONSTANT, (uint8_t)7, tile, policy);
+    TEST_CHECK(test_equal(src, dst));
+    const double homography[9] = {2, 0, 0, 0, 2, 0, 0, 0, 2}; // identity up to scale
+    warpPerspective(dst, src, homography, interp, WARP_BORDER_CONSTANT, (uint8_t)7, tile, policy);
+    TEST_CHECK(test_equal(src, dst));
+
+    const long dx = (long)(rng() % 7) - 3, dy = (long)(rng() % 7) - 3;
+    const double shift[6] = {1, 0, (double)dx, 0, 1, (double)dy};
+    warpAffine(dst, src, shift, interp, WARP_BORDER_CONSTANT, (uint8_t)7, tile, policy);
+    bool shifted = true;
+    for (size_t z = 0; z < src.getBands(); ++z)
+      for (long y = 0; y < (long)src.getHeight(); ++y)
+	for (long x = 0; x < (long)src.getWidth(); ++x) {
+	  const long sx = x + dx, sy = y + dy;
+	  const bool inside = sx >= 0 && sy >= 0 && sx < (long)src.getWidth() && sy < (long)src.getHeight();
+	  // interpolation near the edge mixes in the border
+	  const bool interior = sx >= 1 && sy >= 1 && sx + 2 < (long)src.getWidth() && sy + 2 < (long)src.getHeight();
+	  if (!inside) shifted &= dst.getLine(y, z)[x] == 7;
+	  else if (interior || interp == WARP_NEAREST) shifted &= dst.getLine(y, z)[x] == src.getLine(sy, z)[sx];
+	}
+    TEST_CHECK(shifted);
+
+    const double horizon[9] = {1, 0, 0, 0, 1, 0, 0, 0, 0};
+    const double undefined[9] = {1, 0, nan, 0, 1, 0, 0, 0, 1};
+    const double far[6] = {1, 0, 1e12, 0, 1, -1e15};
+    const double *perspective[2] = {horizon, undefined};
+    for (int k = 0; k < 3; ++k) {
+      if (k < 2) warpPerspective(dst, src, perspective[k], interp, WARP_BORDER_CONSTANT, (uint8_t)7, tile, policy);
+      else warpAffine(dst, src, far, interp, WARP_BORDER_CONSTANT, (uint8_t)7, tile, policy);
+      bool border = true;
+      for (size_t z = 0; z < dst.getBands(); ++z)
+	for (size_t y = 0; y < dst.getHeight(); ++y)
+	  for (size_t x = 0; x < dst.getWidth(); ++x) border &= dst.getLine(y, z)[x] == 7;
+      TEST_CHECK(border);
+    }
+  }
+}
+
+// an identity map reproduces the source, also after a save and load, and
+// a damaged map file is refused
+static void test_remap(void)
+{
+  cthread_pool pool(3);
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  const std::string path = test_temp_file(".remap");
+  std::mt19937 rng(10);
+  for (int it = 0; it < 12; ++it) {
+    const cexecution_policy& policy = policies[it % policies.size()];
+    cpixmap<uint16_t> src(1 + rng() % 90, 1 + rng() % 60, 1 + rng() % 2);
+    cpixmap<uint16_t> dst(src.getWidth(), src.getHeight(), src.getBands());
+    test_fill(src, rng, 65536);
+    cpixmap<float> mapx(src.getWidth(), src.getHeight()), mapy(src.getWidth(), src.getHeight());
+    for (size_t y = 0; y < src.getHeight(); ++y)
+      for (size_t x = 0; x < src.getWidth(); ++x) mapx.getLine(y)[x] = (float)x, mapy.getLine(y)[x] = (float)y;
+
+    cremap<uint16_t> map, loaded;
+    map.compile(mapx, mapy, src.getWidth(), src.getHeight(), (WARP_INTERPOLATION)(it % 2),
+		(WARP_BORDER)(it % 4), (it % 3) ? 1 + rng() % 20 : 0);
+    map.apply(dst, src, 0, policy);
+    TEST_CHECK(test_equal(src, dst));
+    TEST_CHECK(map.save(path));
+    TEST_CHECK(loaded.load(path));
+    std::fill(dst.getImage(0), dst.getImage(0) + dst.getWidth(), 0);
+    loaded.apply(dst, src, 0, policy);
+    TEST_CHECK(test_equal(src, dst));
+  }
+
+  // a map whose last offset points past its source, then one cut short
+  cpixmap<float> mapx(20, 10), mapy(20, 10);
+  test_fill(mapx, rng, 20);
+  test_fill(mapy, rng, 10);
+  cremap<uint16_t> map;
+  map.compile(mapx, mapy, 20, 10, WARP_NEAREST); // no pixel needs the border
+  TEST_CHECK(map.save(path));
+  std::vector<char> data;
+  {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  }
+  cremap<uint16_t> damaged;
+  std::string bad(data.begin(), data.end());
+  const size_t pixels = 20 * 10;
+  const int32_t past = 1 << 30;
+  std::memcpy(&bad[96 + (pixels - 1) * sizeof(int32_t)], &past, sizeof(past));
+  std::istringstream stream(bad);
+  TEST_CHECK(!damaged.load(stream) && !damaged.isCompiled());
+  std::istringstream cut(std::string(data.begin(), data.end() - 1));
+  TEST_CHECK(!damaged.load(cut));
+  std::remove(path.c_str());
+  TEST_CHECK(!damaged.load(path));
+
+  // an empty map compiles without a tile size
+  cpixmap<float> empty(0, 5);
+  cremap<uint16_t> none;
+  none.compile(empty, empty, 4, 4);
+  TEST_CHECK(!none.isCompiled());
+}
+
+// every filter against the separable sum over its coefficient table in
+// double, and the same pixels on every executor
+template <typename T>
+void test_resize_type(cthread_pool& pool, std::mt19937& rng, unsigned range, double tolerance)
+{
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  for (int it = 0; it < 15; ++it) {
+    const RESAMPLE_FILTER filter = (RESAMPLE_FILTER)(it % 5);
+    cpixmap<T> src(1 + rng() % 70, 1 + rng() % 50, 1 + rng() % 2);
+    cpixmap<T> dst(1 + rng() % 90, 1 + rng() % 70, src.getBands()), other(dst);
+    test_fill(src, rng, range);
+    resizePixmap(dst, src, filter, policies[0]);
+    for (size_t p = 1; p < policies.size(); ++p) {
+      resizePixmap(other, src, filter, policies[p]);
+      TEST_CHECK(test_equal(dst, other));
+    }
+
+    const cresample_table xtab(src.getWidth(), dst.getWidth(), filter), ytab(src.getHeight(), dst.getHeight(), filter);
+    double worst = 0.0;
+    for (size_t z = 0; z < src.getBands(); ++z)
+      for (size_t y = 0; y < dst.getHeight(); ++y)
+	for (size_t x = 0; x < dst.getWidth(); ++x) {
+	  double expected = 0.0;
+	  for (size_t j = 0; j < ytab.getTaps(); ++j) {
+	    const T *line = src.getLine(ytab.getStart(y) + j, z) + xtab.getStart(x);
+	    double sum = 0.0;
+	    for (size_t i = 0; i < xtab.getTaps(); ++i) sum += line[i] * xtab.getWeights(x, 0.0)[i];
+	    expected += sum * ytab.getWeights(y, 0.0)[j];
+	  }
+	  if (std::numeric_limits<T>::is_integer)
+	    expected = std::min(std::max(expected, 0.0), (double)std::numeric_limits<T>::max());
+	  worst = std::max(worst, std::fabs(dst.getLine(y, z)[x] - expected));
+	}
+    TEST_CHECK(worst <= tolerance);
+  }
+}
+
+static void test_resize(void)
+{
+  cthread_pool pool(3);
+  std::mt19937 rng(11);
+  test_resize_type<uint8_t>(pool, rng, 256, 0.6); // a rounding of each pass
+  test_resize_type<uint16_t>(pool, rng, 65536, 0.6);
+  test_resize_type<float>(pool, rng, 1000, 1e-3);
+}
+
+// Gaussian levels against the 5x5 binomial blur of the level above at the
+// even pixels, and a Laplacian pyramid collapses back to its image exactly
+static void test_pyramid(void)
+{
+  cthread_pool pool(3);
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  std::mt19937 rng(12);
+  static const long w[5] = {1, 4, 6, 4, 1};
+  for (int it = 0; it < 15; ++it) {
+    const cexecution_policy& policy = policies[it % policies.size()];
+    cpixmap<uint8_t> img(1 + rng() % 100, 1 + rng() % 80, 1 + rng() % 2), back;
+    test_fill(img, rng, 256);
+    const size_t levels = 1 + rng() % 5;
+
+    cpyramid<uint16_t> gaussian(levels);
+    gaussian.buildGaussian(img, policy);
+    bool reduced = true;
+    for (size_t l = 1; l < levels; ++l) {
+      const cpixmap<uint16_t>& upper = gaussian[l - 1], &level = gaussian[l];
+      const long uw = upper.getWidth(), uh = upper.getHeight();
+      for (size_t z = 0; z < level.getBands(); ++z)
+	for (long y = 0; y < (long)level.getHeight(); ++y)
+	  for (long x = 0; x < (long)level.getWidth(); ++x) {
+	    long sum = 0;
+	    for (int j = 0; j < 5; ++j)
+	      for (int i = 0; i < 5; ++i)
+		sum += w[j] * w[i] * upper.getLine(pyramid_reflect(2 * y + j - 2, uh), z)[pyramid_reflect(2 * x + i - 2, uw)];
+	    reduced &= level.getLine(y, z)[x] == (sum + 128) >> 8;
+	  }
+    }
+    TEST_CHECK(reduced);
+
+    cpyramid<int16_t> laplacian(levels);
+    laplacian.buildLaplacian(img, policy);
+    laplacian.collapse(back, policy);
+    TEST_CHECK(test_equal(img, back));
+  }
+}
+
+template <typename U, typename T>
+U test_convert_value(T v, double scale, double offset, CONVERT_ROUNDING rounding)
+{
+  double x = (double)v * scale + offset;
+  if (!std::numeric_limits<U>::is_integer) return (U)x;
+  if (rounding == CONVERT_ROUND_NEAREST) x = std::nearbyint(x);
+  else if (rounding == CONVERT_ROUND_FLOOR) x = std::floor(x);
+  else x = std::trunc(x);
+  return (U)std::min(std::max(x, (double)std::numeric_limits<U>::lowest()), (double)std::numeric_limits<U>::max());
+}
+
+template <typename U, typename T>
+bool test_converted(const cpixmap<U>& dst, const cpixmap<T>& src, double scale, double offset,
+		    CONVERT_ROUNDING rounding)
+{
+  if (!dst.isMatched(src.getWidth(), src.getHeight(), src.getBands())) return false;
+  for (size_t z = 0; z < src.getBands(); ++z)
+    for (size_t y = 0; y < src.getHeight(); ++y)
+      for (size_t x = 0; x < src.getWidth(); ++x)
+	if (dst.getLine(y, z)[x] != test_convert_value<U>(src.getLine(y, z)[x], scale, offset, rounding)) return false;
+  return true;
+}
+
+// every kernel convertPixmap picks (cast, clamp, shift, scale) against the
+// mapping in double, with scales and offsets exact in float so that both
+// round the same ties, and the source type converted in place
+template <typename U, typename T>
+void test_convert_type(cthread_pool& pool, std::mt19937& rng, long lo, long hi)
+{
+  static const double scales[] = {1.0, 0.25, 1.0 / 16, 4.0, 0.75, 1.5, -1.0};
+  static const double offsets[] = {0.0, 0.0, 3.5, -100.25};
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  for (int it = 0; it < 24; ++it) {
+    const double scale = scales[it % 7], offset = offsets[it % 4];
+    const CONVERT_ROUNDING rounding = (CONVERT_ROUNDING)(it % 3);
+    cpixmap<T> src(1 + rng() % 80, 1 + rng() % 40, 1 + rng() % 2);
+    cpixmap<U> dst;
+    for (size_t z = 0; z < src.getBands(); ++z)
+      for (size_t y = 0; y < src.getHeight(); ++y)
+	for (size_t x = 0; x < src.getWidth(); ++x)
+	  src.getLine(y, z)[x] = (T)(lo + (long)(rng() % (unsigned long)(hi - lo + 1)));
+    convertPixmap(dst, src, scale, offset, rounding, policies[it % policies.size()]);
+    TEST_CHECK(test_converted(dst, src, scale, offset, rounding));
+
+    cpixmap<T> img;
+    test_copy(img, src);
+    convertPixmap(img, img, scale, offset, rounding, policies[it % policies.size()]);
+    TEST_CHECK(test_converted(img, src, scale, offset, rounding));
+  }
+}
+
+static void test_convert(void)
+{
+  cthread_pool pool(3);
+  std::mt19937 rng(13);
+  test_convert_type<uint16_t, uint8_t>(pool, rng, 0, 255);
+  test_convert_type<uint8_t, uint16_t>(pool, rng, 0, 65535);
+  test_convert_type<uint8_t, int16_t>(pool, rng, -32768, 32767);
+  test_convert_type<int8_t, uint16_t>(pool, rng, 0, 65535);
+  test_convert_type<int16_t, int16_t>(pool, rng, -32768, 32767);
+  test_convert_type<uint16_t, int32_t>(pool, rng, -100000, 100000);
+  test_convert_type<uint8_t, uint8_t>(pool, rng, 0, 255);
+  test_convert_type<float, uint16_t>(pool, rng, 0, 65535);
+  test_convert_type<int16_t, float>(pool, rng, -40000, 40000);
+}
+
+// mirrored without repeating the edge, as demosaic_load pads the mosaic
+static long test_mirror(long i, long n)
+{
+  return i < 0 ? -i : (i >= n ? 2 * n - 2 - i : i);
+}
+
+// bilinear demosaicing against the mean of the same-colour samples around
+// each site; Malvar keeps the samples, keeps flat fields flat and agrees
+// on every executor
+static void test_demosaic(void)
+{
+  cthread_pool pool(3);
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  std::mt19937 rng(14);
+  for (int it = 0; it < 16; ++it) {
+    const BAYER_PATTERN pattern = (BAYER_PATTERN)(it % 4);
+    const long rx = (pattern == BAYER_GRBG || pattern == BAYER_BGGR), ry = (pattern == BAYER_GBRG || pattern == BAYER_BGGR);
+    const long width = 3 + rng() % 60, height = 3 + rng() % 40;
+    cpixmap<uint16_t> raw(width, height, 2), rgb, other;
+    test_fill(raw, rng, 4096);
+    // colour of a site: 2 red, 1 green, 0 blue as the BGR bands
+    const auto colour = [&](long x, long y) { return ((x & 1) == rx) == ((y & 1) == ry) ? ((y & 1) == ry ? 2 : 0) : 1; };
+
+    demosaicBayer(rgb, raw, pattern, DEMOSAIC_BILINEAR, 1, policies[it % policies.size()]);
+    bool bilinear = true;
+    for (long y = 0; y < height; ++y)
+      for (long x = 0; x < width; ++x)
+	for (int band = 0; band < 3; ++band) {
+	  long sum = 0, count = 0;
+	  for (long dy = -1; dy <= 1; ++dy)
+	    for (long dx = -1; dx <= 1; ++dx)
+	      if (colour(x + dx, y + dy) == band && (band != colour(x, y) || (!dx && !dy))) {
+		sum += raw.getLine(test_mirror(y + dy, height), 1)[test_mirror(x + dx, width)];
+		++count;
+	      }
+	  bilinear &= count && rgb.getLine(y, band)[x] == (16 * sum / count + 8) >> 4;
+	}
+    TEST_CHECK(bilinear);
+
+    demosaicBayer(rgb, raw, pattern, DEMOSAIC_MALVAR, 1, policies[0]);
+    for (size_t p = 1; p < policies.size(); ++p) {
+      demosaicBayer(other, raw, pattern, DEMOSAIC_MALVAR, 1, policies[p]);
+      TEST_CHECK(test_equal(rgb, other));
+    }
+    bool kept = true;
+    for (long y = 0; y < height; ++y)
+      for (long x = 0; x < width; ++x) kept &= rgb.getLine(y, colour(x, y))[x] == raw.getLine(y, 1)[x];
+    TEST_CHECK(kept);
+
+    cpixmap<uint16_t> flat(width, height, 1), expected(width, height, 3);
+    for (size_t y = 0; y < (size_t)height; ++y) std::fill(flat.getLine(y), flat.getLine(y) + width, 1000);
+    for (size_t z = 0; z < 3; ++z)
+      for (size_t y = 0; y < (size_t)height; ++y) std::fill(expected.getLine(y, z), expected.getLine(y, z) + width, 1000);
+    demosaicBayer(rgb, flat, pattern, DEMOSAIC_MALVAR, 0, policies[it % policies.size()]);
+    TEST_CHECK(test_equal(rgb, expected));
+  }
+}
+
+// the bytes of v in reverse order
+template <typename T>
+T test_reversed(T v)
+{
+  uint8_t bytes[sizeof(T)];
+  std::memcpy(bytes, &v, sizeof(T));
+  std::reverse(bytes, bytes + sizeof(T));
+  std::memcpy(&v, bytes, sizeof(T));
+  return v;
+}
+
+// reverseEndianLine at every SIMD level and length, which must not touch
+// the pixel after the row, then cpixmap::reverseEndian and raw files of
+// either byte order written and read back
+template <typename T>
+void test_endian_type(cthread_pool& pool, std::mt19937& rng)
+{
+  const SIMD_LEVEL best = getSimdLevel();
+  for (int l = SIMD_SCALAR; l <= best; ++l) {
+    setSimdLevel((SIMD_LEVEL)l);
+    for (size_t len = 0; len <= 70; ++len) {
+      std::vector<T> line(len + 1), expected(len + 1);
+      for (size_t i = 0; i <= len; ++i) {
+	uint8_t bytes[sizeof(T)];
+	for (size_t k = 0; k < sizeof(T); ++k) bytes[k] = (uint8_t)rng();
+	std::memcpy(&line[i], bytes, sizeof(T));
+	expected[i] = i < len ? test_reversed(line[i]) : line[i];
+      }
+      reverseEndianLine(&line[0], len);
+      TEST_CHECK(std::memcmp(&line[0], &expected[0], line.size() * sizeof(T)) == 0);
+    }
+  }
+  setSimdLevel(best);
+
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  const std::string path = test_temp_file(".raw");
+  cpixmap<T> img(1 + rng() % 60, 1 + rng() % 30, 2), swapped, back;
+  test_fill(img, rng, 30000);
+  for (size_t p = 0; p < policies.size(); ++p) {
+    test_copy(swapped, img);
+    swapped.reverseEndian(policies[p]);
+    bool reversed = true;
+    for (size_t z = 0; z < img.getBands(); ++z)
+      for (size_t y = 0; y < img.getHeight(); ++y)
+	for (size_t x = 0; x < img.getWidth(); ++x) {
+	  const T expected = test_reversed(img.getLine(y, z)[x]);
+	  reversed &= std::memcmp(&swapped.getLine(y, z)[x], &expected, sizeof(T)) == 0;
+	}
+    swapped.reverseEndian(policies[p]);
+    TEST_CHECK(reversed && test_equal(img, swapped));
+  }
+
+  // big endian on disk: the most significant byte first
+  const uint16_t probe = 1;
+  const bool little = *(const uint8_t *)&probe == 1;
+  writeRawImage(img, 1, path, PIXMAP_BIG_ENDIAN);
+  std::vector<char> data;
+  {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  }
+  TEST_CHECK(data.size() == img.getWidth() * img.getHeight() * sizeof(T));
+  if (data.size() >= sizeof(T)) {
+    T first;
+    std::memcpy(&first, &data[0], sizeof(T));
+    TEST_CHECK(first == (little ? test_reversed(img.getLine(0, 1)[0]) : img.getLine(0, 1)[0]));
+  }
+  back.setResolution(img.getWidth(), img.getHeight(), 2);
+  readRawImage(path, back, 0, PIXMAP_BIG_ENDIAN);
+  readRawImage(path, back, 1, little ? PIXMAP_LITTLE_ENDIAN : PIXMAP_BIG_ENDIAN);
+  bool read = true;
+  for (size_t y = 0; y < img.getHeight(); ++y)
+    for (size_t x = 0; x < img.getWidth(); ++x) {
+      read &= back.getLine(y, 0)[x] == img.getLine(y, 1)[x];
+      read &= std::memcmp(&back.getLine(y, 1)[x], &data[(y * img.getWidth() + x) * sizeof(T)], sizeof(T)) == 0;
+    }
+  TEST_CHECK(read);
+  std::remove(path.c_str());
+}
+
+static void test_endian(void)
+{
+  cthread_pool pool(3);
+  std::mt19937 rng(15);
+  test_endian_type<uint8_t>(pool, rng);
+  test_endian_type<int16_t>(pool, rng);
+  test_endian_type<uint32_t>(pool, rng);
+  test_endian_type<uint64_t>(pool, rng);
+  test_endian_type<float>(pool, rng);
+  test_endian_type<double>(pool, rng);
+}
+
+// integer results in int64, clamped to T; floating ones as computed
+template <typename T>
+T test_saturate(int64_t v)
+{
+  return (T)std::min(std::max(v, (int64_t)std::numeric_limits<T>::lowest()), (int64_t)std::numeric_limits<T>::max());
+}
+
+// a scaled result in the work type, rounded half away from zero and
+// saturated as arith_store does
+template <typename T>
+T test_scaled(typename arith_traits<T>::work_type f)
+{
+  typedef typename arith_traits<T>::work_type W;
+  if (!std::numeric_limits<T>::is_integer) return (T)f;
+  W lo, hi;
+  convert_limits<T>(lo, hi);
+  f = (f == f) ? f : (W)0;
+  f = f + ((f < (W)0) ? (W)-0.5 : (W)0.5);
+  return (T)std::min(std::max(f, lo), hi);
+}
+
+// every operation on operands that reach both ends of the range, at
+// every SIMD level and for rows of every length up to a few vectors,
+// against the lane-by-lane definition; the constant forms and in place too
+template <typename T>
+void test_arith_type(cthread_pool& pool, std::mt19937& rng)
+{
+  typedef typename arith_traits<T>::work_type W;
+  typedef std::numeric_limits<T> L;
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  const SIMD_LEVEL best = getSimdLevel();
+  const bool integer = L::is_integer;
+  const auto random = [&](void) {
+    switch (rng() % 4) {
+    case 0: return L::lowest();
+    case 1: return L::max();
+    default: return integer ? (T)((int64_t)L::lowest() + (int64_t)(rng() % ((int64_t)L::max() - (int64_t)L::lowest() + 1)))
+	: (T)((double)(int32_t)rng() / 65536.0);
+    }
+  };
+  for (int l = SIMD_SCALAR; l <= best; ++l) {
+    setSimdLevel((SIMD_LEVEL)l);
+    for (int it = 0; it < 12; ++it) {
+      const cexecution_policy& policy = policies[it % policies.size()];
+      const size_t width = 1 + rng() % 70, height = 1 + rng() % 4;
+      cpixmap<T> a(width, height, 1), b(width, height, 1), dst, inplace;
+      for (size_t y = 0; y < height; ++y)
+	for (size_t x = 0; x < width; ++x) a.getLine(y)[x] = random(), b.getLine(y)[x] = random();
+      const T value = random();
+      const double scale = 1.0 / 256, alpha = 0.5, beta = -0.25, gamma = 3.0;
+
+      for (int op = 0; op < 14; ++op) {
+	const bool constant = op >= 7 && op < 13;
+	const int kind = constant ? op - 7 : op % 13; // the add in place last
+	switch (op) {
+	case 0: addPixmap(dst, a, b, policy); break;
+	case 1: subtractPixmap(dst, a, b, policy); break;
+	case 2: absdiffPixmap(dst, a, b, policy); break;
+	case 3: minPixmap(dst, a, b, policy); break;
+	case 4: maxPixmap(dst, a, b, policy); break;
+	case 5: multiplyPixmap(dst, a, b, scale, policy); break;
+	case 6: addWeightedPixmap(dst, a, alpha, b, beta, gamma, policy); break;
+	case 7: addPixmap(dst, a, value, policy); break;
+	case 8: subtractPixmap(dst, a, value, policy); break;
+	case 9: absdiffPixmap(dst, a, value, policy); break;
+	case 10: minPixmap(dst, a, value, policy); break;
+	case 11: maxPixmap(dst, a, value, policy); break;
+	case 12: multiplyPixmap(dst, a, value, scale, policy); break;
+	default: test_copy(inplace, a); addPixmap(inplace, inplace, b, policy); test_copy(dst, inplace); break;
+	}
+	bool exact = dst.isMatched(a);
+	for (size_t y = 0; y < height && exact; ++y)
+	  for (size_t x = 0; x < width; ++x) {
+	    const T p = a.getLine(y)[x], q = constant ? value : b.getLine(y)[x];
+	    T expected;
+	    switch (kind) {
+	    case 0: expected = integer ? test_saturate<T>((int64_t)p + (int64_t)q) : (T)(p + q); break;
+	    case 1: expected = integer ? test_saturate<T>((int64_t)p - (int64_t)q) : (T)(p - q); break;
+	    case 2: expected = integer ? test_saturate<T>(std::abs((int64_t)p - (int64_t)q)) : (T)(p > q ? p - q : q - p); break;
+	    case 3: expected = std::min(p, q); break;
+	    case 4: expected = std::max(p, q); break;
+	    case 5: expected = test_scaled<T>((W)p * (W)q * (W)scale); break;
+	    default: expected = test_scaled<T>((W)p * (W)alpha + (W)q * (W)beta + (W)gamma); break;
+	    }
+	    exact &= dst.getLine(y)[x] == expected;
+	  }
+	TEST_CHECK(exact);
+      }
+    }
+  }
+  setSimdLevel(best);
+}
+
+static void test_arith(void)
+{
+  cthread_pool pool(3);
+  std::mt19937 rng(16);
+  test_arith_type<uint8_t>(pool, rng);
+  test_arith_type<int8_t>(pool, rng);
+  test_arith_type<uint16_t>(pool, rng);
+  test_arith_type<int16_t>(pool, rng);
+  test_arith_type<uint32_t>(pool, rng);
+  test_arith_type<int32_t>(pool, rng);
+  test_arith_type<float>(pool, rng);
+}
+
+// NUMA placements: every policy gives a zero-filled buffer that the
+// kernels use as usual, and moving the pixels to another placement keeps
+// them; without NUMA support the spreading policies report that nothing
+// was applied
+static void test_memory_numa(void)
+{
+  cthread_pool pool(3);
+  std::mt19937 rng(17);
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  static const NUMA_PLACEMENT placements[] = {NUMA_FIRST_TOUCH, NUMA_INTERLEAVE, NUMA_BIND, NUMA_STRIPS};
+  for (int it = 0; it < 16; ++it) {
+    const cmemory_policy memory(placements[it % 4]), moved(placements[(it + 1 + rng() % 3) % 4]);
+    const size_t w = 1 + rng() % (it < 8 ? 60 : 700), h = 1 + rng() % (it < 8 ? 40 : 500), b = 1 + rng() % 3;
+    cpixmap<uint16_t> img(w, h, b, memory), reference;
+    TEST_CHECK(img.getMemoryPolicy().numa == memory.numa);
+    bool zero = true;
+    for (size_t z = 0; z < b; ++z)
+      for (size_t y = 0; y < h; ++y)
+	for (size_t x = 0; x < w; ++x) zero &= img.getLine(y, z)[x] == 0;
+    TEST_CHECK(zero);
+    test_fill(img, rng, 65536);
+    test_copy(reference, img);
+    img.setMemoryPolicy(moved);
+    TEST_CHECK(img.getMemoryPolicy().numa == moved.numa);
+    TEST_CHECK(test_equal(img, reference));
+    const cexecution_policy& policy = policies[it % policies.size()];
+    img.flipVertically(policy);
+    img.flipVertically(policy);
+    TEST_CHECK(test_equal(img, reference));
+  }
+  if (getNumaNodeCount() == 1) {
+    const size_t bytes = 4 * getPageSize();
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    TEST_CHECK(p != MAP_FAILED);
+    if (p != MAP_FAILED) {
+      TEST_CHECK(!placeMemory(p, bytes, cmemory_policy(NUMA_INTERLEAVE)));
+      TEST_CHECK(!placeMemory(p, bytes, cmemory_policy(NUMA_STRIPS)));
+      TEST_CHECK(!placeMemory(p, bytes, cmemory_policy(NUMA_FIRST_TOUCH)));
+      munmap(p, bytes);
+    }
+  }
+}
+
+// usage accounted to tag, zeros when the tag is unknown
+static cmemory_usage test_memory_usage(const std::string& tag)
+{
+  const std::vector<cmemory_usage> tags = getMemoryUsageByTag();
+  for (size_t i = 0; i < tags.size(); ++i)
+    if (tags[i].tag == tag) return tags[i];
+  return cmemory_usage();
+}
+
+// huge pages: buffers below one huge page stay on base pages, larger ones
+// start on a huge page boundary whenever the status says they are huge,
+// are accounted by whole huge pages and keep their pixels across moves
+static void test_huge_pages(void)
+{
+  cthread_pool pool(3);
+  std::mt19937 rng(18);
+  const size_t page = getHugePageSize();
+  cmemory_policy huge(NUMA_FIRST_TOUCH, 0, true);
+  huge.tag = "test_huge_pages";
+  cpixmap<uint8_t> small(100, 100, 1, huge);
+  TEST_CHECK(small.getHugePageStatus() == HUGE_PAGES_NONE);
+  for (int it = 0; it < 4; ++it) {
+    huge.numa = (it & 1) ? NUMA_INTERLEAVE : NUMA_FIRST_TOUCH;
+    const size_t w = page / 1000 + rng() % 300, h = 1000 + rng() % 200, b = 1 + rng() % 2;
+    cpixmap<uint8_t> img(w, h, b, huge), reference;
+    const HUGE_PAGE_STATUS status = img.getHugePageStatus();
+    TEST_CHECK(status == HUGE_PAGES_NONE || status == HUGE_PAGES_ADVISED || status == HUGE_PAGES_HUGETLB);
+    if (status != HUGE_PAGES_NONE) TEST_CHECK(((uintptr_t)img.getImage(0) & (page - 1)) == 0);
+    const size_t live = test_memory_usage(huge.tag).live - QWORD_ALIGN(100) * 100;
+    TEST_CHECK(live % page == 0 && live >= QWORD_ALIGN(w) * h * b && live < QWORD_ALIGN(w) * h * b + page);
+    bool zero = true;
+    for (size_t z = 0; z < b; ++z)
+      for (size_t y = 0; y < h; ++y)
+	for (size_t x = 0; x < w; ++x) zero &= img.getLine(y, z)[x] == 0;
+    TEST_CHECK(zero);
+    test_fill(img, rng, 256);
+    if (status == HUGE_PAGES_HUGETLB) TEST_CHECK(getHugePageBytes(img.getImage(0)) > 0);
+    test_copy(reference, img);
+    img.setMemoryPolicy(cmemory_policy());
+    TEST_CHECK(img.getHugePageStatus() == HUGE_PAGES_NONE);
+    TEST_CHECK(test_equal(img, reference));
+    img.setMemoryPolicy(huge);
+    TEST_CHECK(img.getHugePageStatus() == status);
+    TEST_CHECK(test_equal(img, reference));
+    img.flipHorizontally(cexecution_policy(pool));
+    img.flipHorizontally(cexecution_policy(pool));
+    TEST_CHECK(test_equal(img, reference));
+  }
+}
+
+// counts what goes through the allocator hook
+class test_counting_allocator : public cmemory_allocator {
+public:
+  test_counting_allocator(void) : live(0), allocations(0), frees(0) {}
+  void *allocate(size_t bytes) { ++allocations; live += bytes; return new double[(bytes + 7) / 8]; }
+  void deallocate(void *p, size_t bytes) { ++frees; live -= bytes; delete [] (double *)p; }
+  size_t live, allocations, frees;
+};
+
+// accounting: pixmaps and chunks add their padded buffer size to their
+// tag and to the total, give it back when freed, move it on a retag and
+// raise the peak only while live; the allocator hook serves every
+// first-touch buffer and gets each one back even after it is unhooked
+static void test_memory_accounting(void)
+{
+  std::mt19937 rng(19);
+  cmemory_policy memory;
+  memory.tag = "test_accounting";
+  const cmemory_usage total = getMemoryUsage(), before = test_memory_usage(memory.tag);
+  size_t expected = 0, peak = 0;
+  {
+    std::vector<cpixmap<uint16_t> *> imgs;
+    for (int it = 0; it < 12; ++it) {
+      const size_t w = 1 + rng() % 300, h = 1 + rng() % 100, b = 1 + rng() % 3;
+      imgs.push_back(new cpixmap<uint16_t>(w, h, b, memory));
+      expected += QWORD_ALIGN(w * sizeof(uint16_t)) * h * b;
+      peak = std::max(peak, expected);
+      if (it % 4 == 3) {
+	const cpixmap<uint16_t> *img = imgs[rng() % imgs.size()];
+	expected -= QWORD_ALIGN(img->getWidth() * sizeof(uint16_t)) * img->getHeight() * img->getBands();
+	imgs.erase(std::find(imgs.begin(), imgs.end(), img));
+	delete img;
+      }
+      const cmemory_usage usage = test_memory_usage(memory.tag);
+      TEST_CHECK(usage.live == before.live + expected);
+      TEST_CHECK(getMemoryUsage().live == total.live + expected);
+    }
+    const cmemory_usage usage = test_memory_usage(memory.tag);
+    TEST_CHECK(usage.peak >= before.live + peak);
+    TEST_CHECK(usage.allocations == before.allocations + 12 && usage.frees == before.frees + 3);
+    resetMemoryPeak();
+    TEST_CHECK(test_memory_usage(memory.tag).peak == before.live + expected);
+
+    // a retag moves the live bytes without counting an allocation
+    cpixmap<uint16_t>& img = *imgs[0];
+    const size_t bytes = QWORD_ALIGN(img.getWidth() * sizeof(uint16_t)) * img.getHeight() * img.getBands();
+    img.setMemoryTag("test_accounting_retag");
+    TEST_CHECK(img.getMemoryTag() == "test_accounting_retag");
+    TEST_CHECK(test_memory_usage(memory.tag).live == before.live + expected - bytes);
+    TEST_CHECK(test_memory_usage("test_accounting_retag").live == bytes);
+    TEST_CHECK(test_memory_usage(memory.tag).allocations == before.allocations + 12);
+    for (size_t i = 0; i < imgs.size(); ++i) delete imgs[i];
+    TEST_CHECK(test_memory_usage("test_accounting_retag").live == 0);
+    TEST_CHECK(test_memory_usage(memory.tag).live == before.live);
+    TEST_CHECK(getMemoryUsage().live == total.live);
+  }
+
+  // chunks: one line more than they hold, under "cchunk" unless tagged
+  {
+    const size_t chunk_before = test_memory_usage("cchunk").live;
+    cchunk<uint8_t> chunk(50, 5, 2, 3);
+    const size_t bytes = (5 + 2 * 3 + 1) * QWORD_ALIGN(50 + 2 * 2);
+    TEST_CHECK(test_memory_usage("cchunk").live == chunk_before + bytes);
+    chunk.setMemoryTag(memory.tag);
+    TEST_CHECK(test_memory_usage("cchunk").live == chunk_before);
+    TEST_CHECK(test_memory_usage(memory.tag).live == before.live + bytes);
+    chunk.setDimension(20, 3, 1, 1);
+    TEST_CHECK(test_memory_usage(memory.tag).live == before.live + (3 + 2 + 1) * QWORD_ALIGN(20 + 2));
+  }
+  TEST_CHECK(test_memory_usage(memory.tag).live == before.live);
+
+  // allocator hook
+  {
+    test_counting_allocator allocator;
+    setMemoryAllocator(&allocator);
+    TEST_CHECK(getMemoryAllocator() == &allocator);
+    cpixmap<float> *img = new cpixmap<float>(33, 17, 2, memory);
+    const size_t bytes = QWORD_ALIGN(33 * sizeof(float)) * 17 * 2;
+    TEST_CHECK(allocator.allocations == 1 && allocator.live == bytes);
+    TEST_CHECK(test_memory_usage(memory.tag).live == before.live + bytes);
+    bool zero = true;
+    for (size_t z = 0; z < 2; ++z)
+      for (size_t y = 0; y < 17; ++y)
+	for (size_t x = 0; x < 33; ++x) zero &= img->getLine(y, z)[x] == 0.0f;
+    TEST_CHECK(zero);
+    setMemoryAllocator(NULL);
+    TEST_CHECK(getMemoryAllocator() == NULL);
+    delete img;
+    TEST_CHECK(allocator.frees == 1 && allocator.live == 0);
+    TEST_CHECK(test_memory_usage(memory.tag).live == before.live);
+    cpixmap<float> unhooked(33, 17, 2, memory);
+    TEST_CHECK(allocator.allocations == 1);
+  }
+}
+
+// bitmap with the pixels of a plain bool per pixel reference
+static bool test_bitmap_equal(const cbitmap& bitmap, const std::vector<bool>& pixels)
+{
+  const size_t w = bitmap.getWidth(), h = bitmap.getHeight();
+  bool ok = true;
+  for (size_t z = 0; z < bitmap.getBands(); ++z)
+    for (size_t y = 0; y < h; ++y) {
+      for (size_t x = 0; x < w; ++x) ok &= bitmap.getPixel(x, y, z) == pixels[(z * h + y) * w + x];
+      ok &= (bitmap.getLine(y, z)[bitmap.getWordsPerLine() - 1] & ~bitmap.getTailMask()) == 0;
+    }
+  return ok;
+}
+
+// bitmaps: thresholds at every SIMD level, logic, counts, 3x3 erosion and
+// dilation and the masked copy and fill against pixel by pixel references,
+// on widths around whole words
+template <typename T>
+void test_bitmap_type(cthread_pool& pool, std::mt19937& rng)
+{
+  const std::vector<cexecution_policy> policies = test_policies(pool);
+  const SIMD_LEVEL best = getSimdLevel();
+  for (int it = 0; it < 12; ++it) {
+    static const size_t widths[] = {1, 63, 64, 65, 128, 200};
+    const size_t w = (it < 6) ? widths[it] : 1 + rng() % 300, h = 1 + rng() % 40, b = 1 + rng() % 3;
+    const cexecution_policy& policy = policies[it % policies.size()];
+    cpixmap<T> src(w, h, b);
+    test_fill(src, rng, 200);
+    const T level = (T)(rng() % 200);
+    std::vector<bool> ref(w * h * b), other(w * h * b);
+    for (size_t z = 0; z < b; ++z)
+      for (size_t y = 0; y < h; ++y)
+	for (size_t x = 0; x < w; ++x) {
+	  ref[(z * h + y) * w + x] = src.getLine(y, z)[x] > level;
+	  other[(z * h + y) * w + x] = rng() % 3 == 0;
+	}
+    cbitmap bits, mask(w, h, b);
+    for (int l = SIMD_SCALAR; l <= best; ++l) {
+      setSimdLevel((SIMD_LEVEL)l);
+      thresholdPixmap(bits, src, level, policies[l % policies.size()]);
+      TEST_CHECK(test_bitmap_equal(bits, ref));
+    }
+    setSimdLevel(best);
+    for (size_t z = 0; z < b; ++z)
+      for (size_t y = 0; y < h; ++y)
+	for (size_t x = 0; x < w; ++x) mask.putPixel(other[(z * h + y) * w + x], x, y, z);
+    TEST_CHECK(test_bitmap_equal(mask, other));
+
+    cpixmap<T> expanded;
+    expandBitmap(expanded, bits, (T)7, policy);
+    bool same = true;
+    for (size_t z = 0; z < b; ++z)
+      for (size_t y = 0; y < h; ++y)
+	for (size_t x = 0; x < w; ++x) same &= expanded.getLine(y, z)[x] == (ref[(z * h + y) * w + x] ? (T)7 : T());
+    TEST_CHECK(same);
+
+    // logic and counts
+    std::vector<bool> a(ref.size()), o(ref.size()), e(ref.size()), n(ref.size()), i(ref.size());
+    uint64_t count = 0;
+    for (size_t k = 0; k < ref.size(); ++k) {
+      a[k] = ref[k] && other[k], o[k] = ref[k] || other[k], e[k] = ref[k] != other[k];
+      n[k] = ref[k] && !other[k], i[k] = !ref[k];
+      count += ref[k];
+    }
+    cbitmap result;
+    andBitmap(result, bits, mask, policy);
+    TEST_CHECK(test_bitmap_equal(result, a));
+    orBitmap(result, bits, mask, policy);
+    TEST_CHECK(test_bitmap_equal(result, o));
+    xorBitmap(result, bits, mask, policy);
+    TEST_CHECK(test_bitmap_equal(result, e));
+    andNotBitmap(result, bits, mask, policy);
+    TEST_CHECK(test_bitmap_equal(result, n));
+    notBitmap(result, bits, policy);
+    TEST_CHECK(test_bitmap_equal(result, i));
+    TEST_CHECK(countBitmap(bits, policy) == count);
+    for (int r = 0; r < 4; ++r) {
+      const size_t x0 = rng() % (w + 2), y0 = rng() % (h + 2), z = rng() % b;
+      const size_t rw = rng() % (w + 70), rh = 1 + rng() % h;
+      uint64_t inside = 0;
+      for (size_t y = y0; y < std::min(y0 + rh, h); ++y)
+	for (size_t x = x0; x < std::min(x0 + rw, w); ++x) inside += ref[(z * h + y) * w + x];
+      TEST_CHECK(countBitmap(bits, cregion<size_t>(x0, y0, z, rw, rh)) == inside);
+    }
+
+    // 3x3 morphology; outside the image neither erodes nor dilates
+    std::vector<bool> eroded(ref.size()), dilated(ref.size());
+    for (size_t z = 0; z < b; ++z)
+      for (size_t y = 0; y < h; ++y)
+	for (size_t x = 0; x < w; ++x) {
+	  bool all = true, any = false;
+	  for (long dy = -1; dy <= 1; ++dy)
+	    for (long dx = -1; dx <= 1; ++dx) {
+	      const long yy = (long)y + dy, xx = (long)x + dx;
+	      if (yy < 0 || yy >= (long)h || xx < 0 || xx >= (long)w) continue;
+	      all &= ref[(z * h + yy) * w + xx];
+	      any |= ref[(z * h + yy) * w + xx];
+	    }
+	  eroded[(z * h + y) * w + x] = all;
+	  dilated[(z * h + y) * w + x] = any;
+	}
+    erodeBitmap(result, bits, policy);
+    TEST_CHECK(test_bitmap_equal(result, eroded));
+    dilateBitmap(result, bits, policy);
+    TEST_CHECK(test_bitmap_equal(result, dilated));
+
+    // masked copy and fill, with a mask per band and one for all bands
+    cbitmap single(w, h, 1);
+    for (size_t y = 0; y < h; ++y)
+      for (size_t x = 0; x < w; ++x) single.putPixel(rng() % 2 || x % 97 < 70, x, y);
+    for (int m = 0; m < 2; ++m) {
+      const cbitmap& sel = m ? single : bits;
+      cpixmap<T> dst(w, h, b), filled(w, h, b), expect(w, h, b);
+      test_fill(dst, rng, 200);
+      test_copy(filled, dst);
+      maskedFillPixmap(filled, (T)255, sel, policy);
+      same = true;
+      for (size_t z = 0; z < b; ++z)
+	for (size_t y = 0; y < h; ++y)
+	  for (size_t x = 0; x < w; ++x) {
+	    const bool on = sel.getPixel(x, y, m ? 0 : z);
+	    expect.getLine(y, z)[x] = on ? src.getLine(y, z)[x] : dst.getLine(y, z)[x];
+	    same &= filled.getLine(y, z)[x] == (on ? (T)255 : dst.getLine(y, z)[x]);
+	  }
+      TEST_CHECK(same);
+      maskedCopyPixmap(dst, src, sel, policy);
+      TEST_CHECK(test_equal(dst, expect));
+    }
+  }
+}
+
+static void test_bitmap(void)
+{
+  cthread_pool pool(3);
+  std::mt19937 rng(20);
+  test_bitmap_type<uint8_t>(pool, rng);
+  test_bitmap_type<uint16_t>(pool, rng);
+  test_bitmap_type<int32_t>(pool, rng);
+  test_bitmap_type<float>(pool, rng);
+}
+
+// chunks: a window with its padding inside the image width reads the
+// image rows in place, any other one holds copies with zeros outside the
+// image; both see the same pixels as the image, through the draft and
+// every shift of the ring
+template <typename T>
+void test_chunk_type(std::mt19937& rng)
+{
+  for (int it = 0; it < 40; ++it) {
+    const size_t w = 1 + rng() % 120, h = 1 + rng() % 60, b = 1 + rng() % 2;
+    cpixmap<T> img(w, h, b);
+    test_fill(img, rng, 100);
+    const size_t cw = 1 + rng() % w, ch = 1 + rng() % 8, hp = rng() % 4, vp = rng() % 4, z = rng() % b;
+    // odd iterations keep the window and its padding inside the width
+    const bool inside = (it & 1) && cw + 2 * hp <= w;
+    const size_t x = inside ? hp + rng() % (w - cw - 2 * hp + 1) : rng() % (w + 3);
+    const bool direct = hp <= x && x + cw + hp <= w;
+    cchunk<T> chunk(cw, ch, hp, vp);
+    chunk.draft(img, x, 0, z);
+    for (int top = -(int)vp; top < (int)h + (int)vp; ) {
+      bool same = true;
+      size_t in_place = 0, copied = 0;
+      for (int yy = top; yy < top + (int)(ch + 2 * vp); ++yy)
+	for (int xx = (int)x - (int)hp; xx < (int)(x + cw + hp); ++xx) {
+	  const bool in = yy >= 0 && yy < (int)h && xx >= 0 && xx < (int)w;
+	  same &= chunk(yy, xx) == (in ? img.getLine(yy, z)[xx] : T());
+	  if (in) ++(&chunk(yy, xx) == img.getLine(yy, z) + xx ? in_place : copied);
+	}
+      TEST_CHECK(same);
+      TEST_CHECK(direct ? copied == 0 : in_place == 0);
+      const size_t lines = 1 + rng() % (ch + 2 * vp);
+      chunk.shiftByNextLines(lines, img, z);
+      top += (int)lines;
+    }
+  }
+
+  // a 3x3 frame swept down the image against the same reference
+  cpixmap<T> img(1 + rng() % 70, 1 + rng() % 20, 1);
+  test_fill(img, rng, 100);
+  const int w = (int)img.getWidth(), h = (int)img.getHeight();
+  window3x3_frame<T> frame(img);
+  frame.draftFrame(img);
+  bool same = true;
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x)
+      for (int dy = -1; dy <= 1; ++dy)
+	for (int dx = -1; dx <= 1; ++dx) {
+	  const bool in = y + dy >= 0 && y + dy < h && x + dx >= 0 && x + dx < w;
+	  same &= frame(y + dy, x + dx) == (in ? img.getLine(y + dy)[x + dx] : T());
+	}
+    frame.shiftFrame(img);
+  }
+  TEST_CHECK(same);
+}
+
+static void test_chunk(void)
+{
+  std::mt19937 rng(21);
+  test_chunk_type<uint8_t>(rng);
+  test_chunk_type<int16_t>(rng);
+  test_chunk_type<float>(rng);
+}
+
+struct test_case {
+  const char *name;
+  void (*run)(void);
+};
+
+static const test_case test_cases[] = {
+  {"codec", test_codec},
+  {"codec_damaged", test_codec_damaged},
+  {"thread_pool", test_thread_pool},
+  {"raw_unpack", test_raw_unpack},
+  {"label", test_label},
+  {"distance", test_distance},
+  {"convolve_tiled", test_convolve_tiled},
+  {"disk_pixmap", test_disk_pixmap},
+  {"colorspace", test_colorspace},
+  {"warp", test_warp},
+  {"remap", test_remap},
+  {"resize", test_resize},
+  {"pyramid", test_pyramid},
+  {"convert", test_convert},
+  {"demosaic", test_demosaic},
+  {"endian", test_endian},
+  {"arith", test_arith},
+  {"memory_numa", test_memory_numa},
+  {"huge_pages", test_huge_pages},
+  {"memory_accounting", test_memory_accounting},
+  {"bitmap", test_bitmap},
+  {"chunk", test_chunk},
+};
+
+int main(int argc, char *argv[])
+{
+  int failed = 0;
+  bool found = argc < 2;
+  for (size_t i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); ++i) {
+    if (argc >= 2 && std::string(argv[1]) != test_cases[i].name) continue;
+    found = true;
+    test_failures = 0;
+    test_cases[i].run();
+    std::printf("%s: %s\n", test_cases[i].name, test_failures ? "FAILED" : "passed");
+    if (test_failures) ++failed;
+  }
+  if (!found) {
+    std::fprintf(stderr, "usage: %s [test]\n", argv[0]);
+    return 1;
+  }
+  return failed;
+}
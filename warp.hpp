@@ -0,0 +1,336 @@
+/*
+  Copyright (C) 2017 Hoyoung Lee
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include <cpixmap.hpp>
+
+enum WARP_INTERPOLATION {
+  WARP_NEAREST = 0,
+  WARP_BILINEAR = 1,
+  WARP_BICUBIC = 2
+};
+
+enum WARP_BORDER {
+  WARP_BORDER_CONSTANT = 0,   // samples outside the source read border_value
+  WARP_BORDER_REPLICATE = 1,  // clamp to the edge pixel
+  WARP_BORDER_REFLECT = 2,    // mirror without repeating the edge pixel
+  WARP_BORDER_TRANSPARENT = 3 // leave dst untouched where the sample lies outside
+};
+
+// Source coordinates are carried with WARP_FRAC_BITS of sub-pixel position,
+// which is also the precision of the interpolation weights.
+#define WARP_FRAC_BITS 10
+#define WARP_FRAC_ONE (1 << WARP_FRAC_BITS)
+
+struct cwarp_coord {
+  int32_t x, y;   // integer part (floor)
+  int32_t fx, fy; // fraction in [0, WARP_FRAC_ONE)
+};
+
+// Bilinear accumulator; 8-bit data fit the 2*WARP_FRAC_BITS weight product in int32.
+template <typename T> struct warp_traits { typedef double acc_type; };
+template <> struct warp_traits<uint8_t> { typedef int32_t acc_type; };
+template <> struct warp_traits<int8_t> { typedef int32_t acc_type; };
+template <> struct warp_traits<uint16_t> { typedef int64_t acc_type; };
+template <> struct warp_traits<int16_t> { typedef int64_t acc_type; };
+template <> struct warp_traits<float> { typedef float acc_type; };
+
+inline long warp_border_index(long i, long n, WARP_BORDER border)
+{
+  if (i >= 0 && i < n) return i;
+  if (border == WARP_BORDER_REFLECT && n > 1) {
+    if (i < 0) i = -i;
+    if (i >= n) i = 2*n - 2 - i;
+  }
+  return std::min(std::max(i, 0L), n - 1);
+}
+
+template <typename T>
+inline T warp_fetch(const cpixmap<T>& src, long x, long y, size_t z, WARP_BORDER border, T value)
+{
+  const long w = src.getWidth(), h = src.getHeight();
+  if (x < 0 || x >= w || y < 0 || y >= h) {
+    if (border == WARP_BORDER_CONSTANT) return value;
+    x = warp_border_index(x, w, border);
+    y = warp_border_index(y, h, border);
+  }
+  return src.getPixel(x, y, z);
+}
+
+template <typename T, typename A>
+inline T warp_saturate(A v)
+{
+  if (std::numeric_limits<T>::is_integer) {
+    if (!std::numeric_limits<A>::is_integer) v = std::floor(v + (A)0.5);
+    if (v < (A)std::numeric_limits<T>::lowest()) return std::numeric_limits<T>::lowest();
+    if (v > (A)std::numeric_limits<T>::max()) return std::numeric_limits<T>::max();
+  }
+  return (T)v;
+}
+
+template <typename A>
+inline A warp_bilinear(A p00, A p01, A p10, A p11, int32_t fx, int32_t fy)
+{
+  A ax = (A)fx / WARP_FRAC_ONE, ay = (A)fy / WARP_FRAC_ONE;
+  A top = p00 + (p01 - p00) * ax;
+  A bottom = p10 + (p11 - p10) * ax;
+  return top + (bottom - top) * ay;
+}
+
+// fixed point; the weights sum to exactly 2^(2*WARP_FRAC_BITS), so flat areas stay flat
+inline int32_t warp_bilinear(int32_t p00, int32_t p01, int32_t p10, int32_t p11, int32_t fx, int32_t fy)
+{
+  int32_t top = p00 * (WARP_FRAC_ONE - fx) + p01 * fx;
+  int32_t bottom = p10 * (WARP_FRAC_ONE - fx) + p11 * fx;
+  return (top * (WARP_FRAC_ONE - fy) + bottom * fy + (1 << (2*WARP_FRAC_BITS - 1))) >> (2*WARP_FRAC_BITS);
+}
+
+inline int64_t warp_bilinear(int64_t p00, int64_t p01, int64_t p10, int64_t p11, int32_t fx, int32_t fy)
+{
+  int64_t top = p00 * (WARP_FRAC_ONE - fx) + p01 * fx;
+  int64_t bottom = p10 * (WARP_FRAC_ONE - fx) + p11 * fx;
+  return (top * (WARP_FRAC_ONE - fy) + bottom * fy + ((int64_t)1 << (2*WARP_FRAC_BITS - 1))) >> (2*WARP_FRAC_BITS);
+}
+
+// Keys cubic (a = -0.5) weights for every representable fraction
+struct warp_cubic_table {
+  float w[WARP_FRAC_ONE * 4];
+  warp_cubic_table(void)
+  {
+    const double a = -0.5;
+    for (int i = 0; i < WARP_FRAC_ONE; ++i) {
+      double t = (double)i / WARP_FRAC_ONE;
+      double d[4] = { 1.0 + t, t, 1.0 - t, 2.0 - t };
+      for (int k = 0; k < 4; ++k) {
+	double x = d[k];
+	w[i*4 + k] = (x < 1.0) ? ((a + 2.0)*x - (a + 3.0))*x*x + 1.0 : (((x - 5.0)*x + 8.0)*x - 4.0)*a;
+      }
+    }
+  }
+};
+
+inline const float *warp_cubic_weights(int32_t f)
+{
+  static const warp_cubic_table table;
+  return &table.w[f*4];
+}
+
+inline void warp_split(cwarp_coord& c, int64_t X, int64_t Y, int shift)
+{
+  // X, Y carry 'shift' fraction bits; keep WARP_FRAC_BITS of them
+  int64_t x = X >> (shift - WARP_FRAC_BITS), y = Y >> (shift - WARP_FRAC_BITS);
+  c.x = (int32_t)(x >> WARP_FRAC_BITS), c.y = (int32_t)(y >> WARP_FRAC_BITS);
+  c.fx = (int32_t)(x & (WARP_FRAC_ONE - 1)), c.fy = (int32_t)(y & (WARP_FRAC_ONE - 1));
+}
+
+// A source position far outside any image, for points the map sends to no
+// finite position; the border mode decides what they read.
+inline void warp_outside(cwarp_coord& c)
+{
+  c.x = c.y = -(std::numeric_limits<int32_t>::max() / 4);
+  c.fx = c.fy = 0;
+}
+
+// Source coordinates of dst pixels (x0 .. x0+n-1, y) under the affine map
+// m = [a b c; d e f].  Only the row origin is evaluated in floating point;
+// the rest of the row is stepped in 32.32 fixed point.  A row whose ends
+// fall outside +-2^29 pixels, where the fixed point would overflow, is
+// evaluated per pixel and clamped as in warpCoordsPerspective, so that it
+// still lands on the border.
+inline void warpCoordsAffine(cwarp_coord *coords, size_t n, long x0, long y, const double m[6])
+{
+  const double scale = 4294967296.0; // 2^32
+  const double limit = (double)std::numeric_limits<int32_t>::max() / 4;
+  const double x = m[0]*x0 + m[1]*y + m[2], xn = x + m[0] * (double)(n ? n - 1 : 0);
+  const double y0 = m[3]*x0 + m[4]*y + m[5], yn = y0 + m[3] * (double)(n ? n - 1 : 0);
+
+  if (!(std::fabs(x) <= limit && std::fabs(xn) <= limit && std::fabs(y0) <= limit && std::fabs(yn) <= limit &&
+	std::fabs(m[0]) <= limit && std::fabs(m[3]) <= limit)) {
+    const double fine = (double)(1 << 16);
+    for (size_t i = 0; i < n; ++i) {
+      double sx = x + m[0] * (double)i, sy = y0 + m[3] * (double)i;
+      if (!std::isfinite(sx) || !std::isfinite(sy)) {
+	warp_outside(coords[i]);
+	continue;
+      }
+      sx = std::min(std::max(sx, -limit), limit);
+      sy = std::min(std::max(sy, -limit), limit);
+      warp_split(coords[i], (int64_t)std::floor(sx * fine), (int64_t)std::floor(sy * fine), 16);
+    }
+    return;
+  }
+
+  int64_t X = (int64_t)std::llround(x * scale);
+  int64_t Y = (int64_t)std::llround(y0 * scale);
+  const int64_t dX = (int64_t)std::llround(m[0] * scale);
+  const int64_t dY = (int64_t)std::llround(m[3] * scale);
+
+  for (size_t i = 0; i < n; ++i) {
+    warp_split(coords[i], X, Y, 32);
+    X += dX, Y += dY;
+  }
+}
+
+// Same for the homography m = [a b c; d e f; g h i]; the numerators and the
+// denominator are stepped incrementally, leaving one divide per pixel.
+// Points on the horizon (W = 0), and any the map makes non-finite, are
+// sent outside the source.
+inline void warpCoordsPerspective(cwarp_coord *coords, size_t n, long x0, long y, const double m[9])
+{
+  const double scale = (double)(1 << 16);
+  double X = m[0]*x0 + m[1]*y + m[2];
+  double Y = m[3]*x0 + m[4]*y + m[5];
+  double W = m[6]*x0 + m[7]*y + m[8];
+  const double limit = (double)std::numeric_limits<int32_t>::max() / 4;
+
+  for (size_t i = 0; i < n; ++i, X += m[0], Y += m[3], W += m[6]) {
+    const double sx = X * scale / W, sy = Y * scale / W;
+    if (W == 0.0 || !std::isfinite(sx) || !std::isfinite(sy)) {
+      warp_outside(coords[i]);
+      continue;
+    }
+    warp_split(coords[i], (int64_t)std::floor(std::min(std::max(sx, -limit * scale), limit * scale)),
+	       (int64_t)std::floor(std::min(std::max(sy, -limit * scale), limit * scale)), 16);
+  }
+}
+
+template <typename T>
+void warpSampleLine(T *dstline, const cwarp_coord *coords, size_t n, const cpixmap<T>& src, size_t z,
+		    WARP_INTERPOLATION interp, WARP_BORDER border, T value)
+{
+  typedef typename warp_traits<T>::acc_type A;
+  const long w = src.getWidth(), h = src.getHeight();
+  const long lo = (interp == WARP_BICUBIC) ? 1 : 0;
+  const long hi = (interp == WARP_BICUBIC) ? 2 : (interp == WARP_BILINEAR) ? 1 : 0;
+
+  for (size_t i = 0; i < n; ++i) {
+    long x = coords[i].x, y = coords[i].y;
+    int32_t fx = coords[i].fx, fy = coords[i].fy;
+
+    if (interp == WARP_NEAREST) {
+      x += fx >> (WARP_FRAC_BITS - 1), y += fy >> (WARP_FRAC_BITS - 1);
+      fx = fy = 0;
+    }
+    if (border == WARP_BORDER_TRANSPARENT && (x < 0 || x >= w || y < 0 || y >= h)) continue;
+
+    bool inside = (x - lo >= 0 && x + hi < w && y - lo >= 0 && y + hi < h);
+    if (interp == WARP_NEAREST) {
+      dstline[i] = inside ? src.getPixel(x, y, z) : warp_fetch(src, x, y, z, border, value);
+    } else if (interp == WARP_BILINEAR) {
+      A p00, p01, p10, p11;
+      if (inside) {
+	const T *l0 = src.getLine(y, z) + x;
+	const T *l1 = src.getLine(y + 1, z) + x;
+	p00 = l0[0], p01 = l0[1], p10 = l1[0], p11 = l1[1];
+      } else {
+	p00 = warp_fetch(src, x, y, z, border, value);
+	p01 = warp_fetch(src, x + 1, y, z, border, value);
+	p10 = warp_fetch(src, x, y + 1, z, border, value);
+	p11 = warp_fetch(src, x + 1, y + 1, z, border, value);
+      }
+      dstline[i] = warp_saturate<T>(warp_bilinear(p00, p01, p10, p11, fx, fy));
+    } else {
+      const float *wx = warp_cubic_weights(fx);
+      const float *wy = warp_cubic_weights(fy);
+      double sum = 0.0;
+      for (long j = 0; j < 4; ++j) {
+	double row = 0.0;
+	if (inside) {
+	  const T *l = src.getLine(y - 1 + j, z) + (x - 1);
+	  row = wx[0]*(double)l[0] + wx[1]*(double)l[1] + wx[2]*(double)l[2] + wx[3]*(double)l[3];
+	} else {
+	  for (long k = 0; k < 4; ++k)
+	    row += wx[k] * (double)warp_fetch(src, x - 1 + k, y - 1 + j, z, border, value);
+	}
+	sum += wy[j] * row;
+      }
+      dstline[i] = warp_saturate<T>(sum);
+    }
+  }
+}
+
+// Tiled driver shared by warpAffine and warpPerspective: dst is walked in
+// tile x tile blocks so that consecutive rows sample a compact source area,
+// and the coordinates of each tile row are generated once for all bands.
+template <typename T, typename Coords>
+void warpPixmap(cpixmap<T>& dst, const cpixmap<T>& src, Coords coordinates,
+		WARP_INTERPOLATION interp, WARP_BORDER border, T value, size_t tile,
+		const cexecution_policy& policy)
+{
+  assert(dst.getBands() == src.getBands());
+  assert(tile > 0);
+
+  const size_t tiles_x = (dst.getWidth() + tile - 1) / tile;
+  const size_t tiles_y = (dst.getHeight() + tile - 1) / tile;
+  const size_t tiles = tiles_x * tiles_y;
+
+  if (src.getWidth() == 0 || src.getHeight() == 0) return;
+
+  policy.getExecutor().run(tiles, [&](size_t t) {
+      std::vector<cwarp_coord> coords(tile);
+      size_t x0 = (t % tiles_x) * tile;
+      size_t y0 = (t / tiles_x) * tile;
+      size_t n = std::min(tile, dst.getWidth() - x0);
+      size_t y1 = std::min(y0 + tile, dst.getHeight());
+
+      for (size_t y = y0; y < y1; ++y) {
+	coordinates(&coords[0], n, (long)x0, (long)y);
+	for (size_t z = 0; z < dst.getBands(); ++z)
+	  warpSampleLine(dst.getLine(y, z) + x0, &coords[0], n, src, z, interp, border, value);
+      }
+    });
+}
+
+struct warp_affine_coords {
+  const double *m;
+  void operator()(cwarp_coord *c, size_t n, long x0, long y) const { warpCoordsAffine(c, n, x0, y, m); }
+};
+
+struct warp_perspective_coords {
+  const double *m;
+  void operator()(cwarp_coord *c, size_t n, long x0, long y) const { warpCoordsPerspective(c, n, x0, y, m); }
+};
+
+// m maps dst pixel (x, y) to the source position (m0*x + m1*y + m2, m3*x + m4*y + m5),
+// i.e. it is the inverse of the transformation applied to the image.
+template <typename T>
+void warpAffine(cpixmap<T>& dst, const cpixmap<T>& src, const double m[6],
+		WARP_INTERPOLATION interp = WARP_BILINEAR, WARP_BORDER border = WARP_BORDER_CONSTANT,
+		T value = 0, size_t tile = 64, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("warpAffine", dst, trace_bytes<T>(src) + trace_bytes<T>(dst), trace_threads(policy));
+  warp_affine_coords coords = { m };
+  warpPixmap(dst, src, coords, interp, border, value, tile, policy);
+}
+
+// m is the 3x3 row-major homography from dst to source pixel coordinates.
+template <typename T>
+void warpPerspective(cpixmap<T>& dst, const cpixmap<T>& src, const double m[9],
+		     WARP_INTERPOLATION interp = WARP_BILINEAR, WARP_BORDER border = WARP_BORDER_CONSTANT,
+		     T value = 0, size_t tile = 64, const cexecution_policy& policy = cexecution_policy())
+{
+  PIXMAP_TRACE("warpPerspective", dst, trace_bytes<T>(src) + trace_bytes<T>(dst), trace_threads(policy));
+  warp_perspective_coords coords = { m };
+  warpPixmap(dst, src, coords, interp, border, value, tile, policy);
+}